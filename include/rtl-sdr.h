@@ -388,6 +388,39 @@ RTLSDR_API int rtlsdr_read_async(rtlsdr_dev_t *dev,
  */
 RTLSDR_API int rtlsdr_cancel_async(rtlsdr_dev_t *dev);
 
+/*!
+ * Allow or forbid zero-copy (usbfs mmap) transfer buffers for the next
+ * rtlsdr_read_async() call. Zero-copy is only tried when the library was
+ * built with ENABLE_ZEROCOPY, it is allowed by default.
+ *
+ * \param dev the device handle given by rtlsdr_open()
+ * \param on 0 for buffers in userspace, 1 to use zero-copy where it works
+ * \return 0 on success
+ */
+RTLSDR_API int rtlsdr_set_zerocopy(rtlsdr_dev_t *dev, int on);
+
+/*!
+ * Get the kind of transfer buffers the running or last rtlsdr_read_async()
+ * call used.
+ *
+ * \param dev the device handle given by rtlsdr_open()
+ * \return 1 for zero-copy, 0 for buffers in userspace, -1 on error
+ */
+RTLSDR_API int rtlsdr_get_zerocopy(rtlsdr_dev_t *dev);
+
+/*!
+ * Get the number of USB control transfers issued on the device since
+ * rtlsdr_open(), and how many of them were I2C transactions with the
+ * tuner or the EEPROM. Take the difference around a call to see its cost.
+ *
+ * \param dev the device handle given by rtlsdr_open()
+ * \param transfers control transfer count, may be NULL
+ * \param i2c I2C transaction count, may be NULL
+ * \return 0 on success
+ */
+RTLSDR_API int rtlsdr_get_ctrl_stats(rtlsdr_dev_t *dev, uint32_t *transfers,
+				     uint32_t *i2c);
+
 /*!
  * Enable or disable the bias tee on GPIO PIN 0.
  *
@@ -0,0 +1,86 @@
+/*
+ * rtl-sdr, turns your Realtek RTL2832 based DVB dongle into a SDR receiver
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __RTL_SDR_TRACE_H
+#define __RTL_SDR_TRACE_H
+
+/*
+ * Hot path tracing. Built with RTLSDR_TRACE defined (cmake -DENABLE_TRACE=ON,
+ * configure --enable-trace) every thread that records an event gets its own
+ * ring of the last RTLSDR_TRACE_RING events; recording takes no lock. The
+ * library records USB transfers, the sample callback and retunes, the tools
+ * add their stages and queue depths.
+ *
+ * With RTLSDR_TRACE set to a file name in the environment the rings are
+ * written there as Chrome trace JSON (chrome://tracing, ui.perfetto.dev)
+ * on SIGUSR1 and at exit. Without RTLSDR_TRACE defined at build time the
+ * macros below compile to nothing and the functions do nothing.
+ */
+
+#include <stdint.h>
+#include <rtl-sdr_export.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define RTLSDR_TRACE_RING 8192	/* events per thread, a power of two */
+
+/*!
+ * Record one event on the calling thread's ring
+ *
+ * \param ph Chrome trace phase, 'B' begin, 'E' end, 'i' instant, 'C' counter
+ * \param name a string literal, it is kept by pointer
+ * \param value shown with instants and counters
+ */
+RTLSDR_API void rtlsdr_trace_event(char ph, const char *name, int64_t value);
+
+/*!
+ * Name the calling thread in the trace
+ *
+ * \param name a string literal, it is kept by pointer
+ */
+RTLSDR_API void rtlsdr_trace_thread(const char *name);
+
+/*!
+ * Write every ring to a file as Chrome trace JSON. Safe to call from a
+ * signal handler.
+ *
+ * \param path file to create or overwrite
+ * \return events written, -1 on error or without tracing built in
+ */
+RTLSDR_API int rtlsdr_trace_dump(const char *path);
+
+#ifdef RTLSDR_TRACE
+#define RTLSDR_TRACE_BEGIN(name)	rtlsdr_trace_event('B', name, 0)
+#define RTLSDR_TRACE_END(name)		rtlsdr_trace_event('E', name, 0)
+#define RTLSDR_TRACE_INSTANT(name, v)	rtlsdr_trace_event('i', name, (int64_t)(v))
+#define RTLSDR_TRACE_COUNTER(name, v)	rtlsdr_trace_event('C', name, (int64_t)(v))
+#define RTLSDR_TRACE_THREAD(name)	rtlsdr_trace_thread(name)
+#else
+#define RTLSDR_TRACE_BEGIN(name)	do {} while (0)
+#define RTLSDR_TRACE_END(name)		do {} while (0)
+#define RTLSDR_TRACE_INSTANT(name, v)	do {} while (0)
+#define RTLSDR_TRACE_COUNTER(name, v)	do {} while (0)
+#define RTLSDR_TRACE_THREAD(name)	do {} while (0)
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __RTL_SDR_TRACE_H */
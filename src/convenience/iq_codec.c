@@ -0,0 +1,354 @@
+/*
+ * rtl-sdr, turns your Realtek RTL2832 based DVB dongle into a SDR receiver
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Each channel is predicted on its own, the predictor is picked per
+ * segment from: constant mid scale, previous sample, linear from the
+ * last two. Residuals wrap into the sample range, are zigzag mapped and
+ * written with a Rice code whose parameter follows the running mean.
+ * Dongle I/Q is mostly noise around 127 with an ENOB well below 8 bits,
+ * which is what makes this pay off.
+ */
+
+#include <string.h>
+
+#include "iq_codec.h"
+
+#define METHOD_STORED 0
+#define METHOD_RICE 1
+#define SEGMENT 4096		/* bytes of I/Q sharing a predictor choice */
+#define UNARY_LIMIT 16		/* longer quotients escape to a raw value */
+#define RICE_RESET 64		/* halve the running mean this often */
+
+struct channel {
+	int prev;
+	int prev2;
+	unsigned int sum;	/* of recent zigzag values */
+	unsigned int count;
+};
+
+struct bit_writer {
+	uint64_t acc;
+	int bits;
+	uint8_t *p;
+	uint8_t *end;
+};
+
+struct bit_reader {
+	uint64_t acc;		/* next bits, msb first */
+	int bits;
+	const uint8_t *p;
+	const uint8_t *end;
+	int overrun;		/* bytes made up past the end */
+};
+
+#if defined(__GNUC__)
+#define leading_zeros(x) __builtin_clzll(x)
+#else
+static int leading_zeros(uint64_t x)
+{
+	int n = 0;
+	while (!(x & 0x8000000000000000ULL)) {
+		x <<= 1;
+		n++;
+	}
+	return n;
+}
+#endif
+
+static void put_le32(uint8_t *p, uint32_t v)
+{
+	p[0] = v & 0xff;
+	p[1] = (v >> 8) & 0xff;
+	p[2] = (v >> 16) & 0xff;
+	p[3] = v >> 24;
+}
+
+static uint32_t get_le32(const uint8_t *p)
+{
+	return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static int put_bits(struct bit_writer *w, uint32_t v, int n)
+/* n up to 32, returns -1 once the output would outgrow the raw block */
+{
+	w->acc = w->acc << n | v;
+	w->bits += n;
+	while (w->bits >= 8) {
+		if (w->p == w->end)
+			return -1;
+		w->bits -= 8;
+		*w->p++ = (uint8_t)(w->acc >> w->bits);
+	}
+	return 0;
+}
+
+static void refill(struct bit_reader *r)
+{
+	while (r->bits <= 56) {
+		if (r->p < r->end)
+			r->acc |= (uint64_t)*r->p++ << (56 - r->bits);
+		else
+			r->overrun++;
+		r->bits += 8;
+	}
+}
+
+static uint32_t get_bits(struct bit_reader *r, int n)
+/* n up to 32 */
+{
+	uint32_t v;
+	if (!n)
+		return 0;
+	if (r->bits < n)
+		refill(r);
+	v = (uint32_t)(r->acc >> (64 - n));
+	r->acc <<= n;
+	r->bits -= n;
+	return v;
+}
+
+static int rice_k(const struct channel *ch)
+{
+	int k = 0;
+	while ((ch->count << k) < ch->sum)
+		k++;
+	return k;
+}
+
+static void rice_update(struct channel *ch, unsigned int z)
+{
+	ch->sum += z;
+	if (++ch->count == RICE_RESET) {
+		ch->sum >>= 1;
+		ch->count >>= 1;
+	}
+}
+
+static void channel_init(struct channel *ch, int shift)
+{
+	ch->prev = ch->prev2 = 128 >> shift;
+	ch->sum = 8;
+	ch->count = 1;
+}
+
+static int predict(const struct channel *ch, int mode, int max)
+{
+	int p;
+	switch (mode) {
+	case 0:
+		return (max + 1) / 2;
+	case 1:
+		return ch->prev;
+	default:
+		p = 2 * ch->prev - ch->prev2;
+		return p < 0 ? 0 : p > max ? max : p;
+	}
+}
+
+static int pick_predictor(const uint8_t *in, size_t n, const struct channel *start, int shift)
+/* cheapest predictor for one channel of a segment, by sum of residuals */
+{
+	unsigned long cost[3] = {0, 0, 0};
+	int max = 255 >> shift;
+	int mode, best = 0;
+	struct channel ch;
+	size_t i;
+	int x, r;
+
+	for (mode = 0; mode < 3; mode++) {
+		ch = *start;
+		for (i = 0; i < n; i += 2) {
+			x = in[i] >> shift;
+			r = x - predict(&ch, mode, max);
+			cost[mode] += r < 0 ? -r : r;
+			ch.prev2 = ch.prev;
+			ch.prev = x;
+		}
+		if (cost[mode] < cost[best])
+			best = mode;
+	}
+	return best;
+}
+
+static int encode_channel(struct bit_writer *w, const uint8_t *in, size_t n,
+			  struct channel *ch, int mode, int shift)
+{
+	int max = 255 >> shift;
+	int range = max + 1;
+	int ebits = 8 - shift;
+	unsigned int z, q;
+	size_t i;
+	int x, r, k;
+
+	for (i = 0; i < n; i += 2) {
+		x = in[i] >> shift;
+		r = x - predict(ch, mode, max);
+		/* wrap into [-range/2, range/2) */
+		if (r >= range / 2)
+			r -= range;
+		else if (r < -range / 2)
+			r += range;
+		z = r < 0 ? (unsigned int)(-2 * r - 1) : (unsigned int)(2 * r);
+		k = rice_k(ch);
+		q = z >> k;
+		if (q < UNARY_LIMIT) {
+			if (put_bits(w, 1u << k | (z & ((1u << k) - 1)), q + 1 + k) < 0)
+				return -1;
+		} else if (put_bits(w, 0, UNARY_LIMIT) < 0 || put_bits(w, z, ebits) < 0)
+			return -1;
+		rice_update(ch, z);
+		ch->prev2 = ch->prev;
+		ch->prev = x;
+	}
+	return 0;
+}
+
+size_t iq_encode_bound(size_t len)
+{
+	return len + IQ_HEADER_LEN;
+}
+
+static size_t encode_stored(const uint8_t *in, size_t len, uint8_t *out)
+{
+	out[2] = METHOD_STORED;
+	out[3] = 0;
+	put_le32(out + 8, (uint32_t)len);
+	memcpy(out + IQ_HEADER_LEN, in, len);
+	return len + IQ_HEADER_LEN;
+}
+
+size_t iq_encode(const uint8_t *in, size_t len, uint8_t *out, int shift)
+{
+	struct channel ch[2];
+	struct bit_writer w;
+	size_t seg, n, c;
+	int mode[2];
+
+	len &= ~(size_t)1;
+	out[0] = 'I';
+	out[1] = 'Q';
+	put_le32(out + 4, (uint32_t)len);
+	if (shift < 0 || shift > IQ_MAX_SHIFT)
+		return encode_stored(in, len, out);
+
+	channel_init(&ch[0], shift);
+	channel_init(&ch[1], shift);
+	w.acc = 0;
+	w.bits = 0;
+	w.p = out + IQ_HEADER_LEN;
+	w.end = w.p + len;
+	for (seg = 0; seg < len; seg += SEGMENT) {
+		n = len - seg < SEGMENT ? len - seg : SEGMENT;
+		for (c = 0; c < 2; c++)
+			mode[c] = pick_predictor(in + seg + c, n - c, &ch[c], shift);
+		if (put_bits(&w, mode[0] << 2 | mode[1], 4) < 0)
+			return encode_stored(in, len, out);
+		for (c = 0; c < 2; c++)
+			if (encode_channel(&w, in + seg + c, n - c, &ch[c], mode[c], shift) < 0)
+				return encode_stored(in, len, out);
+	}
+	if (w.bits && put_bits(&w, 0, 8 - w.bits) < 0)
+		return encode_stored(in, len, out);
+
+	out[2] = METHOD_RICE;
+	out[3] = (uint8_t)shift;
+	put_le32(out + 8, (uint32_t)(w.p - out - IQ_HEADER_LEN));
+	return w.p - out;
+}
+
+long iq_block_length(const uint8_t *hdr, size_t *raw_len)
+{
+	if (hdr[0] != 'I' || hdr[1] != 'Q' || hdr[2] > METHOD_RICE || hdr[3] > IQ_MAX_SHIFT)
+		return -1;
+	*raw_len = get_le32(hdr + 4);
+	return (long)get_le32(hdr + 8) + IQ_HEADER_LEN;
+}
+
+static void decode_channel(struct bit_reader *r, uint8_t *out, size_t n,
+			   struct channel *ch, int mode, int shift)
+{
+	int max = 255 >> shift;
+	int ebits = 8 - shift;
+	int half = shift ? 1 << (shift - 1) : 0;
+	unsigned int z, q;
+	size_t i;
+	int x, k;
+
+	for (i = 0; i < n; i += 2) {
+		if (r->bits < 32)
+			refill(r);
+		k = rice_k(ch);
+		q = r->acc ? leading_zeros(r->acc) : 64;
+		if (q < UNARY_LIMIT) {
+			r->acc <<= q + 1;
+			r->bits -= q + 1;
+			z = q << k | get_bits(r, k);
+		} else {
+			r->acc <<= UNARY_LIMIT;
+			r->bits -= UNARY_LIMIT;
+			z = get_bits(r, ebits);
+		}
+		rice_update(ch, z);
+		x = predict(ch, mode, max) + (z & 1 ? -(int)((z + 1) >> 1) : (int)(z >> 1));
+		x &= max;
+		out[i] = (uint8_t)(x << shift | half);
+		ch->prev2 = ch->prev;
+		ch->prev = x;
+	}
+}
+
+long iq_decode(const uint8_t *in, size_t in_len, uint8_t *out, size_t out_len)
+{
+	struct channel ch[2];
+	struct bit_reader r;
+	size_t raw_len, seg, n, c;
+	long block;
+	int shift, modes;
+
+	if (in_len < IQ_HEADER_LEN)
+		return -1;
+	block = iq_block_length(in, &raw_len);
+	if (block < 0 || (size_t)block > in_len || raw_len > out_len || (raw_len & 1))
+		return -1;
+	if (in[2] == METHOD_STORED) {
+		if ((size_t)block != raw_len + IQ_HEADER_LEN)
+			return -1;
+		memcpy(out, in + IQ_HEADER_LEN, raw_len);
+		return (long)raw_len;
+	}
+
+	shift = in[3];
+	channel_init(&ch[0], shift);
+	channel_init(&ch[1], shift);
+	memset(&r, 0, sizeof(r));
+	r.p = in + IQ_HEADER_LEN;
+	r.end = in + block;
+	for (seg = 0; seg < raw_len; seg += SEGMENT) {
+		n = raw_len - seg < SEGMENT ? raw_len - seg : SEGMENT;
+		modes = (int)get_bits(&r, 4);
+		if ((modes >> 2) > 2 || (modes & 3) > 2)
+			return -1;
+		for (c = 0; c < 2; c++)
+			decode_channel(&r, out + seg + c, n - c, &ch[c],
+				       c ? modes & 3 : modes >> 2, shift);
+		/* each byte past the end stands for 8 bits that were never sent */
+		if (r.overrun * 8 > r.bits)
+			return -1;
+	}
+	return (long)raw_len;
+}
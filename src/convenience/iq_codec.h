@@ -0,0 +1,76 @@
+/*
+ * rtl-sdr, turns your Realtek RTL2832 based DVB dongle into a SDR receiver
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Block codec for interleaved cu8 I/Q. Every block starts with a
+ * IQ_HEADER_LEN byte header and decodes on its own:
+ *
+ *   0  'I' 'Q'
+ *   2  method, 0 stored, 1 predictive Rice
+ *   3  low bits dropped before coding, 0 for lossless
+ *   4  raw length, 32 bit little endian
+ *   8  payload length, 32 bit little endian
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define IQ_HEADER_LEN 12
+#define IQ_MAX_SHIFT 6
+
+/*!
+ * Largest block iq_encode() can produce
+ *
+ * \param len raw length in bytes
+ * \return encoded length in bytes, header included
+ */
+
+size_t iq_encode_bound(size_t len);
+
+/*!
+ * Compress one block of cu8 I/Q
+ *
+ * \param in interleaved samples
+ * \param len bytes, must be even
+ * \param out room for iq_encode_bound(len) bytes
+ * \param shift low bits to drop (0 to IQ_MAX_SHIFT), 0 is lossless
+ * \return bytes written
+ */
+
+size_t iq_encode(const uint8_t *in, size_t len, uint8_t *out, int shift);
+
+/*!
+ * Parse a block header
+ *
+ * \param hdr IQ_HEADER_LEN bytes
+ * \param raw_len set to the decoded length
+ * \return block length with header, -1 if hdr is not a block header
+ */
+
+long iq_block_length(const uint8_t *hdr, size_t *raw_len);
+
+/*!
+ * Decompress one block
+ *
+ * \param in a whole block, header included
+ * \param in_len bytes available at in
+ * \param out room for the raw length given by iq_block_length()
+ * \param out_len bytes available at out
+ * \return bytes written, -1 on a damaged block
+ */
+
+long iq_decode(const uint8_t *in, size_t in_len, uint8_t *out, size_t out_len);
@@ -0,0 +1,291 @@
+/*
+ * rtl-sdr, turns your Realtek RTL2832 based DVB dongle into a SDR receiver
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _USE_MATH_DEFINES
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "iq_convert.h"
+#include "iq_codec.h"
+#include "dsp/dsp.h"
+
+#define DDC_TAPS_PER_DECIM 8
+#define DDC_MAX_TAPS 511
+#define MIX_ONE 16320.0f /* full scale in u8_to_mix, 127.5 << 7 */
+
+const int iq_format_size[IQ_FMT_COUNT] = {2, 2, 4, 8, 1};
+const char *const iq_format_name[IQ_FMT_COUNT] = {"cu8", "cs8", "cs16", "cf32", "cs4"};
+
+/* filled once, every converter reads them */
+static int tables_ready;
+static float u8_to_float[256];
+static int16_t u8_to_mix[256];	/* headroom below and above for dsp_nco_mix() */
+static int8_t u8_to_s8[256];
+static int16_t u8_to_s16[256];
+static uint8_t u8_to_s4_hi[256];
+static uint8_t u8_to_s4_lo[256];
+
+static int clamp(long v, long lo, long hi)
+{
+	return v < lo ? lo : v > hi ? hi : v;
+}
+
+static size_t sample_write(enum iq_format format, uint8_t *out, float i, float q)
+{
+	int16_t v;
+	switch (format) {
+	case IQ_FMT_CU8:
+		out[0] = (uint8_t)clamp(lrintf(i * 127.5f + 127.5f), 0, 255);
+		out[1] = (uint8_t)clamp(lrintf(q * 127.5f + 127.5f), 0, 255);
+		return 2;
+	case IQ_FMT_CS8:
+		out[0] = (uint8_t)clamp(lrintf(i * 127.0f), -128, 127);
+		out[1] = (uint8_t)clamp(lrintf(q * 127.0f), -128, 127);
+		return 2;
+	case IQ_FMT_CS16:
+		v = (int16_t)clamp(lrintf(i * 32767.0f), -32768, 32767);
+		out[0] = (uint8_t)(v & 0xff);
+		out[1] = (uint8_t)(v >> 8);
+		v = (int16_t)clamp(lrintf(q * 32767.0f), -32768, 32767);
+		out[2] = (uint8_t)(v & 0xff);
+		out[3] = (uint8_t)(v >> 8);
+		return 4;
+	case IQ_FMT_CF32:
+		/* every platform rtl-sdr runs on is little endian */
+		memcpy(out, &i, 4);
+		memcpy(out + 4, &q, 4);
+		return 8;
+	case IQ_FMT_CS4:
+		out[0] = (uint8_t)((clamp(lrintf(i * 7.0f), -8, 7) & 0xf) << 4 |
+				   (clamp(lrintf(q * 7.0f), -8, 7) & 0xf));
+		return 1;
+	default:
+		return 0;
+	}
+}
+
+static void tables_init(void)
+/* the lookup tables go through sample_write, so both paths agree bit for bit */
+{
+	uint8_t b[8];
+	int i;
+
+	if (tables_ready)
+		return;
+	for (i = 0; i < 256; i++)
+		u8_to_float[i] = (i - 127.5f) / 127.5f;
+	for (i = 0; i < 256; i++)
+		u8_to_mix[i] = (int16_t)((2 * i - 255) * 64);
+	for (i = 0; i < 256; i++) {
+		sample_write(IQ_FMT_CS8, b, u8_to_float[i], 0);
+		u8_to_s8[i] = (int8_t)b[0];
+		sample_write(IQ_FMT_CS16, b, u8_to_float[i], 0);
+		u8_to_s16[i] = (int16_t)(b[0] | b[1] << 8);
+		sample_write(IQ_FMT_CS4, b, u8_to_float[i], 0);
+		u8_to_s4_hi[i] = b[0] & 0xf0;
+		sample_write(IQ_FMT_CS4, b, 0, u8_to_float[i]);
+		u8_to_s4_lo[i] = b[0] & 0x0f;
+	}
+	tables_ready = 1;
+}
+
+int iq_format_parse(const char *name)
+{
+	int f;
+	for (f = 0; f < IQ_FMT_COUNT; f++)
+		if (strcmp(name, iq_format_name[f]) == 0)
+			return f;
+	return -1;
+}
+
+void iq_ddc_free(struct iq_ddc *d)
+{
+	if (!d)
+		return;
+	free(d->coef);
+	free(d->hist_i);
+	free(d->hist_q);
+	free(d->scratch);
+	free(d->mixed);
+	free(d);
+}
+
+struct iq_ddc *iq_ddc_new(int32_t offset, uint32_t in_rate, uint32_t out_rate,
+			  enum iq_format format, int compress, size_t max_len)
+{
+	struct iq_ddc *d;
+	double fc, x, sum = 0;
+	int i, m;
+
+	tables_init();
+	d = calloc(1, sizeof(struct iq_ddc));
+	if (!d)
+		return NULL;
+	d->format = format;
+	d->compress = compress;
+	dsp_nco_set(&d->nco, -(double)offset, in_rate);
+	d->decim = out_rate && out_rate < in_rate ? (in_rate + out_rate / 2) / out_rate : 1;
+	if (d->nco.step) {
+		d->mixed = malloc(max_len * sizeof(int16_t));
+		if (!d->mixed) {
+			iq_ddc_free(d);
+			return NULL;
+		}
+	}
+	if (compress && (d->nco.step || d->decim > 1)) {
+		d->scratch = malloc(max_len);
+		if (!d->scratch) {
+			iq_ddc_free(d);
+			return NULL;
+		}
+	}
+	if (d->decim == 1)
+		return d;
+
+	/* windowed sinc, cut off a bit inside the new Nyquist */
+	d->taps = d->decim * DDC_TAPS_PER_DECIM + 1;
+	if (d->taps > DDC_MAX_TAPS)
+		d->taps = DDC_MAX_TAPS;
+	d->coef = malloc(d->taps * sizeof(float));
+	d->hist_i = calloc(2 * d->taps, sizeof(float));
+	d->hist_q = calloc(2 * d->taps, sizeof(float));
+	if (!d->coef || !d->hist_i || !d->hist_q) {
+		iq_ddc_free(d);
+		return NULL;
+	}
+	fc = 0.45 / d->decim;
+	m = d->taps - 1;
+	for (i = 0; i < d->taps; i++) {
+		x = i - m / 2.0;
+		d->coef[i] = (float)((x == 0 ? 2 * fc : sin(2 * M_PI * fc * x) / (M_PI * x)) *
+			(0.42 - 0.5 * cos(2 * M_PI * i / m) + 0.08 * cos(4 * M_PI * i / m)));
+		sum += d->coef[i];
+	}
+	for (i = 0; i < d->taps; i++)
+		d->coef[i] /= (float)sum;
+	return d;
+}
+
+void iq_ddc_reset(struct iq_ddc *d)
+{
+	d->nco.phase = 0;
+	d->count = 0;
+	d->pos = 0;
+	if (d->taps) {
+		memset(d->hist_i, 0, 2 * d->taps * sizeof(float));
+		memset(d->hist_q, 0, 2 * d->taps * sizeof(float));
+	}
+}
+
+size_t iq_ddc_worst(const struct iq_ddc *d, size_t len)
+{
+	/* a decimator carries a partial count over, so a block may end one sample ahead */
+	size_t n = (d->decim == 1 ? len / 2 : len / 2 / d->decim + 1) * iq_format_size[d->format];
+	return d->compress ? iq_encode_bound(n) : n;
+}
+
+static size_t convert_direct(enum iq_format format, const uint8_t *buf, size_t len, uint8_t *out)
+/* no mixing or filtering, one table lookup per byte */
+{
+	int16_t v;
+	size_t k;
+
+	len &= ~(size_t)1;
+	switch (format) {
+	case IQ_FMT_CU8:
+		memcpy(out, buf, len);
+		return len;
+	case IQ_FMT_CS8:
+		for (k = 0; k < len; k++)
+			out[k] = (uint8_t)u8_to_s8[buf[k]];
+		return len;
+	case IQ_FMT_CS16:
+		for (k = 0; k < len; k++) {
+			v = u8_to_s16[buf[k]];
+			memcpy(out + 2 * k, &v, 2);
+		}
+		return 2 * len;
+	case IQ_FMT_CF32:
+		for (k = 0; k < len; k++)
+			memcpy(out + 4 * k, &u8_to_float[buf[k]], 4);
+		return 4 * len;
+	case IQ_FMT_CS4:
+		for (k = 0; k < len; k += 2)
+			out[k / 2] = u8_to_s4_hi[buf[k]] | u8_to_s4_lo[buf[k + 1]];
+		return len / 2;
+	default:
+		return 0;
+	}
+}
+
+static size_t ddc_convert(struct iq_ddc *d, const uint8_t *buf, size_t len, uint8_t *out)
+{
+	const float *hi, *hq;
+	float i, q;
+	size_t o = 0;
+	size_t k;
+	int n;
+
+	if (!d->nco.step && d->decim == 1)
+		return convert_direct(d->format, buf, len, out);
+	len &= ~(size_t)1;
+	if (d->nco.step) {
+		for (k = 0; k < len; k++)
+			d->mixed[k] = u8_to_mix[buf[k]];
+		dsp_nco_mix(&d->nco, d->mixed, (int)len);
+	}
+	for (k = 0; k < len; k += 2) {
+		if (d->nco.step) {
+			i = d->mixed[k] * (1.0f / MIX_ONE);
+			q = d->mixed[k+1] * (1.0f / MIX_ONE);
+		} else {
+			i = u8_to_float[buf[k]];
+			q = u8_to_float[buf[k+1]];
+		}
+		if (d->decim > 1) {
+			d->hist_i[d->pos] = d->hist_i[d->pos + d->taps] = i;
+			d->hist_q[d->pos] = d->hist_q[d->pos + d->taps] = q;
+			d->pos = d->pos + 1 == d->taps ? 0 : d->pos + 1;
+			if (++d->count < d->decim)
+				continue;
+			d->count = 0;
+			/* the last taps samples, oldest first */
+			hi = d->hist_i + d->pos;
+			hq = d->hist_q + d->pos;
+			i = q = 0;
+			for (n = 0; n < d->taps; n++) {
+				i += d->coef[n] * hi[n];
+				q += d->coef[n] * hq[n];
+			}
+		}
+		o += sample_write(d->format, out + o, i, q);
+	}
+	return o;
+}
+
+size_t iq_ddc_process(struct iq_ddc *d, const uint8_t *buf, size_t len, uint8_t *out)
+{
+	if (!d->compress)
+		return ddc_convert(d, buf, len, out);
+	/* compressed streams are one codec block per input block */
+	if (d->scratch) {
+		len = ddc_convert(d, buf, len, d->scratch);
+		buf = d->scratch;
+	}
+	return iq_encode(buf, len, out, d->compress - 1);
+}
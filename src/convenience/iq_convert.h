@@ -0,0 +1,113 @@
+/*
+ * rtl-sdr, turns your Realtek RTL2832 based DVB dongle into a SDR receiver
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Digital down converter for cu8 I/Q: the rtlsdr_dsp NCO mixer, a decimating
+ * windowed sinc low pass and a converter into one of the sample formats
+ * below, optionally followed by the iq_codec. Without mixing or
+ * decimation the conversion is a table lookup per byte.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "dsp/dsp.h"
+
+/* numbered as on the rtl_tcp wire, cu8 is what the dongle delivers */
+enum iq_format {
+	IQ_FMT_CU8,
+	IQ_FMT_CS8,
+	IQ_FMT_CS16,		/* little endian */
+	IQ_FMT_CF32,		/* little endian */
+	IQ_FMT_CS4,		/* I in the high nibble, Q in the low one */
+	IQ_FMT_COUNT
+};
+
+extern const int iq_format_size[IQ_FMT_COUNT];		/* bytes per I/Q pair */
+extern const char *const iq_format_name[IQ_FMT_COUNT];
+
+struct iq_ddc {
+	struct dsp_nco nco;
+	int decim;
+	int count;		/* inputs since the last output */
+	int taps;
+	float *coef;
+	float *hist_i;		/* 2 * taps, every sample written twice */
+	float *hist_q;
+	int pos;
+	enum iq_format format;
+	int compress;		/* codec low bits dropped + 1, 0 for plain samples */
+	uint8_t *scratch;	/* cu8 between the filter and the codec */
+	int16_t *mixed;		/* one block after the NCO */
+};
+
+/*!
+ * Look up a sample format by name
+ *
+ * \param name one of iq_format_name
+ * \return the format, -1 if there is no such format
+ */
+
+int iq_format_parse(const char *name);
+
+/*!
+ * Set up a down converter
+ *
+ * \param offset Hz from the center to shift down to zero
+ * \param in_rate input sample rate
+ * \param out_rate wanted output rate, 0 or >= in_rate for no decimation;
+ *                 the decimation is the nearest integer ratio
+ * \param format output format
+ * \param compress codec low bits dropped + 1, 0 for none; needs IQ_FMT_CU8
+ * \param max_len largest input block in bytes
+ * \return the converter, NULL when out of memory
+ */
+
+struct iq_ddc *iq_ddc_new(int32_t offset, uint32_t in_rate, uint32_t out_rate,
+			  enum iq_format format, int compress, size_t max_len);
+
+void iq_ddc_free(struct iq_ddc *d);
+
+/*!
+ * Forget the filter history and NCO phase, for a new stretch of input
+ *
+ * \param d the converter
+ */
+
+void iq_ddc_reset(struct iq_ddc *d);
+
+/*!
+ * Most bytes iq_ddc_process() can make of one input block
+ *
+ * \param d the converter
+ * \param len input bytes
+ * \return output bytes
+ */
+
+size_t iq_ddc_worst(const struct iq_ddc *d, size_t len);
+
+/*!
+ * Convert one block, filter state carries over to the next one
+ *
+ * \param d the converter
+ * \param buf interleaved cu8 I/Q
+ * \param len bytes, at most max_len
+ * \param out room for iq_ddc_worst(d, len) bytes
+ * \return bytes written; a compressing converter writes one codec block
+ */
+
+size_t iq_ddc_process(struct iq_ddc *d, const uint8_t *buf, size_t len, uint8_t *out);
@@ -0,0 +1,774 @@
+/*
+ * rtl-sdr, turns your Realtek RTL2832 based DVB dongle into a SDR receiver
+ * Copyright (C) 2012 by Steve Markgraf <steve@steve-m.de>
+ * Copyright (C) 2012 by Hoernchen <la@tfc-server.de>
+ * Copyright (C) 2012 by Kyle Keen <keenerd@gmail.com>
+ * Copyright (C) 2013 by Elias Oenal <EliasOenal@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+#if defined(_MSC_VER) && (_MSC_VER < 1800)
+#define round(x) (x > 0.0 ? floor(x + 0.5): ceil(x - 0.5))
+#endif
+#define _USE_MATH_DEFINES
+#endif
+
+#include <math.h>
+
+#include "dsp.h"
+#include "dsp_simd.h"
+
+#define NCO_BITS 12
+
+int dsp_cic_9_tables[][10] = {
+	{0,},
+	{9, -156,  -97, 2798, -15489, 61019, -15489, 2798,  -97, -156},
+	{9, -128, -568, 5593, -24125, 74126, -24125, 5593, -568, -128},
+	{9, -129, -639, 6187, -26281, 77511, -26281, 6187, -639, -129},
+	{9, -122, -612, 6082, -26353, 77818, -26353, 6082, -612, -122},
+	{9, -120, -602, 6015, -26269, 77757, -26269, 6015, -602, -120},
+	{9, -120, -582, 5951, -26128, 77542, -26128, 5951, -582, -120},
+	{9, -119, -580, 5931, -26094, 77505, -26094, 5931, -580, -119},
+	{9, -119, -578, 5921, -26077, 77484, -26077, 5921, -578, -119},
+	{9, -119, -577, 5917, -26067, 77473, -26067, 5917, -577, -119},
+	{9, -199, -362, 5303, -25505, 77489, -25505, 5303, -362, -199},
+};
+
+static int *atan_lut = NULL;
+static int atan_lut_size = 131072; /* 512 KB */
+static int atan_lut_coef = 8;
+
+static int16_t nco_sin[1 << NCO_BITS];
+static int nco_ready;
+
+const struct dsp_ops dsp_ops_c = {
+	"c",
+	dsp_rotate_90_c,
+	dsp_cu8_to_s16_c,
+	dsp_magnitude_c,
+	dsp_preamble_scan_c,
+	dsp_power_sum_c
+};
+
+static const struct dsp_ops *ops = &dsp_ops_c;
+
+static void nco_init(void)
+{
+	int i;
+	if (nco_ready) {
+		return;}
+	for (i=0; i < (1 << NCO_BITS); i++) {
+		nco_sin[i] = (int16_t)round(32767 * sin(2 * M_PI * i / (1 << NCO_BITS)));}
+	nco_ready = 1;
+}
+
+const char *dsp_init(void)
+{
+	const struct dsp_ops *sets[4];
+	const char *want = getenv("RTLSDR_DSP");
+	int i, n;
+
+	nco_init();
+	n = dsp_simd_sets(sets);
+	ops = n ? sets[0] : &dsp_ops_c;
+	if (!want) {
+		return ops->name;}
+	/* a named set, as long as the cpu has it */
+	ops = &dsp_ops_c;
+	for (i=0; i<n; i++) {
+		if (strcmp(want, sets[i]->name) == 0) {
+			ops = sets[i];}
+	}
+	return ops->name;
+}
+
+const char *dsp_kernels(void)
+{
+	return ops->name;
+}
+
+void dsp_rotate_90_c(uint8_t *buf, uint32_t len)
+/* 90 rotation is 1+0j, 0+1j, -1+0j, 0-1j
+   or [0, 1, -3, 2, -4, -5, 7, -6] */
+{
+	uint32_t i;
+	unsigned char tmp;
+	for (i=0; i<len; i+=8) {
+		/* uint8_t negation = 255 - x */
+		tmp = 255 - buf[i+3];
+		buf[i+3] = buf[i+2];
+		buf[i+2] = tmp;
+
+		buf[i+4] = 255 - buf[i+4];
+		buf[i+5] = 255 - buf[i+5];
+
+		tmp = 255 - buf[i+6];
+		buf[i+6] = buf[i+7];
+		buf[i+7] = tmp;
+	}
+}
+
+void dsp_rotate_90(uint8_t *buf, uint32_t len)
+{
+	ops->rotate_90(buf, len);
+}
+
+void dsp_cu8_to_s16_c(const uint8_t *in, int16_t *out, int len)
+{
+	int i;
+	for (i=0; i<len; i++) {
+		out[i] = (int16_t)in[i] - 127;}
+}
+
+void dsp_cu8_to_s16(const uint8_t *in, int16_t *out, int len)
+{
+	ops->cu8_to_s16(in, out, len);
+}
+
+void dsp_fifth_order(int16_t *data, int length, int16_t *hist)
+/* for half of interleaved data */
+{
+	int i;
+	int16_t a, b, c, d, e, f;
+	a = hist[1];
+	b = hist[2];
+	c = hist[3];
+	d = hist[4];
+	e = hist[5];
+	f = data[0];
+	/* a downsample should improve resolution, so don't fully shift */
+	data[0] = (a + (b+e)*5 + (c+d)*10 + f) >> 4;
+	for (i=4; i<length; i+=4) {
+		a = c;
+		b = d;
+		c = e;
+		d = f;
+		e = data[i-2];
+		f = data[i];
+		data[i/2] = (a + (b+e)*5 + (c+d)*10 + f) >> 4;
+	}
+	/* archive */
+	hist[0] = a;
+	hist[1] = b;
+	hist[2] = c;
+	hist[3] = d;
+	hist[4] = e;
+	hist[5] = f;
+}
+
+void dsp_fifth_order_block(int16_t *data, int length)
+/* for half of interleaved data */
+{
+	int i;
+	int a, b, c, d, e, f;
+	a = data[0];
+	b = data[2];
+	c = data[4];
+	d = data[6];
+	e = data[8];
+	f = data[10];
+	/* a downsample should improve resolution, so don't fully shift */
+	/* ease in instead of being stateful */
+	data[0] = ((a+b)*10 + (c+d)*5 + d + f) >> 4;
+	data[2] = ((b+c)*10 + (a+d)*5 + e + f) >> 4;
+	data[4] = (a + (b+e)*5 + (c+d)*10 + f) >> 4;
+	for (i=12; i<length; i+=4) {
+		a = c;
+		b = d;
+		c = e;
+		d = f;
+		e = data[i-2];
+		f = data[i];
+		data[i/2] = (a + (b+e)*5 + (c+d)*10 + f) >> 4;
+	}
+}
+
+void dsp_generic_fir(int16_t *data, int length, int *fir, int16_t *hist)
+/* Okay, not at all generic.  Assumes length 9, fix that eventually. */
+{
+	int d, temp, sum;
+	for (d=0; d<length; d+=2) {
+		temp = data[d];
+		sum = 0;
+		sum += (hist[0] + hist[8]) * fir[1];
+		sum += (hist[1] + hist[7]) * fir[2];
+		sum += (hist[2] + hist[6]) * fir[3];
+		sum += (hist[3] + hist[5]) * fir[4];
+		sum +=            hist[4]  * fir[5];
+		data[d] = sum >> 15 ;
+		hist[0] = hist[1];
+		hist[1] = hist[2];
+		hist[2] = hist[3];
+		hist[3] = hist[4];
+		hist[4] = hist[5];
+		hist[5] = hist[6];
+		hist[6] = hist[7];
+		hist[7] = hist[8];
+		hist[8] = temp;
+	}
+}
+
+void dsp_generic_fir_block(int16_t *data, int length, int *fir)
+{
+	int d, temp, sum;
+	int hist[9] = {0,};
+	/* cheat on the beginning, let it go unfiltered */
+	for (d=0; d<18; d+=2) {
+		hist[d/2] = data[d];
+	}
+	for (d=18; d<length; d+=2) {
+		temp = data[d];
+		sum = 0;
+		sum += (hist[0] + hist[8]) * fir[1];
+		sum += (hist[1] + hist[7]) * fir[2];
+		sum += (hist[2] + hist[6]) * fir[3];
+		sum += (hist[3] + hist[5]) * fir[4];
+		sum +=            hist[4]  * fir[5];
+		data[d] = (int16_t)(sum >> 15) ;
+		hist[0] = hist[1];
+		hist[1] = hist[2];
+		hist[2] = hist[3];
+		hist[3] = hist[4];
+		hist[4] = hist[5];
+		hist[5] = hist[6];
+		hist[6] = hist[7];
+		hist[7] = hist[8];
+		hist[8] = temp;
+	}
+}
+
+int dsp_low_pass(int16_t *iq, int len, int downsample, struct dsp_boxcar *b)
+/* simple square window FIR */
+{
+	int i=0, i2=0;
+	while (i < len) {
+		b->now_r += iq[i];
+		b->now_j += iq[i+1];
+		i += 2;
+		b->index++;
+		if (b->index < downsample) {
+			continue;
+		}
+		iq[i2]   = b->now_r;
+		iq[i2+1] = b->now_j;
+		b->index = 0;
+		b->now_r = 0;
+		b->now_j = 0;
+		i2 += 2;
+	}
+	return i2;
+}
+
+void dsp_remove_dc(int16_t *data, int length)
+/* works on interleaved data */
+{
+	int i;
+	int16_t ave;
+	long sum = 0L;
+	for (i=0; i < length; i+=2) {
+		sum += data[i];
+	}
+	ave = (int16_t)(sum / (long)(length));
+	if (ave == 0) {
+		return;}
+	for (i=0; i < length; i+=2) {
+		data[i] -= ave;
+	}
+}
+
+int dsp_rms(int16_t *samples, int len, int step)
+{
+	int i;
+	long p, t, s;
+	double dc, err;
+
+	p = t = 0L;
+	for (i=0; i<len; i+=step) {
+		s = (long)samples[i];
+		t += s;
+		p += s * s;
+	}
+	/* correct for dc offset in squares */
+	dc = (double)(t*step) / (double)len;
+	err = t * 2 * dc - dc * dc * len;
+
+	return (int)sqrt((p-err) / len);
+}
+
+long dsp_power_cu8(const uint8_t *buf, int len)
+{
+	int i, s;
+	long p, t;
+	double dc, err;
+
+	p = t = 0L;
+	for (i=0; i<len; i++) {
+		s = (int)buf[i] - 127;
+		t += (long)s;
+		p += (long)(s * s);
+	}
+	/* correct for dc offset in squares */
+	dc = (double)t / (double)len;
+	err = t * 2 * dc - dc * dc * len;
+	p -= (long)round(err);
+	return p;
+}
+
+/* define our own complex math ops
+   because ARMv5 has no hardware float */
+
+static void multiply(int ar, int aj, int br, int bj, int *cr, int *cj)
+{
+	*cr = ar*br - aj*bj;
+	*cj = aj*br + ar*bj;
+}
+
+static int polar_discriminant(int ar, int aj, int br, int bj)
+{
+	int cr, cj;
+	double angle;
+	multiply(ar, aj, br, -bj, &cr, &cj);
+	angle = atan2((double)cj, (double)cr);
+	return (int)(angle / 3.14159 * (1<<14));
+}
+
+static int fast_atan2(int y, int x)
+/* pre scaled for int16 */
+{
+	int yabs, angle;
+	int pi4=(1<<12), pi34=3*(1<<12);  // note pi = 1<<14
+	if (x==0 && y==0) {
+		return 0;
+	}
+	yabs = y;
+	if (yabs < 0) {
+		yabs = -yabs;
+	}
+	if (x >= 0) {
+		angle = pi4  - pi4 * (x-yabs) / (x+yabs);
+	} else {
+		angle = pi34 - pi4 * (x+yabs) / (yabs-x);
+	}
+	if (y < 0) {
+		return -angle;
+	}
+	return angle;
+}
+
+static int polar_disc_fast(int ar, int aj, int br, int bj)
+{
+	int cr, cj;
+	multiply(ar, aj, br, -bj, &cr, &cj);
+	return fast_atan2(cj, cr);
+}
+
+int dsp_atan_lut_init(void)
+{
+	int i = 0;
+
+	if (atan_lut) {
+		return 0;}
+	atan_lut = malloc(atan_lut_size * sizeof(int));
+	if (!atan_lut) {
+		return -1;}
+
+	for (i = 0; i < atan_lut_size; i++) {
+		atan_lut[i] = (int) (atan((double) i / (1<<atan_lut_coef)) / 3.14159 * (1<<14));
+	}
+
+	return 0;
+}
+
+static int polar_disc_lut(int ar, int aj, int br, int bj)
+{
+	int cr, cj, x, x_abs;
+
+	multiply(ar, aj, br, -bj, &cr, &cj);
+
+	/* special cases */
+	if (cr == 0 || cj == 0) {
+		if (cr == 0 && cj == 0)
+			{return 0;}
+		if (cr == 0 && cj > 0)
+			{return 1 << 13;}
+		if (cr == 0 && cj < 0)
+			{return -(1 << 13);}
+		if (cj == 0 && cr > 0)
+			{return 0;}
+		if (cj == 0 && cr < 0)
+			{return 1 << 14;}
+	}
+
+	/* real range -32768 - 32768 use 64x range -> absolute maximum: 2097152 */
+	x = (cj << atan_lut_coef) / cr;
+	x_abs = abs(x);
+
+	if (x_abs >= atan_lut_size) {
+		/* we can use linear range, but it is not necessary */
+		return (cj > 0) ? 1<<13 : -(1<<13);
+	}
+
+	if (x > 0) {
+		return (cj > 0) ? atan_lut[x] : atan_lut[x] - (1<<14);
+	} else {
+		return (cj > 0) ? (1<<14) - atan_lut[-x] : -atan_lut[-x];
+	}
+
+	return 0;
+}
+
+int dsp_fm_demod(const int16_t *lp, int len, int16_t *out, int pre[2], enum dsp_atan mode)
+{
+	int i, pcm;
+	pcm = polar_discriminant(lp[0], lp[1], pre[0], pre[1]);
+	out[0] = (int16_t)pcm;
+	/* one loop per mode, keeps the switch out of the sample loop */
+	switch (mode) {
+	case DSP_ATAN_FLOAT:
+		for (i = 2; i < (len-1); i += 2) {
+			out[i/2] = (int16_t)polar_discriminant(lp[i], lp[i+1], lp[i-2], lp[i-1]);}
+		break;
+	case DSP_ATAN_FAST:
+		for (i = 2; i < (len-1); i += 2) {
+			out[i/2] = (int16_t)polar_disc_fast(lp[i], lp[i+1], lp[i-2], lp[i-1]);}
+		break;
+	case DSP_ATAN_LUT:
+		for (i = 2; i < (len-1); i += 2) {
+			out[i/2] = (int16_t)polar_disc_lut(lp[i], lp[i+1], lp[i-2], lp[i-1]);}
+		break;
+	}
+	pre[0] = lp[len - 2];
+	pre[1] = lp[len - 1];
+	return len/2;
+}
+
+int dsp_am_demod(const int16_t *lp, int len, int16_t *out, int scale)
+// todo, fix this extreme laziness
+{
+	int i, pcm;
+	for (i = 0; i < len; i += 2) {
+		// hypot uses floats but won't overflow
+		pcm = lp[i] * lp[i];
+		pcm += lp[i+1] * lp[i+1];
+		out[i/2] = (int16_t)sqrt(pcm) * scale;
+	}
+	return len/2;
+}
+
+int dsp_magnitude_c(uint8_t *buf, int len)
+/* takes i/q, changes buf in place (16 bit), returns new len (16 bit) */
+{
+	int i, di, dq;
+	uint16_t *m;
+	for (i=0; i<len; i+=2) {
+		/* equiv to abs(x-127) ^ 2 */
+		di = buf[i] - 127;
+		dq = buf[i+1] - 127;
+		m = (uint16_t*)(&buf[i]);
+		*m = (uint16_t)(di*di + dq*dq);
+	}
+	return len/2;
+}
+
+int dsp_magnitude(uint8_t *buf, int len)
+{
+	return ops->magnitude(buf, len);
+}
+
+static int preamble(const uint16_t *buf, int i)
+/* returns 0/1 for preamble at index i */
+{
+	int i2;
+	uint16_t low  = 0;
+	uint16_t high = 65535;
+	for (i2=0; i2<DSP_PREAMBLE_LEN; i2++) {
+		switch (i2) {
+			case 0:
+			case 2:
+			case 7:
+			case 9:
+				high = buf[i+i2];
+				break;
+			default:
+				low = buf[i+i2];
+				break;
+		}
+		if (high <= low) {
+			return 0;}
+	}
+	return 1;
+}
+
+int dsp_preamble_scan_c(const uint16_t *buf, int i, int end)
+{
+	for ( ; i < end; i++) {
+		if (preamble(buf, i)) {
+			break;}
+	}
+	return i;
+}
+
+int dsp_preamble_scan(const uint16_t *buf, int i, int end)
+{
+	return ops->preamble_scan(buf, i, end);
+}
+
+static inline uint16_t single_manchester(uint16_t a, uint16_t b, uint16_t c, uint16_t d, int quality)
+/* takes 4 consecutive real samples, return 0 or 1, DSP_BADSAMPLE on error */
+{
+	int bit, bit_p;
+	bit_p = a > b;
+	bit   = c > d;
+
+	if (quality == 0) {
+		return bit;}
+
+	if (quality == 5) {
+		if ( bit &&  bit_p && b > c) {
+			return DSP_BADSAMPLE;}
+		if (!bit && !bit_p && b < c) {
+			return DSP_BADSAMPLE;}
+		return bit;
+	}
+
+	if (quality == 10) {
+		if ( bit &&  bit_p && c > b) {
+			return 1;}
+		if ( bit && !bit_p && d < b) {
+			return 1;}
+		if (!bit &&  bit_p && d > b) {
+			return 0;}
+		if (!bit && !bit_p && c < b) {
+			return 0;}
+		return DSP_BADSAMPLE;
+	}
+
+	if ( bit &&  bit_p && c > b && d < a) {
+		return 1;}
+	if ( bit && !bit_p && c > a && d < b) {
+		return 1;}
+	if (!bit &&  bit_p && c < a && d > b) {
+		return 0;}
+	if (!bit && !bit_p && c < b && d > a) {
+		return 0;}
+	return DSP_BADSAMPLE;
+}
+
+void dsp_manchester(struct dsp_manchester *m, uint16_t *buf, int len)
+/* overwrites magnitude buffer with valid bits (DSP_BADSAMPLE on errors) */
+{
+	/* a and b hold old values to verify local manchester */
+	uint16_t a=0, b=0;
+	uint16_t bit;
+	uint32_t power;
+	int i, i2, errors;
+	int maximum_i = len - 1;        // len-1 since we look at i and i+1
+	int last = len - DSP_PREAMBLE_LEN;
+	// todo, allow wrap across buffers
+	i = 0;
+	m->hit_count = 0;
+	while (i < maximum_i) {
+		/* find preamble */
+		for ( ; (i = dsp_preamble_scan(buf, i, last)) < last; i++) {
+			m->candidates++;
+			power = ((uint32_t)buf[i] + buf[i+2] + buf[i+7] + buf[i+9]) / 4;
+			/* noise shaped like a preamble is not worth decoding */
+			if (power < m->threshold) {
+				m->quiet++;
+				continue;}
+			m->hit_pos[m->hit_count] = i + DSP_PREAMBLE_LEN;
+			m->hit_power[m->hit_count] = (uint16_t)power;
+			m->hit_count++;
+			a = buf[i];
+			b = buf[i+1];
+			for (i2=0; i2<DSP_PREAMBLE_LEN; i2++) {
+				buf[i+i2] = DSP_MESSAGEGO;}
+			i += DSP_PREAMBLE_LEN;
+			break;
+		}
+		i2 = i;
+		errors = 0;
+		/* mark bits until encoding breaks */
+		for ( ; i < maximum_i; i+=2, i2++) {
+			bit = single_manchester(a, b, buf[i], buf[i+1], m->quality);
+			a = buf[i];
+			b = buf[i+1];
+			if (bit == DSP_BADSAMPLE) {
+				errors += 1;
+				if (errors > m->allowed_errors) {
+					buf[i2] = DSP_BADSAMPLE;
+					break;
+				} else {
+					bit = a > b;
+					/* these don't have to match the bit */
+					a = 0;
+					b = 65535;
+				}
+			}
+			buf[i] = buf[i+1] = DSP_OVERWRITE;
+			buf[i2] = bit;
+		}
+	}
+}
+
+void dsp_power_sum_c(const int16_t *iq, long *avg, int bins)
+/* real(n * conj(n)) */
+{
+	int j;
+	for (j=0; j<bins; j++) {
+		avg[j] += (long)iq[j*2]*(long)iq[j*2] + (long)iq[j*2+1]*(long)iq[j*2+1];}
+}
+
+void dsp_power_sum(const int16_t *iq, long *avg, int bins)
+{
+	ops->power_sum(iq, avg, bins);
+}
+
+void dsp_power_peak(const int16_t *iq, long *avg, int bins)
+{
+	int j;
+	long p;
+	for (j=0; j<bins; j++) {
+		p = (long)iq[j*2]*(long)iq[j*2] + (long)iq[j*2+1]*(long)iq[j*2+1];
+		if (p > avg[j]) {
+			avg[j] = p;}
+	}
+}
+
+/* FFT based on fix_fft.c by Roberts, Slaney and Bouras
+   http://www.jjj.de/fft/fftpage.html
+   16 bit ints for everything
+   -32768..+32768 maps to -1.0..+1.0
+*/
+
+int dsp_fft_init(struct dsp_fft *f, int log2n)
+{
+	int i;
+	double d;
+	f->log2n = log2n;
+	f->n = 1 << log2n;
+	f->sine = malloc(sizeof(int16_t) * f->n*3/4);
+	if (!f->sine) {
+		return -1;}
+	for (i=0; i<f->n*3/4; i++)
+	{
+		d = (double)i * 2.0 * M_PI / f->n;
+		f->sine[i] = (int)round(32767*sin(d));
+	}
+	return 0;
+}
+
+void dsp_fft_free(struct dsp_fft *f)
+{
+	free(f->sine);
+	f->sine = NULL;
+}
+
+static inline int16_t FIX_MPY(int16_t a, int16_t b)
+/* fixed point multiply and scale */
+{
+	int c = ((int)a * (int)b) >> 14;
+	b = c & 0x01;
+	return (c >> 1) + b;
+}
+
+int dsp_fix_fft(const struct dsp_fft *f, int16_t iq[], int m)
+/* interleaved iq[], 0 <= n < 2**m, changes in place */
+{
+	int mr, nn, i, j, l, k, istep, n, shift;
+	int16_t qr, qi, tr, ti, wr, wi;
+	n = 1 << m;
+	if (n > f->n)
+		{return -1;}
+	mr = 0;
+	nn = n - 1;
+	/* decimation in time - re-order data */
+	for (m=1; m<=nn; ++m) {
+		l = n;
+		do
+			{l >>= 1;}
+		while (mr+l > nn);
+		mr = (mr & (l-1)) + l;
+		if (mr <= m)
+			{continue;}
+		// real = 2*m, imag = 2*m+1
+		tr = iq[2*m];
+		iq[2*m] = iq[2*mr];
+		iq[2*mr] = tr;
+		ti = iq[2*m+1];
+		iq[2*m+1] = iq[2*mr+1];
+		iq[2*mr+1] = ti;
+	}
+	l = 1;
+	k = f->log2n-1;
+	while (l < n) {
+		shift = 1;
+		istep = l << 1;
+		for (m=0; m<l; ++m) {
+			j = m << k;
+			wr =  f->sine[j+f->n/4];
+			wi = -f->sine[j];
+			if (shift) {
+				wr >>= 1; wi >>= 1;}
+			for (i=m; i<n; i+=istep) {
+				j = i + l;
+				tr = FIX_MPY(wr,iq[2*j]) - FIX_MPY(wi,iq[2*j+1]);
+				ti = FIX_MPY(wr,iq[2*j+1]) + FIX_MPY(wi,iq[2*j]);
+				qr = iq[2*i];
+				qi = iq[2*i+1];
+				if (shift) {
+					qr >>= 1; qi >>= 1;}
+				iq[2*j] = qr - tr;
+				iq[2*j+1] = qi - ti;
+				iq[2*i] = qr + tr;
+				iq[2*i+1] = qi + ti;
+			}
+		}
+		--k;
+		l = istep;
+	}
+	return 0;
+}
+
+void dsp_nco_set(struct dsp_nco *n, double freq, double rate)
+{
+	nco_init();
+	n->phase = 0;
+	n->step = (uint32_t)(int64_t)llround(freq / rate * 4294967296.0);
+}
+
+static int16_t clamp16(int v)
+{
+	return v < -32768 ? -32768 : v > 32767 ? 32767 : (int16_t)v;
+}
+
+void dsp_nco_mix(struct dsp_nco *n, int16_t *iq, int len)
+{
+	int k, i, q, s, c;
+	for (k=0; k+1<len; k+=2) {
+		s = nco_sin[n->phase >> (32 - NCO_BITS)];
+		c = nco_sin[(n->phase + 0x40000000u) >> (32 - NCO_BITS)];
+		i = iq[k];
+		q = iq[k+1];
+		/* rounded, 32767 is one */
+		iq[k]   = clamp16((i * c - q * s + (1<<14)) >> 15);
+		iq[k+1] = clamp16((i * s + q * c + (1<<14)) >> 15);
+		n->phase += n->step;
+	}
+}
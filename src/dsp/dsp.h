@@ -0,0 +1,298 @@
+/*
+ * rtl-sdr, turns your Realtek RTL2832 based DVB dongle into a SDR receiver
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __RTLSDR_DSP_H
+#define __RTLSDR_DSP_H
+
+/*
+ * Fixed point kernels shared by rtl_fm, rtl_power, rtl_adsb and the down
+ * converter of rtl_sdr and rtl_tcp. The block kernels have SSE2, AVX2 and
+ * NEON versions picked at run time by dsp_init(); every version gives the
+ * same output as the plain C one.
+ * Until dsp_init() is called the plain C versions are used.
+ */
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* {length, coef, coef, coef}  and scaled by 2^15
+   for now, only length 9, optimal way to get +85% bandwidth */
+#define DSP_CIC_TABLE_MAX 10
+extern int dsp_cic_9_tables[][10];
+
+enum dsp_atan {
+	DSP_ATAN_FLOAT,		/* atan2() */
+	DSP_ATAN_FAST,		/* piecewise linear */
+	DSP_ATAN_LUT		/* table, needs dsp_atan_lut_init() */
+};
+
+/*!
+ * Pick the fastest kernels this cpu runs, RTLSDR_DSP=c in the
+ * environment keeps the plain C ones
+ *
+ * \return name of the kernel set, "c", "sse2", "avx2" or "neon"
+ */
+
+const char *dsp_init(void);
+
+/*!
+ * Name of the kernel set in use
+ */
+
+const char *dsp_kernels(void);
+
+/*!
+ * Shift cu8 I/Q by a quarter of the sample rate, in place
+ *
+ * \param buf interleaved cu8 I/Q
+ * \param len bytes, a multiple of 8
+ */
+
+void dsp_rotate_90(uint8_t *buf, uint32_t len);
+
+/*!
+ * Center cu8 samples on zero, x - 127
+ *
+ * \param in cu8 samples
+ * \param out len int16 samples, may not overlap in
+ * \param len samples
+ */
+
+void dsp_cu8_to_s16(const uint8_t *in, int16_t *out, int len);
+
+/*!
+ * Halve one rail of interleaved I/Q with a fifth order CIC, in place
+ *
+ * \param data first sample of the rail, every other one is filtered
+ * \param length int16 values left in the buffer from data on
+ * \param hist six values of state carried between blocks
+ */
+
+void dsp_fifth_order(int16_t *data, int length, int16_t *hist);
+
+/*!
+ * dsp_fifth_order() for a lone block, eases in instead of keeping state
+ */
+
+void dsp_fifth_order_block(int16_t *data, int length);
+
+/*!
+ * Nine tap symmetric FIR on one rail of interleaved I/Q, in place
+ *
+ * \param data first sample of the rail
+ * \param length int16 values left in the buffer from data on
+ * \param fir one of dsp_cic_9_tables
+ * \param hist nine values of state carried between blocks
+ */
+
+void dsp_generic_fir(int16_t *data, int length, int *fir, int16_t *hist);
+
+/*!
+ * dsp_generic_fir() for a lone block, the first nine samples pass unfiltered
+ */
+
+void dsp_generic_fir_block(int16_t *data, int length, int *fir);
+
+/* running sums of dsp_low_pass(), zero to start */
+struct dsp_boxcar {
+	int now_r, now_j;
+	int index;		/* samples in the sums */
+};
+
+/*!
+ * Decimate interleaved I/Q by summing groups of downsample samples, in place
+ *
+ * \param iq interleaved int16 I/Q
+ * \param len int16 values, even
+ * \param downsample samples per output
+ * \param b partial sums carried between blocks
+ * \return int16 values left
+ */
+
+int dsp_low_pass(int16_t *iq, int len, int downsample, struct dsp_boxcar *b);
+
+/*!
+ * Subtract the mean from one rail of interleaved I/Q
+ */
+
+void dsp_remove_dc(int16_t *data, int length);
+
+/*!
+ * Root mean square of every step-th sample, dc removed
+ */
+
+int dsp_rms(int16_t *samples, int len, int step);
+
+/*!
+ * Power of cu8 samples, the sum of squares with the dc removed
+ */
+
+long dsp_power_cu8(const uint8_t *buf, int len);
+
+/*!
+ * Fill the table for DSP_ATAN_LUT, safe to call more than once
+ *
+ * \return 0 on success, -1 when out of memory
+ */
+
+int dsp_atan_lut_init(void);
+
+/*!
+ * Phase difference of consecutive I/Q samples, pi being 1<<14
+ *
+ * \param lp interleaved int16 I/Q
+ * \param len int16 values, even
+ * \param out len/2 samples
+ * \param pre last I/Q sample of the previous block, updated
+ * \param mode arctangent to use
+ * \return samples written
+ */
+
+int dsp_fm_demod(const int16_t *lp, int len, int16_t *out, int pre[2], enum dsp_atan mode);
+
+/*!
+ * Envelope of interleaved int16 I/Q, times scale
+ *
+ * \return samples written, len/2
+ */
+
+int dsp_am_demod(const int16_t *lp, int len, int16_t *out, int scale);
+
+/*!
+ * I^2 + Q^2 of cu8 samples, in place
+ *
+ * \param buf interleaved cu8 I/Q, becomes len/2 uint16 values
+ * \param len bytes
+ * \return magnitudes written
+ */
+
+int dsp_magnitude(uint8_t *buf, int len);
+
+/*!
+ * Find the next mode s preamble in a magnitude buffer
+ *
+ * \param buf magnitudes, readable up to end + 15
+ * \param i first position to look at
+ * \param end one past the last position to look at
+ * \return position of the preamble, the larger of i and end if there is none
+ */
+
+int dsp_preamble_scan(const uint16_t *buf, int i, int end);
+
+/* values dsp_manchester() leaves in the magnitude buffer besides 0 and 1 */
+#define DSP_PREAMBLE_LEN	16
+#define DSP_MESSAGEGO		253
+#define DSP_OVERWRITE		254
+#define DSP_BADSAMPLE		255
+
+struct dsp_manchester {
+	int      quality;        /* 0, 5, 10 or 20, tenths of a bit checked */
+	int      allowed_errors;
+	uint32_t threshold;      /* minimum preamble pulse power, 0 accepts all */
+	/* preamble positions and pulse power, len / DSP_PREAMBLE_LEN + 1 each */
+	int      *hit_pos;
+	uint16_t *hit_power;
+	int      hit_count;
+	uint64_t candidates;     /* preambles matching the pulse pattern */
+	uint64_t quiet;          /* candidates rejected by the threshold */
+};
+
+/*!
+ * Slice mode s frames out of a magnitude buffer
+ *
+ * \param m settings and counters, hit_count is reset
+ * \param buf magnitudes, overwritten with one bit per value after each
+ *            preamble, DSP_BADSAMPLE where the encoding breaks
+ * \param len magnitudes
+ */
+
+void dsp_manchester(struct dsp_manchester *m, uint16_t *buf, int len);
+
+/*!
+ * Add I^2 + Q^2 of every bin to a running sum
+ *
+ * \param iq interleaved int16 I/Q, bins pairs
+ * \param avg bins sums
+ * \param bins bins
+ */
+
+void dsp_power_sum(const int16_t *iq, long *avg, int bins);
+
+/*!
+ * Keep the largest I^2 + Q^2 of every bin
+ */
+
+void dsp_power_peak(const int16_t *iq, long *avg, int bins);
+
+/* sine table for dsp_fix_fft() */
+struct dsp_fft {
+	int log2n;
+	int n;
+	int16_t *sine;		/* 3/4 of a turn */
+};
+
+/*!
+ * Build the sine table for transforms up to 2^log2n points
+ *
+ * \return 0 on success, -1 when out of memory
+ */
+
+int dsp_fft_init(struct dsp_fft *f, int log2n);
+
+void dsp_fft_free(struct dsp_fft *f);
+
+/*!
+ * 16 bit fixed point FFT, scaled by 1/n
+ *
+ * \param f table from dsp_fft_init()
+ * \param iq interleaved int16 I/Q, changed in place
+ * \param m 2^m points, m <= f->log2n
+ * \return 0 on success, -1 if the table is too small
+ */
+
+int dsp_fix_fft(const struct dsp_fft *f, int16_t iq[], int m);
+
+/* numerically controlled oscillator, a full turn is 2^32 */
+struct dsp_nco {
+	uint32_t phase;
+	uint32_t step;
+};
+
+/*!
+ * Set the NCO to shift by freq Hz at rate samples per second
+ */
+
+void dsp_nco_set(struct dsp_nco *n, double freq, double rate);
+
+/*!
+ * Multiply interleaved int16 I/Q by the NCO, in place
+ *
+ * \param n the oscillator, its phase carries over to the next block
+ * \param iq interleaved int16 I/Q
+ * \param len int16 values, even
+ */
+
+void dsp_nco_mix(struct dsp_nco *n, int16_t *iq, int len);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __RTLSDR_DSP_H */
@@ -0,0 +1,408 @@
+/*
+ * rtl-sdr, turns your Realtek RTL2832 based DVB dongle into a SDR receiver
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Vector versions of the block kernels. The x86 ones are built with
+ * target attributes, so the file compiles for the baseline cpu and the
+ * cpu is asked at run time. Other compilers and cpus get no sets and
+ * stay on the plain C kernels.
+ */
+
+#include <limits.h>
+#include <stdint.h>
+
+#include "dsp_simd.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define DSP_X86
+#include <immintrin.h>
+#elif defined(__GNUC__) && defined(__aarch64__)
+#define DSP_NEON
+#include <arm_neon.h>
+#endif
+
+/* the power sums add into longs, the vector code needs them 64 bit */
+#if LONG_MAX > 0x7fffffffL
+#define DSP_LONG64
+#endif
+
+#ifdef DSP_X86
+
+#define SSE2 __attribute__((target("sse2")))
+#define AVX2 __attribute__((target("avx2")))
+
+SSE2 static void rotate_90_sse2(uint8_t *buf, uint32_t len)
+{
+	/* swap bytes in words 1 and 3 of every four, then negate 2, 4, 5, 7 */
+	const __m128i words = _mm_set_epi16(-1, 0, -1, 0, -1, 0, -1, 0);
+	const __m128i neg = _mm_set_epi8(-1, 0, -1, -1, 0, -1, 0, 0,
+					 -1, 0, -1, -1, 0, -1, 0, 0);
+	__m128i x, s;
+	uint32_t i;
+	for (i=0; i+16<=len; i+=16) {
+		x = _mm_loadu_si128((__m128i *)(buf + i));
+		s = _mm_or_si128(_mm_slli_epi16(x, 8), _mm_srli_epi16(x, 8));
+		x = _mm_or_si128(_mm_and_si128(words, s), _mm_andnot_si128(words, x));
+		_mm_storeu_si128((__m128i *)(buf + i), _mm_xor_si128(x, neg));
+	}
+	dsp_rotate_90_c(buf + i, len - i);
+}
+
+AVX2 static void rotate_90_avx2(uint8_t *buf, uint32_t len)
+{
+	const __m256i swap = _mm256_set_epi8(
+		14, 15, 13, 12, 10, 11, 9, 8, 6, 7, 5, 4, 2, 3, 1, 0,
+		14, 15, 13, 12, 10, 11, 9, 8, 6, 7, 5, 4, 2, 3, 1, 0);
+	const __m256i neg = _mm256_set_epi8(
+		-1, 0, -1, -1, 0, -1, 0, 0, -1, 0, -1, -1, 0, -1, 0, 0,
+		-1, 0, -1, -1, 0, -1, 0, 0, -1, 0, -1, -1, 0, -1, 0, 0);
+	__m256i x;
+	uint32_t i;
+	for (i=0; i+32<=len; i+=32) {
+		x = _mm256_loadu_si256((__m256i *)(buf + i));
+		x = _mm256_xor_si256(_mm256_shuffle_epi8(x, swap), neg);
+		_mm256_storeu_si256((__m256i *)(buf + i), x);
+	}
+	dsp_rotate_90_c(buf + i, len - i);
+}
+
+SSE2 static void cu8_to_s16_sse2(const uint8_t *in, int16_t *out, int len)
+{
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i bias = _mm_set1_epi16(127);
+	__m128i x;
+	int i;
+	for (i=0; i+16<=len; i+=16) {
+		x = _mm_loadu_si128((const __m128i *)(in + i));
+		_mm_storeu_si128((__m128i *)(out + i),
+			_mm_sub_epi16(_mm_unpacklo_epi8(x, zero), bias));
+		_mm_storeu_si128((__m128i *)(out + i + 8),
+			_mm_sub_epi16(_mm_unpackhi_epi8(x, zero), bias));
+	}
+	dsp_cu8_to_s16_c(in + i, out + i, len - i);
+}
+
+AVX2 static void cu8_to_s16_avx2(const uint8_t *in, int16_t *out, int len)
+{
+	const __m256i bias = _mm256_set1_epi16(127);
+	__m256i x;
+	int i;
+	for (i=0; i+16<=len; i+=16) {
+		x = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)(in + i)));
+		_mm256_storeu_si256((__m256i *)(out + i), _mm256_sub_epi16(x, bias));
+	}
+	dsp_cu8_to_s16_c(in + i, out + i, len - i);
+}
+
+SSE2 static int magnitude_sse2(uint8_t *buf, int len)
+{
+	/* the sums reach 32768, packed with a bias to dodge signed saturation */
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i bias = _mm_set1_epi16(127);
+	const __m128i half = _mm_set1_epi32(32768);
+	const __m128i flip = _mm_set1_epi16((short)0x8000);
+	__m128i x, lo, hi;
+	int i;
+	for (i=0; i+16<=len; i+=16) {
+		x = _mm_loadu_si128((__m128i *)(buf + i));
+		lo = _mm_sub_epi16(_mm_unpacklo_epi8(x, zero), bias);
+		hi = _mm_sub_epi16(_mm_unpackhi_epi8(x, zero), bias);
+		lo = _mm_sub_epi32(_mm_madd_epi16(lo, lo), half);
+		hi = _mm_sub_epi32(_mm_madd_epi16(hi, hi), half);
+		x = _mm_xor_si128(_mm_packs_epi32(lo, hi), flip);
+		_mm_storeu_si128((__m128i *)(buf + i), x);
+	}
+	dsp_magnitude_c(buf + i, len - i);
+	return len/2;
+}
+
+AVX2 static int magnitude_avx2(uint8_t *buf, int len)
+{
+	/* unpack and pack both work per 128 bit lane, so the order survives */
+	const __m256i zero = _mm256_setzero_si256();
+	const __m256i bias = _mm256_set1_epi16(127);
+	const __m256i half = _mm256_set1_epi32(32768);
+	const __m256i flip = _mm256_set1_epi16((short)0x8000);
+	__m256i x, lo, hi;
+	int i;
+	for (i=0; i+32<=len; i+=32) {
+		x = _mm256_loadu_si256((__m256i *)(buf + i));
+		lo = _mm256_sub_epi16(_mm256_unpacklo_epi8(x, zero), bias);
+		hi = _mm256_sub_epi16(_mm256_unpackhi_epi8(x, zero), bias);
+		lo = _mm256_sub_epi32(_mm256_madd_epi16(lo, lo), half);
+		hi = _mm256_sub_epi32(_mm256_madd_epi16(hi, hi), half);
+		x = _mm256_xor_si256(_mm256_packs_epi32(lo, hi), flip);
+		_mm256_storeu_si256((__m256i *)(buf + i), x);
+	}
+	dsp_magnitude_c(buf + i, len - i);
+	return len/2;
+}
+
+/*
+ * The preamble test is a fixed set of comparisons between the sixteen
+ * magnitudes from i on, done here for 8 or 16 positions at once. Unsigned
+ * compares are signed ones with the top bit flipped.
+ */
+
+SSE2 static int preamble_scan_sse2(const uint16_t *buf, int i, int end)
+{
+	const __m128i flip = _mm_set1_epi16((short)0x8000);
+	__m128i v[16], m;
+	int k, hits;
+	for ( ; i+8<=end; i+=8) {
+		for (k=0; k<16; k++) {
+			v[k] = _mm_xor_si128(_mm_loadu_si128((const __m128i *)(buf + i + k)), flip);}
+		m = _mm_cmpgt_epi16(v[0], flip);
+		m = _mm_and_si128(m, _mm_cmpgt_epi16(v[0], v[1]));
+		m = _mm_and_si128(m, _mm_cmpgt_epi16(v[2], v[1]));
+		for (k=3; k<=6; k++) {
+			m = _mm_and_si128(m, _mm_cmpgt_epi16(v[2], v[k]));}
+		m = _mm_and_si128(m, _mm_cmpgt_epi16(v[7], v[6]));
+		m = _mm_and_si128(m, _mm_cmpgt_epi16(v[7], v[8]));
+		m = _mm_and_si128(m, _mm_cmpgt_epi16(v[9], v[8]));
+		for (k=10; k<16; k++) {
+			m = _mm_and_si128(m, _mm_cmpgt_epi16(v[9], v[k]));}
+		hits = _mm_movemask_epi8(m);
+		if (hits) {
+			return i + __builtin_ctz(hits) / 2;}
+	}
+	return dsp_preamble_scan_c(buf, i, end);
+}
+
+AVX2 static int preamble_scan_avx2(const uint16_t *buf, int i, int end)
+{
+	const __m256i flip = _mm256_set1_epi16((short)0x8000);
+	__m256i v[16], m;
+	int k;
+	unsigned hits;
+	for ( ; i+16<=end; i+=16) {
+		for (k=0; k<16; k++) {
+			v[k] = _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)(buf + i + k)), flip);}
+		m = _mm256_cmpgt_epi16(v[0], flip);
+		m = _mm256_and_si256(m, _mm256_cmpgt_epi16(v[0], v[1]));
+		m = _mm256_and_si256(m, _mm256_cmpgt_epi16(v[2], v[1]));
+		for (k=3; k<=6; k++) {
+			m = _mm256_and_si256(m, _mm256_cmpgt_epi16(v[2], v[k]));}
+		m = _mm256_and_si256(m, _mm256_cmpgt_epi16(v[7], v[6]));
+		m = _mm256_and_si256(m, _mm256_cmpgt_epi16(v[7], v[8]));
+		m = _mm256_and_si256(m, _mm256_cmpgt_epi16(v[9], v[8]));
+		for (k=10; k<16; k++) {
+			m = _mm256_and_si256(m, _mm256_cmpgt_epi16(v[9], v[k]));}
+		hits = (unsigned)_mm256_movemask_epi8(m);
+		if (hits) {
+			return i + __builtin_ctz(hits) / 2;}
+	}
+	return dsp_preamble_scan_c(buf, i, end);
+}
+
+#ifdef DSP_LONG64
+SSE2 static void power_sum_sse2(const int16_t *iq, long *avg, int bins)
+{
+	/* I^2 + Q^2 reaches 2^31, so the madd result is taken as unsigned */
+	const __m128i zero = _mm_setzero_si128();
+	__m128i x, a;
+	int j;
+	for (j=0; j+4<=bins; j+=4) {
+		x = _mm_loadu_si128((const __m128i *)(iq + 2*j));
+		x = _mm_madd_epi16(x, x);
+		a = _mm_loadu_si128((__m128i *)(avg + j));
+		_mm_storeu_si128((__m128i *)(avg + j),
+			_mm_add_epi64(a, _mm_unpacklo_epi32(x, zero)));
+		a = _mm_loadu_si128((__m128i *)(avg + j + 2));
+		_mm_storeu_si128((__m128i *)(avg + j + 2),
+			_mm_add_epi64(a, _mm_unpackhi_epi32(x, zero)));
+	}
+	dsp_power_sum_c(iq + 2*j, avg + j, bins - j);
+}
+
+AVX2 static void power_sum_avx2(const int16_t *iq, long *avg, int bins)
+{
+	__m256i x, a;
+	int j;
+	for (j=0; j+8<=bins; j+=8) {
+		x = _mm256_loadu_si256((const __m256i *)(iq + 2*j));
+		x = _mm256_madd_epi16(x, x);
+		a = _mm256_loadu_si256((__m256i *)(avg + j));
+		_mm256_storeu_si256((__m256i *)(avg + j), _mm256_add_epi64(a,
+			_mm256_cvtepu32_epi64(_mm256_castsi256_si128(x))));
+		a = _mm256_loadu_si256((__m256i *)(avg + j + 4));
+		_mm256_storeu_si256((__m256i *)(avg + j + 4), _mm256_add_epi64(a,
+			_mm256_cvtepu32_epi64(_mm256_extracti128_si256(x, 1))));
+	}
+	dsp_power_sum_c(iq + 2*j, avg + j, bins - j);
+}
+#else
+#define power_sum_sse2 dsp_power_sum_c
+#define power_sum_avx2 dsp_power_sum_c
+#endif
+
+static const struct dsp_ops ops_sse2 = {
+	"sse2",
+	rotate_90_sse2,
+	cu8_to_s16_sse2,
+	magnitude_sse2,
+	preamble_scan_sse2,
+	power_sum_sse2
+};
+
+static const struct dsp_ops ops_avx2 = {
+	"avx2",
+	rotate_90_avx2,
+	cu8_to_s16_avx2,
+	magnitude_avx2,
+	preamble_scan_avx2,
+	power_sum_avx2
+};
+
+int dsp_simd_sets(const struct dsp_ops **sets)
+{
+	int n = 0;
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		sets[n++] = &ops_avx2;}
+	if (__builtin_cpu_supports("sse2")) {
+		sets[n++] = &ops_sse2;}
+	return n;
+}
+
+#elif defined(DSP_NEON)
+
+static void rotate_90_neon(uint8_t *buf, uint32_t len)
+{
+	static const uint8_t w[16] = {0,0,255,255,0,0,255,255,0,0,255,255,0,0,255,255};
+	static const uint8_t n[16] = {0,0,255,0,255,255,0,255,0,0,255,0,255,255,0,255};
+	const uint8x16_t words = vld1q_u8(w);
+	const uint8x16_t neg = vld1q_u8(n);
+	uint8x16_t x;
+	uint32_t i;
+	for (i=0; i+16<=len; i+=16) {
+		x = vld1q_u8(buf + i);
+		x = vbslq_u8(words, vrev16q_u8(x), x);
+		vst1q_u8(buf + i, veorq_u8(x, neg));
+	}
+	dsp_rotate_90_c(buf + i, len - i);
+}
+
+static void cu8_to_s16_neon(const uint8_t *in, int16_t *out, int len)
+{
+	const uint8x8_t bias = vdup_n_u8(127);
+	uint8x16_t x;
+	int i;
+	for (i=0; i+16<=len; i+=16) {
+		x = vld1q_u8(in + i);
+		/* wraps modulo 2^16, which is the signed difference */
+		vst1q_s16(out + i, vreinterpretq_s16_u16(vsubl_u8(vget_low_u8(x), bias)));
+		vst1q_s16(out + i + 8, vreinterpretq_s16_u16(vsubl_u8(vget_high_u8(x), bias)));
+	}
+	dsp_cu8_to_s16_c(in + i, out + i, len - i);
+}
+
+static int magnitude_neon(uint8_t *buf, int len)
+{
+	const uint8x8_t bias = vdup_n_u8(127);
+	uint8x16x2_t x;
+	int16x8_t di, dq;
+	uint16x8_t lo, hi;
+	int i;
+	for (i=0; i+32<=len; i+=32) {
+		x = vld2q_u8(buf + i);
+		di = vreinterpretq_s16_u16(vsubl_u8(vget_low_u8(x.val[0]), bias));
+		dq = vreinterpretq_s16_u16(vsubl_u8(vget_low_u8(x.val[1]), bias));
+		lo = vaddq_u16(vreinterpretq_u16_s16(vmulq_s16(di, di)),
+			       vreinterpretq_u16_s16(vmulq_s16(dq, dq)));
+		di = vreinterpretq_s16_u16(vsubl_u8(vget_high_u8(x.val[0]), bias));
+		dq = vreinterpretq_s16_u16(vsubl_u8(vget_high_u8(x.val[1]), bias));
+		hi = vaddq_u16(vreinterpretq_u16_s16(vmulq_s16(di, di)),
+			       vreinterpretq_u16_s16(vmulq_s16(dq, dq)));
+		vst1q_u16((uint16_t *)(buf + i), lo);
+		vst1q_u16((uint16_t *)(buf + i + 16), hi);
+	}
+	dsp_magnitude_c(buf + i, len - i);
+	return len/2;
+}
+
+static int preamble_scan_neon(const uint16_t *buf, int i, int end)
+{
+	uint16x8_t v[16], m;
+	uint64_t hits;
+	int k;
+	for ( ; i+8<=end; i+=8) {
+		for (k=0; k<16; k++) {
+			v[k] = vld1q_u16(buf + i + k);}
+		m = vcgtq_u16(v[0], vdupq_n_u16(0));
+		m = vandq_u16(m, vcgtq_u16(v[0], v[1]));
+		m = vandq_u16(m, vcgtq_u16(v[2], v[1]));
+		for (k=3; k<=6; k++) {
+			m = vandq_u16(m, vcgtq_u16(v[2], v[k]));}
+		m = vandq_u16(m, vcgtq_u16(v[7], v[6]));
+		m = vandq_u16(m, vcgtq_u16(v[7], v[8]));
+		m = vandq_u16(m, vcgtq_u16(v[9], v[8]));
+		for (k=10; k<16; k++) {
+			m = vandq_u16(m, vcgtq_u16(v[9], v[k]));}
+		hits = vget_lane_u64(vreinterpret_u64_u8(vmovn_u16(m)), 0);
+		if (hits) {
+			return i + __builtin_ctzll(hits) / 8;}
+	}
+	return dsp_preamble_scan_c(buf, i, end);
+}
+
+#ifdef DSP_LONG64
+static void power_sum_neon(const int16_t *iq, long *avg, int bins)
+{
+	int16x4x2_t x;
+	uint32x4_t p;
+	int j;
+	for (j=0; j+4<=bins; j+=4) {
+		x = vld2_s16(iq + 2*j);
+		/* each square fits, the sum needs the unsigned range */
+		p = vaddq_u32(vreinterpretq_u32_s32(vmull_s16(x.val[0], x.val[0])),
+			      vreinterpretq_u32_s32(vmull_s16(x.val[1], x.val[1])));
+		vst1q_s64((int64_t *)(avg + j), vreinterpretq_s64_u64(vaddw_u32(
+			vreinterpretq_u64_s64(vld1q_s64((int64_t *)(avg + j))), vget_low_u32(p))));
+		vst1q_s64((int64_t *)(avg + j + 2), vreinterpretq_s64_u64(vaddw_u32(
+			vreinterpretq_u64_s64(vld1q_s64((int64_t *)(avg + j + 2))), vget_high_u32(p))));
+	}
+	dsp_power_sum_c(iq + 2*j, avg + j, bins - j);
+}
+#else
+#define power_sum_neon dsp_power_sum_c
+#endif
+
+static const struct dsp_ops ops_neon = {
+	"neon",
+	rotate_90_neon,
+	cu8_to_s16_neon,
+	magnitude_neon,
+	preamble_scan_neon,
+	power_sum_neon
+};
+
+int dsp_simd_sets(const struct dsp_ops **sets)
+{
+	sets[0] = &ops_neon;
+	return 1;
+}
+
+#else
+
+int dsp_simd_sets(const struct dsp_ops **sets)
+{
+	(void)sets;
+	return 0;
+}
+
+#endif
@@ -0,0 +1,48 @@
+/*
+ * rtl-sdr, turns your Realtek RTL2832 based DVB dongle into a SDR receiver
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* between dsp.c and dsp_simd.c only, the tools use dsp.h */
+
+#include <stdint.h>
+
+/* one set of block kernels */
+struct dsp_ops {
+	const char *name;
+	void (*rotate_90)(uint8_t *buf, uint32_t len);
+	void (*cu8_to_s16)(const uint8_t *in, int16_t *out, int len);
+	int  (*magnitude)(uint8_t *buf, int len);
+	int  (*preamble_scan)(const uint16_t *buf, int i, int end);
+	void (*power_sum)(const int16_t *iq, long *avg, int bins);
+};
+
+extern const struct dsp_ops dsp_ops_c;
+
+/* the plain C kernels, the vector ones finish their tails with these */
+void dsp_rotate_90_c(uint8_t *buf, uint32_t len);
+void dsp_cu8_to_s16_c(const uint8_t *in, int16_t *out, int len);
+int dsp_magnitude_c(uint8_t *buf, int len);
+int dsp_preamble_scan_c(const uint16_t *buf, int i, int end);
+void dsp_power_sum_c(const int16_t *iq, long *avg, int bins);
+
+/*!
+ * Vector kernel sets this cpu runs, best first
+ *
+ * \param sets room for four
+ * \return number of sets
+ */
+
+int dsp_simd_sets(const struct dsp_ops **sets);
@@ -0,0 +1,644 @@
+/*
+ * rtl-sdr, turns your Realtek RTL2832 based DVB dongle into a SDR receiver
+ * libusb_emu, an RTL2832U with an R82xx tuner emulated behind libusb
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * librtlsdr built against this file instead of libusb talks to a register
+ * file: the RTL2832 USB, system and demod blocks, the I2C repeater, the
+ * EEPROM and an R820T or R828D whose PLL only locks with the VCO in range.
+ * Bulk reads return noise, or the counter in test mode, with a burst of
+ * louder noise after every PLL change. Settings come from the environment:
+ *
+ * RTLSDR_EMU_TUNER	r820t (default), r828d or blogv4
+ * RTLSDR_EMU_LOG	log every transfer to this file, - for stderr
+ * RTLSDR_EMU_REALTIME	1 to hand out samples no faster than the set rate
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+
+#include "libusb.h"
+
+#define EMU_VID			0x0bda
+#define EMU_PID			0x2838
+#define EMU_XTAL		28800000
+#define R828D_XTAL		16000000
+#define R82XX_CHECK		0x69	/* on the wire, bit reversed */
+#define VCO_MIN			1750000000.0	/* Hz, the PLL locks in here */
+#define VCO_MAX			3600000000.0
+#define SETTLE_US		2000	/* noise burst after a PLL change */
+#define MAX_PENDING		1024
+
+/* RTL2832 register blocks, as librtlsdr addresses them */
+#define DEMODB			0
+#define IICB			6
+#define BLOCKS			6
+#define EEPROM_ADDR		0xa0
+
+#define NOISE			4	/* LSBs, settled */
+#define NOISE_SETTLING		24
+#define NOISE_UNLOCKED		48
+
+struct emu_tuner {
+	const char *name;
+	uint8_t addr;		/* 8 bit I2C address */
+	uint32_t xtal;
+	uint8_t vco_ref;	/* what the driver expects in R4[5:4] */
+	uint8_t regs[32];
+	int locked;
+	double vco;
+	double freq;
+};
+
+struct pending {
+	struct libusb_transfer *xfer;
+	int cancelled;
+};
+
+struct libusb_device {
+	struct libusb_device_descriptor dd;
+	libusb_context *ctx;
+};
+
+/* one emulated dongle per context */
+struct libusb_context {
+	libusb_device device;
+	libusb_device_handle *open;	/* the handle events run on */
+};
+
+struct libusb_device_handle {
+	libusb_context *ctx;
+	pthread_mutex_t lock;
+	uint8_t blocks[BLOCKS][0x10000];
+	uint8_t demod[16][256];
+	uint8_t eeprom[256];
+	uint8_t eeprom_ptr;
+	struct emu_tuner tuner;
+	const char *strings[4];
+	uint8_t counter;
+	uint32_t noise_state;
+	uint64_t settling;	/* samples of the burst still to come */
+	struct pending pending[MAX_PENDING];
+	int pending_first;
+	int pending_count;
+	int realtime;
+	double next_due;	/* s, when the next bulk read may return */
+	double t0;
+	FILE *log;
+	uint64_t ctrl;
+	uint64_t bulk;
+};
+
+static const struct libusb_device_descriptor emu_descriptor = {
+	18, 1, 0x0200, 0, 0, 0, 64, EMU_VID, EMU_PID, 0x0100, 1, 2, 3, 1
+};
+
+static const uint8_t eeprom_default[9] = {
+	0x28, 0x32, EMU_VID & 0xff, EMU_VID >> 8, EMU_PID & 0xff, EMU_PID >> 8,
+	0xa5, 0x16, 0x02
+};
+
+static double now(void)
+{
+#ifdef _WIN32
+	LARGE_INTEGER f, t;
+
+	QueryPerformanceFrequency(&f);
+	QueryPerformanceCounter(&t);
+	return (double)t.QuadPart / f.QuadPart;
+#else
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+#endif
+}
+
+static void sleep_until(double t)
+{
+	double dt = t - now();
+
+	if (dt <= 0)
+		return;
+#ifdef _WIN32
+	Sleep((DWORD)(dt * 1000));
+#else
+	{
+		struct timespec ts;
+
+		ts.tv_sec = (time_t)dt;
+		ts.tv_nsec = (long)((dt - ts.tv_sec) * 1e9);
+		nanosleep(&ts, NULL);
+	}
+#endif
+}
+
+static uint8_t bitrev(uint8_t b)
+{
+	b = (uint8_t)((b & 0xf0) >> 4 | (b & 0x0f) << 4);
+	b = (uint8_t)((b & 0xcc) >> 2 | (b & 0x33) << 2);
+	return (uint8_t)((b & 0xaa) >> 1 | (b & 0x55) << 1);
+}
+
+static void emu_log(libusb_device_handle *h, const char *what,
+		    const unsigned char *data, int len, int r)
+{
+	int i;
+
+	if (!h->log)
+		return;
+	fprintf(h->log, "%10.6f %s", now() - h->t0, what);
+	for (i = 0; data && i < len && i < 32; i++)
+		fprintf(h->log, " %02x", data[i]);
+	if (data && len > 32)
+		fprintf(h->log, " ...");
+	if (r < 0)
+		fprintf(h->log, " -> error %d", r);
+	fprintf(h->log, "\n");
+}
+
+static uint32_t sample_rate(libusb_device_handle *h)
+/* the resampler ratio librtlsdr wrote to demod page 1, 0x9f to 0xa2 */
+{
+	const uint8_t *p = &h->demod[1][0x9f];
+	uint32_t ratio = (uint32_t)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+
+	ratio |= (ratio & 0x08000000) << 1;
+	if (!ratio)
+		return 2048000;
+	return (uint32_t)((double)EMU_XTAL * (1 << 22) / ratio);
+}
+
+static void tuner_pll(libusb_device_handle *h)
+/* the inverse of r82xx_set_pll(), then lock if the VCO can get there */
+{
+	struct emu_tuner *t = &h->tuner;
+	int mix_div = 2 << (t->regs[0x10] >> 5);
+	int nint = 4 * (t->regs[0x14] & 0x3f) + (t->regs[0x14] >> 6) + 13;
+	int sdm = t->regs[0x16] << 8 | t->regs[0x15];
+
+	if (t->regs[0x12] & 0x08)	/* pw_sdm, integer mode */
+		sdm = 0;
+	t->vco = 2.0 * t->xtal * (nint + sdm / 65536.0);
+	t->freq = t->vco / mix_div;
+	t->locked = t->vco >= VCO_MIN && t->vco <= VCO_MAX;
+	h->settling = (uint64_t)sample_rate(h) * SETTLE_US / 1000000;
+	if (h->log)
+		fprintf(h->log, "%10.6f pll vco %.3f MHz, lo %.3f MHz, %s\n", now() - h->t0,
+			t->vco / 1e6, t->freq / 1e6, t->locked ? "locked" : "unlocked");
+}
+
+static int tuner_write(libusb_device_handle *h, const uint8_t *data, int len)
+{
+	struct emu_tuner *t = &h->tuner;
+	int reg = data[0], i, pll = 0;
+
+	for (i = 1; i < len && reg < 32; i++, reg++) {
+		/* R0 to R4 are status, read only */
+		if (reg < 5)
+			continue;
+		t->regs[reg] = data[i];
+		if (reg == 0x10 || (reg >= 0x14 && reg <= 0x16))
+			pll = 1;
+	}
+	if (pll)
+		tuner_pll(h);
+	return len;
+}
+
+static int tuner_read(libusb_device_handle *h, uint8_t *data, int len)
+/* the R82xx always reads from R0, LSB first on the wire */
+{
+	struct emu_tuner *t = &h->tuner;
+	int i;
+
+	t->regs[0] = bitrev(R82XX_CHECK);
+	t->regs[2] = (uint8_t)((t->regs[2] & ~0x40) | (t->locked ? 0x40 : 0));
+	t->regs[4] = (uint8_t)((t->regs[4] & ~0x30) | t->vco_ref << 4);
+	for (i = 0; i < len && i < 32; i++)
+		data[i] = bitrev(t->regs[i]);
+	return len;
+}
+
+static int i2c_transfer(libusb_device_handle *h, int in, uint8_t addr,
+			uint8_t *data, int len)
+/* the EEPROM hangs off the RTL2832, the tuner sits behind the repeater */
+{
+	int i;
+
+	if (addr == EEPROM_ADDR) {
+		if (in) {
+			for (i = 0; i < len; i++)
+				data[i] = h->eeprom[h->eeprom_ptr++];
+			return len;
+		}
+		if (len < 1)
+			return LIBUSB_ERROR_PIPE;
+		h->eeprom_ptr = data[0];
+		for (i = 1; i < len; i++)
+			h->eeprom[h->eeprom_ptr++] = data[i];
+		return len;
+	}
+	/* anything else does not answer without the repeater, nor at a wrong address */
+	if (!(h->demod[1][0x01] & 0x08) || addr != h->tuner.addr || len < 1)
+		return LIBUSB_ERROR_PIPE;
+	return in ? tuner_read(h, data, len) : tuner_write(h, data, len);
+}
+
+static void fill_samples(libusb_device_handle *h, unsigned char *buf, int len)
+{
+	int i, amp;
+	uint32_t x = h->noise_state;
+
+	/* demod 0x19, 0x03 switches the ADC for the 8 bit counter */
+	if (h->demod[0][0x19] == 0x03) {
+		for (i = 0; i < len; i++)
+			buf[i] = h->counter++;
+		return;
+	}
+	for (i = 0; i < len; i++) {
+		if (!h->tuner.locked)
+			amp = NOISE_UNLOCKED;
+		else if (h->settling) {
+			amp = NOISE_SETTLING;
+			if (i & 1)
+				h->settling--;
+		} else
+			amp = NOISE;
+		x ^= x << 13;
+		x ^= x >> 17;
+		x ^= x << 5;
+		/* a triangle from two uniform bytes is close enough to Gaussian */
+		buf[i] = (uint8_t)(127 + ((int)(x & 0xff) + (int)((x >> 8) & 0xff) - 255) *
+				   amp / 128);
+	}
+	h->noise_state = x;
+}
+
+static void pace(libusb_device_handle *h, int len)
+{
+	double t, due;
+
+	if (!h->realtime)
+		return;
+	t = now();
+	/* after an idle spell, start counting again from here */
+	if (h->next_due < t - 0.1)
+		h->next_due = t;
+	h->next_due += len / 2.0 / sample_rate(h);
+	due = h->next_due;
+	pthread_mutex_unlock(&h->lock);
+	sleep_until(due);
+	pthread_mutex_lock(&h->lock);
+}
+
+int libusb_init(libusb_context **ctx)
+{
+	*ctx = calloc(1, sizeof(libusb_context));
+	if (!*ctx)
+		return LIBUSB_ERROR_NO_MEM;
+	(*ctx)->device.dd = emu_descriptor;
+	(*ctx)->device.ctx = *ctx;
+	return 0;
+}
+
+void libusb_exit(libusb_context *ctx)
+{
+	free(ctx);
+}
+
+ssize_t libusb_get_device_list(libusb_context *ctx, libusb_device ***list)
+{
+	*list = calloc(2, sizeof(libusb_device *));
+	if (!*list)
+		return LIBUSB_ERROR_NO_MEM;
+	(*list)[0] = &ctx->device;
+	return 1;
+}
+
+void libusb_free_device_list(libusb_device **list, int unref_devices)
+{
+	(void)unref_devices;
+	free(list);
+}
+
+int libusb_get_device_descriptor(libusb_device *dev, struct libusb_device_descriptor *desc)
+{
+	*desc = dev->dd;
+	return 0;
+}
+
+libusb_device *libusb_get_device(libusb_device_handle *dev_handle)
+{
+	return &dev_handle->ctx->device;
+}
+
+int libusb_open(libusb_device *dev, libusb_device_handle **dev_handle)
+{
+	libusb_device_handle *h;
+	const char *tuner = getenv("RTLSDR_EMU_TUNER");
+	const char *log = getenv("RTLSDR_EMU_LOG");
+	const char *realtime = getenv("RTLSDR_EMU_REALTIME");
+
+	h = calloc(1, sizeof(*h));
+	if (!h)
+		return LIBUSB_ERROR_NO_MEM;
+	h->ctx = dev->ctx;
+	h->ctx->open = h;
+	pthread_mutex_init(&h->lock, NULL);
+	memset(h->eeprom, 0xff, sizeof(h->eeprom));
+	memcpy(h->eeprom, eeprom_default, sizeof(eeprom_default));
+	h->strings[1] = "Realtek";
+	h->strings[2] = "RTL2838UHIDIR";
+	h->strings[3] = "00000001";
+	h->tuner.name = "R820T";
+	h->tuner.addr = 0x34;
+	h->tuner.xtal = EMU_XTAL;
+	h->tuner.vco_ref = 2;
+	if (tuner && (!strcmp(tuner, "r828d") || !strcmp(tuner, "blogv4"))) {
+		h->tuner.name = "R828D";
+		h->tuner.addr = 0x74;
+		h->tuner.xtal = R828D_XTAL;
+		h->tuner.vco_ref = 1;
+		if (!strcmp(tuner, "blogv4")) {
+			h->tuner.xtal = EMU_XTAL;
+			h->strings[1] = "RTLSDRBlog";
+			h->strings[2] = "Blog V4";
+		}
+	} else if (tuner && strcmp(tuner, "r820t"))
+		fprintf(stderr, "Emulator: unknown tuner %s, using an R820T.\n", tuner);
+	h->tuner.locked = 1;
+	h->noise_state = 0x2545f491;
+	h->realtime = realtime && atoi(realtime);
+	h->t0 = now();
+	if (log)
+		h->log = strcmp(log, "-") ? fopen(log, "w") : stderr;
+	if (log && !h->log)
+		fprintf(stderr, "Emulator: could not open %s\n", log);
+	fprintf(stderr, "Emulator: RTL2832U with %s, %u Hz tuner reference\n",
+		h->tuner.name, h->tuner.xtal);
+	*dev_handle = h;
+	return 0;
+}
+
+void libusb_close(libusb_device_handle *dev_handle)
+{
+	libusb_device_handle *h = dev_handle;
+
+	if (h->log) {
+		fprintf(h->log, "%10.6f close after %llu control and %llu bulk transfers\n",
+			now() - h->t0, (unsigned long long)h->ctrl,
+			(unsigned long long)h->bulk);
+		if (h->log != stderr)
+			fclose(h->log);
+	}
+	h->ctx->open = NULL;
+	pthread_mutex_destroy(&h->lock);
+	free(h);
+}
+
+int libusb_get_string_descriptor_ascii(libusb_device_handle *dev_handle,
+				       uint8_t desc_index, unsigned char *data, int length)
+{
+	const char *s = desc_index < 4 ? dev_handle->strings[desc_index] : NULL;
+	int n;
+
+	if (!s || length <= 0)
+		return LIBUSB_ERROR_INVALID_PARAM;
+	n = (int)strlen(s);
+	if (n > length - 1)
+		n = length - 1;
+	memcpy(data, s, n);
+	data[n] = 0;
+	return n;
+}
+
+int libusb_kernel_driver_active(libusb_device_handle *dev_handle, int interface_number)
+{
+	(void)dev_handle;
+	(void)interface_number;
+	return 0;
+}
+
+int libusb_detach_kernel_driver(libusb_device_handle *dev_handle, int interface_number)
+{
+	(void)dev_handle;
+	(void)interface_number;
+	return 0;
+}
+
+int libusb_attach_kernel_driver(libusb_device_handle *dev_handle, int interface_number)
+{
+	(void)dev_handle;
+	(void)interface_number;
+	return 0;
+}
+
+int libusb_claim_interface(libusb_device_handle *dev_handle, int interface_number)
+{
+	(void)dev_handle;
+	(void)interface_number;
+	return 0;
+}
+
+int libusb_release_interface(libusb_device_handle *dev_handle, int interface_number)
+{
+	(void)dev_handle;
+	(void)interface_number;
+	return 0;
+}
+
+int libusb_reset_device(libusb_device_handle *dev_handle)
+{
+	emu_log(dev_handle, "reset", NULL, 0, 0);
+	return 0;
+}
+
+int libusb_control_transfer(libusb_device_handle *dev_handle,
+			    uint8_t request_type, uint8_t bRequest, uint16_t wValue,
+			    uint16_t wIndex, unsigned char *data, uint16_t wLength,
+			    unsigned int timeout)
+/*
+ * Block accesses put the address in wValue and the block in the high byte
+ * of wIndex, demod accesses put the register in the high byte of wValue
+ * with 0x20 below it and the page in wIndex. 0x10 in wIndex marks writes.
+ */
+{
+	libusb_device_handle *h = dev_handle;
+	int in = (request_type & LIBUSB_ENDPOINT_IN) != 0;
+	int block = wIndex >> 8, r = wLength, i;
+	char what[64];
+
+	(void)bRequest;
+	(void)timeout;
+	pthread_mutex_lock(&h->lock);
+	h->ctrl++;
+	if (block == DEMODB) {
+		uint8_t *page = h->demod[wIndex & 0x0f];
+		int reg = wValue >> 8;
+
+		for (i = 0; i < wLength && reg + i < 256; i++) {
+			if (in)
+				data[i] = page[reg + i];
+			else
+				page[reg + i] = data[i];
+		}
+		snprintf(what, sizeof(what), "%s demod %x:%02x", in ? "rd" : "wr",
+			 wIndex & 0x0f, reg);
+	} else if (block == IICB) {
+		r = i2c_transfer(h, in, (uint8_t)wValue, data, wLength);
+		snprintf(what, sizeof(what), "%s i2c %02x%s", in ? "rd" : "wr", wValue,
+			 wValue == h->tuner.addr && !in ? " reg" : "");
+	} else if (block < BLOCKS) {
+		for (i = 0; i < wLength && wValue + i < 0x10000; i++) {
+			if (in)
+				data[i] = h->blocks[block][wValue + i];
+			else
+				h->blocks[block][wValue + i] = data[i];
+		}
+		snprintf(what, sizeof(what), "%s blk%d %04x", in ? "rd" : "wr", block, wValue);
+	} else {
+		r = LIBUSB_ERROR_PIPE;
+		snprintf(what, sizeof(what), "%s ?? %04x %04x", in ? "rd" : "wr", wValue, wIndex);
+	}
+	emu_log(h, what, data, r < 0 ? 0 : wLength, r);
+	pthread_mutex_unlock(&h->lock);
+	return r;
+}
+
+int libusb_bulk_transfer(libusb_device_handle *dev_handle, unsigned char endpoint,
+			 unsigned char *data, int length, int *actual_length,
+			 unsigned int timeout)
+{
+	libusb_device_handle *h = dev_handle;
+	char what[32];
+
+	(void)endpoint;
+	(void)timeout;
+	pthread_mutex_lock(&h->lock);
+	h->bulk++;
+	pace(h, length);
+	fill_samples(h, data, length);
+	snprintf(what, sizeof(what), "bulk %d", length);
+	emu_log(h, what, NULL, 0, 0);
+	pthread_mutex_unlock(&h->lock);
+	*actual_length = length;
+	return 0;
+}
+
+struct libusb_transfer *libusb_alloc_transfer(int iso_packets)
+{
+	(void)iso_packets;
+	return calloc(1, sizeof(struct libusb_transfer));
+}
+
+void libusb_free_transfer(struct libusb_transfer *transfer)
+{
+	free(transfer);
+}
+
+int libusb_submit_transfer(struct libusb_transfer *transfer)
+{
+	libusb_device_handle *h = transfer->dev_handle;
+	int r = 0;
+
+	pthread_mutex_lock(&h->lock);
+	if (h->pending_count == MAX_PENDING)
+		r = LIBUSB_ERROR_BUSY;
+	else {
+		h->pending[(h->pending_first + h->pending_count) % MAX_PENDING].xfer = transfer;
+		h->pending[(h->pending_first + h->pending_count) % MAX_PENDING].cancelled = 0;
+		h->pending_count++;
+	}
+	pthread_mutex_unlock(&h->lock);
+	return r;
+}
+
+int libusb_cancel_transfer(struct libusb_transfer *transfer)
+{
+	libusb_device_handle *h = transfer->dev_handle;
+	int i, r = LIBUSB_ERROR_NOT_FOUND;
+
+	pthread_mutex_lock(&h->lock);
+	for (i = 0; i < h->pending_count; i++) {
+		struct pending *p = &h->pending[(h->pending_first + i) % MAX_PENDING];
+		if (p->xfer == transfer && !p->cancelled) {
+			p->cancelled = 1;
+			r = 0;
+		}
+	}
+	pthread_mutex_unlock(&h->lock);
+	return r;
+}
+
+int libusb_handle_events_timeout_completed(libusb_context *ctx,
+					   struct timeval *tv, int *completed)
+/* completes the cancelled transfers, or else the oldest one with samples */
+{
+	libusb_device_handle *h = ctx->open;
+	struct libusb_transfer *done[MAX_PENDING];
+	struct pending p;
+	int n = 0, i, count;
+	char what[32];
+
+	(void)completed;
+	if (!h)
+		return LIBUSB_ERROR_NOT_FOUND;
+	pthread_mutex_lock(&h->lock);
+	count = h->pending_count;
+	for (i = 0; i < count; i++) {
+		p = h->pending[h->pending_first];
+		h->pending_first = (h->pending_first + 1) % MAX_PENDING;
+		h->pending_count--;
+		if (p.cancelled) {
+			p.xfer->status = LIBUSB_TRANSFER_CANCELLED;
+			p.xfer->actual_length = 0;
+			done[n++] = p.xfer;
+		} else {
+			h->pending[(h->pending_first + h->pending_count) % MAX_PENDING] = p;
+			h->pending_count++;
+		}
+	}
+	if (!n && h->pending_count) {
+		p = h->pending[h->pending_first];
+		h->pending_first = (h->pending_first + 1) % MAX_PENDING;
+		h->pending_count--;
+		h->bulk++;
+		pace(h, p.xfer->length);
+		fill_samples(h, p.xfer->buffer, p.xfer->length);
+		p.xfer->status = LIBUSB_TRANSFER_COMPLETED;
+		p.xfer->actual_length = p.xfer->length;
+		snprintf(what, sizeof(what), "bulk %d", p.xfer->length);
+		emu_log(h, what, NULL, 0, 0);
+		done[n++] = p.xfer;
+	}
+	pthread_mutex_unlock(&h->lock);
+
+	if (!n && tv && (tv->tv_sec || tv->tv_usec))
+		sleep_until(now() + 0.001);
+	for (i = 0; i < n; i++)
+		done[i]->callback(done[i]);
+	return 0;
+}
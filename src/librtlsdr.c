@@ -43,6 +43,7 @@
 #define TWO_POW(n)		((double)(1ULL<<(n)))
 
 #include "rtl-sdr.h"
+#include "rtl-sdr_trace.h"
 #include "tuner_e4k.h"
 #include "tuner_fc0012.h"
 #include "tuner_fc0013.h"
@@ -98,6 +99,9 @@ struct rtlsdr_dev {
 	enum rtlsdr_async_status async_status;
 	int async_cancel;
 	int use_zerocopy;
+	int zerocopy_off; /* userspace buffers even where zero-copy works */
+	uint32_t ctrl_xfers; /* control transfers since open */
+	uint32_t i2c_xfers; /* the part of them that went to the I2C block */
 	/* rtl demod context */
 	uint32_t rate; /* Hz */
 	uint32_t rtl_xtal; /* Hz */
@@ -405,12 +409,23 @@ enum blocks {
 	IICB			= 6,
 };
 
+static int rtlsdr_ctrl_transfer(rtlsdr_dev_t *dev, uint8_t type, uint16_t addr,
+				uint16_t index, uint8_t *data, uint16_t len)
+/* every register access goes through here, so it can be counted */
+{
+	dev->ctrl_xfers++;
+	if ((index >> 8) == IICB)
+		dev->i2c_xfers++;
+
+	return libusb_control_transfer(dev->devh, type, 0, addr, index, data, len, CTRL_TIMEOUT);
+}
+
 int rtlsdr_read_array(rtlsdr_dev_t *dev, uint8_t block, uint16_t addr, uint8_t *array, uint8_t len)
 {
 	int r;
 	uint16_t index = (block << 8);
 
-	r = libusb_control_transfer(dev->devh, CTRL_IN, 0, addr, index, array, len, CTRL_TIMEOUT);
+	r = rtlsdr_ctrl_transfer(dev, CTRL_IN, addr, index, array, len);
 #if 0
 	if (r < 0)
 		fprintf(stderr, "%s failed with %d\n", __FUNCTION__, r);
@@ -423,7 +438,7 @@ int rtlsdr_write_array(rtlsdr_dev_t *dev, uint8_t block, uint16_t addr, uint8_t
 	int r;
 	uint16_t index = (block << 8) | 0x10;
 
-	r = libusb_control_transfer(dev->devh, CTRL_OUT, 0, addr, index, array, len, CTRL_TIMEOUT);
+	r = rtlsdr_ctrl_transfer(dev, CTRL_OUT, addr, index, array, len);
 #if 0
 	if (r < 0)
 		fprintf(stderr, "%s failed with %d\n", __FUNCTION__, r);
@@ -479,7 +494,7 @@ uint16_t rtlsdr_read_reg(rtlsdr_dev_t *dev, uint8_t block, uint16_t addr, uint8_
 	uint16_t index = (block << 8);
 	uint16_t reg;
 
-	r = libusb_control_transfer(dev->devh, CTRL_IN, 0, addr, index, data, len, CTRL_TIMEOUT);
+	r = rtlsdr_ctrl_transfer(dev, CTRL_IN, addr, index, data, len);
 
 	if (r < 0)
 		fprintf(stderr, "%s failed with %d\n", __FUNCTION__, r);
@@ -503,7 +518,7 @@ int rtlsdr_write_reg(rtlsdr_dev_t *dev, uint8_t block, uint16_t addr, uint16_t v
 
 	data[1] = val & 0xff;
 
-	r = libusb_control_transfer(dev->devh, CTRL_OUT, 0, addr, index, data, len, CTRL_TIMEOUT);
+	r = rtlsdr_ctrl_transfer(dev, CTRL_OUT, addr, index, data, len);
 
 	if (r < 0)
 		fprintf(stderr, "%s failed with %d\n", __FUNCTION__, r);
@@ -520,7 +535,7 @@ uint16_t rtlsdr_demod_read_reg(rtlsdr_dev_t *dev, uint8_t page, uint16_t addr, u
 	uint16_t reg;
 	addr = (addr << 8) | 0x20;
 
-	r = libusb_control_transfer(dev->devh, CTRL_IN, 0, addr, index, data, len, CTRL_TIMEOUT);
+	r = rtlsdr_ctrl_transfer(dev, CTRL_IN, addr, index, data, len);
 
 	if (r < 0)
 		fprintf(stderr, "%s failed with %d\n", __FUNCTION__, r);
@@ -544,7 +559,7 @@ int rtlsdr_demod_write_reg(rtlsdr_dev_t *dev, uint8_t page, uint16_t addr, uint1
 
 	data[1] = val & 0xff;
 
-	r = libusb_control_transfer(dev->devh, CTRL_OUT, 0, addr, index, data, len, CTRL_TIMEOUT);
+	r = rtlsdr_ctrl_transfer(dev, CTRL_OUT, addr, index, data, len);
 
 	if (r < 0)
 		fprintf(stderr, "%s failed with %d\n", __FUNCTION__, r);
@@ -884,7 +899,7 @@ int rtlsdr_read_eeprom(rtlsdr_dev_t *dev, uint8_t *data, uint8_t offset, uint16_
 	return r;
 }
 
-int rtlsdr_set_center_freq(rtlsdr_dev_t *dev, uint32_t freq)
+static int _rtlsdr_set_center_freq(rtlsdr_dev_t *dev, uint32_t freq)
 {
 	int r = -1;
 	int last_ds;
@@ -928,6 +943,17 @@ int rtlsdr_set_center_freq(rtlsdr_dev_t *dev, uint32_t freq)
 	return r;
 }
 
+int rtlsdr_set_center_freq(rtlsdr_dev_t *dev, uint32_t freq)
+{
+	int r;
+
+	RTLSDR_TRACE_BEGIN("retune");
+	r = _rtlsdr_set_center_freq(dev, freq);
+	RTLSDR_TRACE_END("retune");
+
+	return r;
+}
+
 uint32_t rtlsdr_get_center_freq(rtlsdr_dev_t *dev)
 {
 	if (!dev)
@@ -1776,12 +1802,17 @@ static void LIBUSB_CALL _libusb_callback(struct libusb_transfer *xfer)
 	rtlsdr_dev_t *dev = (rtlsdr_dev_t *)xfer->user_data;
 
 	if (LIBUSB_TRANSFER_COMPLETED == xfer->status) {
-		if (dev->cb)
+		RTLSDR_TRACE_INSTANT("transfer", xfer->actual_length);
+		if (dev->cb) {
+			RTLSDR_TRACE_BEGIN("callback");
 			dev->cb(xfer->buffer, xfer->actual_length, dev->cb_ctx);
+			RTLSDR_TRACE_END("callback");
+		}
 
 		libusb_submit_transfer(xfer); /* resubmit transfer */
 		dev->xfer_errors = 0;
 	} else if (LIBUSB_TRANSFER_CANCELLED != xfer->status) {
+		RTLSDR_TRACE_INSTANT("transfer_error", xfer->status);
 #ifndef _WIN32
 		if (LIBUSB_TRANSFER_ERROR == xfer->status)
 			dev->xfer_errors++;
@@ -1825,7 +1856,12 @@ static int _rtlsdr_alloc_async_buffers(rtlsdr_dev_t *dev)
 	dev->xfer_buf = malloc(dev->xfer_buf_num * sizeof(unsigned char *));
 	memset(dev->xfer_buf, 0, dev->xfer_buf_num * sizeof(unsigned char *));
 
+	dev->use_zerocopy = 0;
+
 #if defined(ENABLE_ZEROCOPY) && defined (__linux__) && LIBUSB_API_VERSION >= 0x01000105
+	if (dev->zerocopy_off)
+		goto userspace;
+
 	fprintf(stderr, "Allocating %d zero-copy buffers\n", dev->xfer_buf_num);
 
 	dev->use_zerocopy = 1;
@@ -1867,6 +1903,7 @@ static int _rtlsdr_alloc_async_buffers(rtlsdr_dev_t *dev)
 						    dev->xfer_buf_len);
 		}
 	}
+userspace:
 #endif
 
 	/* no zero-copy available, allocate buffers in userspace */
@@ -2056,6 +2093,37 @@ int rtlsdr_cancel_async(rtlsdr_dev_t *dev)
 	return -2;
 }
 
+int rtlsdr_set_zerocopy(rtlsdr_dev_t *dev, int on)
+{
+	if (!dev)
+		return -1;
+
+	dev->zerocopy_off = !on;
+
+	return 0;
+}
+
+int rtlsdr_get_zerocopy(rtlsdr_dev_t *dev)
+{
+	if (!dev)
+		return -1;
+
+	return dev->use_zerocopy;
+}
+
+int rtlsdr_get_ctrl_stats(rtlsdr_dev_t *dev, uint32_t *transfers, uint32_t *i2c)
+{
+	if (!dev)
+		return -1;
+
+	if (transfers)
+		*transfers = dev->ctrl_xfers;
+	if (i2c)
+		*i2c = dev->i2c_xfers;
+
+	return 0;
+}
+
 uint32_t rtlsdr_get_tuner_clock(void *dev)
 {
 	uint32_t tuner_freq;
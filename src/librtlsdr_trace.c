@@ -0,0 +1,372 @@
+/*
+ * rtl-sdr, turns your Realtek RTL2832 based DVB dongle into a SDR receiver
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <fcntl.h>
+#ifndef _WIN32
+#include <unistd.h>
+#include <time.h>
+#else
+#include <windows.h>
+#include <io.h>
+#include <process.h>
+#endif
+
+#include "rtl-sdr_trace.h"
+
+#ifdef RTLSDR_TRACE
+
+/*
+ * Each ring has a single writer, the thread it belongs to. It fills the
+ * slot, then publishes it by moving head with a release store. Readers
+ * copy a slot and check head again afterwards; a slot the writer may have
+ * started to reuse meanwhile is skipped. Rings are never freed, the
+ * events of threads that have exited still show up in the dump.
+ *
+ * The dump only uses open(), write() and close() so it can run in the
+ * signal handler.
+ */
+
+#ifdef _WIN32
+#define open _open
+#define write _write
+#define close _close
+#define getpid _getpid
+#else
+#define O_BINARY 0
+#endif
+
+#if defined(__GNUC__)
+#define TRACE_VOLATILE
+#define TRACE_TLS		__thread
+#define load_acquire(p)		__atomic_load_n(p, __ATOMIC_ACQUIRE)
+#define store_release(p, v)	__atomic_store_n(p, v, __ATOMIC_RELEASE)
+#define fence_acquire()		__atomic_thread_fence(__ATOMIC_ACQUIRE)
+#define fetch_add(p, v)		__atomic_fetch_add(p, v, __ATOMIC_RELAXED)
+#define push_ring(r)		do { r->next = load_acquire(&rings); } while \
+	(!__atomic_compare_exchange_n(&rings, &r->next, r, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+#define claim(p)		(__atomic_exchange_n(p, 1, __ATOMIC_ACQUIRE) == 0)
+#define release(p)		__atomic_store_n(p, 0, __ATOMIC_RELEASE)
+#elif defined(_MSC_VER)
+/* the shared fields are volatile there, /volatile:ms makes that acquire and release */
+#define TRACE_VOLATILE		volatile
+#define TRACE_TLS		__declspec(thread)
+#define load_acquire(p)		(*(p))
+#define store_release(p, v)	(*(p) = (v))
+#define fence_acquire()		MemoryBarrier()
+#define fetch_add(p, v)		InterlockedExchangeAdd((volatile LONG *)(p), v)
+#define push_ring(r)		do { r->next = rings; } while \
+	(InterlockedCompareExchangePointer((PVOID volatile *)&rings, r, r->next) != r->next)
+#define claim(p)		(InterlockedExchange((volatile LONG *)(p), 1) == 0)
+#define release(p)		InterlockedExchange((volatile LONG *)(p), 0)
+#endif
+
+#define RING_MASK	(RTLSDR_TRACE_RING - 1)
+
+struct trace_event {
+	uint64_t ts;		/* ns, monotonic */
+	const char *name;
+	int64_t value;
+	char ph;
+};
+
+struct trace_ring {
+	struct trace_ring *next;	/* every ring, newest first */
+	const char *name;
+	int tid;
+	TRACE_VOLATILE uint64_t head;	/* events ever recorded, only the owner moves it */
+	struct trace_event ev[RTLSDR_TRACE_RING];
+};
+
+/* what the dump writes with, a buffer and a file */
+struct trace_out {
+	int fd;
+	int len;
+	int failed;
+	char buf[4096];
+};
+
+static struct trace_ring *TRACE_VOLATILE rings;
+static TRACE_TLS struct trace_ring *self;
+static int next_tid;
+static int set_up;
+static int dumping;
+static const char *dump_path;
+
+static uint64_t now_ns(void)
+{
+#ifdef _WIN32
+	static LARGE_INTEGER freq;
+	LARGE_INTEGER t;
+	if (!freq.QuadPart)
+		QueryPerformanceFrequency(&freq);
+	QueryPerformanceCounter(&t);
+	return (uint64_t)(t.QuadPart * (1e9 / freq.QuadPart));
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+#endif
+}
+
+#ifndef _WIN32
+static void dump_on_signal(int signum)
+{
+	int saved = errno;
+	(void)signum;
+	rtlsdr_trace_dump(dump_path);
+	errno = saved;
+}
+#endif
+
+static void dump_at_exit(void)
+{
+	rtlsdr_trace_dump(dump_path);
+}
+
+static void trace_setup(void)
+/* RTLSDR_TRACE=file arms the dumps, SIGUSR1 only if the program left it alone */
+{
+#ifndef _WIN32
+	struct sigaction sa, old;
+#endif
+
+	dump_path = getenv("RTLSDR_TRACE");
+	if (!dump_path || !*dump_path)
+		return;
+#ifndef _WIN32
+	if (sigaction(SIGUSR1, NULL, &old) == 0 && old.sa_handler == SIG_DFL) {
+		memset(&sa, 0, sizeof(sa));
+		sa.sa_handler = dump_on_signal;
+		sa.sa_flags = SA_RESTART;
+		sigemptyset(&sa.sa_mask);
+		sigaction(SIGUSR1, &sa, NULL);
+	}
+#endif
+	atexit(dump_at_exit);
+}
+
+static struct trace_ring *ring_new(void)
+{
+	struct trace_ring *r;
+
+	r = malloc(sizeof(*r));
+	if (!r)
+		return NULL;
+	/* fault the pages in now, not one by one while recording */
+	memset(r, 0, sizeof(*r));
+	r->tid = fetch_add(&next_tid, 1) + 1;
+	push_ring(r);
+	self = r;
+	if (claim(&set_up))
+		trace_setup();
+	return r;
+}
+
+void rtlsdr_trace_event(char ph, const char *name, int64_t value)
+{
+	struct trace_ring *r = self;
+	struct trace_event *e;
+	uint64_t h;
+
+	if (!r && !(r = ring_new()))
+		return;
+	h = r->head;
+	e = &r->ev[h & RING_MASK];
+	e->ts = now_ns();
+	e->name = name;
+	e->value = value;
+	e->ph = ph;
+	store_release(&r->head, h + 1);
+}
+
+void rtlsdr_trace_thread(const char *name)
+{
+	struct trace_ring *r = self;
+
+	if (!r && !(r = ring_new()))
+		return;
+	r->name = name;
+}
+
+static void out_flush(struct trace_out *o)
+{
+	int off = 0, n;
+
+	while (!o->failed && off < o->len) {
+		n = (int)write(o->fd, o->buf + off, (unsigned int)(o->len - off));
+		if (n <= 0)
+			o->failed = 1;
+		else
+			off += n;
+	}
+	o->len = 0;
+}
+
+static void out_char(struct trace_out *o, char c)
+{
+	if (o->len == (int)sizeof(o->buf))
+		out_flush(o);
+	o->buf[o->len++] = c;
+}
+
+static void out_str(struct trace_out *o, const char *s)
+{
+	while (*s)
+		out_char(o, *s++);
+}
+
+static void out_name(struct trace_out *o, const char *s)
+/* names are literals, but never let one break the JSON */
+{
+	out_char(o, '"');
+	for (; *s; s++)
+		out_char(o, (*s == '"' || *s == '\\' || (unsigned char)*s < 0x20) ? '_' : *s);
+	out_char(o, '"');
+}
+
+static void out_u64(struct trace_out *o, uint64_t v)
+{
+	char tmp[24];
+	int n = 0;
+
+	do {
+		tmp[n++] = (char)('0' + v % 10);
+		v /= 10;
+	} while (v);
+	while (n)
+		out_char(o, tmp[--n]);
+}
+
+static void out_i64(struct trace_out *o, int64_t v)
+{
+	if (v < 0) {
+		out_char(o, '-');
+		out_u64(o, (uint64_t)0 - (uint64_t)v);
+	} else
+		out_u64(o, (uint64_t)v);
+}
+
+static void out_head(struct trace_out *o, const char *name, char ph,
+		     int pid, int tid)
+{
+	out_str(o, "{\"name\":");
+	out_name(o, name);
+	out_str(o, ",\"ph\":\"");
+	out_char(o, ph);
+	out_str(o, "\",\"pid\":");
+	out_u64(o, (uint64_t)pid);
+	out_str(o, ",\"tid\":");
+	out_u64(o, (uint64_t)tid);
+}
+
+static void out_event(struct trace_out *o, const struct trace_event *e,
+		      int pid, int tid)
+{
+	out_head(o, e->name, e->ph, pid, tid);
+	/* microseconds, to the nanosecond */
+	out_str(o, ",\"ts\":");
+	out_u64(o, e->ts / 1000);
+	out_char(o, '.');
+	out_char(o, (char)('0' + e->ts / 100 % 10));
+	out_char(o, (char)('0' + e->ts / 10 % 10));
+	out_char(o, (char)('0' + e->ts % 10));
+	if (e->ph == 'i')
+		out_str(o, ",\"s\":\"t\"");
+	if (e->ph == 'i' || e->ph == 'C') {
+		out_str(o, ",\"args\":{\"value\":");
+		out_i64(o, e->value);
+		out_char(o, '}');
+	}
+	out_char(o, '}');
+}
+
+int rtlsdr_trace_dump(const char *path)
+{
+	static struct trace_out o;
+	struct trace_ring *r;
+	struct trace_event e;
+	uint64_t head, i;
+	int pid, count = 0;
+
+	if (!path)
+		return -1;
+	/* a signal during an exit dump, or two at once, gets nothing */
+	if (!claim(&dumping))
+		return -1;
+	o.len = 0;
+	o.failed = 0;
+	o.fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0644);
+	if (o.fd < 0) {
+		release(&dumping);
+		return -1;
+	}
+	pid = (int)getpid();
+	out_str(&o, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+	for (r = load_acquire(&rings); r; r = r->next) {
+		if (r->name) {
+			if (count++)
+				out_str(&o, ",\n");
+			out_head(&o, "thread_name", 'M', pid, r->tid);
+			out_str(&o, ",\"args\":{\"name\":");
+			out_name(&o, r->name);
+			out_str(&o, "}}");
+		}
+		head = load_acquire(&r->head);
+		i = head > RTLSDR_TRACE_RING ? head - RTLSDR_TRACE_RING : 0;
+		for (; i < head; i++) {
+			memcpy(&e, &r->ev[i & RING_MASK], sizeof(e));
+			fence_acquire();
+			/* the owner has come round to this slot again */
+			if (load_acquire(&r->head) >= i + RTLSDR_TRACE_RING)
+				continue;
+			if (count++)
+				out_str(&o, ",\n");
+			out_event(&o, &e, pid, r->tid);
+		}
+	}
+	out_str(&o, "\n]}\n");
+	out_flush(&o);
+	close(o.fd);
+	release(&dumping);
+	return o.failed ? -1 : count;
+}
+
+#else /* RTLSDR_TRACE */
+
+void rtlsdr_trace_event(char ph, const char *name, int64_t value)
+{
+	(void)ph;
+	(void)name;
+	(void)value;
+}
+
+void rtlsdr_trace_thread(const char *name)
+{
+	(void)name;
+}
+
+int rtlsdr_trace_dump(const char *path)
+{
+	(void)path;
+	return -1;
+}
+
+#endif /* RTLSDR_TRACE */
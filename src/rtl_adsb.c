@@ -20,6 +20,9 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#ifdef __linux__
+#define _GNU_SOURCE /* accept4 */
+#endif
 
 #include <errno.h>
 #include <signal.h>
@@ -30,6 +33,8 @@
 
 #ifndef _WIN32
 #include <unistd.h>
+#include <sys/time.h>
+#include <time.h>
 #else
 #include <windows.h>
 #include <fcntl.h>
@@ -41,7 +46,21 @@
 #include <libusb.h>
 
 #include "rtl-sdr.h"
+#include "rtl-sdr_trace.h"
 #include "convenience/convenience.h"
+#include "dsp/dsp.h"
+
+/* the network server is built around epoll, other platforms use the file output only */
+#ifdef __linux__
+#define ADSB_NET
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#endif
 
 #ifdef _WIN32
 #define sleep Sleep
@@ -50,39 +69,151 @@
 #endif
 #endif
 
+/* the demod workers share the noise floor, these keep its loads and stores whole */
+#if defined(__GNUC__)
+#define floor_load(p)		__atomic_load_n(p, __ATOMIC_RELAXED)
+#define floor_store(p, v)	__atomic_store_n(p, v, __ATOMIC_RELAXED)
+#else
+#define floor_load(p)		(*(volatile uint32_t *)(p))
+#define floor_store(p, v)	(*(volatile uint32_t *)(p) = (v))
+#endif
+
 #define ADSB_RATE			2000000
 #define ADSB_FREQ			1090000000
 #define DEFAULT_ASYNC_BUF_NUMBER	12
 #define DEFAULT_BUF_LENGTH		(16 * 16384)
 #define AUTO_GAIN			-100
+#define DEFAULT_WORKERS			1
+#define MAX_WORKERS			16
+#define DEDUP_HISTORY			64
+#define MAX_DONGLES			8
+#define DIVERSITY_SLOTS			4096
+#define DIVERSITY_PROBES		16
+#define DIVERSITY_WINDOW_NS		(100 * 1000000ULL)
+#define DEFAULT_SNR_DB			6
+#define NOISE_DECIMATION		16
+#define NOISE_BINS			1024
+#define NOISE_PERCENTILE		50
 
-#define MESSAGEGO    253
-#define OVERWRITE    254
-#define BADSAMPLE    255
+#define DEFAULT_NET_QUEUE		(256 * 1024)
+#define NET_LISTEN_BACKLOG		16
+#define BEAST_ESCAPE			0x1a
+#define BEAST_CLOCK_MUL			6	/* 12 MHz beast clock / 2 MHz sample rate */
+#define MODES_CRC_POLY			0xfff409
+#define ICAO_CACHE_SIZE			1024
+#define ICAO_CACHE_TTL			(60ULL * ADSB_RATE * BEAST_CLOCK_MUL)
 
-static pthread_t demod_thread;
-static pthread_cond_t ready;
-static pthread_mutex_t ready_m;
 static volatile int do_exit = 0;
-static rtlsdr_dev_t *dev = NULL;
-
-uint16_t squares[256];
 
-/* todo, bundle these up in a struct */
-uint8_t *buffer;  /* also abused for uint16_t */
 int verbose_output = 0;
 int short_output = 0;
 int quality = 10;
 int allowed_errors = 5;
+double snr_margin = DEFAULT_SNR_DB;
 FILE *file;
-int adsb_frame[14];
-#define preamble_len		16
+#define preamble_len		DSP_PREAMBLE_LEN
 #define long_frame		112
 #define short_frame		56
 
-/* signals are not threadsafe by default */
-#define safe_cond_signal(n, m) pthread_mutex_lock(m); pthread_cond_signal(n); pthread_mutex_unlock(m)
-#define safe_cond_wait(n, m) pthread_mutex_lock(m); pthread_cond_wait(n, m); pthread_mutex_unlock(m)
+/* tail of the previous block repeated in front of each block, in raw bytes,
+ * so frames straddling a block boundary are decoded in the next block */
+#define BLOCK_OVERLAP		(2 * (preamble_len + 2 * long_frame))
+#define BLOCK_SAMPLES		((DEFAULT_BUF_LENGTH + BLOCK_OVERLAP) / 2)
+#define BLOCK_MAX_MSGS		(BLOCK_SAMPLES / (preamble_len + short_frame) + 1)
+
+struct adsb_msg
+{
+	int      frame[14];
+	int      len;        /* in bits */
+	uint64_t timestamp;  /* 12 MHz ticks at the start of the preamble, per receiver clock */
+	uint8_t  level;      /* beast signal level, 255 is full scale */
+	int      rx;         /* receiver that heard it first */
+	uint64_t host_ns;    /* monotonic host time the frame was on the air */
+};
+
+struct adsb_block
+{
+	uint8_t  *data;          /* BLOCK_OVERLAP bytes of history, then the usb block */
+	uint32_t len;
+	uint64_t seq;
+	uint64_t sample_start;   /* absolute sample index of data[0] */
+	uint64_t arrival_ns;     /* host time when the last sample arrived */
+	struct adsb_msg *msgs;
+	int      msg_count;
+	int      done;
+	struct adsb_block *next;
+};
+
+struct block_pool
+{
+	pthread_mutex_t m;
+	pthread_cond_t work;
+	struct adsb_block *blocks;
+	int      count;
+	struct adsb_block *free_list;
+	struct adsb_block *queue_head, *queue_tail;
+	uint64_t next_seq;       /* assigned by the callback */
+	uint64_t next_sample;
+	uint8_t  tail[BLOCK_OVERLAP];
+	int      tail_valid;
+	uint64_t dropped;
+	/* ordered merge, blocks are emitted by sequence number whoever finished them */
+	pthread_mutex_t merge_m;
+	struct adsb_block **order;
+	uint64_t emit_seq;
+	struct adsb_msg recent[DEDUP_HISTORY];
+	int      recent_pos;
+	uint64_t duplicates;
+};
+
+struct demod_state
+{
+	pthread_t thread;
+	int      adsb_frame[14];
+	/* preamble positions and pulse power, recorded by dsp_manchester() for messages() */
+	int      hit_pos[BLOCK_SAMPLES / preamble_len + 1];
+	uint16_t hit_power[BLOCK_SAMPLES / preamble_len + 1];
+	struct dsp_manchester bits;  /* its threshold follows the snr margin */
+	uint64_t accepted;       /* frames decoded */
+	struct adsb_block *block;
+	struct dongle_state *dongle;
+};
+
+struct dongle_state
+{
+	int      id;
+	int      dev_index;
+	rtlsdr_dev_t *dev;
+	pthread_t thread;        /* runs rtlsdr_read_async */
+	int      result;
+	struct block_pool pool;
+	struct demod_state *workers;
+	uint64_t frames;         /* decoded by this receiver */
+	uint64_t first;          /* frames this receiver delivered first */
+	uint64_t levels;         /* sum of levels for the frames it heard */
+	uint32_t noise_floor;    /* running, magnitude squared */
+};
+
+/* frames heard by several receivers within DIVERSITY_WINDOW_NS are merged */
+struct diversity_slot
+{
+	uint64_t host_ns;
+	int      frame[14];
+	int      len;
+	uint32_t heard;          /* bitmask of receivers */
+};
+
+struct diversity_state
+{
+	pthread_mutex_t m;
+	struct diversity_slot slots[DIVERSITY_SLOTS];
+	uint64_t merged;
+};
+
+struct dongle_state dongles[MAX_DONGLES];
+int dongle_count = 0;
+struct diversity_state diversity;
+int worker_count = DEFAULT_WORKERS;
 
 void usage(void)
 {
@@ -90,24 +221,53 @@ void usage(void)
 		"rtl_adsb, a simple ADS-B decoder\n\n"
 		"Use:\trtl_adsb [-R] [-g gain] [-p ppm] [output file]\n"
 		"\t[-d device_index (default: 0)]\n"
+		"\t    use multiple -d for diversity reception, frames are merged\n"
 		"\t[-V verbove output (default: off)]\n"
 		"\t[-S show short frames (default: off)]\n"
 		"\t[-Q quality (0: no sanity checks, 0.5: half bit, 1: one bit (default), 2: two bits)]\n"
 		"\t[-e allowed_errors (default: 5)]\n"
+		"\t[-n preamble snr margin over the noise floor in dB (default: %d, 0: off)]\n"
 		"\t[-g tuner_gain (default: automatic)]\n"
 		"\t[-p ppm_error (default: 0)]\n"
 		"\t[-T enable bias-T on GPIO PIN 0 (works for rtl-sdr.com v3/v4 dongles)]\n"
+		"\t[-w demod worker threads (default: %d, max: %d)]\n"
+		"\t[-b port for Beast binary output (default: off)]\n"
+		"\t[-s port for SBS/BaseStation output (default: off)]\n"
+		"\t[-a listen address for network output (default: 127.0.0.1)]\n"
+		"\t[-q per client queue in kB, slower clients are dropped (default: %d)]\n"
 		"\tfilename (a '-' dumps samples to stdout)\n"
 		"\t (omitting the filename also uses stdout)\n\n"
+		"Serving several clients:\n"
+		"\trtl_adsb -b 30005 -s 30003 /dev/null\n"
 		"Streaming with netcat:\n"
 		"\trtl_adsb | netcat -lp 8080\n"
 		"\twhile true; do rtl_adsb | nc -lp 8080; done\n"
 		"Streaming with socat:\n"
 		"\trtl_adsb | socat -u - TCP4:sdrsharp.com:47806\n"
-		"\n");
+		"\n", DEFAULT_SNR_DB, DEFAULT_WORKERS, MAX_WORKERS, DEFAULT_NET_QUEUE / 1024);
 	exit(1);
 }
 
+static void cancel_all(void)
+{
+	int i;
+	for (i=0; i<dongle_count; i++) {
+		if (dongles[i].dev) {
+			rtlsdr_cancel_async(dongles[i].dev);}
+	}
+}
+
+static uint64_t now_ns(void)
+{
+#ifdef _WIN32
+	return (uint64_t)GetTickCount64() * 1000000ULL;
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+#endif
+}
+
 #ifdef _WIN32
 BOOL WINAPI
 sighandler(int signum)
@@ -115,7 +275,7 @@ sighandler(int signum)
 	if (CTRL_C_EVENT == signum) {
 		fprintf(stderr, "Signal caught, exiting!\n");
 		do_exit = 1;
-		rtlsdr_cancel_async(dev);
+		cancel_all();
 		return TRUE;
 	}
 	return FALSE;
@@ -126,18 +286,29 @@ static void sighandler(int signum)
 	signal(SIGPIPE, SIG_IGN);
 	fprintf(stderr, "Signal caught, exiting!\n");
 	do_exit = 1;
-	rtlsdr_cancel_async(dev);
+	cancel_all();
 }
 #endif
 
-void display(int *frame, int len)
+int frame_wanted(int *frame, int len)
 {
-	int i, df;
+	int df;
 	if (!short_output && len <= short_frame) {
-		return;}
+		return 0;}
 	df = (frame[0] >> 3) & 0x1f;
 	if (quality == 0 && !(df==11 || df==17 || df==18 || df==19)) {
+		return 0;}
+	return 1;
+}
+
+void display(struct adsb_msg *msg)
+{
+	int i, df;
+	int *frame = msg->frame;
+	int len = msg->len;
+	if (!frame_wanted(frame, len)) {
 		return;}
+	df = (frame[0] >> 3) & 0x1f;
 	fprintf(file, "*");
 	for (i=0; i<((len+7)/8); i++) {
 		fprintf(file, "%02x", frame[i]);}
@@ -146,6 +317,7 @@ void display(int *frame, int len)
 		return;}
 	fprintf(file, "DF=%i CA=%i\n", df, frame[0] & 0x07);
 	fprintf(file, "ICAO Address=%06x\n", frame[1] << 16 | frame[2] << 8 | frame[3]);
+	fprintf(file, "Receiver=%i Level=%i Time=%.6f\n", msg->rx, msg->level, msg->host_ns / 1e9);
 	if (len <= short_frame) {
 		return;}
 	fprintf(file, "PI=0x%06x\n",  frame[11] << 16 | frame[12] << 8 | frame[13]);
@@ -153,168 +325,637 @@ void display(int *frame, int len)
 	fprintf(file, "--------------\n");
 }
 
-int abs8(int x)
-/* do not subtract 127 from the raw iq, this handles it */
+uint32_t noise_floor(uint16_t *buf, int len)
+/* percentile of a decimated block magnitude, cheap enough for every block */
 {
-	if (x >= 127) {
-		return x - 127;}
-	return 127 - x;
+	uint32_t hist[NOISE_BINS];
+	int i, n = 0, target;
+	memset(hist, 0, sizeof(hist));
+	for (i=0; i<len; i+=NOISE_DECIMATION, n++) {
+		hist[buf[i] < NOISE_BINS ? buf[i] : NOISE_BINS - 1]++;}
+	target = n * NOISE_PERCENTILE / 100;
+	for (i=0; i<NOISE_BINS-1; i++) {
+		target -= (int)hist[i];
+		if (target < 0) {
+			break;}
+	}
+	return (uint32_t)i;
+}
+
+void update_threshold(struct demod_state *d, uint16_t *buf, int len)
+{
+	struct dongle_state *dg = d->dongle;
+	uint32_t floor = noise_floor(buf, len);
+	uint32_t running;
+	if (snr_margin <= 0) {
+		d->bits.threshold = 0;
+		return;}
+	/* another worker's update may get overwritten, any recent estimate will do */
+	running = floor_load(&dg->noise_floor);
+	if (running) {
+		floor = (3 * running + floor) / 4;}
+	floor_store(&dg->noise_floor, floor);
+	d->bits.threshold = (uint32_t)((floor ? floor : 1) * pow(10.0, snr_margin / 10.0));
 }
 
-void squares_precompute(void)
-/* equiv to abs(x-128) ^ 2 */
+uint8_t signal_level(uint16_t power)
+/* beast levels are amplitude, full scale being 127 on both I and Q */
+{
+	double level = sqrt((double)power / (2.0 * 127 * 127)) * 255.0;
+	if (level > 255.0) {
+		return 255;}
+	return (uint8_t)round(level);
+}
+
+void frame_bytes(struct adsb_msg *msg, uint8_t *bytes)
+{
+	int i;
+	for (i=0; i<msg->len/8; i++) {
+		bytes[i] = (uint8_t)msg->frame[i];}
+}
+
+#ifdef ADSB_NET
+
+enum net_proto
+{
+	NET_BEAST = 0,
+	NET_SBS,
+	NET_PROTOS
+};
+
+struct net_client
+{
+	int      fd;
+	int      proto;
+	char     *out;      /* bounded send queue, DEFAULT_NET_QUEUE */
+	size_t   out_len;
+	int      want_write;
+	struct net_client *next;
+};
+
+struct net_stage
+{
+	char     *data;
+	size_t   len;
+};
+
+struct net_state
 {
+	int      enabled;
+	int      exit_flag;
+	pthread_t thread;
+	char     *addr;
+	int      port[NET_PROTOS];
+	int      listen_fd[NET_PROTOS];
+	int      epoll_fd;
+	int      wake_fd;
+	size_t   queue_limit;
+	/* frames are staged by the demod thread and swapped out by the network thread */
+	pthread_mutex_t stage_m;
+	struct net_stage stage[NET_PROTOS];
+	struct net_stage spare[NET_PROTOS];
+	struct net_client *clients;
+	uint64_t accepted;
+	uint64_t evicted;
+	uint64_t stage_dropped;
+	uint32_t crc_table[256];
+	uint32_t icao_cache[ICAO_CACHE_SIZE];
+	uint64_t icao_seen[ICAO_CACHE_SIZE];
+};
+
+struct net_state net;
+
+static const char *net_proto_name[NET_PROTOS] = {"Beast", "SBS"};
+
+void modes_crc_init(void)
+{
+	uint32_t c;
 	int i, j;
-	// todo, check if this LUT is actually any faster
 	for (i=0; i<256; i++) {
-		j = abs8(i);
-		squares[i] = (uint16_t)(j*j);
+		c = (uint32_t)i << 16;
+		for (j=0; j<8; j++) {
+			c = (c & 0x800000) ? (c << 1) ^ MODES_CRC_POLY : c << 1;}
+		net.crc_table[i] = c & 0xffffff;
 	}
 }
 
-int magnitute(uint8_t *buf, int len)
-/* takes i/q, changes buf in place (16 bit), returns new len (16 bit) */
+uint32_t modes_syndrome(uint8_t *bytes, int len)
+/* crc of the data bits xor the parity field, 0 for a clean DF17 */
 {
-	int i;
-	uint16_t *m;
-	for (i=0; i<len; i+=2) {
-		m = (uint16_t*)(&buf[i]);
-		*m = squares[buf[i]] + squares[buf[i+1]];
-	}
-	return len/2;
+	uint32_t crc = 0;
+	int i, n = len / 8;
+	for (i=0; i<n-3; i++) {
+		crc = ((crc << 8) ^ net.crc_table[((crc >> 16) ^ bytes[i]) & 0xff]) & 0xffffff;}
+	return crc ^ ((uint32_t)bytes[n-3] << 16 | (uint32_t)bytes[n-2] << 8 | bytes[n-1]);
 }
 
-static inline uint16_t single_manchester(uint16_t a, uint16_t b, uint16_t c, uint16_t d)
-/* takes 4 consecutive real samples, return 0 or 1, BADSAMPLE on error */
+static inline int icao_slot(uint32_t addr)
 {
-	int bit, bit_p;
-	bit_p = a > b;
-	bit   = c > d;
+	return (int)(((addr * 2654435761u) >> 16) % ICAO_CACHE_SIZE);
+}
+
+void icao_mark(uint32_t addr, uint64_t now)
+{
+	int slot = icao_slot(addr);
+	net.icao_cache[slot] = addr;
+	net.icao_seen[slot] = now;
+}
 
-	if (quality == 0) {
-		return bit;}
+int icao_known(uint32_t addr, uint64_t now)
+{
+	int slot = icao_slot(addr);
+	return net.icao_cache[slot] == addr && now - net.icao_seen[slot] < ICAO_CACHE_TTL;
+}
+
+static void stage_put(int proto, const char *data, size_t len)
+/* called with stage_m held */
+{
+	struct net_stage *st = &net.stage[proto];
+	if (st->len + len > net.queue_limit) {
+		net.stage_dropped++;
+		return;}
+	memcpy(st->data + st->len, data, len);
+	st->len += len;
+}
 
-	if (quality == 5) {
-		if ( bit &&  bit_p && b > c) {
-			return BADSAMPLE;}
-		if (!bit && !bit_p && b < c) {
-			return BADSAMPLE;}
-		return bit;
+size_t beast_encode(struct adsb_msg *msg, uint8_t *bytes, char *out)
+{
+	uint8_t raw[6 + 1 + 14];
+	int i, n = 0, raw_len = 0;
+	for (i=5; i>=0; i--) {
+		raw[raw_len++] = (uint8_t)(msg->timestamp >> (i * 8));}
+	raw[raw_len++] = msg->level;
+	memcpy(raw + raw_len, bytes, msg->len / 8);
+	raw_len += msg->len / 8;
+	out[n++] = BEAST_ESCAPE;
+	out[n++] = msg->len > short_frame ? '3' : '2';
+	for (i=0; i<raw_len; i++) {
+		out[n++] = (char)raw[i];
+		if (raw[i] == BEAST_ESCAPE) {
+			out[n++] = BEAST_ESCAPE;}
 	}
+	return (size_t)n;
+}
 
-	if (quality == 10) {
-		if ( bit &&  bit_p && c > b) {
-			return 1;}
-		if ( bit && !bit_p && d < b) {
-			return 1;}
-		if (!bit &&  bit_p && d > b) {
+int ac13_altitude(uint8_t *bytes)
+/* only the 25 ft encoding, gillham coded altitudes are left blank */
+{
+	int ac13 = (bytes[2] & 0x1f) << 8 | bytes[3];
+	int n;
+	if (ac13 == 0 || (ac13 & 0x40) || !(ac13 & 0x10)) {
+		return INT32_MIN;}
+	n = ((ac13 & 0x1f80) >> 2) | ((ac13 & 0x20) >> 1) | (ac13 & 0x0f);
+	return n * 25 - 1000;
+}
+
+int ac12_altitude(uint8_t *bytes)
+{
+	int ac12 = bytes[5] << 4 | bytes[6] >> 4;
+	int n;
+	if (ac12 == 0 || !(ac12 & 0x10)) {
+		return INT32_MIN;}
+	n = ((ac12 & 0x0fe0) >> 1) | (ac12 & 0x0f);
+	return n * 25 - 1000;
+}
+
+int id13_squawk(uint8_t *bytes)
+{
+	int id = (bytes[2] & 0x1f) << 8 | bytes[3];
+	int a, b, c, d;
+	a = ((id >> 7) & 1) << 2 | ((id >> 9) & 1) << 1 | ((id >> 11) & 1);
+	b = ((id >> 1) & 1) << 2 | ((id >> 3) & 1) << 1 | ((id >> 5) & 1);
+	c = ((id >> 8) & 1) << 2 | ((id >> 10) & 1) << 1 | ((id >> 12) & 1);
+	d = ((id >> 0) & 1) << 2 | ((id >> 2) & 1) << 1 | ((id >> 4) & 1);
+	return a * 1000 + b * 100 + c * 10 + d;
+}
+
+size_t sbs_encode(struct adsb_msg *msg, uint8_t *bytes, char *out, size_t out_size)
+/* returns 0 for frames that carry nothing for a BaseStation consumer */
+{
+	static const char *charset =
+		"#ABCDEFGHIJKLMNOPQRSTUVWXYZ##### ###############0123456789######";
+	char fields[128] = "";
+	char stamp[64];
+	char callsign[9];
+	struct timeval tv;
+	struct tm tm;
+	uint32_t syndrome, addr;
+	int df, tc, type, alt, i, ew, ns, vr;
+	double gs, track;
+
+	df = bytes[0] >> 3;
+	syndrome = modes_syndrome(bytes, msg->len);
+	addr = (uint32_t)bytes[1] << 16 | (uint32_t)bytes[2] << 8 | bytes[3];
+	switch (df) {
+	case 11:
+		/* the low bits may carry the interrogator id */
+		if (syndrome & ~0x7fu) {
 			return 0;}
-		if (!bit && !bit_p && c < b) {
+		icao_mark(addr, msg->timestamp);
+		type = 8;
+		snprintf(fields, sizeof(fields), ",,,,,,,,,,,");
+		break;
+	case 17:
+	case 18:
+		if (syndrome) {
 			return 0;}
-		return BADSAMPLE;
+		icao_mark(addr, msg->timestamp);
+		tc = bytes[4] >> 3;
+		if (tc >= 1 && tc <= 4) {
+			for (i=0; i<8; i++) {
+				int bit = 40 + i * 6;
+				int c = (bytes[bit/8] << 8 | bytes[bit/8 + 1]) >> (10 - bit % 8) & 0x3f;
+				callsign[i] = charset[c];
+			}
+			callsign[8] = '\0';
+			type = 1;
+			snprintf(fields, sizeof(fields), "%s,,,,,,,,,,,", callsign);
+		} else if (tc >= 9 && tc <= 18) {
+			type = 3;
+			alt = ac12_altitude(bytes);
+			if (alt == INT32_MIN) {
+				return 0;}
+			snprintf(fields, sizeof(fields), ",%d,,,,,,,,,,0", alt);
+		} else if (tc == 19 && ((bytes[4] & 0x07) == 1 || (bytes[4] & 0x07) == 2)) {
+			ew = ((bytes[5] & 0x03) << 8 | bytes[6]) - 1;
+			ns = ((bytes[7] & 0x7f) << 3 | bytes[8] >> 5) - 1;
+			vr = ((bytes[8] & 0x07) << 6 | bytes[9] >> 2) - 1;
+			if (ew < 0 || ns < 0) {
+				return 0;}
+			if (bytes[5] & 0x04) {
+				ew = -ew;}
+			if (bytes[7] & 0x80) {
+				ns = -ns;}
+			gs = sqrt((double)ew * ew + (double)ns * ns);
+			track = atan2(ew, ns) * 180.0 / M_PI;
+			if (track < 0) {
+				track += 360.0;}
+			type = 4;
+			if (vr < 0) {
+				snprintf(fields, sizeof(fields), ",,%.0f,%.0f,,,,,,,,0", gs, track);
+			} else {
+				snprintf(fields, sizeof(fields), ",,%.0f,%.0f,,,%d,,,,,0",
+					gs, track, (bytes[8] & 0x08) ? -vr * 64 : vr * 64);
+			}
+		} else {
+			return 0;
+		}
+		break;
+	case 4:
+	case 20:
+	case 5:
+	case 21:
+		/* address/parity: trust only addresses already seen with a clean crc */
+		addr = syndrome;
+		if (!icao_known(addr, msg->timestamp)) {
+			return 0;}
+		if (df == 4 || df == 20) {
+			alt = ac13_altitude(bytes);
+			if (alt == INT32_MIN) {
+				return 0;}
+			type = 5;
+			snprintf(fields, sizeof(fields), ",%d,,,,,,,,,,", alt);
+		} else {
+			type = 6;
+			snprintf(fields, sizeof(fields), ",,,,,,,%04d,,,,", id13_squawk(bytes));
+		}
+		break;
+	default:
+		return 0;
 	}
 
-	if ( bit &&  bit_p && c > b && d < a) {
-		return 1;}
-	if ( bit && !bit_p && c > a && d < b) {
-		return 1;}
-	if (!bit &&  bit_p && c < a && d > b) {
+	gettimeofday(&tv, NULL);
+	localtime_r(&tv.tv_sec, &tm);
+	i = (int)strftime(stamp, sizeof(stamp), "%Y/%m/%d,%H:%M:%S", &tm);
+	snprintf(stamp + i, sizeof(stamp) - i, ".%03d", (int)(tv.tv_usec / 1000));
+	i = snprintf(out, out_size, "MSG,%d,1,1,%06X,1,%s,%s,%s\r\n",
+		type, addr, stamp, stamp, fields);
+	if (i < 0 || (size_t)i >= out_size) {
 		return 0;}
-	if (!bit && !bit_p && c < b && d > a) {
-		return 0;}
-	return BADSAMPLE;
+	return (size_t)i;
 }
 
-static inline uint16_t min16(uint16_t a, uint16_t b)
+void net_publish(struct adsb_msg *msg)
+/* runs in the demod thread, never touches a socket */
 {
-	return a<b ? a : b;
+	uint8_t bytes[14];
+	char beast[2 + 2 * (6 + 1 + 14)];
+	char sbs[256];
+	size_t beast_len = 0, sbs_len = 0;
+
+	frame_bytes(msg, bytes);
+	if (net.port[NET_BEAST]) {
+		beast_len = beast_encode(msg, bytes, beast);}
+	if (net.port[NET_SBS]) {
+		sbs_len = sbs_encode(msg, bytes, sbs, sizeof(sbs));}
+	if (!beast_len && !sbs_len) {
+		return;}
+	pthread_mutex_lock(&net.stage_m);
+	if (beast_len) {
+		stage_put(NET_BEAST, beast, beast_len);}
+	if (sbs_len) {
+		stage_put(NET_SBS, sbs, sbs_len);}
+	pthread_mutex_unlock(&net.stage_m);
 }
 
-static inline uint16_t max16(uint16_t a, uint16_t b)
+void net_kick(void)
+/* once per block, wakes the network thread if anything was staged */
 {
-	return a>b ? a : b;
+	uint64_t one = 1;
+	int pending;
+	pthread_mutex_lock(&net.stage_m);
+	pending = net.stage[NET_BEAST].len || net.stage[NET_SBS].len;
+	pthread_mutex_unlock(&net.stage_m);
+	if (pending || net.exit_flag) {
+		if (write(net.wake_fd, &one, sizeof(one)) < 0) {
+			return;}
+	}
 }
 
-static inline int preamble(uint16_t *buf, int i)
-/* returns 0/1 for preamble at index i */
+static void client_interest(struct net_client *c, int want_write)
 {
-	int i2;
-	uint16_t low  = 0;
-	uint16_t high = 65535;
-	for (i2=0; i2<preamble_len; i2++) {
-		switch (i2) {
-			case 0:
-			case 2:
-			case 7:
-			case 9:
-				//high = min16(high, buf[i+i2]);
-				high = buf[i+i2];
-				break;
-			default:
-				//low  = max16(low,  buf[i+i2]);
-				low = buf[i+i2];
-				break;
+	struct epoll_event ev;
+	if (c->want_write == want_write) {
+		return;}
+	ev.events = EPOLLIN | EPOLLRDHUP | (want_write ? EPOLLOUT : 0);
+	ev.data.ptr = c;
+	epoll_ctl(net.epoll_fd, EPOLL_CTL_MOD, c->fd, &ev);
+	c->want_write = want_write;
+}
+
+static void client_close(struct net_client *c)
+{
+	struct net_client **pp;
+	for (pp = &net.clients; *pp; pp = &(*pp)->next) {
+		if (*pp == c) {
+			*pp = c->next;
+			break;
 		}
-		if (high <= low) {
+	}
+	epoll_ctl(net.epoll_fd, EPOLL_CTL_DEL, c->fd, NULL);
+	close(c->fd);
+	free(c->out);
+	free(c);
+}
+
+static int client_flush(struct net_client *c)
+/* one send per client per loop iteration, returns -1 if the client is gone */
+{
+	ssize_t n;
+	if (!c->out_len) {
+		client_interest(c, 0);
+		return 0;}
+	n = send(c->fd, c->out, c->out_len, MSG_NOSIGNAL | MSG_DONTWAIT);
+	if (n < 0) {
+		if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+			client_interest(c, 1);
 			return 0;}
+		return -1;
 	}
-	return 1;
+	c->out_len -= (size_t)n;
+	if (c->out_len) {
+		memmove(c->out, c->out + n, c->out_len);}
+	client_interest(c, c->out_len != 0);
+	return 0;
 }
 
-void manchester(uint16_t *buf, int len)
-/* overwrites magnitude buffer with valid bits (BADSAMPLE on errors) */
-{
-	/* a and b hold old values to verify local manchester */
-	uint16_t a=0, b=0;
-	uint16_t bit;
-	int i, i2, start, errors;
-	int maximum_i = len - 1;        // len-1 since we look at i and i+1
-	// todo, allow wrap across buffers
-	i = 0;
-	while (i < maximum_i) {
-		/* find preamble */
-		for ( ; i < (len - preamble_len); i++) {
-			if (!preamble(buf, i)) {
-				continue;}
-			a = buf[i];
-			b = buf[i+1];
-			for (i2=0; i2<preamble_len; i2++) {
-				buf[i+i2] = MESSAGEGO;}
-			i += preamble_len;
-			break;
+static void client_accept(int proto)
+{
+	struct net_client *c;
+	struct epoll_event ev;
+	int fd, one = 1;
+	while ((fd = accept4(net.listen_fd[proto], NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+		c = calloc(1, sizeof(struct net_client));
+		if (c) {
+			c->out = malloc(net.queue_limit);}
+		if (!c || !c->out) {
+			free(c);
+			close(fd);
+			continue;
 		}
-		i2 = start = i;
-		errors = 0;
-		/* mark bits until encoding breaks */
-		for ( ; i < maximum_i; i+=2, i2++) {
-			bit = single_manchester(a, b, buf[i], buf[i+1]);
-			a = buf[i];
-			b = buf[i+1];
-			if (bit == BADSAMPLE) {
-				errors += 1;
-				if (errors > allowed_errors) {
-					buf[i2] = BADSAMPLE;
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+		c->fd = fd;
+		c->proto = proto;
+		ev.events = EPOLLIN | EPOLLRDHUP;
+		ev.data.ptr = c;
+		if (epoll_ctl(net.epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+			close(fd);
+			free(c->out);
+			free(c);
+			continue;
+		}
+		c->next = net.clients;
+		net.clients = c;
+		net.accepted++;
+	}
+}
+
+static int client_input(struct net_client *c)
+/* clients may talk to us (beast settings), nothing is supported so drain it */
+{
+	char scratch[512];
+	ssize_t n;
+	while ((n = recv(c->fd, scratch, sizeof(scratch), MSG_DONTWAIT)) > 0) {}
+	if (n == 0) {
+		return -1;}
+	if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+		return 0;}
+	return -1;
+}
+
+static void net_distribute(void)
+{
+	struct net_client *c, *next;
+	struct net_stage tmp;
+	int p;
+
+	pthread_mutex_lock(&net.stage_m);
+	for (p=0; p<NET_PROTOS; p++) {
+		tmp = net.stage[p];
+		net.stage[p] = net.spare[p];
+		net.spare[p] = tmp;
+	}
+	pthread_mutex_unlock(&net.stage_m);
+
+	for (c = net.clients; c; c = next) {
+		struct net_stage *st = &net.spare[c->proto];
+		next = c->next;
+		if (!st->len) {
+			continue;}
+		if (c->out_len + st->len > net.queue_limit) {
+			net.evicted++;
+			client_close(c);
+			continue;
+		}
+		memcpy(c->out + c->out_len, st->data, st->len);
+		c->out_len += st->len;
+	}
+	for (p=0; p<NET_PROTOS; p++) {
+		net.spare[p].len = 0;}
+}
+
+static void *net_thread_fn(void *arg)
+{
+	struct epoll_event events[64];
+	struct net_client *c, *next;
+	uint64_t count;
+	int n, i, p;
+
+	RTLSDR_TRACE_THREAD("net");
+	while (!net.exit_flag) {
+		n = epoll_wait(net.epoll_fd, events, 64, 1000);
+		if (n < 0 && errno != EINTR) {
+			break;}
+		for (i=0; i<n; i++) {
+			void *ptr = events[i].data.ptr;
+			if (ptr == &net.wake_fd) {
+				if (read(net.wake_fd, &count, sizeof(count)) < 0) {
+					continue;}
+				continue;
+			}
+			for (p=0; p<NET_PROTOS; p++) {
+				if (ptr == &net.listen_fd[p]) {
+					client_accept(p);
 					break;
-				} else {
-					bit = a > b;
-					/* these don't have to match the bit */
-					a = 0;
-					b = 65535;
 				}
 			}
-			buf[i] = buf[i+1] = OVERWRITE;
-			buf[i2] = bit;
+			if (p < NET_PROTOS) {
+				continue;}
+			c = (struct net_client *)ptr;
+			if ((events[i].events & EPOLLIN) && client_input(c) < 0) {
+				client_close(c);
+				continue;
+			}
+			if (events[i].events & (EPOLLERR | EPOLLHUP | EPOLLRDHUP)) {
+				client_close(c);
+				continue;
+			}
+		}
+		/* batch everything staged since the last pass, then one send per client */
+		net_distribute();
+		for (c = net.clients; c; c = next) {
+			next = c->next;
+			if (client_flush(c) < 0) {
+				client_close(c);}
 		}
 	}
+	return 0;
 }
 
-void messages(uint16_t *buf, int len)
+static int net_listen(const char *port)
 {
-	int i, data_i, index, shift, frame_len;
-	// todo, allow wrap across buffers
+	struct addrinfo hints, *ai, *head;
+	int fd = -1, one = 1, r;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_flags = AI_PASSIVE;
+	hints.ai_family = PF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_protocol = IPPROTO_TCP;
+	r = getaddrinfo(net.addr, port, &hints, &head);
+	if (r != 0) {
+		fprintf(stderr, "local address %s ERROR - %s.\n", net.addr, gai_strerror(r));
+		return -1;
+	}
+	for (ai = head; ai != NULL; ai = ai->ai_next) {
+		fd = socket(ai->ai_family, ai->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, ai->ai_protocol);
+		if (fd < 0) {
+			continue;}
+		setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+		if (bind(fd, ai->ai_addr, ai->ai_addrlen) == 0 && listen(fd, NET_LISTEN_BACKLOG) == 0) {
+			break;}
+		close(fd);
+		fd = -1;
+	}
+	freeaddrinfo(head);
+	return fd;
+}
+
+int net_start(void)
+{
+	struct epoll_event ev;
+	char port[16];
+	int p;
+
+	modes_crc_init();
+	pthread_mutex_init(&net.stage_m, NULL);
+	net.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	net.wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (net.epoll_fd < 0 || net.wake_fd < 0) {
+		fprintf(stderr, "Failed to set up the network event loop.\n");
+		return -1;
+	}
+	ev.events = EPOLLIN;
+	ev.data.ptr = &net.wake_fd;
+	epoll_ctl(net.epoll_fd, EPOLL_CTL_ADD, net.wake_fd, &ev);
+	for (p=0; p<NET_PROTOS; p++) {
+		net.listen_fd[p] = -1;
+		net.stage[p].data = malloc(net.queue_limit);
+		net.spare[p].data = malloc(net.queue_limit);
+		if (!net.stage[p].data || !net.spare[p].data) {
+			return -1;}
+		if (!net.port[p]) {
+			continue;}
+		snprintf(port, sizeof(port), "%d", net.port[p]);
+		net.listen_fd[p] = net_listen(port);
+		if (net.listen_fd[p] < 0) {
+			fprintf(stderr, "Failed to listen on %s:%d for %s output.\n",
+				net.addr, net.port[p], net_proto_name[p]);
+			return -1;
+		}
+		ev.events = EPOLLIN;
+		ev.data.ptr = &net.listen_fd[p];
+		epoll_ctl(net.epoll_fd, EPOLL_CTL_ADD, net.listen_fd[p], &ev);
+		fprintf(stderr, "%s output on %s:%d\n", net_proto_name[p], net.addr, net.port[p]);
+	}
+	return pthread_create(&net.thread, NULL, net_thread_fn, NULL);
+}
+
+void net_stop(void)
+{
+	int p;
+	net.exit_flag = 1;
+	net_kick();
+	pthread_join(net.thread, NULL);
+	while (net.clients) {
+		client_close(net.clients);}
+	for (p=0; p<NET_PROTOS; p++) {
+		if (net.listen_fd[p] >= 0) {
+			close(net.listen_fd[p]);}
+		free(net.stage[p].data);
+		free(net.spare[p].data);
+	}
+	close(net.wake_fd);
+	close(net.epoll_fd);
+	pthread_mutex_destroy(&net.stage_m);
+	fprintf(stderr, "Network: %llu clients served, %llu evicted as too slow, %llu frames dropped\n",
+		(unsigned long long)net.accepted, (unsigned long long)net.evicted,
+		(unsigned long long)net.stage_dropped);
+}
+
+#endif /* ADSB_NET */
+
+void output_msg(struct adsb_msg *msg)
+{
+	display(msg);
+#ifdef ADSB_NET
+	if (net.enabled) {
+		net_publish(msg);}
+#endif
+}
+
+void messages(struct demod_state *d, uint16_t *buf, int len)
+/* collects the frames of one block, output happens in block order */
+{
+	int i, data_i, index, shift, frame_len, start, hit = 0;
+	int *adsb_frame = d->adsb_frame;
+	struct adsb_block *block = d->block;
+	struct adsb_msg *msg;
+	block->msg_count = 0;
 	for (i=0; i<len; i++) {
 		if (buf[i] > 1) {
 			continue;}
+		start = i;
 		frame_len = long_frame;
 		data_i = 0;
 		for (index=0; index<14; index++) {
@@ -336,54 +977,378 @@ void messages(uint16_t *buf, int len)
 		}
 		if (data_i < (frame_len-1)) {
 			continue;}
-		display(adsb_frame, frame_len);
+		if (!frame_wanted(adsb_frame, frame_len)) {
+			continue;}
+		if (block->msg_count >= BLOCK_MAX_MSGS) {
+			break;}
+		/* both lists are ascending, so the preamble lookup is a merge */
+		while (hit < d->bits.hit_count && d->hit_pos[hit] < start) {
+			hit++;}
+		msg = &block->msgs[block->msg_count++];
+		d->accepted++;
+		memcpy(msg->frame, adsb_frame, sizeof(msg->frame));
+		msg->len = frame_len;
+		msg->timestamp = (block->sample_start + (uint64_t)(start - preamble_len)) * BEAST_CLOCK_MUL;
+		msg->level = 0;
+		if (hit < d->bits.hit_count && d->hit_pos[hit] == start) {
+			msg->level = signal_level(d->hit_power[hit]);}
+		msg->rx = d->dongle->id;
+		/* the last sample of the block arrived at arrival_ns, 500 ns per sample */
+		msg->host_ns = block->arrival_ns - (uint64_t)(len - start + preamble_len) * 1000000000ULL / ADSB_RATE;
+	}
+}
+
+int is_duplicate(struct block_pool *p, struct adsb_msg *msg)
+/* the block overlap decodes some frames twice, same bits at the same time */
+{
+	int i;
+	struct adsb_msg *r;
+	for (i=0; i<DEDUP_HISTORY; i++) {
+		r = &p->recent[i];
+		if (r->len != msg->len) {
+			continue;}
+		if (r->timestamp + 2 * BEAST_CLOCK_MUL < msg->timestamp ||
+		    msg->timestamp + 2 * BEAST_CLOCK_MUL < r->timestamp) {
+			continue;}
+		if (memcmp(r->frame, msg->frame, sizeof(int) * (msg->len / 8)) == 0) {
+			return 1;}
+	}
+	return 0;
+}
+
+static uint32_t frame_hash(struct adsb_msg *msg)
+{
+	uint32_t h = 2166136261u;
+	int i;
+	for (i=0; i<msg->len/8; i++) {
+		h = (h ^ (uint32_t)msg->frame[i]) * 16777619u;}
+	return h;
+}
+
+int diversity_merge(struct adsb_msg *msg)
+/* returns 1 if another receiver already delivered this frame, diversity.m held */
+{
+	struct diversity_slot *slot, *victim = NULL;
+	uint32_t h = frame_hash(msg);
+	int i, dup = 0;
+	for (i=0; i<DIVERSITY_PROBES; i++) {
+		slot = &diversity.slots[(h + i) % DIVERSITY_SLOTS];
+		/* a receiver repeating itself is a new transmission, not diversity */
+		if (slot->len == msg->len && !(slot->heard & (1u << msg->rx)) &&
+		    msg->host_ns < slot->host_ns + DIVERSITY_WINDOW_NS &&
+		    slot->host_ns < msg->host_ns + DIVERSITY_WINDOW_NS &&
+		    memcmp(slot->frame, msg->frame, sizeof(int) * (msg->len / 8)) == 0) {
+			slot->heard |= 1u << msg->rx;
+			diversity.merged++;
+			dup = 1;
+			break;
+		}
+		/* reuse the stalest slot of the probe run */
+		if (!victim || slot->host_ns < victim->host_ns) {
+			victim = slot;}
+	}
+	if (!dup) {
+		memcpy(victim->frame, msg->frame, sizeof(victim->frame));
+		victim->len = msg->len;
+		victim->host_ns = msg->host_ns;
+		victim->heard = 1u << msg->rx;
+	}
+	return dup;
+}
+
+void merge_block(struct dongle_state *dg, struct adsb_block *block)
+/* called with merge_m held, in sequence order */
+{
+	int i;
+	struct adsb_msg *msg;
+	struct block_pool *p = &dg->pool;
+	/* also serializes the output between receivers */
+	pthread_mutex_lock(&diversity.m);
+	for (i=0; i<block->msg_count; i++) {
+		msg = &block->msgs[i];
+		if (is_duplicate(p, msg)) {
+			p->duplicates++;
+			continue;
+		}
+		p->recent[p->recent_pos] = *msg;
+		p->recent_pos = (p->recent_pos + 1) % DEDUP_HISTORY;
+		dg->frames++;
+		dg->levels += msg->level;
+		if (dongle_count > 1 && diversity_merge(msg)) {
+			continue;}
+		dg->first++;
+		output_msg(msg);
+	}
+	pthread_mutex_unlock(&diversity.m);
+}
+
+void block_finished(struct dongle_state *dg, struct adsb_block *block)
+{
+	int emitted = 0;
+	struct adsb_block *b;
+	struct block_pool *p = &dg->pool;
+	pthread_mutex_lock(&p->merge_m);
+	block->done = 1;
+	while (1) {
+		b = p->order[p->emit_seq % p->count];
+		if (!b || !b->done || b->seq != p->emit_seq) {
+			break;}
+		merge_block(dg, b);
+		p->order[p->emit_seq % p->count] = NULL;
+		p->emit_seq++;
+		emitted++;
+		pthread_mutex_lock(&p->m);
+		b->next = p->free_list;
+		p->free_list = b;
+		pthread_mutex_unlock(&p->m);
+	}
+	pthread_mutex_unlock(&p->merge_m);
+	if (emitted) {
+		/* batched, one flush per block instead of per frame */
+		pthread_mutex_lock(&diversity.m);
 		fflush(file);
+		pthread_mutex_unlock(&diversity.m);
+#ifdef ADSB_NET
+		if (net.enabled) {
+			net_kick();}
+#endif
 	}
 }
 
 static void rtlsdr_callback(unsigned char *buf, uint32_t len, void *ctx)
 {
+	struct dongle_state *dg = ctx;
+	struct block_pool *p = &dg->pool;
+	struct adsb_block *block;
+	uint64_t sample = p->next_sample;
 	if (do_exit) {
 		return;}
-	memcpy(buffer, buf, len);
-	safe_cond_signal(&ready, &ready_m);
+	p->next_sample += len / 2;
+	if (len != DEFAULT_BUF_LENGTH) {
+		p->tail_valid = 0;
+		return;}
+	pthread_mutex_lock(&p->m);
+	block = p->free_list;
+	if (block) {
+		p->free_list = block->next;}
+	else {
+		p->dropped++;}
+	pthread_mutex_unlock(&p->m);
+	if (!block) {
+		/* every block is still queued, losing this one breaks the overlap */
+		RTLSDR_TRACE_INSTANT("block_dropped", p->dropped);
+		p->tail_valid = 0;
+		return;
+	}
+	block->arrival_ns = now_ns();
+	if (p->tail_valid) {
+		memcpy(block->data, p->tail, BLOCK_OVERLAP);}
+	else {
+		memset(block->data, 127, BLOCK_OVERLAP);}
+	memcpy(block->data + BLOCK_OVERLAP, buf, len);
+	memcpy(p->tail, buf + len - BLOCK_OVERLAP, BLOCK_OVERLAP);
+	p->tail_valid = 1;
+	block->len = len + BLOCK_OVERLAP;
+	block->sample_start = sample - BLOCK_OVERLAP / 2;
+	block->done = 0;
+	block->next = NULL;
+
+	pthread_mutex_lock(&p->merge_m);
+	block->seq = p->next_seq++;
+	p->order[block->seq % p->count] = block;
+	/* blocks queued, being demodulated or waiting to be emitted in order */
+	RTLSDR_TRACE_COUNTER("blocks_in_flight", p->next_seq - p->emit_seq);
+	pthread_mutex_unlock(&p->merge_m);
+
+	pthread_mutex_lock(&p->m);
+	if (p->queue_tail) {
+		p->queue_tail->next = block;}
+	else {
+		p->queue_head = block;}
+	p->queue_tail = block;
+	pthread_cond_signal(&p->work);
+	pthread_mutex_unlock(&p->m);
 }
 
 static void *demod_thread_fn(void *arg)
 {
+	struct demod_state *d = arg;
+	struct block_pool *p = &d->dongle->pool;
+	struct adsb_block *block;
 	int len;
-	while (!do_exit) {
-		safe_cond_wait(&ready, &ready_m);
-		len = magnitute(buffer, DEFAULT_BUF_LENGTH);
-		manchester((uint16_t*)buffer, len);
-		messages((uint16_t*)buffer, len);
+	RTLSDR_TRACE_THREAD("demod");
+	while (1) {
+		pthread_mutex_lock(&p->m);
+		while (!p->queue_head && !do_exit) {
+			pthread_cond_wait(&p->work, &p->m);}
+		block = p->queue_head;
+		if (block) {
+			p->queue_head = block->next;
+			if (!p->queue_head) {
+				p->queue_tail = NULL;}
+		}
+		pthread_mutex_unlock(&p->m);
+		if (!block) {
+			break;}
+		d->block = block;
+		RTLSDR_TRACE_BEGIN("magnitude");
+		len = dsp_magnitude(block->data, (int)block->len);
+		update_threshold(d, (uint16_t*)block->data, len);
+		RTLSDR_TRACE_END("magnitude");
+		RTLSDR_TRACE_BEGIN("manchester");
+		dsp_manchester(&d->bits, (uint16_t*)block->data, len);
+		RTLSDR_TRACE_END("manchester");
+		RTLSDR_TRACE_BEGIN("messages");
+		messages(d, (uint16_t*)block->data, len);
+		RTLSDR_TRACE_END("messages");
+		RTLSDR_TRACE_BEGIN("emit");
+		block_finished(d->dongle, block);
+		RTLSDR_TRACE_END("emit");
+	}
+	return 0;
+}
+
+static void *async_thread_fn(void *arg)
+{
+	struct dongle_state *dg = arg;
+	RTLSDR_TRACE_THREAD("dongle");
+	dg->result = rtlsdr_read_async(dg->dev, rtlsdr_callback, dg,
+			      DEFAULT_ASYNC_BUF_NUMBER,
+			      DEFAULT_BUF_LENGTH);
+	/* one receiver failing takes the others down */
+	do_exit = 1;
+	cancel_all();
+	return 0;
+}
+
+int pool_init(struct block_pool *p, int count)
+{
+	int i;
+	memset(p, 0, sizeof(struct block_pool));
+	pthread_mutex_init(&p->m, NULL);
+	pthread_mutex_init(&p->merge_m, NULL);
+	pthread_cond_init(&p->work, NULL);
+	p->count = count;
+	p->blocks = calloc(count, sizeof(struct adsb_block));
+	p->order = calloc(count, sizeof(struct adsb_block *));
+	if (!p->blocks || !p->order) {
+		return -1;}
+	for (i=0; i<count; i++) {
+		p->blocks[i].data = malloc(DEFAULT_BUF_LENGTH + BLOCK_OVERLAP);
+		p->blocks[i].msgs = malloc(BLOCK_MAX_MSGS * sizeof(struct adsb_msg));
+		if (!p->blocks[i].data || !p->blocks[i].msgs) {
+			return -1;}
+		p->blocks[i].next = p->free_list;
+		p->free_list = &p->blocks[i];
 	}
-	rtlsdr_cancel_async(dev);
 	return 0;
 }
 
+void pool_free(struct block_pool *p)
+{
+	int i;
+	if (!p->blocks) {
+		return;}
+	for (i=0; i<p->count; i++) {
+		free(p->blocks[i].data);
+		free(p->blocks[i].msgs);
+	}
+	free(p->blocks);
+	free(p->order);
+	pthread_cond_destroy(&p->work);
+	pthread_mutex_destroy(&p->m);
+	pthread_mutex_destroy(&p->merge_m);
+}
+
+int dongle_open(struct dongle_state *dg, int gain, int ppm_error, int enable_biastee)
+{
+	int i, r;
+	r = rtlsdr_open(&dg->dev, (uint32_t)dg->dev_index);
+	if (r < 0) {
+		fprintf(stderr, "Failed to open rtlsdr device #%d.\n", dg->dev_index);
+		dg->dev = NULL;
+		return r;
+	}
+
+	/* Set the tuner gain */
+	if (gain == AUTO_GAIN) {
+		verbose_auto_gain(dg->dev);
+	} else {
+		verbose_gain_set(dg->dev, nearest_gain(dg->dev, gain));
+	}
+
+	verbose_ppm_set(dg->dev, ppm_error);
+	rtlsdr_set_agc_mode(dg->dev, 1);
+
+	/* Set the tuner frequency */
+	verbose_set_frequency(dg->dev, ADSB_FREQ);
+
+	/* Set the sample rate */
+	verbose_set_sample_rate(dg->dev, ADSB_RATE);
+
+	rtlsdr_set_bias_tee(dg->dev, enable_biastee);
+	if (enable_biastee)
+		fprintf(stderr, "activated bias-T on GPIO PIN 0\n");
+
+	/* Reset endpoint before we start reading from it (mandatory) */
+	verbose_reset_buffer(dg->dev);
+
+	/* enough blocks for every worker plus the usb transfers in flight */
+	dg->workers = calloc(worker_count, sizeof(struct demod_state));
+	if (!dg->workers || pool_init(&dg->pool, DEFAULT_ASYNC_BUF_NUMBER + 2 * worker_count) < 0) {
+		fprintf(stderr, "Failed to allocate buffers.\n");
+		return -1;
+	}
+	for (i=0; i<worker_count; i++) {
+		dg->workers[i].dongle = dg;
+		dg->workers[i].bits.quality = quality;
+		dg->workers[i].bits.allowed_errors = allowed_errors;
+		dg->workers[i].bits.hit_pos = dg->workers[i].hit_pos;
+		dg->workers[i].bits.hit_power = dg->workers[i].hit_power;
+	}
+	return 0;
+}
+
+void dongle_close(struct dongle_state *dg)
+{
+	if (dg->dev) {
+		rtlsdr_close(dg->dev);}
+	pool_free(&dg->pool);
+	free(dg->workers);
+}
+
 int main(int argc, char **argv)
 {
 #ifndef _WIN32
 	struct sigaction sigact;
 #endif
 	char *filename = NULL;
-	int r, opt;
+	int r = 0, opt;
 	int gain = AUTO_GAIN; /* tenths of a dB */
-	int dev_index = 0;
-	int dev_given = 0;
 	int ppm_error = 0;
 	int enable_biastee = 0;
-	pthread_cond_init(&ready, NULL);
-	pthread_mutex_init(&ready_m, NULL);
-	squares_precompute();
+	int beast_port = 0;
+	int sbs_port = 0;
+	char *net_addr = "127.0.0.1";
+	int net_queue = DEFAULT_NET_QUEUE;
+	int i, j;
+	uint64_t candidates = 0, quiet = 0, accepted = 0;
+	struct dongle_state *dg;
+	dsp_init();
+	pthread_mutex_init(&diversity.m, NULL);
 
-	while ((opt = getopt(argc, argv, "d:g:p:e:Q:VST")) != -1)
+	while ((opt = getopt(argc, argv, "d:g:p:e:n:Q:VSTw:b:s:a:q:")) != -1)
 	{
 		switch (opt) {
 		case 'd':
-			dev_index = verbose_device_search(optarg);
-			dev_given = 1;
+			if (dongle_count >= MAX_DONGLES) {
+				fprintf(stderr, "At most %d devices are supported.\n", MAX_DONGLES);
+				exit(1);
+			}
+			dongles[dongle_count].dev_index = verbose_device_search(optarg);
+			if (dongles[dongle_count].dev_index < 0) {
+				exit(1);}
+			dongle_count++;
 			break;
 		case 'g':
 			gain = (int)(atof(optarg) * 10);
@@ -400,39 +1365,78 @@ int main(int argc, char **argv)
 		case 'e':
 			allowed_errors = atoi(optarg);
 			break;
+		case 'n':
+			snr_margin = atof(optarg);
+			break;
 		case 'Q':
 			quality = (int)(atof(optarg) * 10);
 			break;
 		case 'T':
 			enable_biastee = 1;
 			break;
+		case 'w':
+			worker_count = atoi(optarg);
+			break;
+		case 'b':
+			beast_port = atoi(optarg);
+			break;
+		case 's':
+			sbs_port = atoi(optarg);
+			break;
+		case 'a':
+			net_addr = optarg;
+			break;
+		case 'q':
+			net_queue = atoi(optarg) * 1024;
+			break;
 		default:
 			usage();
 			return 0;
 		}
 	}
 
+	if (worker_count < 1 || worker_count > MAX_WORKERS) {
+		fprintf(stderr, "Worker count must be between 1 and %d.\n", MAX_WORKERS);
+		exit(1);
+	}
+	if (net_queue < 1024) {
+		fprintf(stderr, "Network queue must be at least 1 kB.\n");
+		exit(1);
+	}
+#ifdef ADSB_NET
+	net.enabled = beast_port || sbs_port;
+	net.addr = net_addr;
+	net.port[NET_BEAST] = beast_port;
+	net.port[NET_SBS] = sbs_port;
+	net.queue_limit = (size_t)net_queue;
+#else
+	if (beast_port || sbs_port) {
+		fprintf(stderr, "Network output is not supported on this platform.\n");
+		exit(1);
+	}
+#endif
+
 	if (argc <= optind) {
 		filename = "-";
 	} else {
 		filename = argv[optind];
 	}
 
-	buffer = malloc(DEFAULT_BUF_LENGTH * sizeof(uint8_t));
-
-	if (!dev_given) {
-		dev_index = verbose_device_search("0");
+	if (!dongle_count) {
+		dongles[0].dev_index = verbose_device_search("0");
+		if (dongles[0].dev_index < 0) {
+			exit(1);}
+		dongle_count = 1;
 	}
-
-	if (dev_index < 0) {
-		exit(1);
+	for (i=0; i<dongle_count; i++) {
+		for (j=0; j<i; j++) {
+			if (dongles[i].dev_index == dongles[j].dev_index) {
+				fprintf(stderr, "Device #%d given twice.\n", dongles[i].dev_index);
+				exit(1);
+			}
+		}
 	}
 
-	r = rtlsdr_open(&dev, (uint32_t)dev_index);
-	if (r < 0) {
-		fprintf(stderr, "Failed to open rtlsdr device #%d.\n", dev_index);
-		exit(1);
-	}
 #ifndef _WIN32
 	sigact.sa_handler = sighandler;
 	sigemptyset(&sigact.sa_mask);
@@ -447,7 +1451,8 @@ int main(int argc, char **argv)
 
 	if (strcmp(filename, "-") == 0) { /* Write samples to stdout */
 		file = stdout;
-		setvbuf(stdout, NULL, _IONBF, 0);
+		/* fully buffered, the demod thread flushes once per block */
+		setvbuf(stdout, NULL, _IOFBF, BUFSIZ);
 #ifdef _WIN32
 		_setmode(_fileno(file), _O_BINARY);
 #endif
@@ -459,50 +1464,78 @@ int main(int argc, char **argv)
 		}
 	}
 
-	/* Set the tuner gain */
-	if (gain == AUTO_GAIN) {
-		verbose_auto_gain(dev);
-	} else {
-		gain = nearest_gain(dev, gain);
-		verbose_gain_set(dev, gain);
+	for (i=0; i<dongle_count; i++) {
+		dongles[i].id = i;
+		if (dongle_open(&dongles[i], gain, ppm_error, enable_biastee) < 0) {
+			for (j=0; j<=i; j++) {
+				dongle_close(&dongles[j]);}
+			exit(1);
+		}
 	}
 
-	verbose_ppm_set(dev, ppm_error);
-	r = rtlsdr_set_agc_mode(dev, 1);
-
-	/* Set the tuner frequency */
-	verbose_set_frequency(dev, ADSB_FREQ);
-
-	/* Set the sample rate */
-	verbose_set_sample_rate(dev, ADSB_RATE);
-
-	rtlsdr_set_bias_tee(dev, enable_biastee);
-	if (enable_biastee)
-		fprintf(stderr, "activated bias-T on GPIO PIN 0\n");
-
-	/* Reset endpoint before we start reading from it (mandatory) */
-	verbose_reset_buffer(dev);
+#ifdef ADSB_NET
+	if (net.enabled && net_start() != 0) {
+		for (i=0; i<dongle_count; i++) {
+			dongle_close(&dongles[i]);}
+		exit(1);
+	}
+#endif
 
-	pthread_create(&demod_thread, NULL, demod_thread_fn, (void *)(NULL));
-	rtlsdr_read_async(dev, rtlsdr_callback, (void *)(NULL),
-			      DEFAULT_ASYNC_BUF_NUMBER,
-			      DEFAULT_BUF_LENGTH);
+	for (i=0; i<dongle_count; i++) {
+		dg = &dongles[i];
+		for (j=0; j<worker_count; j++) {
+			pthread_create(&dg->workers[j].thread, NULL, demod_thread_fn, &dg->workers[j]);}
+		pthread_create(&dg->thread, NULL, async_thread_fn, dg);
+	}
+	for (i=0; i<dongle_count; i++) {
+		pthread_join(dongles[i].thread, NULL);
+		if (dongles[i].result < 0) {
+			r = dongles[i].result;}
+	}
 
-	if (do_exit) {
+	if (r >= 0) {
 		fprintf(stderr, "\nUser cancel, exiting...\n");}
 	else {
 		fprintf(stderr, "\nLibrary error %d, exiting...\n", r);}
-	rtlsdr_cancel_async(dev);
-	pthread_cancel(demod_thread);
-	pthread_join(demod_thread, NULL);
-	pthread_cond_destroy(&ready);
-	pthread_mutex_destroy(&ready_m);
+	for (i=0; i<dongle_count; i++) {
+		dg = &dongles[i];
+		pthread_mutex_lock(&dg->pool.m);
+		pthread_cond_broadcast(&dg->pool.work);
+		pthread_mutex_unlock(&dg->pool.m);
+		for (j=0; j<worker_count; j++) {
+			pthread_join(dg->workers[j].thread, NULL);
+			candidates += dg->workers[j].bits.candidates;
+			quiet += dg->workers[j].bits.quiet;
+			accepted += dg->workers[j].accepted;
+		}
+		fprintf(stderr, "Receiver %d: %llu preamble candidates, %llu under the snr margin, "
+			"%llu frames, noise floor %.1f dBFS\n",
+			i, (unsigned long long)candidates, (unsigned long long)quiet,
+			(unsigned long long)accepted,
+			10.0 * log10((dg->noise_floor ? dg->noise_floor : 1) / (2.0 * 127 * 127)));
+		candidates = quiet = accepted = 0;
+		if (dg->pool.dropped || dg->pool.duplicates) {
+			fprintf(stderr, "Receiver %d: blocks dropped: %llu, boundary duplicates removed: %llu\n",
+				i, (unsigned long long)dg->pool.dropped,
+				(unsigned long long)dg->pool.duplicates);}
+		if (dongle_count > 1) {
+			fprintf(stderr, "Receiver %d: %llu frames heard, %llu delivered first, mean level %.1f\n",
+				i, (unsigned long long)dg->frames, (unsigned long long)dg->first,
+				dg->frames ? (double)dg->levels / dg->frames : 0.0);}
+	}
+	if (dongle_count > 1) {
+		fprintf(stderr, "Frames merged across receivers: %llu\n",
+			(unsigned long long)diversity.merged);}
+#ifdef ADSB_NET
+	if (net.enabled) {
+		net_stop();}
+#endif
 
 	if (file != stdout) {
 		fclose(file);}
 
-	rtlsdr_close(dev);
-	free(buffer);
+	for (i=0; i<dongle_count; i++) {
+		dongle_close(&dongles[i]);}
+	pthread_mutex_destroy(&diversity.m);
 	return r >= 0 ? r : -r;
 }
-
@@ -0,0 +1,627 @@
+/*
+ * rtl-sdr, turns your Realtek RTL2832 based DVB dongle into a SDR receiver
+ * rtl_dsp_bench, times the DSP kernels of rtl_fm, rtl_power and rtl_adsb
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Every kernel runs over one synthetic block of the size librtlsdr
+ * hands to its callback: an FM broadcast for the I/Q kernels, mode S
+ * frames in noise for the rtl_adsb ones. Times are per I/Q sample of
+ * that block (per magnitude for manchester and preamble). Warm runs
+ * repeat on cached data, cold runs flush the caches before each run.
+ * The JSON on stdout can be saved and given back with -c, so a change
+ * shows up as a per kernel difference.
+ */
+
+#ifdef __linux__
+#define _GNU_SOURCE /* syscall */
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#ifndef _WIN32
+#include <unistd.h>
+#include <time.h>
+#else
+#include <windows.h>
+#include "getopt/getopt.h"
+#define _USE_MATH_DEFINES
+#endif
+
+#include <math.h>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#endif
+
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+#define HAVE_TSC
+#ifdef _MSC_VER
+#include <intrin.h>
+#else
+#include <x86intrin.h>
+#endif
+#endif
+
+#include "dsp/dsp.h"
+
+#define DEFAULT_BUF_LENGTH		(16 * 16384)
+#define DEFAULT_SECONDS			0.25
+#define DEFAULT_THRESHOLD		10.0	/* percent */
+#define MIN_RUNS			5
+#define MAX_RUNS			100000
+#define EVICT_BYTES			(64 * 1024 * 1024)
+#define FM_DOWNSAMPLE			42	/* rtl_fm's default 24 kHz from 1 Msps */
+#define MIN_BIN_E			4
+#define MAX_BIN_E			14
+#define MAX_KERNELS			32
+#define MAX_BASELINE			128
+
+struct bench {
+	int len;		/* bytes of cu8, len/2 samples */
+	uint8_t *cu8;		/* the untouched inputs */
+	int16_t *s16;
+	uint16_t *mag;
+	uint8_t *work8;		/* what the in place kernels change */
+	int16_t *work16;
+	int16_t *out16;
+	long *avg;
+	struct dsp_fft fft;
+	struct dsp_nco nco;
+	struct dsp_manchester bits;
+	int *hit_pos;
+	uint16_t *hit_power;
+	uint8_t *evict;
+};
+
+struct kernel {
+	char name[24];
+	int param;
+	void (*prepare)(struct bench *b);
+	void (*run)(struct bench *b, int param);
+};
+
+struct result {
+	char kernel[24];
+	char cache[8];
+	int runs;
+	double ns;		/* per sample, median of the runs */
+	double ns_min;
+	double cycles;		/* per sample, median, 0 without a counter */
+};
+
+static enum {
+	CYCLES_NONE,
+	CYCLES_PERF,		/* core cycles of this thread */
+	CYCLES_TSC		/* reference cycles, not scaled with the clock */
+} cycle_counter = CYCLES_NONE;
+
+static const char *cycle_counter_name[] = {"none", "perf", "tsc"};
+
+#ifdef __linux__
+static int perf_fd = -1;
+#endif
+
+static struct kernel kernels[MAX_KERNELS];
+static int kernel_count;
+
+void usage(void)
+{
+	fprintf(stderr,
+		"rtl_dsp_bench, times the DSP kernels of rtl_fm, rtl_power and rtl_adsb\n\n"
+		"Usage:\t[-b block length in bytes (default: %d)]\n"
+		"\t[-t seconds per kernel and cache state, flushing included (default: %.2f)]\n"
+		"\t[-k only kernels whose name contains this]\n"
+		"\t[-m caches: warm, cold or both (default: both)]\n"
+		"\t[-c baseline JSON from an earlier run to compare with]\n"
+		"\t[-r slowdown in percent that counts as a regression (default: %.0f)]\n"
+		"\t[-l list the kernels]\n"
+		"JSON goes to stdout, a summary to stderr. With -c the exit status is 1\n"
+		"when a kernel got slower than the threshold. RTLSDR_DSP=c (or sse2,\n"
+		"avx2) in the environment picks the kernel set.\n",
+		DEFAULT_BUF_LENGTH, DEFAULT_SECONDS, DEFAULT_THRESHOLD);
+	exit(1);
+}
+
+static uint64_t now_ns(void)
+{
+#ifdef _WIN32
+	static LARGE_INTEGER freq;
+	LARGE_INTEGER t;
+	if (!freq.QuadPart) {
+		QueryPerformanceFrequency(&freq);}
+	QueryPerformanceCounter(&t);
+	return (uint64_t)(t.QuadPart * (1e9 / freq.QuadPart));
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+#endif
+}
+
+static void cycles_init(void)
+/* a real cycle counter if the kernel lets us, else the time stamp counter */
+{
+#ifdef __linux__
+	struct perf_event_attr pe;
+	memset(&pe, 0, sizeof(pe));
+	pe.type = PERF_TYPE_HARDWARE;
+	pe.size = sizeof(pe);
+	pe.config = PERF_COUNT_HW_CPU_CYCLES;
+	pe.exclude_kernel = 1;
+	pe.exclude_hv = 1;
+	perf_fd = (int)syscall(__NR_perf_event_open, &pe, 0, -1, -1, 0);
+	if (perf_fd >= 0) {
+		cycle_counter = CYCLES_PERF;
+		return;
+	}
+#endif
+#ifdef HAVE_TSC
+	cycle_counter = CYCLES_TSC;
+#endif
+}
+
+static uint64_t cycles_now(void)
+{
+#ifdef __linux__
+	uint64_t v;
+	if (cycle_counter == CYCLES_PERF) {
+		if (read(perf_fd, &v, sizeof(v)) != sizeof(v)) {
+			return 0;}
+		return v;
+	}
+#endif
+#ifdef HAVE_TSC
+	if (cycle_counter == CYCLES_TSC) {
+		return __rdtsc();}
+#endif
+	return 0;
+}
+
+static uint32_t xorshift(uint32_t *s)
+{
+	uint32_t x = *s;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	*s = x;
+	return x;
+}
+
+static uint8_t to_u8(double v)
+{
+	return v < 0 ? 0 : v > 255 ? 255 : (uint8_t)lrint(v);
+}
+
+static void make_fm(struct bench *b)
+/* a 1 kHz tone, 75 kHz deviation, 250 kHz off center at 1 Msps, some noise */
+{
+	uint32_t seed = 0x2545f491;
+	double phase = 0, rate = 1e6, dev;
+	int i;
+	for (i = 0; i < b->len; i += 2) {
+		dev = 75e3 * sin(2 * M_PI * 1e3 * (i/2) / rate);
+		phase += 2 * M_PI * (250e3 + dev) / rate;
+		b->cu8[i]   = to_u8(127.5 + 60 * cos(phase) + (int)(xorshift(&seed) % 17) - 8);
+		b->cu8[i+1] = to_u8(127.5 + 60 * sin(phase) + (int)(xorshift(&seed) % 17) - 8);
+	}
+	dsp_cu8_to_s16(b->cu8, b->s16, b->len);
+}
+
+static void make_modes(struct bench *b)
+/* a 112 bit frame about every 2000 samples, noise between them */
+{
+	static const int pulse[DSP_PREAMBLE_LEN] = {1,0,1,0,0,0,0,1,0,1,0,0,0,0,0,0};
+	uint32_t seed = 0x9e3779b9;
+	uint8_t *m = (uint8_t *)b->mag;
+	int n = b->len / 2, i, k, next = 100, bit = 0, on;
+	for (i = 0; i < n; i++) {
+		on = 0;
+		if (i >= next && i < next + DSP_PREAMBLE_LEN) {
+			on = pulse[i - next];
+		} else if (i >= next + DSP_PREAMBLE_LEN && i < next + DSP_PREAMBLE_LEN + 224) {
+			k = i - next - DSP_PREAMBLE_LEN;
+			if (!(k & 1)) {
+				bit = xorshift(&seed) & 1;}
+			on = (k & 1) ? !bit : bit;
+		} else if (i == next + DSP_PREAMBLE_LEN + 224) {
+			next += 1500 + xorshift(&seed) % 1000;
+		}
+		m[2*i]   = to_u8(127 + (on ? 50 : 0) + (int)(xorshift(&seed) % 11) - 5);
+		m[2*i+1] = to_u8(127 + (on ? 30 : 0) + (int)(xorshift(&seed) % 11) - 5);
+	}
+	dsp_magnitude(m, b->len);
+}
+
+static void prep_none(struct bench *b)
+{
+	(void)b;
+}
+
+static void prep_cu8(struct bench *b)
+{
+	memcpy(b->work8, b->cu8, b->len);
+}
+
+static void prep_s16(struct bench *b)
+{
+	memcpy(b->work16, b->s16, b->len * sizeof(int16_t));
+}
+
+static void prep_mag(struct bench *b)
+{
+	memcpy(b->work16, b->mag, b->len);
+}
+
+static void prep_avg(struct bench *b)
+{
+	memset(b->avg, 0, b->len / 2 * sizeof(long));
+}
+
+static void run_rotate_90(struct bench *b, int param)
+{
+	(void)param;
+	dsp_rotate_90(b->work8, (uint32_t)b->len);
+}
+
+static void run_cu8_to_s16(struct bench *b, int param)
+{
+	(void)param;
+	dsp_cu8_to_s16(b->cu8, b->out16, b->len);
+}
+
+static void run_low_pass(struct bench *b, int param)
+{
+	struct dsp_boxcar bc = {0, 0, 0};
+	dsp_low_pass(b->work16, b->len, param, &bc);
+}
+
+static void run_fifth_order(struct bench *b, int param)
+{
+	int16_t hist_i[6] = {0}, hist_q[6] = {0};
+	(void)param;
+	dsp_fifth_order(b->work16, b->len, hist_i);
+	dsp_fifth_order(b->work16 + 1, b->len - 1, hist_q);
+}
+
+static void run_generic_fir(struct bench *b, int param)
+{
+	int16_t hist_i[9] = {0}, hist_q[9] = {0};
+	dsp_generic_fir(b->work16, b->len, dsp_cic_9_tables[param], hist_i);
+	dsp_generic_fir(b->work16 + 1, b->len - 1, dsp_cic_9_tables[param], hist_q);
+}
+
+static void run_fm_demod(struct bench *b, int param)
+{
+	int pre[2] = {0, 0};
+	dsp_fm_demod(b->s16, b->len, b->out16, pre, (enum dsp_atan)param);
+}
+
+static void run_am_demod(struct bench *b, int param)
+{
+	(void)param;
+	dsp_am_demod(b->s16, b->len, b->out16, 1);
+}
+
+static void run_fix_fft(struct bench *b, int param)
+{
+	int off;
+	for (off = 0; off + (2 << param) <= b->len; off += 2 << param) {
+		dsp_fix_fft(&b->fft, b->work16 + off, param);}
+}
+
+static void run_power_sum(struct bench *b, int param)
+{
+	(void)param;
+	dsp_power_sum(b->s16, b->avg, b->len / 2);
+}
+
+static void run_nco_mix(struct bench *b, int param)
+{
+	(void)param;
+	dsp_nco_mix(&b->nco, b->work16, b->len);
+}
+
+static void run_magnitude(struct bench *b, int param)
+{
+	(void)param;
+	dsp_magnitude(b->work8, b->len);
+}
+
+static void run_manchester(struct bench *b, int param)
+{
+	(void)param;
+	dsp_manchester(&b->bits, (uint16_t *)b->work16, b->len / 2);
+}
+
+static void run_preamble(struct bench *b, int param)
+{
+	int i = 0, end = b->len / 2 - DSP_PREAMBLE_LEN;
+	(void)param;
+	while ((i = dsp_preamble_scan(b->mag, i, end)) < end) {
+		i++;}
+}
+
+static void add_kernel(const char *name, int param,
+		       void (*prepare)(struct bench *), void (*run)(struct bench *, int))
+{
+	struct kernel *k = &kernels[kernel_count++];
+	snprintf(k->name, sizeof(k->name), "%s", name);
+	k->param = param;
+	k->prepare = prepare;
+	k->run = run;
+}
+
+static void kernels_init(void)
+/* in pipeline order, rtl_fm first */
+{
+	static const char *atan_name[] = {"fm_demod_std", "fm_demod_fast", "fm_demod_lut"};
+	char name[24];
+	int i;
+
+	add_kernel("rotate_90", 0, prep_cu8, run_rotate_90);
+	add_kernel("cu8_to_s16", 0, prep_none, run_cu8_to_s16);
+	add_kernel("low_pass", FM_DOWNSAMPLE, prep_s16, run_low_pass);
+	add_kernel("fifth_order", 0, prep_s16, run_fifth_order);
+	add_kernel("generic_fir", 1, prep_s16, run_generic_fir);
+	for (i = DSP_ATAN_FLOAT; i <= DSP_ATAN_LUT; i++) {
+		add_kernel(atan_name[i], i, prep_none, run_fm_demod);}
+	add_kernel("am_demod", 0, prep_none, run_am_demod);
+	add_kernel("nco_mix", 0, prep_s16, run_nco_mix);
+	for (i = MIN_BIN_E; i <= MAX_BIN_E; i++) {
+		snprintf(name, sizeof(name), "fix_fft_%d", i);
+		add_kernel(name, i, prep_s16, run_fix_fft);
+	}
+	add_kernel("power_sum", 0, prep_avg, run_power_sum);
+	add_kernel("magnitude", 0, prep_cu8, run_magnitude);
+	add_kernel("preamble", 0, prep_none, run_preamble);
+	add_kernel("manchester", 0, prep_mag, run_manchester);
+}
+
+static int bench_init(struct bench *b, int len)
+{
+	memset(b, 0, sizeof(*b));
+	b->len = len;
+	b->cu8 = malloc(len);
+	b->s16 = malloc(len * sizeof(int16_t));
+	b->mag = malloc(len);
+	b->work8 = malloc(len);
+	b->work16 = malloc(len * sizeof(int16_t));
+	b->out16 = malloc(len * sizeof(int16_t));
+	b->avg = calloc(len / 2, sizeof(long));
+	b->hit_pos = malloc((len / 2 / DSP_PREAMBLE_LEN + 1) * sizeof(int));
+	b->hit_power = malloc((len / 2 / DSP_PREAMBLE_LEN + 1) * sizeof(uint16_t));
+	b->evict = malloc(EVICT_BYTES);
+	if (!b->cu8 || !b->s16 || !b->mag || !b->work8 || !b->work16 || !b->out16 ||
+	    !b->avg || !b->hit_pos || !b->hit_power || !b->evict ||
+	    dsp_fft_init(&b->fft, MAX_BIN_E) < 0 || dsp_atan_lut_init() < 0) {
+		return -1;}
+	memset(b->evict, 0, EVICT_BYTES);
+	dsp_nco_set(&b->nco, -250e3, 1e6);
+	b->bits.quality = 10;
+	b->bits.allowed_errors = 5;
+	b->bits.threshold = 0;
+	b->bits.hit_pos = b->hit_pos;
+	b->bits.hit_power = b->hit_power;
+	make_fm(b);
+	make_modes(b);
+	return 0;
+}
+
+static void evict(struct bench *b)
+/* writing a buffer larger than the last level cache pushes everything else out */
+{
+	static uint8_t v;
+	int i;
+	v++;
+	for (i = 0; i < EVICT_BYTES; i += 64) {
+		b->evict[i] = v;}
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+	return x < y ? -1 : x > y;
+}
+
+static void measure(struct bench *b, struct kernel *k, int cold, double seconds,
+		    struct result *r)
+{
+	static double ns[MAX_RUNS], cyc[MAX_RUNS];
+	double samples = b->len / 2;
+	uint64_t start, t0, t1, c0, c1;
+	int n = 0;
+
+	/* once untimed, for the page faults and lazily built tables */
+	k->prepare(b);
+	k->run(b, k->param);
+	/* the budget includes preparing and flushing, cold runs cost more */
+	start = now_ns();
+	while (n < MAX_RUNS && (n < MIN_RUNS || now_ns() - start < seconds * 1e9)) {
+		k->prepare(b);
+		if (cold) {
+			evict(b);}
+		c0 = cycles_now();
+		t0 = now_ns();
+		k->run(b, k->param);
+		t1 = now_ns();
+		c1 = cycles_now();
+		ns[n] = (double)(t1 - t0);
+		cyc[n] = (double)(c1 - c0);
+		n++;
+	}
+	qsort(ns, n, sizeof(double), cmp_double);
+	qsort(cyc, n, sizeof(double), cmp_double);
+	memcpy(r->kernel, k->name, sizeof(r->kernel));
+	snprintf(r->cache, sizeof(r->cache), "%s", cold ? "cold" : "warm");
+	r->runs = n;
+	r->ns = ns[n/2] / samples;
+	r->ns_min = ns[0] / samples;
+	r->cycles = cycle_counter == CYCLES_NONE ? 0 : cyc[n/2] / samples;
+}
+
+static int load_baseline(const char *path, struct result *base)
+/* reads the result lines of our own JSON, one object per line */
+{
+	char line[512];
+	char *p;
+	FILE *f;
+	int n = 0;
+
+	f = fopen(path, "r");
+	if (!f) {
+		return -1;}
+	while (n < MAX_BASELINE && fgets(line, sizeof(line), f)) {
+		p = strstr(line, "{\"kernel\": ");
+		if (!p) {
+			continue;}
+		if (sscanf(p, "{\"kernel\": \"%23[^\"]\", \"cache\": \"%7[^\"]\", "
+			   "\"runs\": %d, \"ns_per_sample\": %lf",
+			   base[n].kernel, base[n].cache, &base[n].runs, &base[n].ns) == 4) {
+			n++;}
+	}
+	fclose(f);
+	return n;
+}
+
+static const struct result *find_baseline(const struct result *base, int n,
+					  const struct result *r)
+{
+	int i;
+	for (i = 0; i < n; i++) {
+		if (!strcmp(base[i].kernel, r->kernel) && !strcmp(base[i].cache, r->cache)) {
+			return &base[i];}
+	}
+	return NULL;
+}
+
+int main(int argc, char **argv)
+{
+	static struct result base[MAX_BASELINE];
+	struct bench b;
+	struct result r;
+	const struct result *old;
+	const char *filter = NULL, *baseline = NULL, *set;
+	double seconds = DEFAULT_SECONDS, threshold = DEFAULT_THRESHOLD, change;
+	int len = DEFAULT_BUF_LENGTH, warm = 1, cold = 1, list = 0;
+	int opt, i, c, base_count = 0, first = 1, slower = 0;
+
+	set = dsp_init();
+	kernels_init();
+	while ((opt = getopt(argc, argv, "b:t:k:m:c:r:l")) != -1) {
+		switch (opt) {
+		case 'b':
+			len = atoi(optarg);
+			break;
+		case 't':
+			seconds = atof(optarg);
+			break;
+		case 'k':
+			filter = optarg;
+			break;
+		case 'm':
+			warm = strcmp(optarg, "cold") != 0;
+			cold = strcmp(optarg, "warm") != 0;
+			if (strcmp(optarg, "warm") && strcmp(optarg, "cold") && strcmp(optarg, "both")) {
+				usage();}
+			break;
+		case 'c':
+			baseline = optarg;
+			break;
+		case 'r':
+			threshold = atof(optarg);
+			break;
+		case 'l':
+			list = 1;
+			break;
+		default:
+			usage();
+			break;
+		}
+	}
+	if (list) {
+		for (i = 0; i < kernel_count; i++) {
+			printf("%s\n", kernels[i].name);}
+		return 0;
+	}
+	/* the largest transform has to fit, and the rotation works in groups of 8 */
+	if (len < (4 << MAX_BIN_E) || len % 8) {
+		fprintf(stderr, "Block length must be a multiple of 8 and at least %d.\n",
+			4 << MAX_BIN_E);
+		exit(1);
+	}
+	if (seconds <= 0) {
+		fprintf(stderr, "Seconds must be positive.\n");
+		exit(1);
+	}
+	if (baseline) {
+		base_count = load_baseline(baseline, base);
+		if (base_count <= 0) {
+			fprintf(stderr, "No results in %s.\n", baseline);
+			exit(1);
+		}
+	}
+	if (bench_init(&b, len) < 0) {
+		fprintf(stderr, "Out of memory.\n");
+		exit(1);
+	}
+	cycles_init();
+
+	fprintf(stderr, "%s kernels, %d byte blocks, cycles from %s\n",
+		set, len, cycle_counter_name[cycle_counter]);
+	fprintf(stderr, "%-16s %-5s %10s %10s %10s%s\n", "kernel", "cache",
+		"ns/sample", "min", "cyc/sample", baseline ? "   baseline   change" : "");
+	printf("{\n  \"tool\": \"rtl_dsp_bench\",\n  \"kernels\": \"%s\",\n"
+	       "  \"buf_len\": %d,\n  \"cycle_counter\": \"%s\",\n  \"results\": [",
+	       set, len, cycle_counter_name[cycle_counter]);
+	for (i = 0; i < kernel_count; i++) {
+		if (filter && !strstr(kernels[i].name, filter)) {
+			continue;}
+		for (c = 0; c <= 1; c++) {
+			if ((c && !cold) || (!c && !warm)) {
+				continue;}
+			measure(&b, &kernels[i], c, seconds, &r);
+			old = baseline ? find_baseline(base, base_count, &r) : NULL;
+			change = old && old->ns > 0 ? (r.ns - old->ns) / old->ns * 100 : 0;
+			fprintf(stderr, "%-16s %-5s %10.4f %10.4f %10.3f", r.kernel, r.cache,
+				r.ns, r.ns_min, r.cycles);
+			if (old) {
+				fprintf(stderr, " %10.4f %+7.1f%%%s", old->ns, change,
+					change > threshold ? " slower" : "");}
+			fprintf(stderr, "\n");
+			printf("%s\n    {\"kernel\": \"%s\", \"cache\": \"%s\", \"runs\": %d, "
+			       "\"ns_per_sample\": %.4f, \"ns_per_sample_min\": %.4f, "
+			       "\"cycles_per_sample\": %.4f",
+			       first ? "" : ",", r.kernel, r.cache, r.runs, r.ns, r.ns_min, r.cycles);
+			if (old) {
+				printf(", \"baseline_ns_per_sample\": %.4f, \"change_percent\": %.1f",
+				       old->ns, change);}
+			printf("}");
+			first = 0;
+			if (old && change > threshold) {
+				slower++;}
+		}
+	}
+	printf("\n  ]\n}\n");
+	if (baseline) {
+		fprintf(stderr, "%d of the measurements slower than the baseline by over %.0f%%.\n",
+			slower, threshold);}
+	return slower ? 1 : 0;
+}
@@ -73,7 +73,9 @@
 #include <libusb.h>
 
 #include "rtl-sdr.h"
+#include "rtl-sdr_trace.h"
 #include "convenience/convenience.h"
+#include "dsp/dsp.h"
 
 #define DEFAULT_SAMPLE_RATE		24000
 #define DEFAULT_BUF_LENGTH		(1 * 16384)
@@ -88,10 +90,6 @@ static volatile int do_exit = 0;
 static int lcm_post[17] = {1,1,1,3,1,5,3,7,1,9,5,11,3,13,7,15,1};
 static int ACTUAL_BUF_LENGTH;
 
-static int *atan_lut = NULL;
-static int atan_lut_size = 131072; /* 512 KB */
-static int atan_lut_coef = 8;
-
 struct dongle_state
 {
 	int      exit_flag;
@@ -125,9 +123,8 @@ struct demod_state
 	int      rate_in;
 	int      rate_out;
 	int      rate_out2;
-	int      now_r, now_j;
+	struct dsp_boxcar boxcar;
 	int      pre_r, pre_j;
-	int      prev_index;
 	int      downsample;    /* min 1, max 256 */
 	int      post_downsample;
 	int      output_scale;
@@ -257,23 +254,6 @@ static void sighandler(int signum)
 #define safe_cond_signal(n, m) pthread_mutex_lock(m); pthread_cond_signal(n); pthread_mutex_unlock(m)
 #define safe_cond_wait(n, m) pthread_mutex_lock(m); pthread_cond_wait(n, m); pthread_mutex_unlock(m)
 
-/* {length, coef, coef, coef}  and scaled by 2^15
-   for now, only length 9, optimal way to get +85% bandwidth */
-#define CIC_TABLE_MAX 10
-int cic_9_tables[][10] = {
-	{0,},
-	{9, -156,  -97, 2798, -15489, 61019, -15489, 2798,  -97, -156},
-	{9, -128, -568, 5593, -24125, 74126, -24125, 5593, -568, -128},
-	{9, -129, -639, 6187, -26281, 77511, -26281, 6187, -639, -129},
-	{9, -122, -612, 6082, -26353, 77818, -26353, 6082, -612, -122},
-	{9, -120, -602, 6015, -26269, 77757, -26269, 6015, -602, -120},
-	{9, -120, -582, 5951, -26128, 77542, -26128, 5951, -582, -120},
-	{9, -119, -580, 5931, -26094, 77505, -26094, 5931, -580, -119},
-	{9, -119, -578, 5921, -26077, 77484, -26077, 5921, -578, -119},
-	{9, -119, -577, 5917, -26067, 77473, -26067, 5917, -577, -119},
-	{9, -199, -362, 5303, -25505, 77489, -25505, 5303, -362, -199},
-};
-
 #if defined(_MSC_VER) && (_MSC_VER < 1800)
 double log2(double n)
 {
@@ -281,49 +261,6 @@ double log2(double n)
 }
 #endif
 
-void rotate_90(unsigned char *buf, uint32_t len)
-/* 90 rotation is 1+0j, 0+1j, -1+0j, 0-1j
-   or [0, 1, -3, 2, -4, -5, 7, -6] */
-{
-	uint32_t i;
-	unsigned char tmp;
-	for (i=0; i<len; i+=8) {
-		/* uint8_t negation = 255 - x */
-		tmp = 255 - buf[i+3];
-		buf[i+3] = buf[i+2];
-		buf[i+2] = tmp;
-
-		buf[i+4] = 255 - buf[i+4];
-		buf[i+5] = 255 - buf[i+5];
-
-		tmp = 255 - buf[i+6];
-		buf[i+6] = buf[i+7];
-		buf[i+7] = tmp;
-	}
-}
-
-void low_pass(struct demod_state *d)
-/* simple square window FIR */
-{
-	int i=0, i2=0;
-	while (i < d->lp_len) {
-		d->now_r += d->lowpassed[i];
-		d->now_j += d->lowpassed[i+1];
-		i += 2;
-		d->prev_index++;
-		if (d->prev_index < d->downsample) {
-			continue;
-		}
-		d->lowpassed[i2]   = d->now_r; // * d->output_scale;
-		d->lowpassed[i2+1] = d->now_j; // * d->output_scale;
-		d->prev_index = 0;
-		d->now_r = 0;
-		d->now_j = 0;
-		i2 += 2;
-	}
-	d->lp_len = i2;
-}
-
 int low_pass_simple(int16_t *signal2, int len, int step)
 // no wrap around, length must be multiple of step
 {
@@ -362,204 +299,18 @@ void low_pass_real(struct demod_state *s)
 	s->result_len = i2;
 }
 
-void fifth_order(int16_t *data, int length, int16_t *hist)
-/* for half of interleaved data */
-{
-	int i;
-	int16_t a, b, c, d, e, f;
-	a = hist[1];
-	b = hist[2];
-	c = hist[3];
-	d = hist[4];
-	e = hist[5];
-	f = data[0];
-	/* a downsample should improve resolution, so don't fully shift */
-	data[0] = (a + (b+e)*5 + (c+d)*10 + f) >> 4;
-	for (i=4; i<length; i+=4) {
-		a = c;
-		b = d;
-		c = e;
-		d = f;
-		e = data[i-2];
-		f = data[i];
-		data[i/2] = (a + (b+e)*5 + (c+d)*10 + f) >> 4;
-	}
-	/* archive */
-	hist[0] = a;
-	hist[1] = b;
-	hist[2] = c;
-	hist[3] = d;
-	hist[4] = e;
-	hist[5] = f;
-}
-
-void generic_fir(int16_t *data, int length, int *fir, int16_t *hist)
-/* Okay, not at all generic.  Assumes length 9, fix that eventually. */
-{
-	int d, temp, sum;
-	for (d=0; d<length; d+=2) {
-		temp = data[d];
-		sum = 0;
-		sum += (hist[0] + hist[8]) * fir[1];
-		sum += (hist[1] + hist[7]) * fir[2];
-		sum += (hist[2] + hist[6]) * fir[3];
-		sum += (hist[3] + hist[5]) * fir[4];
-		sum +=            hist[4]  * fir[5];
-		data[d] = sum >> 15 ;
-		hist[0] = hist[1];
-		hist[1] = hist[2];
-		hist[2] = hist[3];
-		hist[3] = hist[4];
-		hist[4] = hist[5];
-		hist[5] = hist[6];
-		hist[6] = hist[7];
-		hist[7] = hist[8];
-		hist[8] = temp;
-	}
-}
-
-/* define our own complex math ops
-   because ARMv5 has no hardware float */
-
-void multiply(int ar, int aj, int br, int bj, int *cr, int *cj)
-{
-	*cr = ar*br - aj*bj;
-	*cj = aj*br + ar*bj;
-}
-
-int polar_discriminant(int ar, int aj, int br, int bj)
-{
-	int cr, cj;
-	double angle;
-	multiply(ar, aj, br, -bj, &cr, &cj);
-	angle = atan2((double)cj, (double)cr);
-	return (int)(angle / 3.14159 * (1<<14));
-}
-
-int fast_atan2(int y, int x)
-/* pre scaled for int16 */
-{
-	int yabs, angle;
-	int pi4=(1<<12), pi34=3*(1<<12);  // note pi = 1<<14
-	if (x==0 && y==0) {
-		return 0;
-	}
-	yabs = y;
-	if (yabs < 0) {
-		yabs = -yabs;
-	}
-	if (x >= 0) {
-		angle = pi4  - pi4 * (x-yabs) / (x+yabs);
-	} else {
-		angle = pi34 - pi4 * (x+yabs) / (yabs-x);
-	}
-	if (y < 0) {
-		return -angle;
-	}
-	return angle;
-}
-
-int polar_disc_fast(int ar, int aj, int br, int bj)
-{
-	int cr, cj;
-	multiply(ar, aj, br, -bj, &cr, &cj);
-	return fast_atan2(cj, cr);
-}
-
-int atan_lut_init(void)
-{
-	int i = 0;
-
-	atan_lut = malloc(atan_lut_size * sizeof(int));
-
-	for (i = 0; i < atan_lut_size; i++) {
-		atan_lut[i] = (int) (atan((double) i / (1<<atan_lut_coef)) / 3.14159 * (1<<14));
-	}
-
-	return 0;
-}
-
-int polar_disc_lut(int ar, int aj, int br, int bj)
-{
-	int cr, cj, x, x_abs;
-
-	multiply(ar, aj, br, -bj, &cr, &cj);
-
-	/* special cases */
-	if (cr == 0 || cj == 0) {
-		if (cr == 0 && cj == 0)
-			{return 0;}
-		if (cr == 0 && cj > 0)
-			{return 1 << 13;}
-		if (cr == 0 && cj < 0)
-			{return -(1 << 13);}
-		if (cj == 0 && cr > 0)
-			{return 0;}
-		if (cj == 0 && cr < 0)
-			{return 1 << 14;}
-	}
-
-	/* real range -32768 - 32768 use 64x range -> absolute maximum: 2097152 */
-	x = (cj << atan_lut_coef) / cr;
-	x_abs = abs(x);
-
-	if (x_abs >= atan_lut_size) {
-		/* we can use linear range, but it is not necessary */
-		return (cj > 0) ? 1<<13 : -(1<<13);
-	}
-
-	if (x > 0) {
-		return (cj > 0) ? atan_lut[x] : atan_lut[x] - (1<<14);
-	} else {
-		return (cj > 0) ? (1<<14) - atan_lut[-x] : -atan_lut[-x];
-	}
-
-	return 0;
-}
-
 void fm_demod(struct demod_state *fm)
 {
-	int i, pcm;
-	int16_t *lp = fm->lowpassed;
-	pcm = polar_discriminant(lp[0], lp[1],
-		fm->pre_r, fm->pre_j);
-	fm->result[0] = (int16_t)pcm;
-	for (i = 2; i < (fm->lp_len-1); i += 2) {
-		switch (fm->custom_atan) {
-		case 0:
-			pcm = polar_discriminant(lp[i], lp[i+1],
-				lp[i-2], lp[i-1]);
-			break;
-		case 1:
-			pcm = polar_disc_fast(lp[i], lp[i+1],
-				lp[i-2], lp[i-1]);
-			break;
-		case 2:
-			pcm = polar_disc_lut(lp[i], lp[i+1],
-				lp[i-2], lp[i-1]);
-			break;
-		}
-		fm->result[i/2] = (int16_t)pcm;
-	}
-	fm->pre_r = lp[fm->lp_len - 2];
-	fm->pre_j = lp[fm->lp_len - 1];
-	fm->result_len = fm->lp_len/2;
+	int pre[2] = {fm->pre_r, fm->pre_j};
+	fm->result_len = dsp_fm_demod(fm->lowpassed, fm->lp_len, fm->result,
+		pre, (enum dsp_atan)fm->custom_atan);
+	fm->pre_r = pre[0];
+	fm->pre_j = pre[1];
 }
 
 void am_demod(struct demod_state *fm)
-// todo, fix this extreme laziness
 {
-	int i, pcm;
-	int16_t *lp = fm->lowpassed;
-	int16_t *r  = fm->result;
-	for (i = 0; i < fm->lp_len; i += 2) {
-		// hypot uses floats but won't overflow
-		//r[i/2] = (int16_t)hypot(lp[i], lp[i+1]);
-		pcm = lp[i] * lp[i];
-		pcm += lp[i+1] * lp[i+1];
-		r[i/2] = (int16_t)sqrt(pcm) * fm->output_scale;
-	}
-	fm->result_len = fm->lp_len/2;
+	fm->result_len = dsp_am_demod(fm->lowpassed, fm->lp_len, fm->result, fm->output_scale);
 	// lowpass? (3khz)  highpass?  (dc)
 }
 
@@ -645,26 +396,6 @@ int mad(int16_t *samples, int len, int step)
 	return sum / (len / step);
 }
 
-int rms(int16_t *samples, int len, int step)
-/* largely lifted from rtl_power */
-{
-	int i;
-	long p, t, s;
-	double dc, err;
-
-	p = t = 0L;
-	for (i=0; i<len; i+=step) {
-		s = (long)samples[i];
-		t += s;
-		p += s * s;
-	}
-	/* correct for dc offset in squares */
-	dc = (double)(t*step) / (double)len;
-	err = t * 2 * dc - dc * dc * len;
-
-	return (int)sqrt((p-err) / len);
-}
-
 void arbitrary_upsample(int16_t *buf1, int16_t *buf2, int len1, int len2)
 /* linear interpolation, len1 < len2 */
 {
@@ -735,25 +466,27 @@ void full_demod(struct demod_state *d)
 	int i, ds_p;
 	int sr = 0;
 	ds_p = d->downsample_passes;
+	RTLSDR_TRACE_BEGIN("lowpass");
 	if (ds_p) {
 		for (i=0; i < ds_p; i++) {
-			fifth_order(d->lowpassed,   (d->lp_len >> i), d->lp_i_hist[i]);
-			fifth_order(d->lowpassed+1, (d->lp_len >> i) - 1, d->lp_q_hist[i]);
+			dsp_fifth_order(d->lowpassed,   (d->lp_len >> i), d->lp_i_hist[i]);
+			dsp_fifth_order(d->lowpassed+1, (d->lp_len >> i) - 1, d->lp_q_hist[i]);
 		}
 		d->lp_len = d->lp_len >> ds_p;
 		/* droop compensation */
-		if (d->comp_fir_size == 9 && ds_p <= CIC_TABLE_MAX) {
-			generic_fir(d->lowpassed, d->lp_len,
-				cic_9_tables[ds_p], d->droop_i_hist);
-			generic_fir(d->lowpassed+1, d->lp_len-1,
-				cic_9_tables[ds_p], d->droop_q_hist);
+		if (d->comp_fir_size == 9 && ds_p <= DSP_CIC_TABLE_MAX) {
+			dsp_generic_fir(d->lowpassed, d->lp_len,
+				dsp_cic_9_tables[ds_p], d->droop_i_hist);
+			dsp_generic_fir(d->lowpassed+1, d->lp_len-1,
+				dsp_cic_9_tables[ds_p], d->droop_q_hist);
 		}
 	} else {
-		low_pass(d);
+		d->lp_len = dsp_low_pass(d->lowpassed, d->lp_len, d->downsample, &d->boxcar);
 	}
+	RTLSDR_TRACE_END("lowpass");
 	/* power squelch */
 	if (d->squelch_level) {
-		sr = rms(d->lowpassed, d->lp_len, 1);
+		sr = dsp_rms(d->lowpassed, d->lp_len, 1);
 		if (sr < d->squelch_level) {
 			d->squelch_hits++;
 			for (i=0; i<d->lp_len; i++) {
@@ -762,10 +495,13 @@ void full_demod(struct demod_state *d)
 		} else {
 			d->squelch_hits = 0;}
 	}
+	RTLSDR_TRACE_BEGIN("demodulate");
 	d->mode_demod(d);  /* lowpassed -> result */
+	RTLSDR_TRACE_END("demodulate");
 	if (d->mode_demod == &raw_demod) {
 		return;
 	}
+	RTLSDR_TRACE_BEGIN("post");
 	/* todo, fm noise squelch */
 	// use nicer filter here too?
 	if (d->post_downsample > 1) {
@@ -778,6 +514,7 @@ void full_demod(struct demod_state *d)
 		low_pass_real(d);
 		//arbitrary_resample(d->result, d->result, d->result_len, d->result_len * d->rate_out2 / d->rate_out);
 	}
+	RTLSDR_TRACE_END("post");
 }
 
 static void rtlsdr_callback(unsigned char *buf, uint32_t len, void *ctx)
@@ -796,10 +533,12 @@ static void rtlsdr_callback(unsigned char *buf, uint32_t len, void *ctx)
 		s->mute = 0;
 	}
 	if (!s->offset_tuning) {
-		rotate_90(buf, len);}
-	for (i=0; i<(int)len; i++) {
-		s->buf16[i] = (int16_t)buf[i] - 127;}
+		dsp_rotate_90(buf, len);}
+	dsp_cu8_to_s16(buf, (int16_t *)s->buf16, (int)len);
+	/* waits while the demod thread still has the last block */
+	RTLSDR_TRACE_BEGIN("handoff");
 	pthread_rwlock_wrlock(&d->rw);
+	RTLSDR_TRACE_END("handoff");
 	memcpy(d->lowpassed, s->buf16, 2*len);
 	d->lp_len = len;
 	pthread_rwlock_unlock(&d->rw);
@@ -809,6 +548,7 @@ static void rtlsdr_callback(unsigned char *buf, uint32_t len, void *ctx)
 static void *dongle_thread_fn(void *arg)
 {
 	struct dongle_state *s = arg;
+	RTLSDR_TRACE_THREAD("dongle");
 	rtlsdr_read_async(s->dev, rtlsdr_callback, s, 0, s->buf_len);
 	return 0;
 }
@@ -817,10 +557,13 @@ static void *demod_thread_fn(void *arg)
 {
 	struct demod_state *d = arg;
 	struct output_state *o = d->output_target;
+	RTLSDR_TRACE_THREAD("demod");
 	while (!do_exit) {
 		safe_cond_wait(&d->ready, &d->ready_m);
 		pthread_rwlock_wrlock(&d->rw);
+		RTLSDR_TRACE_BEGIN("demod");
 		full_demod(d);
+		RTLSDR_TRACE_END("demod");
 		pthread_rwlock_unlock(&d->rw);
 		if (d->exit_flag) {
 			do_exit = 1;
@@ -842,11 +585,14 @@ static void *demod_thread_fn(void *arg)
 static void *output_thread_fn(void *arg)
 {
 	struct output_state *s = arg;
+	RTLSDR_TRACE_THREAD("output");
 	while (!do_exit) {
 		// use timedwait and pad out under runs
 		safe_cond_wait(&s->ready, &s->ready_m);
 		pthread_rwlock_rdlock(&s->rw);
+		RTLSDR_TRACE_BEGIN("write");
 		fwrite(s->result, 2, s->result_len, s->file);
+		RTLSDR_TRACE_END("write");
 		pthread_rwlock_unlock(&s->rw);
 	}
 	return 0;
@@ -886,6 +632,7 @@ static void *controller_thread_fn(void *arg)
 	int i;
 	struct controller_state *s = arg;
 
+	RTLSDR_TRACE_THREAD("controller");
 	if (s->wb_mode) {
 		for (i=0; i < s->freq_len; i++) {
 			s->freqs[i] += 16000;}
@@ -975,13 +722,13 @@ void demod_init(struct demod_state *s)
 	s->squelch_hits = 11;
 	s->downsample_passes = 0;
 	s->comp_fir_size = 0;
-	s->prev_index = 0;
 	s->post_downsample = 1;  // once this works, default = 4
 	s->custom_atan = 0;
 	s->deemph = 0;
 	s->rate_out2 = -1;  // flag for disabled
 	s->mode_demod = &fm_demod;
-	s->pre_j = s->pre_r = s->now_r = s->now_j = 0;
+	s->pre_j = s->pre_r = 0;
+	memset(&s->boxcar, 0, sizeof(s->boxcar));
 	s->prev_lpr_index = 0;
 	s->deemph_a = 0;
 	s->now_lpr = 0;
@@ -1063,6 +810,7 @@ int main(int argc, char **argv)
 	demod_init(&demod);
 	output_init(&output);
 	controller_init(&controller);
+	dsp_init();
 
 	while ((opt = getopt(argc, argv, "d:f:g:s:b:l:o:t:r:p:E:F:A:M:hT")) != -1) {
 		switch (opt) {
@@ -1136,7 +884,7 @@ int main(int argc, char **argv)
 			if (strcmp("fast", optarg) == 0) {
 				demod.custom_atan = 1;}
 			if (strcmp("lut",  optarg) == 0) {
-				atan_lut_init();
+				dsp_atan_lut_init();
 				demod.custom_atan = 2;}
 			break;
 		case 'M':
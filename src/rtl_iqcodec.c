@@ -0,0 +1,278 @@
+/*
+ * rtl-sdr, turns your Realtek RTL2832 based DVB dongle into a SDR receiver
+ * rtl_iqcodec, compress, expand and benchmark cu8 I/Q recordings
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#ifndef _WIN32
+#include <unistd.h>
+#else
+#include <io.h>
+#include <fcntl.h>
+#include "getopt/getopt.h"
+#endif
+
+#include "convenience/iq_codec.h"
+
+#define DEFAULT_BLOCK_LENGTH (16 * 16384)
+#define MAXIMAL_BLOCK_LENGTH (256 * 16384)
+
+void usage(void)
+{
+	fprintf(stderr,
+		"rtl_iqcodec, compress and expand cu8 I/Q recordings\n\n"
+		"Usage:\trtl_iqcodec [-options] infile outfile\n"
+		"\trtl_iqcodec -B [-options] file [file...]\n"
+		"\t[-d expand instead of compress]\n"
+		"\t[-l low bits to drop, 0 is lossless (default: 0, max: %d)]\n"
+		"\t[-b block size in bytes (default: %d)]\n"
+		"\t[-B benchmark ratio and speed on the given recordings]\n"
+		"\tfilenames (a '-' reads stdin or writes stdout)\n\n",
+		IQ_MAX_SHIFT, DEFAULT_BLOCK_LENGTH);
+	exit(1);
+}
+
+static FILE *open_file(const char *name, const char *mode)
+{
+	FILE *f;
+	if (strcmp(name, "-") == 0) {
+		f = mode[0] == 'r' ? stdin : stdout;
+#ifdef _WIN32
+		_setmode(_fileno(f), _O_BINARY);
+#endif
+		return f;
+	}
+	f = fopen(name, mode);
+	if (!f)
+		fprintf(stderr, "Failed to open %s\n", name);
+	return f;
+}
+
+static int compress(FILE *in, FILE *out, size_t block, int shift)
+{
+	uint8_t *raw = malloc(block);
+	uint8_t *enc = malloc(iq_encode_bound(block));
+	size_t n, len;
+	int r = 0;
+
+	if (!raw || !enc) {
+		fprintf(stderr, "Out of memory.\n");
+		r = 1;
+		goto done;
+	}
+	/* block is even, so only the last read can end in half a sample */
+	while ((n = fread(raw, 1, block, in)) > 0) {
+		if (n & 1) {
+			fprintf(stderr, "Input ends in half an I/Q sample, "
+				"its last byte can not be stored!\n");
+			r = 1;
+			n--;
+		}
+		if (!n)
+			break;
+		len = iq_encode(raw, n, enc, shift);
+		if (fwrite(enc, 1, len, out) != len) {
+			fprintf(stderr, "Short write, exiting!\n");
+			r = 1;
+			break;
+		}
+	}
+done:
+	free(raw);
+	free(enc);
+	return r;
+}
+
+static int expand(FILE *in, FILE *out)
+{
+	uint8_t hdr[IQ_HEADER_LEN];
+	uint8_t *enc = NULL, *raw = NULL;
+	size_t raw_len, enc_cap = 0, raw_cap = 0;
+	long block, n;
+	void *p;
+
+	while (fread(hdr, 1, IQ_HEADER_LEN, in) == IQ_HEADER_LEN) {
+		block = iq_block_length(hdr, &raw_len);
+		if (block < 0 || raw_len > MAXIMAL_BLOCK_LENGTH ||
+		    (size_t)block > iq_encode_bound(raw_len)) {
+			fprintf(stderr, "Not a compressed recording.\n");
+			goto fail;
+		}
+		if ((size_t)block > enc_cap) {
+			if (!(p = realloc(enc, block)))
+				goto oom;
+			enc = p;
+			enc_cap = block;
+		}
+		if (raw_len > raw_cap) {
+			if (!(p = realloc(raw, raw_len)))
+				goto oom;
+			raw = p;
+			raw_cap = raw_len;
+		}
+		memcpy(enc, hdr, IQ_HEADER_LEN);
+		if (fread(enc + IQ_HEADER_LEN, 1, block - IQ_HEADER_LEN, in) !=
+		    (size_t)block - IQ_HEADER_LEN) {
+			fprintf(stderr, "Truncated block, exiting!\n");
+			goto fail;
+		}
+		n = iq_decode(enc, block, raw, raw_cap);
+		if (n < 0) {
+			fprintf(stderr, "Damaged block, exiting!\n");
+			goto fail;
+		}
+		if (fwrite(raw, 1, n, out) != (size_t)n) {
+			fprintf(stderr, "Short write, exiting!\n");
+			goto fail;
+		}
+	}
+	free(enc);
+	free(raw);
+	return 0;
+oom:
+	fprintf(stderr, "Out of memory.\n");
+fail:
+	free(enc);
+	free(raw);
+	return 1;
+}
+
+static int benchmark(const char *name, size_t block, int shift)
+/* encodes and decodes every block, timing both on the cpu clock */
+{
+	FILE *f = open_file(name, "rb");
+	uint8_t *raw = malloc(block);
+	uint8_t *enc = malloc(iq_encode_bound(block));
+	uint8_t *dec = malloc(block);
+	double t_enc = 0, t_dec = 0, samples;
+	unsigned long long total = 0, packed = 0;
+	int err, max_err = 0, bad = 0;
+	size_t n, len, i;
+	clock_t t0;
+	long d;
+
+	if (!f || !raw || !enc || !dec) {
+		free(raw);
+		free(enc);
+		free(dec);
+		return 1;
+	}
+	while ((n = fread(raw, 1, block, f)) > 1) {
+		n &= ~(size_t)1;
+		t0 = clock();
+		len = iq_encode(raw, n, enc, shift);
+		t_enc += (double)(clock() - t0) / CLOCKS_PER_SEC;
+		t0 = clock();
+		d = iq_decode(enc, len, dec, block);
+		t_dec += (double)(clock() - t0) / CLOCKS_PER_SEC;
+		if (d != (long)n) {
+			bad++;
+			continue;
+		}
+		for (i = 0; i < n; i++) {
+			err = abs(dec[i] - raw[i]);
+			if (err > max_err)
+				max_err = err;
+		}
+		total += n;
+		packed += len;
+	}
+	if (f != stdin)
+		fclose(f);
+	free(raw);
+	free(enc);
+	free(dec);
+
+	if (!total) {
+		fprintf(stderr, "%s: no samples\n", name);
+		return 1;
+	}
+	samples = total / 2.0;
+	printf("%s: %.1f MB, ratio %.3f (%.2f bits per I or Q), "
+	       "encode %.1f MS/s, decode %.1f MS/s, max error %d%s\n",
+	       name, total / 1e6, (double)total / packed, 8.0 * packed / total,
+	       t_enc > 0 ? samples / t_enc / 1e6 : 0.0,
+	       t_dec > 0 ? samples / t_dec / 1e6 : 0.0,
+	       max_err, bad ? ", DAMAGED BLOCKS" : "");
+	return bad ? 1 : 0;
+}
+
+int main(int argc, char **argv)
+{
+	int opt, r = 0;
+	int decode = 0, bench = 0, shift = 0;
+	size_t block = DEFAULT_BLOCK_LENGTH;
+	FILE *in, *out;
+
+	while ((opt = getopt(argc, argv, "dl:b:B")) != -1) {
+		switch (opt) {
+		case 'd':
+			decode = 1;
+			break;
+		case 'l':
+			shift = atoi(optarg);
+			break;
+		case 'b':
+			block = (size_t)atof(optarg);
+			break;
+		case 'B':
+			bench = 1;
+			break;
+		default:
+			usage();
+			break;
+		}
+	}
+
+	if (shift < 0 || shift > IQ_MAX_SHIFT) {
+		fprintf(stderr, "Can drop at most %d bits.\n", IQ_MAX_SHIFT);
+		exit(1);
+	}
+	block &= ~(size_t)1;
+	if (block < 2 || block > MAXIMAL_BLOCK_LENGTH) {
+		fprintf(stderr, "Block size must be 2 to %d bytes.\n", MAXIMAL_BLOCK_LENGTH);
+		exit(1);
+	}
+
+	if (bench) {
+		if (argc <= optind)
+			usage();
+		for (; optind < argc; optind++)
+			r |= benchmark(argv[optind], block, shift);
+		return r;
+	}
+
+	if (argc - optind != 2)
+		usage();
+	in = open_file(argv[optind], "rb");
+	if (!in)
+		return 1;
+	out = open_file(argv[optind + 1], "wb");
+	if (!out)
+		return 1;
+
+	r = decode ? expand(in, out) : compress(in, out, block, shift);
+
+	if (in != stdin)
+		fclose(in);
+	if (out != stdout)
+		fclose(out);
+	return r;
+}
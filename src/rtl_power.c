@@ -64,7 +64,9 @@
 #include <libusb.h>
 
 #include "rtl-sdr.h"
+#include "rtl-sdr_trace.h"
 #include "convenience/convenience.h"
+#include "dsp/dsp.h"
 
 #define MAX(x, y) (((x) > (y)) ? (x) : (y))
 
@@ -79,9 +81,7 @@ static volatile int do_exit = 0;
 static rtlsdr_dev_t *dev = NULL;
 FILE *file;
 
-int16_t* Sinewave;
-double* power_table;
-int N_WAVE, LOG2_N_WAVE;
+struct dsp_fft fft;
 int next_power;
 int16_t *fft_buf;
 int *window_coefs;
@@ -205,23 +205,6 @@ static void sighandler(int signum)
 #define safe_cond_signal(n, m) pthread_mutex_lock(m); pthread_cond_signal(n); pthread_mutex_unlock(m)
 #define safe_cond_wait(n, m) pthread_mutex_lock(m); pthread_cond_wait(n, m); pthread_mutex_unlock(m)
 
-/* {length, coef, coef, coef}  and scaled by 2^15
-   for now, only length 9, optimal way to get +85% bandwidth */
-#define CIC_TABLE_MAX 10
-int cic_9_tables[][10] = {
-	{0,},
-	{9, -156,  -97, 2798, -15489, 61019, -15489, 2798,  -97, -156},
-	{9, -128, -568, 5593, -24125, 74126, -24125, 5593, -568, -128},
-	{9, -129, -639, 6187, -26281, 77511, -26281, 6187, -639, -129},
-	{9, -122, -612, 6082, -26353, 77818, -26353, 6082, -612, -122},
-	{9, -120, -602, 6015, -26269, 77757, -26269, 6015, -602, -120},
-	{9, -120, -582, 5951, -26128, 77542, -26128, 5951, -582, -120},
-	{9, -119, -580, 5931, -26094, 77505, -26094, 5931, -580, -119},
-	{9, -119, -578, 5921, -26077, 77484, -26077, 5921, -578, -119},
-	{9, -119, -577, 5917, -26067, 77473, -26067, 5917, -577, -119},
-	{9, -199, -362, 5303, -25505, 77489, -25505, 5303, -362, -199},
-};
-
 #if defined(_MSC_VER) && (_MSC_VER < 1800)
 double log2(double n)
 {
@@ -229,94 +212,6 @@ double log2(double n)
 }
 #endif
 
-/* FFT based on fix_fft.c by Roberts, Slaney and Bouras
-   http://www.jjj.de/fft/fftpage.html
-   16 bit ints for everything
-   -32768..+32768 maps to -1.0..+1.0
-*/
-
-void sine_table(int size)
-{
-	int i;
-	double d;
-	LOG2_N_WAVE = size;
-	N_WAVE = 1 << LOG2_N_WAVE;
-	Sinewave = malloc(sizeof(int16_t) * N_WAVE*3/4);
-	power_table = malloc(sizeof(double) * N_WAVE);
-	for (i=0; i<N_WAVE*3/4; i++)
-	{
-		d = (double)i * 2.0 * M_PI / N_WAVE;
-		Sinewave[i] = (int)round(32767*sin(d));
-		//printf("%i\n", Sinewave[i]);
-	}
-}
-
-static inline int16_t FIX_MPY(int16_t a, int16_t b)
-/* fixed point multiply and scale */
-{
-	int c = ((int)a * (int)b) >> 14;
-	b = c & 0x01;
-	return (c >> 1) + b;
-}
-
-int fix_fft(int16_t iq[], int m)
-/* interleaved iq[], 0 <= n < 2**m, changes in place */
-{
-	int mr, nn, i, j, l, k, istep, n, shift;
-	int16_t qr, qi, tr, ti, wr, wi;
-	n = 1 << m;
-	if (n > N_WAVE)
-		{return -1;}
-	mr = 0;
-	nn = n - 1;
-	/* decimation in time - re-order data */
-	for (m=1; m<=nn; ++m) {
-		l = n;
-		do
-			{l >>= 1;}
-		while (mr+l > nn);
-		mr = (mr & (l-1)) + l;
-		if (mr <= m)
-			{continue;}
-		// real = 2*m, imag = 2*m+1
-		tr = iq[2*m];
-		iq[2*m] = iq[2*mr];
-		iq[2*mr] = tr;
-		ti = iq[2*m+1];
-		iq[2*m+1] = iq[2*mr+1];
-		iq[2*mr+1] = ti;
-	}
-	l = 1;
-	k = LOG2_N_WAVE-1;
-	while (l < n) {
-		shift = 1;
-		istep = l << 1;
-		for (m=0; m<l; ++m) {
-			j = m << k;
-			wr =  Sinewave[j+N_WAVE/4];
-			wi = -Sinewave[j];
-			if (shift) {
-				wr >>= 1; wi >>= 1;}
-			for (i=m; i<n; i+=istep) {
-				j = i + l;
-				tr = FIX_MPY(wr,iq[2*j]) - FIX_MPY(wi,iq[2*j+1]);
-				ti = FIX_MPY(wr,iq[2*j+1]) + FIX_MPY(wi,iq[2*j]);
-				qr = iq[2*i];
-				qi = iq[2*i+1];
-				if (shift) {
-					qr >>= 1; qi >>= 1;}
-				iq[2*j] = qr - tr;
-				iq[2*j+1] = qi - ti;
-				iq[2*i] = qr + tr;
-				iq[2*i+1] = qi + ti;
-			}
-		}
-		--k;
-		l = istep;
-	}
-	return 0;
-}
-
 double rectangle(int i, int length)
 {
 	return 1.0;
@@ -401,22 +296,7 @@ double bartlett(int i, int length)
 void rms_power(struct tuning_state *ts)
 /* for bins between 1MHz and 2MHz */
 {
-	int i, s;
-	uint8_t *buf = ts->buf8;
-	int buf_len = ts->buf_len;
-	long p, t;
-	double dc, err;
-
-	p = t = 0L;
-	for (i=0; i<buf_len; i++) {
-		s = (int)buf[i] - 127;
-		t += (long)s;
-		p += (long)(s * s);
-	}
-	/* correct for dc offset in squares */
-	dc = (double)t / (double)buf_len;
-	err = t * 2 * dc - dc * dc * buf_len;
-	p -= (long)round(err);
+	long p = dsp_power_cu8(ts->buf8, ts->buf_len);
 
 	if (!peak_hold) {
 		ts->avg[0] += p;
@@ -544,98 +424,20 @@ void retune(rtlsdr_dev_t *d, int freq)
 	int n_read;
 	rtlsdr_set_center_freq(d, (uint32_t)freq);
 	/* wait for settling and flush buffer */
+	RTLSDR_TRACE_BEGIN("settle");
 	usleep(5000);
 	rtlsdr_read_sync(d, &dump, BUFFER_DUMP, &n_read);
+	RTLSDR_TRACE_END("settle");
 	if (n_read != BUFFER_DUMP) {
 		fprintf(stderr, "Error: bad retune.\n");}
 }
 
-void fifth_order(int16_t *data, int length)
-/* for half of interleaved data */
-{
-	int i;
-	int a, b, c, d, e, f;
-	a = data[0];
-	b = data[2];
-	c = data[4];
-	d = data[6];
-	e = data[8];
-	f = data[10];
-	/* a downsample should improve resolution, so don't fully shift */
-	/* ease in instead of being stateful */
-	data[0] = ((a+b)*10 + (c+d)*5 + d + f) >> 4;
-	data[2] = ((b+c)*10 + (a+d)*5 + e + f) >> 4;
-	data[4] = (a + (b+e)*5 + (c+d)*10 + f) >> 4;
-	for (i=12; i<length; i+=4) {
-		a = c;
-		b = d;
-		c = e;
-		d = f;
-		e = data[i-2];
-		f = data[i];
-		data[i/2] = (a + (b+e)*5 + (c+d)*10 + f) >> 4;
-	}
-}
-
-void remove_dc(int16_t *data, int length)
-/* works on interleaved data */
-{
-	int i;
-	int16_t ave;
-	long sum = 0L;
-	for (i=0; i < length; i+=2) {
-		sum += data[i];
-	}
-	ave = (int16_t)(sum / (long)(length));
-	if (ave == 0) {
-		return;}
-	for (i=0; i < length; i+=2) {
-		data[i] -= ave;
-	}
-}
-
-void generic_fir(int16_t *data, int length, int *fir)
-/* Okay, not at all generic.  Assumes length 9, fix that eventually. */
-{
-	int d, temp, sum;
-	int hist[9] = {0,};
-	/* cheat on the beginning, let it go unfiltered */
-	for (d=0; d<18; d+=2) {
-		hist[d/2] = data[d];
-	}
-	for (d=18; d<length; d+=2) {
-		temp = data[d];
-		sum = 0;
-		sum += (hist[0] + hist[8]) * fir[1];
-		sum += (hist[1] + hist[7]) * fir[2];
-		sum += (hist[2] + hist[6]) * fir[3];
-		sum += (hist[3] + hist[5]) * fir[4];
-		sum +=            hist[4]  * fir[5];
-		data[d] = (int16_t)(sum >> 15) ;
-		hist[0] = hist[1];
-		hist[1] = hist[2];
-		hist[2] = hist[3];
-		hist[3] = hist[4];
-		hist[4] = hist[5];
-		hist[5] = hist[6];
-		hist[6] = hist[7];
-		hist[7] = hist[8];
-		hist[8] = temp;
-	}
-}
-
 void downsample_iq(int16_t *data, int length)
 {
-	fifth_order(data, length);
-	//remove_dc(data, length);
-	fifth_order(data+1, length-1);
-	//remove_dc(data+1, length-1);
-}
-
-long real_conj(int16_t real, int16_t imag)
-/* real(n * conj(n)) */
-{
-	return ((long)real*(long)real + (long)imag*(long)imag);
+	dsp_fifth_order_block(data, length);
+	//dsp_remove_dc(data, length);
+	dsp_fifth_order_block(data+1, length-1);
+	//dsp_remove_dc(data+1, length-1);
 }
 
 void scanner(void)
@@ -653,7 +455,9 @@ void scanner(void)
 		f = (int)rtlsdr_get_center_freq(dev);
 		if (f != ts->freq) {
 			retune(dev, ts->freq);}
+		RTLSDR_TRACE_BEGIN("read");
 		rtlsdr_read_sync(dev, ts->buf8, buf_len, &n_read);
+		RTLSDR_TRACE_END("read");
 		if (n_read != buf_len) {
 			fprintf(stderr, "Error: dropped samples.\n");}
 		/* rms */
@@ -662,9 +466,8 @@ void scanner(void)
 			continue;
 		}
 		/* prep for fft */
-		for (j=0; j<buf_len; j++) {
-			fft_buf[j] = (int16_t)ts->buf8[j] - 127;
-		}
+		RTLSDR_TRACE_BEGIN("downsample");
+		dsp_cu8_to_s16(ts->buf8, fft_buf, buf_len);
 		ds = ts->downsample;
 		ds_p = ts->downsample_passes;
 		if (boxcar && ds > 1) {
@@ -683,14 +486,16 @@ void scanner(void)
 				downsample_iq(fft_buf, buf_len >> j);
 			}
 			/* droop compensation */
-			if (comp_fir_size == 9 && ds_p <= CIC_TABLE_MAX) {
-				generic_fir(fft_buf, buf_len >> j, cic_9_tables[ds_p]);
-				generic_fir(fft_buf+1, (buf_len >> j)-1, cic_9_tables[ds_p]);
+			if (comp_fir_size == 9 && ds_p <= DSP_CIC_TABLE_MAX) {
+				dsp_generic_fir_block(fft_buf, buf_len >> j, dsp_cic_9_tables[ds_p]);
+				dsp_generic_fir_block(fft_buf+1, (buf_len >> j)-1, dsp_cic_9_tables[ds_p]);
 			}
 		}
-		remove_dc(fft_buf, buf_len / ds);
-		remove_dc(fft_buf+1, (buf_len / ds) - 1);
+		dsp_remove_dc(fft_buf, buf_len / ds);
+		dsp_remove_dc(fft_buf+1, (buf_len / ds) - 1);
+		RTLSDR_TRACE_END("downsample");
 		/* window function and fft */
+		RTLSDR_TRACE_BEGIN("fft");
 		for (offset=0; offset<(buf_len/ds); offset+=(2*bin_len)) {
 			// todo, let rect skip this
 			for (j=0; j<bin_len; j++) {
@@ -703,18 +508,15 @@ void scanner(void)
 				//w /= (int32_t)(ds);
 				fft_buf[offset+j*2+1] = (int16_t)w;
 			}
-			fix_fft(fft_buf+offset, bin_e);
+			dsp_fix_fft(&fft, fft_buf+offset, bin_e);
 			if (!peak_hold) {
-				for (j=0; j<bin_len; j++) {
-					ts->avg[j] += real_conj(fft_buf[offset+j*2], fft_buf[offset+j*2+1]);
-				}
+				dsp_power_sum(fft_buf+offset, ts->avg, bin_len);
 			} else {
-				for (j=0; j<bin_len; j++) {
-					ts->avg[j] = MAX(real_conj(fft_buf[offset+j*2], fft_buf[offset+j*2+1]), ts->avg[j]);
-				}
+				dsp_power_peak(fft_buf+offset, ts->avg, bin_len);
 			}
 			ts->samples += ds;
 		}
+		RTLSDR_TRACE_END("fft");
 	}
 }
 
@@ -791,6 +593,7 @@ int main(int argc, char **argv)
 	struct tm *cal_time;
 	double (*window_fn)(int, int) = rectangle;
 	freq_optarg = "";
+	dsp_init();
 
 	while ((opt = getopt(argc, argv, "f:i:s:t:d:g:p:e:w:c:F:1PDOhT")) != -1) {
 		switch (opt) {
@@ -962,7 +765,9 @@ int main(int argc, char **argv)
 
 	/* actually do stuff */
 	rtlsdr_set_sample_rate(dev, (uint32_t)tunes[0].rate);
-	sine_table(tunes[0].bin_e);
+	if (dsp_fft_init(&fft, tunes[0].bin_e) < 0) {
+		fprintf(stderr, "Failed to allocate the FFT table.\n");
+		exit(1);}
 	next_tick = time(NULL) + interval;
 	if (exit_time) {
 		exit_time = time(NULL) + exit_time;}
@@ -1005,6 +810,7 @@ int main(int argc, char **argv)
 
 	rtlsdr_close(dev);
 	free(fft_buf);
+	dsp_fft_free(&fft);
 	free(window_coefs);
 	//for (i=0; i<tune_count; i++) {
 	//	free(tunes[i].avg);
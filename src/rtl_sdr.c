@@ -16,32 +16,167 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#ifdef __linux__
+#define _GNU_SOURCE /* O_DIRECT, fallocate */
+#endif
+
 #include <errno.h>
 #include <signal.h>
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <math.h>
+#include <time.h>
 
 #ifndef _WIN32
 #include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/time.h>
 #else
 #include <windows.h>
 #include <io.h>
 #include <fcntl.h>
+#include <malloc.h>
 #include "getopt/getopt.h"
 #endif
 
+#include <pthread.h>
+
 #include "rtl-sdr.h"
+#include "rtl-sdr_trace.h"
 #include "convenience/convenience.h"
+#include "convenience/iq_codec.h"
+#include "convenience/iq_convert.h"
 
 #define DEFAULT_SAMPLE_RATE		2048000
 #define DEFAULT_BUF_LENGTH		(16 * 16384)
 #define MINIMAL_BUF_LENGTH		512
 #define MAXIMAL_BUF_LENGTH		(256 * 16384)
+#define DEFAULT_RING_MB			32
+#define DEFAULT_WRITE_KB		1024
+#define IO_ALIGN			4096	/* O_DIRECT wants buffers, offsets and lengths aligned */
+#define SLOW_WRITE_NS			100000000ULL
+#define DEFAULT_POST_TRIGGER		1.0	/* seconds */
+#define TM_SLACK_SEC			2.0	/* ring room for a dump that falls behind */
+#define MAX_CUTS			16
+
+/* where one file ends and the next begins */
+struct segment_cut {
+	uint64_t pos;		/* stream byte the new file starts at */
+	uint64_t sample;	/* output sample index of that byte */
+	uint64_t t_us;		/* wall clock of that sample */
+};
+
+/*
+ * The USB thread only copies into the ring, a writer thread drains it in
+ * large aligned writes. A stalled disk now fills the ring instead of
+ * holding up transfer resubmission, blocks that find it full are dropped.
+ * When rotating, the writer also switches files at the queued cuts.
+ */
+struct writer {
+	pthread_t thread;
+	pthread_mutex_t mutex;
+	pthread_cond_t ready;
+	uint8_t *ring;
+	size_t size;		/* a multiple of chunk */
+	size_t chunk;		/* bytes per write */
+	uint64_t head;		/* bytes ever queued, only the producer moves it */
+	uint64_t tail;		/* bytes ever written, only the writer moves it */
+	int stop;
+	int failed;
+	FILE *file;		/* NULL until the first cut when rotating */
+	int fd;
+	int want_direct;
+	int direct;		/* fd has O_DIRECT set right now */
+	uint64_t prealloc;	/* reserve this much ahead of the data, 0 for off */
+	uint64_t allocated;
+	uint64_t seg_pos;	/* stream byte the open file starts at */
+	struct segment_cut seg;	/* the open file */
+	struct segment_cut cuts[MAX_CUTS];
+	unsigned int cut_first;
+	unsigned int cut_count;
+	unsigned int segments;
+	char name[1024];
+	char expanded[1024];	/* the pattern as strftime gave it */
+	unsigned int repeat;	/* times it came out the same */
+	/* stats */
+	uint64_t fill_max;
+	uint64_t dropped;
+	uint64_t dropped_ns;	/* when the last block was dropped */
+	uint64_t stall_max_ns;
+	unsigned int slow_writes;
+};
+
+struct tm_slot {
+	uint64_t seq;		/* block number stored here */
+	uint64_t t_us;		/* wall clock when it arrived */
+	uint32_t len;
+};
+
+/*
+ * Time machine: the last blocks always sit in memory, a trigger dumps
+ * pre blocks before it and post blocks after it to a new file. Triggers
+ * arriving during a dump extend it. The dump thread copies each block
+ * out of the ring before writing it; a block the producer overwrote
+ * before or during the copy is left out and counted as lost.
+ */
+struct time_machine {
+	pthread_t thread;
+	pthread_mutex_t mutex;
+	pthread_cond_t ready;
+	uint8_t *data;
+	struct tm_slot *slots;
+	uint32_t count;
+	size_t block;		/* bytes per slot */
+	uint64_t head;		/* blocks ever stored */
+	uint32_t pre;
+	uint32_t post;
+	uint32_t rate;		/* samples per second, for messages */
+	uint64_t start;		/* blocks of the pending or running dump */
+	uint64_t end;		/* 0 when idle */
+	uint64_t trigger_us;
+	const char *why;
+	double level;		/* block power that fires, 0 for off */
+	int stop;
+	const char *name;	/* dumps get a timestamp inserted */
+	struct iq_ddc *ddc;	/* restarted for every dump */
+	uint8_t *ddc_buf;
+	uint8_t *copy;		/* the block being written, out of the producer's way */
+	unsigned int dumps;
+	uint64_t lost;
+};
+
+/*
+ * Rotation cuts the stream into files by size or time. The producer puts
+ * the cuts between blocks, so codec blocks stay whole and no sample is lost
+ * or written twice; the writer opens the next file when it gets there.
+ */
+struct rotation {
+	const char *pattern;	/* strftime, or the file number goes before the extension */
+	const char *hook;	/* run on each finished file */
+	double seconds;
+	uint64_t bytes;
+	uint32_t rate;		/* input samples per second */
+	int started;
+	uint64_t samples;	/* input samples so far */
+	uint64_t seg_samples;
+	uint64_t seg_bytes;
+};
 
 static int do_exit = 0;
 static uint32_t bytes_to_read = 0;
 static rtlsdr_dev_t *dev = NULL;
+static int codec_shift = -1;	/* compress blocks when >= 0 */
+static enum iq_format out_format = IQ_FMT_CU8;
+static int32_t ddc_offset = 0;
+static uint32_t ddc_rate = 0;	/* 0 keeps the capture rate */
+static int sigmf = 0;
+static struct iq_ddc *ddc = NULL;	/* NULL while writing the raw stream */
+static uint8_t *ddc_buf = NULL;
+static struct writer writer;
+static struct time_machine tm;
+static struct rotation rot;
 
 void usage(void)
 {
@@ -56,7 +191,27 @@ void usage(void)
 		"\t[-n number of samples to read (default: 0, infinite)]\n"
 		"\t[-S force sync output (default: async)]\n"
 		"\t[-D enable direct sampling (default: off)]\n"
-		"\tfilename (a '-' dumps samples to stdout)\n\n");
+		"\t[-z compress each block, n low bits dropped (0: lossless, max: %d)]\n"
+		"\t    expand with rtl_iqcodec -d\n"
+		"\t[-B writer ring size in MB (default: %d)]\n"
+		"\t[-w write size in kB, a multiple of 4 (default: %d)]\n"
+		"\t[-O bypass the page cache with O_DIRECT (Linux only)]\n"
+		"\t[-A reserve disk space this many MB ahead with fallocate (Linux only)]\n"
+		"\t[-T seconds to hold in memory, only dump them on a trigger (default: off)]\n"
+		"\t[-t seconds to keep recording after a trigger (default: %.0f)]\n"
+		"\t[-L trigger when a block's power exceeds this many dBFS]\n"
+		"\t[-C control fifo, a line 'trigger' dumps, 'quit' exits]\n"
+		"\t    dumps go to filename with the trigger time inserted\n"
+		"\t[-F output format: cu8, cs8, cs16, cf32, cs4 (default: cu8)]\n"
+		"\t[-o shift this many Hz from the tuned frequency down to 0 Hz]\n"
+		"\t[-r decimate to about this output rate (default: capture rate)]\n"
+		"\t[-M write SigMF metadata next to each recording]\n"
+		"\t[-e start a new file every this many seconds]\n"
+		"\t[-E start a new file every this many MB]\n"
+		"\t    files are named by strftime when filename has a %%, else numbered\n"
+		"\t[-X shell command run on each finished file, passed as $1]\n"
+		"\tfilename (a '-' dumps samples to stdout)\n\n",
+		IQ_MAX_SHIFT, DEFAULT_RING_MB, DEFAULT_WRITE_KB, DEFAULT_POST_TRIGGER);
 	exit(1);
 }
 
@@ -82,6 +237,762 @@ static void sighandler(int signum)
 }
 #endif
 
+static uint64_t now_ns(void)
+{
+#ifdef _WIN32
+	return (uint64_t)GetTickCount64() * 1000000ULL;
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+#endif
+}
+
+static uint64_t wall_us(void)
+{
+#ifdef _WIN32
+	FILETIME ft;
+	uint64_t t;
+	GetSystemTimeAsFileTime(&ft);
+	t = (uint64_t)ft.dwHighDateTime << 32 | ft.dwLowDateTime;
+	return t / 10 - 11644473600000000ULL;	/* from 1601 to 1970 */
+#else
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+#endif
+}
+
+static void format_utc(char *out, size_t len, uint64_t t_us, const char *fmt)
+{
+	time_t t = (time_t)(t_us / 1000000);
+	struct tm *utc = gmtime(&t);
+	if (!utc || !strftime(out, len, fmt, utc))
+		snprintf(out, len, "%llu", (unsigned long long)(t_us / 1000000));
+}
+
+static const char *extension(const char *name)
+/* the last dot in the file name part, or the end of the string */
+{
+	const char *dot = strrchr(name, '.');
+	const char *slash = strrchr(name, '/');
+	if (!dot || (slash && dot < slash))
+		return name + strlen(name);
+	return dot;
+}
+
+static void *aligned_alloc_io(size_t len)
+{
+#ifdef _WIN32
+	return _aligned_malloc(len, IO_ALIGN);
+#else
+	void *p;
+	return posix_memalign(&p, IO_ALIGN, len) ? NULL : p;
+#endif
+}
+
+static void aligned_free_io(void *p)
+{
+#ifdef _WIN32
+	_aligned_free(p);
+#else
+	free(p);
+#endif
+}
+
+static int write_all(int fd, const uint8_t *buf, size_t len)
+{
+	long r;
+	while (len) {
+		r = (long)write(fd, buf, (unsigned int)len);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r <= 0)
+			return -1;
+		buf += r;
+		len -= r;
+	}
+	return 0;
+}
+
+static int converting(void)
+{
+	return out_format != IQ_FMT_CU8 || ddc_offset || ddc_rate || codec_shift >= 0;
+}
+
+static int converter_new(struct iq_ddc **d, uint8_t **out, uint32_t rate, uint32_t block)
+/* the codec runs behind the converter, so -z goes through here too */
+{
+	*d = iq_ddc_new(ddc_offset, rate, ddc_rate, out_format, codec_shift + 1, block);
+	*out = *d ? malloc(iq_ddc_worst(*d, block)) : NULL;
+	if (!*out) {
+		fprintf(stderr, "Failed to set up the converter.\n");
+		iq_ddc_free(*d);
+		*d = NULL;
+		return -1;
+	}
+	if ((*d)->nco.step || (*d)->decim > 1)
+		fprintf(stderr, "Writing %s at %u Hz, %d Hz from center, %d taps.\n",
+			iq_format_name[out_format], rate / (*d)->decim, ddc_offset, (*d)->taps);
+	return 0;
+}
+
+static const char *sigmf_datatype(enum iq_format format)
+{
+	switch (format) {
+	case IQ_FMT_CU8:
+		return "cu8";
+	case IQ_FMT_CS8:
+		return "ci8";
+	case IQ_FMT_CS16:
+		return "ci16_le";
+	case IQ_FMT_CF32:
+		return "cf32_le";
+	default:
+		return NULL;
+	}
+}
+
+static void write_sigmf(const char *data_name, uint64_t start_us, uint64_t offset,
+			const struct iq_ddc *d)
+/* capture.cs16 gets capture.sigmf-meta, pointing back at it as the dataset */
+{
+	const char *dot = extension(data_name);
+	const char *base = strrchr(data_name, '/');
+	char name[1024], when[32];
+	uint32_t rate = rtlsdr_get_sample_rate(dev);
+	int decim = d ? d->decim : 1;
+	FILE *f;
+
+	base = base ? base + 1 : data_name;
+	snprintf(name, sizeof(name), "%.*s.sigmf-meta", (int)(dot - data_name), data_name);
+	f = fopen(name, "w");
+	if (!f) {
+		fprintf(stderr, "Failed to open %s\n", name);
+		return;
+	}
+	format_utc(when, sizeof(when), start_us, "%Y-%m-%dT%H:%M:%S");
+	fprintf(f, "{\n"
+		"    \"global\": {\n"
+		"        \"core:datatype\": \"%s\",\n"
+		"        \"core:sample_rate\": %.3f,\n"
+		"        \"core:version\": \"1.0.0\",\n"
+		"        \"core:recorder\": \"rtl_sdr\",\n"
+		"        \"core:offset\": %llu",
+		sigmf_datatype(out_format), (double)rate / decim, (unsigned long long)offset);
+	if (strcmp(dot, ".sigmf-data") != 0)
+		fprintf(f, ",\n        \"core:dataset\": \"%s\"", base);
+	fprintf(f, "\n    },\n"
+		"    \"captures\": [\n"
+		"        {\n"
+		"            \"core:sample_start\": 0,\n"
+		"            \"core:frequency\": %.0f,\n"
+		"            \"core:datetime\": \"%s.%03uZ\"\n"
+		"        }\n"
+		"    ],\n"
+		"    \"annotations\": []\n"
+		"}\n",
+		(double)rtlsdr_get_center_freq(dev) + ddc_offset, when,
+		(unsigned int)(start_us / 1000 % 1000));
+	fclose(f);
+}
+
+static void writer_reserve(struct writer *w, uint64_t end)
+/* keeps prealloc bytes reserved past the data, without changing the file size */
+{
+#if defined(__linux__) && defined(FALLOC_FL_KEEP_SIZE)
+	if (!w->prealloc || end <= w->allocated)
+		return;
+	if (fallocate(w->fd, FALLOC_FL_KEEP_SIZE, (off_t)w->allocated,
+		      (off_t)(end + w->prealloc - w->allocated)) < 0) {
+		fprintf(stderr, "Writer: fallocate failed (%s), not reserving space.\n",
+			strerror(errno));
+		w->prealloc = 0;
+		return;
+	}
+	w->allocated = end + w->prealloc;
+#else
+	(void)w;
+	(void)end;
+#endif
+}
+
+static void writer_direct(struct writer *w, int on)
+/* O_DIRECT only takes aligned writes, the odd one goes through the page cache */
+{
+	if (on == w->direct)
+		return;
+#if defined(__linux__) && defined(O_DIRECT)
+	if (fcntl(w->fd, F_SETFL, on ? fcntl(w->fd, F_GETFL) | O_DIRECT :
+				       fcntl(w->fd, F_GETFL) & ~O_DIRECT) == 0) {
+		w->direct = on;
+		return;
+	}
+	fprintf(stderr, "Writer: O_DIRECT not supported here (%s).\n", strerror(errno));
+#else
+	fprintf(stderr, "Writer: O_DIRECT not supported here.\n");
+#endif
+	w->want_direct = 0;
+}
+
+#ifndef _WIN32
+static void run_hook(const char *name, const struct segment_cut *seg)
+/* sh -c hook sh name, the environment is built before the fork */
+{
+	extern char **environ;
+	char *argv[] = {"sh", "-c", (char *)rot.hook, "sh", (char *)name, NULL};
+	char vars[5][1100], when[32];
+	char **envp;
+	int n = 0, i;
+	pid_t pid;
+
+	while (environ[n])
+		n++;
+	envp = malloc((n + 6) * sizeof(char *));
+	if (!envp)
+		return;
+	memcpy(envp, environ, n * sizeof(char *));
+	format_utc(when, sizeof(when), seg->t_us, "%Y-%m-%dT%H:%M:%S");
+	snprintf(vars[0], sizeof(vars[0]), "RTL_SDR_FILE=%s", name);
+	snprintf(vars[1], sizeof(vars[1]), "RTL_SDR_SAMPLE_START=%llu",
+		 (unsigned long long)seg->sample);
+	snprintf(vars[2], sizeof(vars[2]), "RTL_SDR_START=%s.%03uZ", when,
+		 (unsigned int)(seg->t_us / 1000 % 1000));
+	snprintf(vars[3], sizeof(vars[3]), "RTL_SDR_FREQUENCY=%.0f",
+		 (double)rtlsdr_get_center_freq(dev) + ddc_offset);
+	snprintf(vars[4], sizeof(vars[4]), "RTL_SDR_SAMPLE_RATE=%u",
+		 rtlsdr_get_sample_rate(dev) / (ddc ? ddc->decim : 1));
+	for (i = 0; i < 5; i++)
+		envp[n + i] = vars[i];
+	envp[n + 5] = NULL;
+	/* SIGCHLD is ignored, nobody has to wait for it */
+	pid = fork();
+	if (pid == 0) {
+		execve("/bin/sh", argv, envp);
+		_exit(127);
+	}
+	if (pid < 0)
+		fprintf(stderr, "Failed to run the hook for %s (%s).\n", name, strerror(errno));
+	free(envp);
+}
+#endif
+
+static void segment_name(char *out, size_t len, uint64_t t_us, unsigned int index)
+/* strftime on the start time in UTC, or capture.cu8 becomes capture-0003.cu8 */
+{
+	const char *dot = extension(rot.pattern);
+
+	if (strchr(rot.pattern, '%'))
+		format_utc(out, len, t_us, rot.pattern);
+	else
+		snprintf(out, len, "%.*s-%04u%s", (int)(dot - rot.pattern), rot.pattern,
+			 index, dot);
+}
+
+static void writer_close(struct writer *w)
+/* trims the reservation and hands the finished file to the hook */
+{
+	if (!w->file)
+		return;
+#ifndef _WIN32
+	if (w->allocated > w->tail - w->seg_pos &&
+	    ftruncate(w->fd, (off_t)(w->tail - w->seg_pos)) < 0)
+		fprintf(stderr, "Writer: could not trim the reserved space.\n");
+#endif
+	if (w->file != stdout)
+		fclose(w->file);
+	w->file = NULL;
+#ifndef _WIN32
+	if (rot.hook)
+		run_hook(w->name, &w->seg);
+#endif
+}
+
+static int writer_open(struct writer *w, const struct segment_cut *cut)
+{
+	char name[1024];
+	const char *dot;
+
+	segment_name(name, sizeof(name), cut->t_us, w->segments);
+	if (w->segments && strcmp(name, w->expanded) == 0) {
+		/* the pattern has not ticked over yet, never overwrite */
+		w->repeat++;
+		dot = extension(w->expanded);
+		snprintf(name, sizeof(name), "%.*s-%u%s", (int)(dot - w->expanded),
+			 w->expanded, w->repeat, dot);
+	} else {
+		snprintf(w->expanded, sizeof(w->expanded), "%s", name);
+		w->repeat = 0;
+	}
+	w->file = fopen(name, "wb");
+	if (!w->file) {
+		fprintf(stderr, "Failed to open %s\n", name);
+		return -1;
+	}
+	snprintf(w->name, sizeof(w->name), "%s", name);
+	w->fd = fileno(w->file);
+	w->direct = 0;
+	w->allocated = 0;
+	w->seg_pos = cut->pos;
+	w->seg = *cut;
+	w->segments++;
+	if (sigmf)
+		write_sigmf(w->name, cut->t_us, cut->sample, ddc);
+	fprintf(stderr, "Writing %s\n", w->name);
+	return 0;
+}
+
+static void *writer_thread(void *arg)
+{
+	struct writer *w = arg;
+	struct segment_cut cut;
+	uint64_t t0, dt, end;
+	size_t off, n;
+	int r;
+
+	RTLSDR_TRACE_THREAD("writer");
+	pthread_mutex_lock(&w->mutex);
+	for (;;) {
+		/* a cut is due once the block behind it is in */
+		while (!w->stop && w->head - w->tail < w->chunk &&
+		       !(w->cut_count && w->head > w->cuts[w->cut_first].pos))
+			pthread_cond_wait(&w->ready, &w->mutex);
+		if (w->cut_count && w->tail == w->cuts[w->cut_first].pos &&
+		    w->head > w->tail) {
+			cut = w->cuts[w->cut_first];
+			w->cut_first = (w->cut_first + 1) % MAX_CUTS;
+			w->cut_count--;
+			pthread_mutex_unlock(&w->mutex);
+			writer_close(w);
+			r = writer_open(w, &cut);
+			pthread_mutex_lock(&w->mutex);
+			if (r < 0)
+				goto failed;
+			continue;
+		}
+		end = w->cut_count ? w->cuts[w->cut_first].pos : w->head;
+		n = end - w->tail < w->chunk ? (size_t)(end - w->tail) : w->chunk;
+		if (!n)
+			break;
+		off = (size_t)(w->tail % w->size);
+		/* cuts leave the tail off chunk boundaries, do not run past the end */
+		if (n > w->size - off)
+			n = w->size - off;
+		pthread_mutex_unlock(&w->mutex);
+
+		writer_direct(w, w->want_direct &&
+			      ((uintptr_t)(w->ring + off) | n | (w->tail - w->seg_pos)) % IO_ALIGN == 0);
+		writer_reserve(w, w->tail - w->seg_pos + n);
+		t0 = now_ns();
+		RTLSDR_TRACE_BEGIN("write");
+		r = write_all(w->fd, w->ring + off, n);
+		RTLSDR_TRACE_END("write");
+		dt = now_ns() - t0;
+		if (dt >= SLOW_WRITE_NS) {
+			w->slow_writes++;
+			if (dt > w->stall_max_ns)
+				fprintf(stderr, "Writer: write stalled for %llu ms, ring %llu%% full\n",
+					(unsigned long long)(dt / 1000000),
+					(unsigned long long)((w->head - w->tail) * 100 / w->size));
+		}
+		if (dt > w->stall_max_ns)
+			w->stall_max_ns = dt;
+
+		pthread_mutex_lock(&w->mutex);
+		if (r < 0) {
+			fprintf(stderr, "Short write, samples lost, exiting!\n");
+			goto failed;
+		}
+		w->tail += n;
+	}
+	pthread_mutex_unlock(&w->mutex);
+	return NULL;
+failed:
+	w->failed = 1;
+	do_exit = 1;
+	rtlsdr_cancel_async(dev);
+	pthread_mutex_unlock(&w->mutex);
+	return NULL;
+}
+
+static int writer_start(struct writer *w, FILE *file, size_t ring_len, size_t chunk,
+			int direct, uint64_t prealloc)
+/* file is NULL when rotating, the first cut opens one */
+{
+	w->file = file;
+	w->fd = file ? fileno(file) : -1;
+	w->chunk = chunk;
+	w->size = (ring_len + chunk - 1) / chunk * chunk;
+	w->want_direct = direct;
+	w->prealloc = prealloc;
+#ifndef _WIN32
+	{
+		struct stat st;
+		/* pipes and devices have nothing to reserve */
+		if (file && fstat(w->fd, &st) == 0 && !S_ISREG(st.st_mode))
+			w->prealloc = 0;
+	}
+#endif
+	w->ring = aligned_alloc_io(w->size);
+	if (!w->ring) {
+		fprintf(stderr, "Failed to allocate a %u MB writer ring.\n",
+			(unsigned int)(w->size >> 20));
+		return -1;
+	}
+	/* fault every page in now rather than from the USB thread */
+	memset(w->ring, 0, w->size);
+	pthread_mutex_init(&w->mutex, NULL);
+	pthread_cond_init(&w->ready, NULL);
+	return pthread_create(&w->thread, NULL, writer_thread, w);
+}
+
+static int writer_push(struct writer *w, const uint8_t *buf, size_t len,
+		       const struct segment_cut *cut)
+/* 0 when queued, 1 when queued but the cut has to wait, -1 when dropped */
+{
+	uint64_t fill, t;
+	size_t off, first;
+	int r = 0;
+
+	pthread_mutex_lock(&w->mutex);
+	fill = w->head - w->tail;
+	pthread_mutex_unlock(&w->mutex);
+	/* whole blocks or nothing, compressed blocks can not be cut */
+	if (fill + len > w->size) {
+		t = now_ns();
+		if (t - w->dropped_ns > 1000000000ULL)
+			fprintf(stderr, "Writer ring full, samples lost!\n");
+		w->dropped_ns = t;
+		w->dropped += len;
+		RTLSDR_TRACE_INSTANT("ring_full", len);
+		return -1;
+	}
+	/* the writer never touches the free part, copy without the lock */
+	off = (size_t)(w->head % w->size);
+	first = len < w->size - off ? len : w->size - off;
+	memcpy(w->ring + off, buf, first);
+	memcpy(w->ring, buf + first, len - first);
+
+	pthread_mutex_lock(&w->mutex);
+	if (cut && w->cut_count < MAX_CUTS) {
+		w->cuts[(w->cut_first + w->cut_count) % MAX_CUTS] = *cut;
+		w->cuts[(w->cut_first + w->cut_count) % MAX_CUTS].pos = w->head;
+		w->cut_count++;
+	} else if (cut)
+		r = 1;
+	w->head += len;
+	RTLSDR_TRACE_COUNTER("ring_bytes", w->head - w->tail);
+	if (w->head - w->tail > w->fill_max)
+		w->fill_max = w->head - w->tail;
+	if (w->head - w->tail >= w->chunk || w->cut_count)
+		pthread_cond_signal(&w->ready);
+	pthread_mutex_unlock(&w->mutex);
+	return r;
+}
+
+static void writer_finish(struct writer *w)
+/* drains whatever is queued, closes the file, then prints the stats */
+{
+	pthread_mutex_lock(&w->mutex);
+	w->stop = 1;
+	pthread_cond_signal(&w->ready);
+	pthread_mutex_unlock(&w->mutex);
+	pthread_join(w->thread, NULL);
+	writer_close(w);
+	fprintf(stderr, "Writer: %.1f MB written, ring peak %.1f of %.1f MB, "
+		"longest write %.1f ms, %u over %d ms, %llu bytes dropped\n",
+		w->tail / 1048576.0, w->fill_max / 1048576.0, w->size / 1048576.0,
+		w->stall_max_ns / 1e6, w->slow_writes, (int)(SLOW_WRITE_NS / 1000000),
+		(unsigned long long)w->dropped);
+	if (w->segments > 1)
+		fprintf(stderr, "Writer: %u files, the last one %s\n", w->segments, w->name);
+	pthread_mutex_destroy(&w->mutex);
+	pthread_cond_destroy(&w->ready);
+	aligned_free_io(w->ring);
+}
+
+static void write_samples(uint8_t *buf, uint32_t len)
+{
+	struct segment_cut cut, *want = NULL;
+	uint32_t in = len / 2;
+	int r;
+
+	if (rot.pattern && (!rot.started ||
+	    (rot.seconds > 0 && rot.seg_samples >= rot.seconds * rot.rate)))
+		want = &cut;
+	if (ddc) {
+		len = (uint32_t)iq_ddc_process(ddc, buf, len, ddc_buf);
+		buf = ddc_buf;
+	}
+	if (rot.pattern && rot.bytes && rot.seg_bytes && rot.seg_bytes + len > rot.bytes)
+		want = &cut;
+	if (want) {
+		cut.sample = rot.samples / (ddc ? ddc->decim : 1);
+		/* the block ends now, the cut is at its first sample */
+		cut.t_us = wall_us() - (uint64_t)in * 1000000 / rot.rate;
+	}
+	r = writer_push(&writer, buf, len, want);
+	if (want && r == 0) {
+		rot.started = 1;
+		rot.seg_samples = 0;
+		rot.seg_bytes = 0;
+	}
+	if (r >= 0)
+		rot.seg_bytes += len;
+	rot.samples += in;
+	rot.seg_samples += in;
+}
+
+static double block_power(const uint8_t *buf, uint32_t len)
+/* mean I^2 + Q^2 relative to full scale, 1.0 is 0 dBFS */
+{
+	uint64_t sum = 0;
+	uint32_t i;
+	int x;
+	for (i = 0; i < len; i++) {
+		x = 2 * buf[i] - 255;
+		sum += (uint64_t)(x * x);
+	}
+	return len ? (double)sum / (65025.0 * (len / 2)) : 0.0;
+}
+
+static void tm_trigger(struct time_machine *t, const char *why)
+{
+	uint64_t oldest;
+
+	pthread_mutex_lock(&t->mutex);
+	if (t->end && t->head <= t->end) {
+		/* still dumping, keep going a while longer */
+		t->end = t->head + t->post;
+		pthread_mutex_unlock(&t->mutex);
+		return;
+	}
+	oldest = t->head >= t->count ? t->head - t->count + 1 : 0;
+	t->start = t->head > t->pre ? t->head - t->pre : 0;
+	if (t->start < oldest)
+		t->start = oldest;
+	t->end = t->head + t->post;
+	t->trigger_us = wall_us();
+	t->why = why;
+	pthread_cond_signal(&t->ready);
+	pthread_mutex_unlock(&t->mutex);
+}
+
+static void tm_push(struct time_machine *t, const uint8_t *buf, uint32_t len)
+{
+	struct tm_slot *slot;
+	uint64_t seq = t->head;	/* only the producer moves head */
+
+	slot = &t->slots[seq % t->count];
+	memcpy(t->data + (seq % t->count) * t->block, buf, len);
+	slot->seq = seq;
+	slot->t_us = wall_us();
+	slot->len = len;
+
+	pthread_mutex_lock(&t->mutex);
+	t->head = seq + 1;
+	if (t->end)
+		pthread_cond_signal(&t->ready);
+	pthread_mutex_unlock(&t->mutex);
+
+	if (t->level > 0 && block_power(buf, len) > t->level)
+		tm_trigger(t, "power");
+}
+
+static void dump_name(const struct time_machine *t, char *out, size_t len)
+/* capture.cu8 becomes capture-20240101-120000-123.cu8 */
+{
+	const char *dot = extension(t->name);
+	char stamp[32];
+	int base = (int)(dot - t->name);
+
+	format_utc(stamp, sizeof(stamp), t->trigger_us, "%Y%m%d-%H%M%S");
+	snprintf(out, len, "%.*s-%s-%03u%s", base, t->name, stamp,
+		 (unsigned int)(t->trigger_us / 1000 % 1000), dot);
+}
+
+static int tm_write_block(struct time_machine *t, int fd, size_t len)
+{
+	const uint8_t *buf = t->copy;
+
+	if (t->ddc) {
+		len = iq_ddc_process(t->ddc, buf, len, t->ddc_buf);
+		buf = t->ddc_buf;
+	}
+	return write_all(fd, buf, len);
+}
+
+static void *tm_thread(void *arg)
+{
+	struct time_machine *t = arg;
+	char name[1024], when[32];
+	uint64_t cur, oldest, first_us, t_us, lost;
+	size_t len;
+	FILE *f;
+	int r;
+
+	pthread_mutex_lock(&t->mutex);
+	for (;;) {
+		while (!t->stop && !t->end)
+			pthread_cond_wait(&t->ready, &t->mutex);
+		if (!t->end)
+			break;
+		cur = t->start;
+		dump_name(t, name, sizeof(name));
+		format_utc(when, sizeof(when), t->trigger_us, "%H:%M:%S");
+		fprintf(stderr, "Trigger (%s) at %s UTC, dumping %.1f s before it to %s\n",
+			t->why, when, (double)(t->head - cur) * t->block / 2 / t->rate, name);
+		pthread_mutex_unlock(&t->mutex);
+		f = fopen(name, "wb");
+		if (!f)
+			fprintf(stderr, "Failed to open %s\n", name);
+		if (t->ddc)
+			iq_ddc_reset(t->ddc);
+		pthread_mutex_lock(&t->mutex);
+
+		first_us = 0;
+		lost = 0;
+		r = 0;
+		while (f && cur < t->end) {
+			while (!t->stop && t->head <= cur)
+				pthread_cond_wait(&t->ready, &t->mutex);
+			if (t->head <= cur)
+				break;
+			oldest = t->head >= t->count ? t->head - t->count + 1 : 0;
+			if (cur < oldest) {
+				lost += oldest - cur;
+				cur = oldest;
+			}
+			t_us = t->slots[cur % t->count].t_us;
+			len = t->slots[cur % t->count].len;
+			pthread_mutex_unlock(&t->mutex);
+			memcpy(t->copy, t->data + (cur % t->count) * t->block, len);
+			pthread_mutex_lock(&t->mutex);
+			/* lapped during the copy, the block is torn, leave it out */
+			oldest = t->head >= t->count ? t->head - t->count + 1 : 0;
+			if (cur < oldest) {
+				lost++;
+				cur++;
+				continue;
+			}
+			if (!first_us)
+				first_us = t_us;
+			pthread_mutex_unlock(&t->mutex);
+			r = tm_write_block(t, fileno(f), len);
+			pthread_mutex_lock(&t->mutex);
+			if (r < 0) {
+				fprintf(stderr, "Short write, dump %s cut short!\n", name);
+				break;
+			}
+			cur++;
+		}
+		if (f) {
+			format_utc(when, sizeof(when), first_us, "%H:%M:%S");
+			fprintf(stderr, "Dumped %s: from %s.%03u UTC, %llu blocks, %llu lost\n",
+				name, when, (unsigned int)(first_us / 1000 % 1000),
+				(unsigned long long)(cur - t->start - lost),
+				(unsigned long long)lost);
+			pthread_mutex_unlock(&t->mutex);
+			fclose(f);
+			if (sigmf && first_us)
+				write_sigmf(name, first_us, 0, t->ddc);
+			pthread_mutex_lock(&t->mutex);
+			t->dumps++;
+		}
+		t->lost += lost;
+		t->end = 0;
+		if (t->stop)
+			break;
+	}
+	pthread_mutex_unlock(&t->mutex);
+	return NULL;
+}
+
+static void *control_thread(void *arg)
+/* reopens the fifo each time the writer goes away */
+{
+	const char *path = arg;
+	char line[64];
+	FILE *f;
+
+	while (!do_exit) {
+		f = fopen(path, "r");
+		if (!f) {
+			fprintf(stderr, "Failed to open control fifo %s\n", path);
+			return NULL;
+		}
+		while (!do_exit && fgets(line, sizeof(line), f)) {
+			line[strcspn(line, "\r\n")] = '\0';
+			if (strcmp(line, "trigger") == 0)
+				tm_trigger(&tm, "command");
+			else if (strcmp(line, "quit") == 0) {
+				do_exit = 1;
+				rtlsdr_cancel_async(dev);
+			} else if (line[0])
+				fprintf(stderr, "Control: unknown command '%s'\n", line);
+		}
+		fclose(f);
+	}
+	return NULL;
+}
+
+static int tm_start(struct time_machine *t, const char *name, double pre_sec, double post_sec,
+		    uint32_t rate, uint32_t block)
+{
+	double blocks_per_sec = 2.0 * rate / block;
+
+	t->name = name;
+	t->block = block;
+	t->rate = rate;
+	t->pre = (uint32_t)ceil(pre_sec * blocks_per_sec);
+	t->post = (uint32_t)ceil(post_sec * blocks_per_sec);
+	t->count = t->pre + t->post + (uint32_t)ceil(TM_SLACK_SEC * blocks_per_sec) + 2;
+	t->data = malloc((size_t)t->count * block);
+	t->slots = calloc(t->count, sizeof(struct tm_slot));
+	t->copy = malloc(block);
+	if (converting() && converter_new(&t->ddc, &t->ddc_buf, rate, block))
+		return -1;
+	if (!t->data || !t->slots || !t->copy) {
+		fprintf(stderr, "Failed to allocate %.0f MB for the time machine.\n",
+			(double)t->count * block / 1048576);
+		return -1;
+	}
+	/* fault every page in now rather than from the USB thread */
+	memset(t->data, 0, (size_t)t->count * block);
+	fprintf(stderr, "Holding %.1f s of samples in %.0f MB, %.1f s after a trigger.\n",
+		pre_sec, (double)t->count * block / 1048576, post_sec);
+	pthread_mutex_init(&t->mutex, NULL);
+	pthread_cond_init(&t->ready, NULL);
+	return pthread_create(&t->thread, NULL, tm_thread, t);
+}
+
+static void tm_finish(struct time_machine *t)
+/* a running dump keeps what it has so far */
+{
+	pthread_mutex_lock(&t->mutex);
+	t->stop = 1;
+	pthread_cond_signal(&t->ready);
+	pthread_mutex_unlock(&t->mutex);
+	pthread_join(t->thread, NULL);
+	fprintf(stderr, "Time machine: %u dumps, %llu blocks lost\n",
+		t->dumps, (unsigned long long)t->lost);
+	pthread_mutex_destroy(&t->mutex);
+	pthread_cond_destroy(&t->ready);
+	free(t->data);
+	free(t->slots);
+	free(t->copy);
+	iq_ddc_free(t->ddc);
+	free(t->ddc_buf);
+}
+
+static void handle_samples(uint8_t *buf, uint32_t len)
+{
+	if (tm.count)
+		tm_push(&tm, buf, len);
+	else
+		write_samples(buf, len);
+}
+
 static void rtlsdr_callback(unsigned char *buf, uint32_t len, void *ctx)
 {
 	if (ctx) {
@@ -94,10 +1005,7 @@ static void rtlsdr_callback(unsigned char *buf, uint32_t len, void *ctx)
 			rtlsdr_cancel_async(dev);
 		}
 
-		if (fwrite(buf, 1, len, (FILE*)ctx) != len) {
-			fprintf(stderr, "Short write, samples lost, exiting!\n");
-			rtlsdr_cancel_async(dev);
-		}
+		handle_samples(buf, len);
 
 		if (bytes_to_read > 0)
 			bytes_to_read -= len;
@@ -123,8 +1031,17 @@ int main(int argc, char **argv)
 	uint32_t frequency = 100000000;
 	uint32_t samp_rate = DEFAULT_SAMPLE_RATE;
 	uint32_t out_block_size = DEFAULT_BUF_LENGTH;
+	size_t ring_len = (size_t)DEFAULT_RING_MB << 20;
+	size_t write_len = (size_t)DEFAULT_WRITE_KB << 10;
+	uint64_t prealloc = 0;
+	int direct = 0;
+	double pre_trigger = 0, post_trigger = DEFAULT_POST_TRIGGER, level_db = 0;
+	int level_given = 0;
+	char *control = NULL;
+	size_t worst;
+	pthread_t control_id;
 
-	while ((opt = getopt(argc, argv, "d:f:g:s:b:n:p:SD")) != -1) {
+	while ((opt = getopt(argc, argv, "d:f:g:s:b:n:p:SDz:B:w:OA:T:t:L:C:F:o:r:Me:E:X:")) != -1) {
 		switch (opt) {
 		case 'd':
 			dev_index = verbose_device_search(optarg);
@@ -154,6 +1071,60 @@ int main(int argc, char **argv)
 		case 'D':
 			direct_sampling = 1;
 			break;
+		case 'z':
+			codec_shift = atoi(optarg);
+			if (codec_shift < 0 || codec_shift > IQ_MAX_SHIFT)
+				usage();
+			break;
+		case 'B':
+			ring_len = (size_t)(atof(optarg) * 1048576);
+			break;
+		case 'w':
+			write_len = (size_t)atoi(optarg) << 10;
+			break;
+		case 'O':
+			direct = 1;
+			break;
+		case 'A':
+			prealloc = (uint64_t)(atof(optarg) * 1048576);
+			break;
+		case 'T':
+			pre_trigger = atof(optarg);
+			break;
+		case 't':
+			post_trigger = atof(optarg);
+			break;
+		case 'L':
+			level_db = atof(optarg);
+			level_given = 1;
+			break;
+		case 'C':
+			control = optarg;
+			break;
+		case 'F':
+			r = iq_format_parse(optarg);
+			if (r < 0)
+				usage();
+			out_format = (enum iq_format)r;
+			break;
+		case 'o':
+			ddc_offset = (int32_t)atofs(optarg);
+			break;
+		case 'r':
+			ddc_rate = (uint32_t)atofs(optarg);
+			break;
+		case 'M':
+			sigmf = 1;
+			break;
+		case 'e':
+			rot.seconds = atof(optarg);
+			break;
+		case 'E':
+			rot.bytes = (uint64_t)(atof(optarg) * 1048576);
+			break;
+		case 'X':
+			rot.hook = optarg;
+			break;
 		default:
 			usage();
 			break;
@@ -177,6 +1148,58 @@ int main(int argc, char **argv)
 		out_block_size = DEFAULT_BUF_LENGTH;
 	}
 
+	if (write_len < IO_ALIGN || write_len % IO_ALIGN) {
+		fprintf(stderr, "Write size must be a multiple of %d kB.\n", IO_ALIGN >> 10);
+		exit(1);
+	}
+	if (codec_shift >= 0 && out_format != IQ_FMT_CU8) {
+		fprintf(stderr, "Compression needs cu8 output.\n");
+		exit(1);
+	}
+	if (sigmf && (!sigmf_datatype(out_format) || codec_shift >= 0 ||
+		      strcmp(filename, "-") == 0)) {
+		fprintf(stderr, "SigMF metadata needs an uncompressed file in cu8, cs8, cs16 or cf32.\n");
+		exit(1);
+	}
+	worst = iq_encode_bound(out_block_size);
+	if (converting() && pre_trigger <= 0) {
+		if (converter_new(&ddc, &ddc_buf, samp_rate, out_block_size))
+			exit(1);
+		worst = iq_ddc_worst(ddc, out_block_size);
+	}
+	/* room for a few blocks even when conversion makes them grow */
+	if (ring_len < 2 * write_len || ring_len < 4 * worst) {
+		fprintf(stderr, "Writer ring too small for the write and block sizes.\n");
+		exit(1);
+	}
+
+	if ((level_given || control) && pre_trigger <= 0) {
+		fprintf(stderr, "Triggers need a time machine, see -T.\n");
+		exit(1);
+	}
+	if (pre_trigger > 0 && (post_trigger < 0 || strcmp(filename, "-") == 0)) {
+		fprintf(stderr, "Time machine dumps need a filename and a positive -t.\n");
+		exit(1);
+	}
+	if (rot.seconds > 0 || rot.bytes) {
+		if (pre_trigger > 0 || strcmp(filename, "-") == 0) {
+			fprintf(stderr, "Rotation needs a filename and no time machine.\n");
+			exit(1);
+		}
+		rot.pattern = filename;
+		rot.rate = samp_rate;
+	}
+	if (rot.hook && !rot.pattern) {
+		fprintf(stderr, "The hook runs on rotated files, see -e and -E.\n");
+		exit(1);
+	}
+#ifdef _WIN32
+	if (rot.hook) {
+		fprintf(stderr, "Hooks are not supported on Windows.\n");
+		exit(1);
+	}
+#endif
+
 	buffer = malloc(out_block_size * sizeof(uint8_t));
 
 	if (!dev_given) {
@@ -200,6 +1223,8 @@ int main(int argc, char **argv)
 	sigaction(SIGTERM, &sigact, NULL);
 	sigaction(SIGQUIT, &sigact, NULL);
 	sigaction(SIGPIPE, &sigact, NULL);
+	if (rot.hook)
+		signal(SIGCHLD, SIG_IGN);
 #else
 	SetConsoleCtrlHandler( (PHANDLER_ROUTINE) sighandler, TRUE );
 #endif
@@ -225,10 +1250,31 @@ int main(int argc, char **argv)
 
 	verbose_ppm_set(dev, ppm_error);
 
-	if(strcmp(filename, "-") == 0) { /* Write samples to stdout */
+	if (pre_trigger > 0) {
+		file = NULL;
+		if (tm_start(&tm, filename, pre_trigger, post_trigger, samp_rate, out_block_size)) {
+			r = -1;
+			goto out;
+		}
+		if (level_given)
+			tm.level = pow(10.0, level_db / 10.0);
+		if (control) {
+#ifndef _WIN32
+			if (mkfifo(control, 0600) < 0 && errno != EEXIST)
+				fprintf(stderr, "Failed to create control fifo %s\n", control);
+#endif
+			if (pthread_create(&control_id, NULL, control_thread, control) == 0)
+				pthread_detach(control_id);
+		}
+	} else if (rot.pattern) {
+		file = NULL;
+	} else if(strcmp(filename, "-") == 0) { /* Write samples to stdout */
 		file = stdout;
+		/* neither applies to a pipe */
+		direct = 0;
+		prealloc = 0;
 #ifdef _WIN32
-		_setmode(_fileno(stdin), _O_BINARY);
+		_setmode(_fileno(stdout), _O_BINARY);
 #endif
 	} else {
 		file = fopen(filename, "wb");
@@ -238,6 +1284,15 @@ int main(int argc, char **argv)
 		}
 	}
 
+	if (pre_trigger <= 0 && writer_start(&writer, file, ring_len, write_len, direct, prealloc)) {
+		if (file && file != stdout)
+			fclose(file);
+		r = -1;
+		goto out;
+	}
+	if (file && sigmf)
+		write_sigmf(filename, wall_us(), 0, ddc);
+
 	/* Reset endpoint before we start reading from it (mandatory) */
 	verbose_reset_buffer(dev);
 
@@ -255,10 +1310,9 @@ int main(int argc, char **argv)
 				do_exit = 1;
 			}
 
-			if (fwrite(buffer, 1, n_read, file) != (size_t)n_read) {
-				fprintf(stderr, "Short write, samples lost, exiting!\n");
+			handle_samples(buffer, n_read);
+			if (writer.failed)
 				break;
-			}
 
 			if ((uint32_t)n_read < out_block_size) {
 				fprintf(stderr, "Short read, samples lost, exiting!\n");
@@ -270,7 +1324,9 @@ int main(int argc, char **argv)
 		}
 	} else {
 		fprintf(stderr, "Reading samples in async mode...\n");
-		r = rtlsdr_read_async(dev, rtlsdr_callback, (void *)file,
+		RTLSDR_TRACE_THREAD("dongle");
+		r = rtlsdr_read_async(dev, rtlsdr_callback,
+				      pre_trigger > 0 ? (void *)&tm : (void *)&writer,
 				      0, out_block_size);
 	}
 
@@ -279,11 +1335,15 @@ int main(int argc, char **argv)
 	else
 		fprintf(stderr, "\nLibrary error %d, exiting...\n", r);
 
-	if (file != stdout)
-		fclose(file);
+	if (pre_trigger > 0)
+		tm_finish(&tm);
+	else
+		writer_finish(&writer);
 
 	rtlsdr_close(dev);
 	free (buffer);
+	iq_ddc_free(ddc);
+	free (ddc_buf);
 out:
 	return r >= 0 ? r : -r;
 }
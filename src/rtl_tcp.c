@@ -17,6 +17,10 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#ifdef __linux__
+#define _GNU_SOURCE /* sendmmsg */
+#endif
+
 #include <errno.h>
 #include <signal.h>
 #include <string.h>
@@ -33,47 +37,357 @@
 #include <netdb.h>
 #include <netinet/in.h>
 #include <fcntl.h>
+#include <poll.h>
+#include <sys/uio.h>
 #else
 #include <winsock2.h>
 #include <ws2tcpip.h>
 #include "getopt/getopt.h"
+#define _USE_MATH_DEFINES
 #endif
 
+#include <math.h>
 #include <pthread.h>
 
 #include "rtl-sdr.h"
+#include "rtl-sdr_trace.h"
 #include "convenience/convenience.h"
+#include "convenience/iq_codec.h"
+#include "convenience/iq_convert.h"
 
 #ifdef _WIN32
 #pragma comment(lib, "ws2_32.lib")
 
 typedef int socklen_t;
+#define usleep(x) Sleep(x/1000)
+#define SOCKET_WOULDBLOCK() (WSAGetLastError() == WSAEWOULDBLOCK)
 
 #else
+#define SOCKET_WOULDBLOCK() (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
 #define closesocket close
 #define SOCKADDR struct sockaddr
 #define SOCKET int
 #define SOCKET_ERROR -1
 #endif
 
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <linux/errqueue.h>
+/* older headers lack the zero-copy bits, the kernel decides at runtime */
+#ifndef SO_ZEROCOPY
+#define SO_ZEROCOPY 60
+#endif
+#ifndef MSG_ZEROCOPY
+#define MSG_ZEROCOPY 0x4000000
+#endif
+#ifndef SO_EE_ORIGIN_ZEROCOPY
+#define SO_EE_ORIGIN_ZEROCOPY 5
+#endif
+#ifndef SO_EE_CODE_ZEROCOPY_COPIED
+#define SO_EE_CODE_ZEROCOPY_COPIED 1
+#endif
+#endif
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
 #define DEFAULT_PORT_STR "1234"
 #define DEFAULT_SAMPLE_RATE_HZ 2048000
 #define DEFAULT_MAX_NUM_BUFFERS 500
+#define DEFAULT_BUF_LENGTH (16 * 32 * 512)
+#define DEFAULT_MAX_CLIENTS 8
+#define MAX_DEVICES 8
+#define LAG_MARGIN 2 /* blocks between a lagging client and the callback */
+#define RING_WRITING UINT64_MAX
+#define BATCH_BLOCKS 16 /* ring blocks handed to a single send call */
+#define ZEROCOPY_MIN (64 * 1024) /* smaller sends are cheaper to copy */
+#define ZEROCOPY_PENDING 64 /* zero-copy sends awaiting completion per client */
+#define LOOP_EVENTS 64
+
+#define UDP_HEADER_LEN 32
+#define DEFAULT_UDP_PAYLOAD 1024
+#define UDP_BATCH 64 /* datagrams per sendmmsg() */
+#define CTRL_PENDING 32 /* distinct settings waiting for the control thread */
+#define CTRL_DONE (2 * CTRL_PENDING) /* results the loop has yet to send, a batch and one more */
+#define FRAME_HEADER_LEN 8
+#define FRAME_SAMPLES 0
+#define FRAME_STATUS 1
+#define FRAME_SPECTRUM 2
+#define STATUS_LEN 16
+#define SPEC_HEADER_LEN 20
+#define SPEC_MIN_SIZE 64
+#define SPEC_MAX_SIZE 32768
+#define SPEC_MAX_RATE 100
+#define DEFAULT_SPEC_RATE 10
+#define DEFAULT_SPEC_FLOOR -100 /* dB */
+#define DEFAULT_SPEC_STEP 50 /* hundredths of a dB */
+/* a framed block as cf32 and every status frame the loop may add to it */
+#define OUT_BUF_LENGTH (FRAME_HEADER_LEN + 4 * DEFAULT_BUF_LENGTH + \
+			CTRL_DONE * (FRAME_HEADER_LEN + STATUS_LEN))
+
+#define EV_READ 1
+#define EV_WRITE 2
+#define EV_ERROR 4
 
-static SOCKET s;
-
-static pthread_t tcp_worker_thread;
-static pthread_t command_thread;
-static pthread_cond_t exit_cond;
-static pthread_mutex_t exit_cond_lock;
+#ifdef _WIN32
+typedef WSABUF io_buf;
+#define IO_BUF_SET(b, p, l) ((b)->buf = (char *)(p), (b)->len = (ULONG)(l))
+#define poll WSAPoll
+#else
+typedef struct iovec io_buf;
+#define IO_BUF_SET(b, p, l) ((b)->iov_base = (p), (b)->iov_len = (l))
+#endif
 
+/* guards the ring between the USB callback and the event loop */
 static pthread_mutex_t ll_mutex;
-static pthread_cond_t cond;
 
-struct llist {
+/*
+ * Fixed ring of blocks, addressed by an ever increasing sequence number.
+ * The arena is allocated once, untouched slots cost no resident memory.
+ * Every client reads it through its own cursor.
+ */
+struct ring_slot {
 	char *data;
-	size_t len;
-	struct llist *next;
+	uint32_t len;
+	uint64_t seq;		/* RING_WRITING while the callback fills it */
+	int pins;		/* sends the kernel may still read from the slot */
+	uint64_t sample;	/* index of the first sample since streaming started */
+	uint64_t time_ns;	/* host clock when the block arrived */
+};
+
+struct sample_ring {
+	char *arena;
+	struct ring_slot *slots;
+	unsigned int size;
+	uint64_t wseq;		/* next block the callback will write */
+	uint64_t samples;	/* delivered by the dongle, lost blocks included */
+	/* stats, only reported outside the hot path */
+	uint64_t blocks;
+	uint64_t busy;		/* new blocks lost because the oldest was mid-send */
+};
+
+enum lag_policy {
+	LAG_DROP,		/* disconnect a client that falls a ring behind */
+	LAG_SKIP		/* jump it forward to the newest block */
+};
+
+enum ctrl_policy {
+	CTRL_ALL,		/* every client may send commands */
+	CTRL_FIRST,		/* the longest connected client owns the device */
+	CTRL_LAST		/* the most recently connected client owns it */
+};
+
+/* FFT tables and window, shared by every client asking for the same size */
+struct fft_plan {
+	int size;
+	int refs;
+	int *rev;		/* bit reversed index */
+	float *cos_tab;		/* size / 2 twiddles */
+	float *sin_tab;
+	float *window;
+	float gain;		/* power of a full scale tone through the window */
+	struct fft_plan *next;
+};
+
+/* per client averaged power spectrum of the full band */
+struct spectrum {
+	struct fft_plan *plan;
+	float *re;
+	float *im;
+	float *acc;		/* power summed over ffts transforms */
+	int fill;		/* samples waiting in re and im */
+	int ffts;
+	uint32_t rate;
+	uint64_t interval;	/* samples per frame */
+	uint64_t since;		/* samples transformed since the last frame */
+	uint64_t first;		/* index of the first sample in acc */
+	int floor_db;
+	int step;		/* hundredths of a dB per count, 0 for float */
+};
+
+/* blocks pinned by one zero-copy send until the kernel reports it done */
+struct zc_send {
+	uint64_t first;
+	uint64_t last;
+	int done;
+};
+
+struct client {
+	int id;
+	struct device *d;
+	SOCKET s;
+	int dead;
+	int want_write;		/* socket was full, waiting to become writable */
+	int pad_pending;
+	uint64_t cursor;	/* next block to send */
+	uint32_t offset;	/* bytes of the cursor block already sent */
+	unsigned char cmd[5];	/* command being received, cmd_len bytes so far */
+	int cmd_len;
+	int zerocopy;
+	struct iq_ddc *ddc;	/* NULL while the client takes the raw stream */
+	int reconfigure;	/* apply the settings below at the next block */
+	int32_t ddc_offset;
+	uint32_t ddc_rate;
+	enum iq_format format;
+	int compress;
+	int mute;		/* asked for no samples over TCP, applied to muted */
+	int muted;
+	int frame;		/* asked for framing, applied to framed */
+	int framed;
+	struct spectrum *spec;	/* spectrum frames instead of samples */
+	int spec_size;
+	int spec_rate;
+	int spec_floor;
+	int spec_step;
+	char *out;		/* converted samples, sent from out_pos */
+	size_t out_pos;
+	size_t out_len;
+	struct zc_send zc[ZEROCOPY_PENDING];	/* indexed by kernel send id */
+	uint32_t zc_head;	/* next id the kernel will hand out */
+	uint32_t zc_tail;	/* oldest id not yet completed */
+	uint64_t sent;
+	uint64_t skipped;
+	uint64_t ignored;	/* commands refused by the control policy */
+	uint64_t status_lost;	/* status frames that found the buffer full */
+	uint64_t bytes;
+	uint64_t send_calls;
+	char host[NI_MAXHOST];
+	char port[NI_MAXSERV];
+	struct client *next;
+};
+
+/* the loop owns every socket, only the wake flag is shared */
+struct event_loop {
+#ifdef __linux__
+	int epfd;
+#else
+	struct pollfd *fds;
+	void **tags;
+#endif
+	SOCKET wake_rx;
+	SOCKET wake_tx;
+	int wake_pending;	/* under ll_mutex */
+};
+
+/*
+ * Samples of the first device as fixed size datagrams to one address,
+ * unicast or multicast. Every datagram starts with a UDP_HEADER_LEN byte
+ * big endian header:
+ *
+ *   0  'R' 'T' 'L' 'U'
+ *   4  datagram sequence number, 32 bit, gaps are network loss
+ *   8  index of the first sample, 64 bit, gaps are samples the server lost
+ *  16  host time of the first sample, ns since the epoch, 64 bit
+ *  24  sample rate, 32 bit
+ *  28  sample format, 16 bit, 0 for cu8
+ *  30  payload bytes, 16 bit
+ */
+struct udp_stream {
+	SOCKET s;
+	struct sockaddr_storage dest;
+	socklen_t dest_len;
+	int payload;
+	int want_write;
+	uint64_t cursor;
+	uint32_t offset;
+	uint32_t seq;
+	uint64_t datagrams;
+	uint64_t skipped;
+};
+
+/*
+ * Framed clients (command 0x25) get everything wrapped in frames with a
+ * FRAME_HEADER_LEN byte big endian header:
+ *
+ *   0  'R' 'F'
+ *   2  type, FRAME_SAMPLES, FRAME_STATUS or FRAME_SPECTRUM
+ *   3  0
+ *   4  payload bytes, 32 bit
+ *
+ * Samples keep the client's format, one frame per block. A status frame
+ * goes to every framed client once a device command was applied, its
+ * STATUS_LEN byte payload is:
+ *
+ *   0  command
+ *   4  value applied, 32 bit
+ *   8  librtlsdr result, 32 bit signed, negative on failure
+ *  12  newer values that replaced this command before it was applied
+ *
+ * Spectrum clients (command 0x26) are always framed and get power spectra
+ * of the whole band instead of samples. Each has a SPEC_HEADER_LEN byte
+ * header, then one value per bin from -rate/2 up to rate/2:
+ *
+ *   0  index of the first sample averaged, 64 bit
+ *   8  sample rate, 32 bit
+ *  12  transforms averaged, 16 bit
+ *  14  dB of a bin value of 0, 16 bit signed
+ *  16  hundredths of a dB per bin value, 16 bit, 0 for float dB
+ *  18  0
+ *
+ * Bins are one byte each, or a cf32 style float in dB relative to a full
+ * scale tone when the step is 0.
+ */
+
+/* device commands waiting for or returning from the control thread */
+struct ctrl_cmd {
+	unsigned char cmd;
+	uint32_t param;
+	int replaced;
+	int result;
+};
+
+/* latest value per setting, in order of arrival, under ctrl_mutex */
+struct ctrl_queue {
+	struct ctrl_cmd pending[CTRL_PENDING];
+	int npending;
+	struct ctrl_cmd done[CTRL_DONE];
+	int ndone;
+};
+
+struct loop_event {
+	void *tag;
+	int flags;
+};
+
+struct net_stats {
+	uint64_t bytes;
+	uint64_t send_calls;
+	uint64_t recv_calls;
+	uint64_t waits;
+	uint64_t zc_sends;
+	uint64_t zc_copied;	/* completions where the kernel copied after all */
+	uint64_t datagrams;
+	uint64_t commands;
+	uint64_t replaced;	/* commands superseded before they were applied */
+};
+
+/*
+ * One dongle with its own port, ring and sample rate. The event loop and
+ * the ring arena are shared, librtlsdr still wants a thread per device
+ * for the async transfers and the control calls. Without a dongle, dev is
+ * NULL and a source thread plays a file or a test tone in real time.
+ */
+struct device {
+	int id;			/* order on the command line */
+	rtlsdr_dev_t *dev;
+	FILE *file;		/* source samples, NULL for the tone */
+	volatile int source_stop;
+	uint32_t source_pos;	/* tone phase and noise state */
+	uint32_t source_seed;
+	char serial[256];
+	SOCKET listen;
+	char port[NI_MAXSERV];
+	struct sample_ring ring;
+	uint32_t sample_rate;
+	pthread_t async_thread;
+	int streaming;
+	struct ctrl_queue ctrl;
+	pthread_mutex_t ctrl_mutex;
+	pthread_cond_t ctrl_cond;
+	pthread_t ctrl_thread;
+	int clients;
+	uint64_t bytes;		/* sent to its clients */
 };
 
 typedef struct { /* structure size must be multiple of 2 bytes */
@@ -82,12 +396,31 @@ typedef struct { /* structure size must be multiple of 2 bytes */
 	uint32_t tuner_gain_count;
 } dongle_info_t;
 
-static rtlsdr_dev_t *dev = NULL;
+static struct device devices[MAX_DEVICES];
+static int device_count = 0;
+static char *ring_arena = NULL;	/* every ring carves its slots from here */
 
 static int enable_biastee = 0;
-static int global_numq = 0;
-static struct llist *ll_buffers = 0;
 static int llbuf_num = DEFAULT_MAX_NUM_BUFFERS;
+static enum lag_policy lag_policy = LAG_DROP;
+static enum ctrl_policy ctrl_policy = CTRL_ALL;
+static int zerocopy = 0;
+static int stats_interval = 0;
+
+static struct event_loop loop;
+static struct net_stats stats;
+static struct udp_stream udp;
+static int udp_enabled = 0;
+static char *source = NULL;
+static int keep_streaming = 0;
+static int replay_ms = 0;
+
+/* connect order, oldest first */
+static struct client *clients = NULL;
+static int client_count = 0;
+static int max_clients = DEFAULT_MAX_CLIENTS;
+
+static uint32_t buf_num = 0;
 
 static volatile int do_exit = 0;
 
@@ -96,13 +429,28 @@ void usage(void)
 {
 	printf("rtl_tcp, an I/Q spectrum server for RTL2832 based DVB-T receivers\n\n");
 	printf("Usage:\t[-a listen address]\n");
-	printf("\t[-p listen port (default: %s)]\n", DEFAULT_PORT_STR);
+	printf("\t[-p listen port of the first device, the next ones count up (default: %s)]\n", DEFAULT_PORT_STR);
 	printf("\t[-f frequency to tune to [Hz]]\n");
 	printf("\t[-g gain (default: 0 for auto)]\n");
 	printf("\t[-s samplerate in Hz (default: %d Hz)]\n", DEFAULT_SAMPLE_RATE_HZ);
 	printf("\t[-b number of buffers (default: 15, set by library)]\n");
-	printf("\t[-n max number of linked list buffers to keep (default: %d)]\n", DEFAULT_MAX_NUM_BUFFERS);
-	printf("\t[-d device index (default: 0)]\n");
+	printf("\t[-n max number of buffers to keep, oldest dropped when full (default: %d)]\n", DEFAULT_MAX_NUM_BUFFERS);
+	printf("\t[-m max number of simultaneous clients per device (default: %d)]\n", DEFAULT_MAX_CLIENTS);
+	printf("\t[-l lagging client policy: drop, skip (default: drop)]\n");
+	printf("\t[-c control policy: all, first, last (default: all)]\n");
+	printf("\t    first/last: only the oldest/newest client may send commands\n");
+	printf("\t[-u stream samples of the first device as UDP datagrams to host:port,\n"
+	       "\t    unicast or multicast]\n");
+	printf("\t[-U UDP payload bytes per datagram (default: %d)]\n", DEFAULT_UDP_PAYLOAD);
+	printf("\t[-t multicast TTL (default: 1)]\n");
+	printf("\t[-k keep streaming into the ring while no client is connected]\n");
+	printf("\t[-r replay the last n ms to new clients, implies -k (default: 0)]\n");
+	printf("\t[-S print network stats every n seconds (default: off)]\n");
+#ifdef __linux__
+	printf("\t[-Z send large batches with MSG_ZEROCOPY]\n");
+#endif
+	printf("\t[-F serve a cu8 file, looped, or 'tone' instead of a dongle, paced at -s]\n");
+	printf("\t[-d device index or serial, repeat to serve up to %d devices (default: 0)]\n", MAX_DEVICES);
 	printf("\t[-P ppm_error (default: 0)]\n");
 	printf("\t[-T enable bias-T on GPIO PIN 0 (works for rtl-sdr.com v3/v4 dongles)]\n");
 	printf("\t[-D enable direct sampling (default: off)]\n");
@@ -134,10 +482,12 @@ int gettimeofday(struct timeval *tv, void* ignored)
 BOOL WINAPI
 sighandler(int signum)
 {
+	int i;
 	if (CTRL_C_EVENT == signum) {
 		fprintf(stderr, "Signal caught, exiting!\n");
 		do_exit = 1;
-		rtlsdr_cancel_async(dev);
+		for (i = 0; i < device_count; i++)
+			rtlsdr_cancel_async(devices[i].dev);
 		return TRUE;
 	}
 	return FALSE;
@@ -145,362 +495,1854 @@ sighandler(int signum)
 #else
 static void sighandler(int signum)
 {
+	int i;
 	signal(SIGPIPE, SIG_IGN);
 	fprintf(stderr, "Signal caught, exiting!\n");
-	rtlsdr_cancel_async(dev);
+	for (i = 0; i < device_count; i++)
+		rtlsdr_cancel_async(devices[i].dev);
 	do_exit = 1;
 }
 #endif
 
-void rtlsdr_callback(unsigned char *buf, uint32_t len, void *ctx)
+static double now_sec(void)
 {
-	if(!do_exit) {
-		struct llist *rpt = (struct llist*)malloc(sizeof(struct llist));
-		rpt->data = (char*)malloc(len);
-		memcpy(rpt->data, buf, len);
-		rpt->len = len;
-		rpt->next = NULL;
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1e6;
+}
 
-		pthread_mutex_lock(&ll_mutex);
+static uint64_t now_ns(void)
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return (uint64_t)tv.tv_sec * 1000000000ULL + (uint64_t)tv.tv_usec * 1000;
+}
+
+static void set_nonblocking(SOCKET s, int on)
+{
+#ifdef _WIN32
+	u_long blockmode = on;
+	ioctlsocket(s, FIONBIO, &blockmode);
+#else
+	int flags = fcntl(s, F_GETFL, 0);
+	fcntl(s, F_SETFL, on ? flags | O_NONBLOCK : flags & ~O_NONBLOCK);
+#endif
+}
 
-		if (ll_buffers == NULL) {
-			ll_buffers = rpt;
-		} else {
-			struct llist *cur = ll_buffers;
-			int num_queued = 0;
+static int ring_init(struct sample_ring *r, unsigned int size, char *arena)
+/* arena holds size blocks and belongs to the caller */
+{
+	unsigned int i;
+	memset(r, 0, sizeof(*r));
+	r->arena = arena;
+	r->slots = calloc(size, sizeof(struct ring_slot));
+	if (!r->slots)
+		return -1;
+	r->size = size;
+	for (i = 0; i < size; i++) {
+		r->slots[i].data = r->arena + (size_t)i * DEFAULT_BUF_LENGTH;
+		r->slots[i].seq = RING_WRITING;
+	}
+	return 0;
+}
 
-			while (cur->next != NULL) {
-				cur = cur->next;
-				num_queued++;
-			}
+static void ring_free(struct sample_ring *r)
+{
+	free(r->slots);
+}
 
-			if(llbuf_num && llbuf_num == num_queued-2){
-				struct llist *curelem;
+static void ring_unpin(struct sample_ring *r, uint64_t first, uint64_t last)
+/* called with ll_mutex held */
+{
+	uint64_t seq;
+	for (seq = first; seq <= last; seq++)
+		r->slots[seq % r->size].pins--;
+}
 
-				free(ll_buffers->data);
-				curelem = ll_buffers->next;
-				free(ll_buffers);
-				ll_buffers = curelem;
-			}
+static float u8_to_float[256];
+
+static void dsp_tables_init(void)
+{
+	int i;
+	for (i = 0; i < 256; i++)
+		u8_to_float[i] = (i - 127.5f) / 127.5f;
+}
+
+static int clamp(long v, long lo, long hi)
+{
+	return v < lo ? lo : v > hi ? hi : v;
+}
 
-			cur->next = rpt;
 
-			if (num_queued > global_numq)
-				printf("ll+, now %d\n", num_queued);
-			else if (num_queued < global_numq)
-				printf("ll-, now %d\n", num_queued);
+static int loop_wake_init(void)
+/* a self-pipe, or a loopback socket where pipes cannot be polled */
+{
+#ifdef _WIN32
+	struct sockaddr_in sa;
+	int len = sizeof(sa);
+
+	loop.wake_rx = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+	if (loop.wake_rx == INVALID_SOCKET)
+		return -1;
+	memset(&sa, 0, sizeof(sa));
+	sa.sin_family = AF_INET;
+	sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (bind(loop.wake_rx, (struct sockaddr *)&sa, sizeof(sa)) ||
+	    getsockname(loop.wake_rx, (struct sockaddr *)&sa, &len) ||
+	    connect(loop.wake_rx, (struct sockaddr *)&sa, sizeof(sa)))
+		return -1;
+	loop.wake_tx = loop.wake_rx;
+#else
+	int fds[2];
 
-			global_numq = num_queued;
-		}
-		pthread_cond_signal(&cond);
+	if (pipe(fds) < 0)
+		return -1;
+	loop.wake_rx = fds[0];
+	loop.wake_tx = fds[1];
+	set_nonblocking(loop.wake_tx, 1);
+#endif
+	set_nonblocking(loop.wake_rx, 1);
+	return 0;
+}
+
+static void loop_wake(void)
+{
+	char b = 0;
+#ifdef _WIN32
+	send(loop.wake_tx, &b, 1, 0);
+#else
+	if (write(loop.wake_tx, &b, 1) < 0) {
+		/* pipe full, the loop is awake anyway */
+	}
+#endif
+}
+
+static void loop_wake_drain(void)
+{
+	char b[64];
+#ifdef _WIN32
+	while (recv(loop.wake_rx, b, sizeof(b), 0) > 0);
+#else
+	while (read(loop.wake_rx, b, sizeof(b)) > 0);
+#endif
+	pthread_mutex_lock(&ll_mutex);
+	loop.wake_pending = 0;
+	pthread_mutex_unlock(&ll_mutex);
+}
+
+static int loop_init(void)
+{
+#ifdef __linux__
+	loop.epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (loop.epfd < 0)
+		return -1;
+#else
+	loop.fds = calloc(device_count * (max_clients + 1) + 2, sizeof(struct pollfd));
+	loop.tags = calloc(device_count * (max_clients + 1) + 2, sizeof(void *));
+	if (!loop.fds || !loop.tags)
+		return -1;
+#endif
+	return loop_wake_init();
+}
+
+static void loop_add(SOCKET s, void *tag)
+{
+#ifdef __linux__
+	struct epoll_event ev;
+	ev.events = EPOLLIN;
+	ev.data.ptr = tag;
+	epoll_ctl(loop.epfd, EPOLL_CTL_ADD, s, &ev);
+#else
+	/* poll() gets the whole set on every wait */
+	(void)s;
+	(void)tag;
+#endif
+}
+
+static void loop_del(SOCKET s)
+{
+#ifdef __linux__
+	struct epoll_event ev;
+	epoll_ctl(loop.epfd, EPOLL_CTL_DEL, s, &ev);
+#else
+	(void)s;
+#endif
+}
+
+static void loop_mod(SOCKET s, void *tag, int read, int write)
+{
+#ifdef __linux__
+	struct epoll_event ev;
+	ev.events = (read ? EPOLLIN : 0) | (write ? EPOLLOUT : 0);
+	ev.data.ptr = tag;
+	epoll_ctl(loop.epfd, EPOLL_CTL_MOD, s, &ev);
+#else
+	(void)s;
+	(void)tag;
+	(void)read;
+	(void)write;
+#endif
+}
+
+static void loop_want_write(struct client *c, int on)
+{
+	if (c->want_write == on)
+		return;
+	c->want_write = on;
+	loop_mod(c->s, c, 1, on);
+}
+
+static int loop_wait(struct loop_event *out, int max, int timeout_ms)
+{
+	int i, n;
+#ifdef __linux__
+	struct epoll_event ev[LOOP_EVENTS];
+
+	if (max > LOOP_EVENTS)
+		max = LOOP_EVENTS;
+	n = epoll_wait(loop.epfd, ev, max, timeout_ms);
+	stats.waits++;
+	for (i = 0; i < n; i++) {
+		out[i].tag = ev[i].data.ptr;
+		out[i].flags = 0;
+		if (ev[i].events & (EPOLLIN | EPOLLHUP))
+			out[i].flags |= EV_READ;
+		if (ev[i].events & EPOLLOUT)
+			out[i].flags |= EV_WRITE;
+		if (ev[i].events & EPOLLERR)
+			out[i].flags |= EV_ERROR;
+	}
+	return n;
+#else
+	struct client *c;
+	int r;
+
+	n = 0;
+	for (i = 0; i < device_count; i++) {
+		loop.fds[n].fd = devices[i].listen;
+		loop.fds[n].events = POLLIN;
+		loop.tags[n++] = &devices[i].listen;
+	}
+	loop.fds[n].fd = loop.wake_rx;
+	loop.fds[n].events = POLLIN;
+	loop.tags[n++] = &loop.wake_rx;
+	if (udp_enabled) {
+		loop.fds[n].fd = udp.s;
+		loop.fds[n].events = udp.want_write ? POLLOUT : 0;
+		loop.tags[n++] = &udp;
+	}
+	for (c = clients; c; c = c->next) {
+		loop.fds[n].fd = c->s;
+		loop.fds[n].events = POLLIN | (c->want_write ? POLLOUT : 0);
+		loop.tags[n++] = c;
+	}
+	r = poll(loop.fds, n, timeout_ms);
+	stats.waits++;
+	if (r <= 0)
+		return r;
+	r = 0;
+	for (i = 0; i < n && r < max; i++) {
+		if (!loop.fds[i].revents)
+			continue;
+		out[r].tag = loop.tags[i];
+		out[r].flags = 0;
+		if (loop.fds[i].revents & (POLLIN | POLLHUP))
+			out[r].flags |= EV_READ;
+		if (loop.fds[i].revents & POLLOUT)
+			out[r].flags |= EV_WRITE;
+		if (loop.fds[i].revents & (POLLERR | POLLNVAL))
+			out[r].flags |= EV_ERROR;
+		r++;
+	}
+	return r;
+#endif
+}
+
+void rtlsdr_callback(unsigned char *buf, uint32_t len, void *ctx)
+{
+	struct device *d = ctx;
+	struct sample_ring *ring = &d->ring;
+	struct ring_slot *slot;
+	uint64_t seq;
+	int wake;
+
+	if (do_exit || len > DEFAULT_BUF_LENGTH)
+		return;
+
+	pthread_mutex_lock(&ll_mutex);
+	seq = ring->wseq;
+	slot = &ring->slots[seq % ring->size];
+	if (slot->pins) {
+		/* a client a whole ring behind is still sending from this slot */
+		ring->busy++;
+		RTLSDR_TRACE_INSTANT("ring_busy", ring->busy);
+		ring->samples += len / 2;
 		pthread_mutex_unlock(&ll_mutex);
+		return;
 	}
+	slot->seq = RING_WRITING;
+	pthread_mutex_unlock(&ll_mutex);
+
+	memcpy(slot->data, buf, len);
+
+	pthread_mutex_lock(&ll_mutex);
+	slot->len = len;
+	slot->seq = seq;
+	slot->sample = ring->samples;
+	slot->time_ns = now_ns();
+	ring->samples += len / 2;
+	ring->wseq = seq + 1;
+	ring->blocks++;
+	/* one wakeup until the loop has caught up */
+	wake = !loop.wake_pending;
+	loop.wake_pending = 1;
+	pthread_mutex_unlock(&ll_mutex);
+
+	if (wake)
+		loop_wake();
+}
+
+static int client_lagging(struct client *c)
+/* called with ll_mutex held, applies the lag policy */
+{
+	struct sample_ring *ring = &c->d->ring;
+	struct ring_slot *slot = &ring->slots[c->cursor % ring->size];
+	/* blocks handed to the kernel cannot be skipped, only given back by closing */
+	if (c->zc_tail != c->zc_head &&
+	    c->zc[c->zc_tail % ZEROCOPY_PENDING].first + ring->size <= ring->wseq + LAG_MARGIN)
+		return 1;
+	if (ring->wseq - c->cursor + LAG_MARGIN <= ring->size && slot->seq == c->cursor)
+		return 0;
+	if (lag_policy == LAG_DROP)
+		return 1;
+	c->skipped += ring->wseq - 1 - c->cursor;
+	c->cursor = ring->wseq - 1;
+	/* skipped mid-block, keep I and Q aligned */
+	if (c->offset & 1)
+		c->pad_pending = 1;
+	c->offset = 0;
+	return 0;
 }
 
-static void *tcp_worker(void *arg)
+static int send_batch(struct client *c, io_buf *bufs, int n, int zc)
+/* non-blocking, returns bytes sent, 0 if the socket is full, -1 on error */
 {
-	struct llist *curelem,*prev;
-	int bytesleft,bytessent, index;
-	struct timeval tv= {1,0};
-	struct timespec ts;
-	struct timeval tp;
-	fd_set writefds;
-	int r = 0;
+#ifdef _WIN32
+	DWORD sent = 0;
 
-	while(1) {
-		if(do_exit)
-			pthread_exit(0);
+	c->send_calls++;
+	stats.send_calls++;
+	if (WSASend(c->s, bufs, n, &sent, 0, NULL, NULL) == SOCKET_ERROR)
+		return SOCKET_WOULDBLOCK() ? 0 : -1;
+	return (int)sent;
+#else
+	struct msghdr msg;
+	ssize_t r;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = bufs;
+	msg.msg_iovlen = n;
+	c->send_calls++;
+	stats.send_calls++;
+#ifdef __linux__
+	if (zc) {
+		r = sendmsg(c->s, &msg, MSG_NOSIGNAL | MSG_ZEROCOPY);
+		if (r >= 0 || errno != ENOBUFS)
+			goto done;
+		/* out of locked memory, copy this one */
+		c->send_calls++;
+		stats.send_calls++;
+	}
+#else
+	(void)zc;
+#endif
+	r = sendmsg(c->s, &msg, MSG_NOSIGNAL);
+#ifdef __linux__
+done:
+#endif
+	if (r < 0)
+		return SOCKET_WOULDBLOCK() ? 0 : -1;
+	return (int)r;
+#endif
+}
 
+static int client_flush_raw(struct client *c)
+/* sends straight from the ring, returns like client_flush() */
+{
+	struct sample_ring *ring = &c->d->ring;
+	io_buf bufs[BATCH_BLOCKS];
+	struct ring_slot *slot;
+	uint64_t seq, last;
+	uint32_t offset;
+	size_t total, left;
+	int n, r, zc;
+	char pad = 127;
+
+	while (1) {
 		pthread_mutex_lock(&ll_mutex);
-		gettimeofday(&tp, NULL);
-		ts.tv_sec  = tp.tv_sec+5;
-		ts.tv_nsec = tp.tv_usec * 1000;
-		r = pthread_cond_timedwait(&cond, &ll_mutex, &ts);
-		if(r == ETIMEDOUT) {
+		if (c->cursor == ring->wseq) {
+			pthread_mutex_unlock(&ll_mutex);
+			return 0;
+		}
+		if (client_lagging(c)) {
+			pthread_mutex_unlock(&ll_mutex);
+			printf("client %d lagging, dropped\n", c->id);
+			return -1;
+		}
+		RTLSDR_TRACE_COUNTER("client_lag", ring->wseq - c->cursor);
+		if (c->pad_pending) {
+			pthread_mutex_unlock(&ll_mutex);
+			IO_BUF_SET(&bufs[0], &pad, 1);
+			r = send_batch(c, bufs, 1, 0);
+			if (r <= 0)
+				return r < 0 ? -1 : 1;
+			c->pad_pending = 0;
+			continue;
+		}
+		if (c->reconfigure && !c->offset) {
 			pthread_mutex_unlock(&ll_mutex);
-			printf("worker cond timeout\n");
-			sighandler(0);
-			pthread_exit(NULL);
+			return 2;
 		}
 
-		curelem = ll_buffers;
-		ll_buffers = 0;
+		/* pin a run of blocks, the socket copies or maps them unlocked */
+		total = 0;
+		for (n = 0, seq = c->cursor; seq < ring->wseq && n < BATCH_BLOCKS; n++, seq++) {
+			/* only finish the current block before switching formats */
+			if (n && c->reconfigure)
+				break;
+			slot = &ring->slots[seq % ring->size];
+			offset = n ? 0 : c->offset;
+			IO_BUF_SET(&bufs[n], slot->data + offset, slot->len - offset);
+			total += slot->len - offset;
+			slot->pins++;
+		}
 		pthread_mutex_unlock(&ll_mutex);
 
-		while(curelem != 0) {
-			bytesleft = curelem->len;
-			index = 0;
-			bytessent = 0;
-			while(bytesleft > 0) {
-				FD_ZERO(&writefds);
-				FD_SET(s, &writefds);
-				tv.tv_sec = 1;
-				tv.tv_usec = 0;
-				r = select(s+1, NULL, &writefds, NULL, &tv);
-				if(r) {
-					bytessent = send(s,  &curelem->data[index], bytesleft, 0);
-					bytesleft -= bytessent;
-					index += bytessent;
-				}
-				if(bytessent == SOCKET_ERROR || do_exit) {
-						printf("worker socket bye\n");
-						sighandler(0);
-						pthread_exit(NULL);
+		zc = c->zerocopy && total >= ZEROCOPY_MIN &&
+		     c->zc_head - c->zc_tail < ZEROCOPY_PENDING;
+		RTLSDR_TRACE_BEGIN("send");
+		r = send_batch(c, bufs, n, zc);
+		RTLSDR_TRACE_END("send");
+
+		pthread_mutex_lock(&ll_mutex);
+		last = c->cursor + n - 1;
+		if (r > 0) {
+			c->bytes += r;
+			c->d->bytes += r;
+			stats.bytes += r;
+			/* advance through what went out */
+			left = r;
+			while (left) {
+				slot = &ring->slots[c->cursor % ring->size];
+				if (left < slot->len - c->offset) {
+					c->offset += left;
+					break;
 				}
+				left -= slot->len - c->offset;
+				c->offset = 0;
+				c->cursor++;
+				c->sent++;
 			}
-			prev = curelem;
-			curelem = curelem->next;
-			free(prev->data);
-			free(prev);
 		}
+#ifdef __linux__
+		if (r > 0 && zc) {
+			/* keep the blocks the kernel still maps until it reports back */
+			struct zc_send *z = &c->zc[c->zc_head % ZEROCOPY_PENDING];
+			z->first = last + 1 - n;
+			z->last = c->offset ? c->cursor : c->cursor - 1;
+			z->done = 0;
+			c->zc_head++;
+			stats.zc_sends++;
+			if (z->last < last)
+				ring_unpin(ring, z->last + 1, last);
+		} else
+#endif
+		ring_unpin(ring, last + 1 - n, last);
+		pthread_mutex_unlock(&ll_mutex);
+
+		if (r < 0)
+			return -1;
+		if ((size_t)r < total)
+			return 1;
 	}
 }
 
-static int set_gain_by_index(rtlsdr_dev_t *_dev, unsigned int index)
+static void put_be(unsigned char *p, uint64_t v, int bytes)
 {
-	int res = 0;
-	int* gains;
-	int count = rtlsdr_get_tuner_gains(_dev, NULL);
+	while (bytes--) {
+		p[bytes] = v & 0xff;
+		v >>= 8;
+	}
+}
 
-	if (count > 0 && (unsigned int)count > index) {
-		gains = malloc(sizeof(int) * count);
-		count = rtlsdr_get_tuner_gains(_dev, gains);
+static size_t frame_header(char *p, int type, size_t len)
+{
+	p[0] = 'R';
+	p[1] = 'F';
+	p[2] = (char)type;
+	p[3] = 0;
+	put_be((unsigned char *)p + 4, len, 4);
+	return FRAME_HEADER_LEN;
+}
 
-		res = rtlsdr_set_tuner_gain(_dev, gains[index]);
+static struct fft_plan *fft_plans = NULL;
 
-		free(gains);
-	}
+static void fft_plan_put(struct fft_plan *p)
+{
+	struct fft_plan **pp;
+
+	if (!p || --p->refs)
+		return;
+	for (pp = &fft_plans; *pp != p; pp = &(*pp)->next);
+	*pp = p->next;
+	free(p->rev);
+	free(p->cos_tab);
+	free(p->sin_tab);
+	free(p->window);
+	free(p);
+}
 
-	return res;
+static struct fft_plan *fft_plan_get(int size)
+{
+	struct fft_plan *p;
+	double sum = 0;
+	int i, j, bits;
+
+	for (p = fft_plans; p; p = p->next)
+		if (p->size == size) {
+			p->refs++;
+			return p;
+		}
+	p = calloc(1, sizeof(struct fft_plan));
+	if (!p)
+		return NULL;
+	p->size = size;
+	p->refs = 1;
+	p->next = fft_plans;
+	fft_plans = p;
+	p->rev = malloc(size * sizeof(int));
+	p->cos_tab = malloc(size / 2 * sizeof(float));
+	p->sin_tab = malloc(size / 2 * sizeof(float));
+	p->window = malloc(size * sizeof(float));
+	if (!p->rev || !p->cos_tab || !p->sin_tab || !p->window) {
+		fft_plan_put(p);
+		return NULL;
+	}
+	for (bits = 0; (1 << bits) < size; bits++);
+	for (i = 0; i < size; i++) {
+		for (j = 0, p->rev[i] = 0; j < bits; j++)
+			p->rev[i] |= ((i >> j) & 1) << (bits - 1 - j);
+		/* Hann */
+		p->window[i] = (float)(0.5 - 0.5 * cos(2 * M_PI * i / size));
+		sum += p->window[i];
+	}
+	for (i = 0; i < size / 2; i++) {
+		p->cos_tab[i] = (float)cos(2 * M_PI * i / size);
+		p->sin_tab[i] = (float)-sin(2 * M_PI * i / size);
+	}
+	p->gain = (float)(sum * sum);
+	return p;
 }
 
-#ifdef _WIN32
-#define __attribute__(x)
-#pragma pack(push, 1)
-#endif
-struct command{
-	unsigned char cmd;
-	unsigned int param;
-}__attribute__((packed));
-#ifdef _WIN32
-#pragma pack(pop)
-#endif
-static void *command_worker(void *arg)
-{
-	int left, received = 0;
-	fd_set readfds;
-	struct command cmd={0, 0};
-	struct timeval tv= {1, 0};
-	int r = 0;
-	uint32_t tmp;
-
-	while(1) {
-		left=sizeof(cmd);
-		while(left >0) {
-			FD_ZERO(&readfds);
-			FD_SET(s, &readfds);
-			tv.tv_sec = 1;
-			tv.tv_usec = 0;
-			r = select(s+1, &readfds, NULL, NULL, &tv);
-			if(r) {
-				received = recv(s, (char*)&cmd+(sizeof(cmd)-left), left, 0);
-				left -= received;
-			}
-			if(received == SOCKET_ERROR || do_exit) {
-				printf("comm recv bye\n");
-				sighandler(0);
-				pthread_exit(NULL);
+static void fft_run(const struct fft_plan *p, float *re, float *im)
+/* in place, radix 2 */
+{
+	int i, j, k, len, half, step;
+	float t, tr, ti, wr, wi;
+
+	for (i = 0; i < p->size; i++) {
+		j = p->rev[i];
+		if (j <= i)
+			continue;
+		t = re[i]; re[i] = re[j]; re[j] = t;
+		t = im[i]; im[i] = im[j]; im[j] = t;
+	}
+	for (len = 2; len <= p->size; len <<= 1) {
+		half = len >> 1;
+		step = p->size / len;
+		for (i = 0; i < p->size; i += len) {
+			for (k = 0; k < half; k++) {
+				wr = p->cos_tab[k * step];
+				wi = p->sin_tab[k * step];
+				j = i + k + half;
+				tr = re[j] * wr - im[j] * wi;
+				ti = re[j] * wi + im[j] * wr;
+				re[j] = re[i + k] - tr;
+				im[j] = im[i + k] - ti;
+				re[i + k] += tr;
+				im[i + k] += ti;
 			}
 		}
-		switch(cmd.cmd) {
-		case 0x01:
-			printf("set freq %d\n", ntohl(cmd.param));
-			rtlsdr_set_center_freq(dev,ntohl(cmd.param));
-			break;
-		case 0x02:
-			printf("set sample rate %d\n", ntohl(cmd.param));
-			rtlsdr_set_sample_rate(dev, ntohl(cmd.param));
-			break;
-		case 0x03:
-			printf("set gain mode %d\n", ntohl(cmd.param));
-			rtlsdr_set_tuner_gain_mode(dev, ntohl(cmd.param));
-			break;
-		case 0x04:
-			printf("set gain %d\n", ntohl(cmd.param));
-			rtlsdr_set_tuner_gain(dev, ntohl(cmd.param));
-			break;
-		case 0x05:
-			printf("set freq correction %d\n", ntohl(cmd.param));
-			rtlsdr_set_freq_correction(dev, ntohl(cmd.param));
-			break;
-		case 0x06:
-			tmp = ntohl(cmd.param);
-			printf("set if stage %d gain %d\n", tmp >> 16, (short)(tmp & 0xffff));
-			rtlsdr_set_tuner_if_gain(dev, tmp >> 16, (short)(tmp & 0xffff));
-			break;
-		case 0x07:
-			printf("set test mode %d\n", ntohl(cmd.param));
-			rtlsdr_set_testmode(dev, ntohl(cmd.param));
-			break;
-		case 0x08:
-			printf("set agc mode %d\n", ntohl(cmd.param));
-			rtlsdr_set_agc_mode(dev, ntohl(cmd.param));
-			break;
-		case 0x09:
-			printf("set direct sampling %d\n", ntohl(cmd.param));
-			rtlsdr_set_direct_sampling(dev, ntohl(cmd.param));
-			break;
-		case 0x0a:
-			printf("set offset tuning %d\n", ntohl(cmd.param));
-			rtlsdr_set_offset_tuning(dev, ntohl(cmd.param));
-			break;
-		case 0x0b:
-			printf("set rtl xtal %d\n", ntohl(cmd.param));
-			rtlsdr_set_xtal_freq(dev, ntohl(cmd.param), 0);
-			break;
-		case 0x0c:
-			printf("set tuner xtal %d\n", ntohl(cmd.param));
-			rtlsdr_set_xtal_freq(dev, 0, ntohl(cmd.param));
-			break;
-		case 0x0d:
-			printf("set tuner gain by index %d\n", ntohl(cmd.param));
-			set_gain_by_index(dev, ntohl(cmd.param));
-			break;
-		case 0x0e:
-			printf("set bias tee %d\n", ntohl(cmd.param));
-			rtlsdr_set_bias_tee(dev, (int)ntohl(cmd.param));
-			break;
-		default:
-			break;
-		}
-		cmd.cmd = 0xff;
 	}
 }
 
-int main(int argc, char **argv)
+static void spectrum_free(struct spectrum *sp)
 {
-	int r, opt, i;
-	char *addr = "127.0.0.1";
-	const char *port = DEFAULT_PORT_STR;
-	uint32_t frequency = 100000000, samp_rate = DEFAULT_SAMPLE_RATE_HZ;
-	struct sockaddr_storage local, remote;
-	struct addrinfo *ai;
-	struct addrinfo *aiHead;
-	struct addrinfo  hints = { 0 };
-	char hostinfo[NI_MAXHOST];
-	char portinfo[NI_MAXSERV];
-	char remhostinfo[NI_MAXHOST];
-	char remportinfo[NI_MAXSERV];
-	int aiErr;
-	uint32_t buf_num = 0;
-	int dev_index = 0;
-	int dev_given = 0;
-	int gain = 0;
-	int ppm_error = 0;
-	int direct_sampling = 0;
-	struct llist *curelem,*prev;
-	pthread_attr_t attr;
-	void *status;
-	struct timeval tv = {1,0};
-	struct linger ling = {1,0};
-	SOCKET listensocket = 0;
-	socklen_t rlen;
-	fd_set readfds;
-	u_long blockmode = 1;
-	dongle_info_t dongle_info;
-#ifdef _WIN32
-	WSADATA wsd;
-	i = WSAStartup(MAKEWORD(2,2), &wsd);
-#else
-	struct sigaction sigact, sigign;
-#endif
+	if (!sp)
+		return;
+	fft_plan_put(sp->plan);
+	free(sp->re);
+	free(sp->im);
+	free(sp->acc);
+	free(sp);
+}
 
-	while ((opt = getopt(argc, argv, "a:p:f:g:s:b:n:d:P:TD")) != -1) {
-		switch (opt) {
-		case 'd':
-			dev_index = verbose_device_search(optarg);
-			dev_given = 1;
-			break;
-		case 'f':
-			frequency = (uint32_t)atofs(optarg);
-			break;
-		case 'g':
-			gain = (int)(atof(optarg) * 10); /* tenths of a dB */
-			break;
-		case 's':
-			samp_rate = (uint32_t)atofs(optarg);
-			break;
-		case 'a':
-		        addr = strdup(optarg);
-			break;
-		case 'p':
-		        port = strdup(optarg);
-			break;
-		case 'b':
-			buf_num = atoi(optarg);
-			break;
-		case 'n':
-			llbuf_num = atoi(optarg);
-			break;
-		case 'P':
-			ppm_error = atoi(optarg);
-			break;
-		case 'T':
-			enable_biastee = 1;
-			break;
-		case 'D':
-			direct_sampling = 1;
-			break;
-		default:
-			usage();
+static struct spectrum *spectrum_new(int size, int rate, int floor_db, int step, uint32_t in_rate)
+{
+	struct spectrum *sp = calloc(1, sizeof(struct spectrum));
+
+	if (!sp)
+		return NULL;
+	sp->plan = fft_plan_get(size);
+	sp->re = malloc(size * sizeof(float));
+	sp->im = malloc(size * sizeof(float));
+	sp->acc = calloc(size, sizeof(float));
+	if (!sp->plan || !sp->re || !sp->im || !sp->acc) {
+		spectrum_free(sp);
+		return NULL;
+	}
+	sp->rate = in_rate;
+	sp->interval = in_rate / rate;
+	sp->floor_db = floor_db;
+	sp->step = step;
+	return sp;
+}
+
+static size_t spectrum_frame_len(const struct spectrum *sp)
+{
+	return FRAME_HEADER_LEN + SPEC_HEADER_LEN +
+	       sp->plan->size * (sp->step ? 1 : sizeof(float));
+}
+
+static size_t spectrum_worst(const struct spectrum *sp, uint32_t len)
+{
+	uint64_t per = sp->interval > (uint64_t)sp->plan->size ?
+		       sp->interval : (uint64_t)sp->plan->size;
+	return (len / 2 / per + 1) * spectrum_frame_len(sp);
+}
+
+static size_t spectrum_frame(struct spectrum *sp, char *out)
+{
+	int size = sp->plan->size;
+	float scale = 1.0f / (sp->ffts * sp->plan->gain);
+	unsigned char *p = (unsigned char *)out + FRAME_HEADER_LEN;
+	float db;
+	int k;
+
+	frame_header(out, FRAME_SPECTRUM, spectrum_frame_len(sp) - FRAME_HEADER_LEN);
+	put_be(p, sp->first, 8);
+	put_be(p + 8, sp->rate, 4);
+	put_be(p + 12, sp->ffts > 0xffff ? 0xffff : sp->ffts, 2);
+	put_be(p + 14, (uint16_t)sp->floor_db, 2);
+	put_be(p + 16, sp->step, 2);
+	put_be(p + 18, 0, 2);
+	p += SPEC_HEADER_LEN;
+	for (k = 0; k < size; k++) {
+		/* negative frequencies first */
+		db = 10.0f * log10f(sp->acc[(k + size / 2) & (size - 1)] * scale + 1e-20f);
+		if (sp->step)
+			p[k] = (unsigned char)clamp(lrintf((db - sp->floor_db) * 100.0f / sp->step), 0, 255);
+		else
+			memcpy(p + k * sizeof(float), &db, sizeof(float));
+	}
+	memset(sp->acc, 0, size * sizeof(float));
+	sp->ffts = 0;
+	return spectrum_frame_len(sp);
+}
+
+static size_t spectrum_process(struct spectrum *sp, const struct ring_slot *slot, char *out)
+{
+	const struct fft_plan *p = sp->plan;
+	const unsigned char *buf = (const unsigned char *)slot->data;
+	size_t o = 0;
+	uint32_t i;
+	int k;
+
+	for (i = 0; i + 1 < slot->len; i += 2) {
+		if (!sp->fill && !sp->ffts)
+			sp->first = slot->sample + i / 2;
+		sp->re[sp->fill] = u8_to_float[buf[i]] * p->window[sp->fill];
+		sp->im[sp->fill] = u8_to_float[buf[i + 1]] * p->window[sp->fill];
+		if (++sp->fill < p->size)
+			continue;
+		sp->fill = 0;
+		fft_run(p, sp->re, sp->im);
+		for (k = 0; k < p->size; k++)
+			sp->acc[k] += sp->re[k] * sp->re[k] + sp->im[k] * sp->im[k];
+		sp->ffts++;
+		sp->since += p->size;
+		if (sp->since < sp->interval)
+			continue;
+		sp->since = sp->since >= 2 * sp->interval ? 0 : sp->since - sp->interval;
+		o += spectrum_frame(sp, out + o);
+	}
+	return o;
+}
+
+static size_t client_convert(struct client *c, struct ring_slot *slot, char *out)
+/* one block as the client wants it, framed or not */
+{
+	size_t head = c->framed ? FRAME_HEADER_LEN : 0;
+	size_t len;
+
+	if (c->spec)
+		return spectrum_process(c->spec, slot, out);
+	if (c->ddc)
+		len = iq_ddc_process(c->ddc, (uint8_t *)slot->data, slot->len, (uint8_t *)out + head);
+	else {
+		memcpy(out + head, slot->data, slot->len);
+		len = slot->len;
+	}
+	if (head)
+		frame_header(out, FRAME_SAMPLES, len);
+	return head + len;
+}
+
+static int client_flush_buffered(struct client *c)
+/* converts blocks into the client buffer and sends from there */
+{
+	struct sample_ring *ring = &c->d->ring;
+	struct ring_slot *slot;
+	size_t worst;
+	io_buf buf;
+	int r;
+
+	while (1) {
+		if (c->out_pos == c->out_len)
+			c->out_pos = c->out_len = 0;
+		while (!c->reconfigure && !c->muted) {
+			pthread_mutex_lock(&ll_mutex);
+			if (c->cursor == ring->wseq) {
+				pthread_mutex_unlock(&ll_mutex);
+				break;
+			}
+			if (client_lagging(c)) {
+				pthread_mutex_unlock(&ll_mutex);
+				printf("client %d lagging, dropped\n", c->id);
+				return -1;
+			}
+			slot = &ring->slots[c->cursor % ring->size];
+			if (c->spec)
+				worst = spectrum_worst(c->spec, slot->len);
+			else
+				worst = c->ddc ? iq_ddc_worst(c->ddc, slot->len) : slot->len;
+			if (c->out_len + FRAME_HEADER_LEN + worst > OUT_BUF_LENGTH) {
+				pthread_mutex_unlock(&ll_mutex);
+				break;
+			}
+			slot->pins++;
+			pthread_mutex_unlock(&ll_mutex);
+
+			c->out_len += client_convert(c, slot, c->out + c->out_len);
+
+			pthread_mutex_lock(&ll_mutex);
+			slot->pins--;
+			c->cursor++;
+			c->sent++;
+			pthread_mutex_unlock(&ll_mutex);
+		}
+		if (c->out_pos == c->out_len)
+			return c->reconfigure ? 2 : 0;
+
+		IO_BUF_SET(&buf, c->out + c->out_pos, c->out_len - c->out_pos);
+		r = send_batch(c, &buf, 1, 0);
+		if (r < 0)
+			return -1;
+		c->out_pos += r;
+		c->bytes += r;
+		c->d->bytes += r;
+		stats.bytes += r;
+		if (c->out_pos < c->out_len)
+			return 1;
+	}
+}
+
+static void client_reconfigure(struct client *c)
+{
+	c->reconfigure = 0;
+	c->muted = c->mute;
+	c->framed = c->frame;
+	if (c->compress && c->format != IQ_FMT_CU8) {
+		printf("client %d: compression needs cu8, sending %s uncompressed\n",
+		       c->id, iq_format_name[c->format]);
+		c->compress = 0;
+	}
+	iq_ddc_free(c->ddc);
+	c->ddc = NULL;
+	spectrum_free(c->spec);
+	c->spec = NULL;
+	if (c->spec_size) {
+		/* spectra come from the whole band and need frames around them */
+		c->spec = spectrum_new(c->spec_size, c->spec_rate, c->spec_floor,
+				       c->spec_step, c->d->sample_rate);
+		c->framed = 1;
+	} else if (c->ddc_offset || (c->ddc_rate && c->ddc_rate < c->d->sample_rate) ||
+		   c->format != IQ_FMT_CU8 || c->compress)
+		/* otherwise the client takes the raw stream */
+		c->ddc = iq_ddc_new(c->ddc_offset, c->d->sample_rate, c->ddc_rate, c->format,
+				    c->compress, DEFAULT_BUF_LENGTH);
+	if ((c->ddc || c->framed) && !c->out)
+		c->out = malloc(OUT_BUF_LENGTH);
+	if (!c->out) {
+		iq_ddc_free(c->ddc);
+		c->ddc = NULL;
+		spectrum_free(c->spec);
+		c->spec = NULL;
+		c->framed = 0;
+	}
+	if (c->spec) {
+		printf("client %d: %d bin spectrum, %d per second, ", c->id,
+		       c->spec_size, c->spec_rate);
+		if (c->spec_step)
+			printf("%d dB + %.2f dB steps", c->spec_floor, c->spec_step / 100.0);
+		else
+			printf("float dB");
+	} else if (!c->ddc)
+		printf("client %d: raw cu8 at %u Hz", c->id, c->d->sample_rate);
+	else {
+		printf("client %d: %s at %u Hz, %d Hz from center, %d taps", c->id,
+		       iq_format_name[c->ddc->format], c->d->sample_rate / c->ddc->decim,
+		       c->ddc_offset, c->ddc->taps);
+		if (c->compress)
+			printf(", compressed with %d bits dropped", c->compress - 1);
+	}
+	printf("%s\n", c->framed ? ", framed" : "");
+}
+
+static int client_flush(struct client *c)
+/*
+ * Sends queued blocks until the client caught up or the socket is full.
+ * Returns 0 when caught up, 1 when the socket is full, -1 on error.
+ */
+{
+	struct sample_ring *ring = &c->d->ring;
+	int r;
+
+	while (1) {
+		/* settings change between whole blocks, with nothing left over */
+		if (c->reconfigure && !c->offset && !c->pad_pending && c->out_pos == c->out_len)
+			client_reconfigure(c);
+		if (c->muted) {
+			/* status frames still go out */
+			pthread_mutex_lock(&ll_mutex);
+			c->cursor = ring->wseq;
+			pthread_mutex_unlock(&ll_mutex);
+		}
+		if (c->ddc || c->framed || c->muted)
+			r = client_flush_buffered(c);
+		else
+			r = client_flush_raw(c);
+		if (r != 2)
+			return r;
+	}
+}
+
+#ifdef __linux__
+static void zc_complete(struct client *c, uint32_t lo, uint32_t hi)
+/* called with ll_mutex held */
+{
+	struct sample_ring *ring = &c->d->ring;
+	struct zc_send *z;
+	uint32_t id;
+
+	for (id = lo; id - lo <= hi - lo; id++) {
+		if (id - c->zc_tail >= c->zc_head - c->zc_tail)
+			continue;
+		z = &c->zc[id % ZEROCOPY_PENDING];
+		if (z->done)
+			continue;
+		ring_unpin(ring, z->first, z->last);
+		z->done = 1;
+	}
+	/* completions can arrive out of order, free entries from the oldest */
+	while (c->zc_tail != c->zc_head && c->zc[c->zc_tail % ZEROCOPY_PENDING].done)
+		c->zc_tail++;
+}
+
+static int client_errqueue(struct client *c)
+/* reads zero-copy completions, returns how many notifications were read */
+{
+	char control[256];
+	struct msghdr msg;
+	struct cmsghdr *cm;
+	struct sock_extended_err *serr;
+	int count = 0;
+
+	while (1) {
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+		if (recvmsg(c->s, &msg, MSG_ERRQUEUE) < 0)
+			return count;
+		stats.recv_calls++;
+		pthread_mutex_lock(&ll_mutex);
+		for (cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+			serr = (struct sock_extended_err *)CMSG_DATA(cm);
+			if (serr->ee_errno || serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+				continue;
+			if (serr->ee_code & SO_EE_CODE_ZEROCOPY_COPIED)
+				stats.zc_copied += serr->ee_data - serr->ee_info + 1;
+			zc_complete(c, serr->ee_info, serr->ee_data);
+			count++;
+		}
+		pthread_mutex_unlock(&ll_mutex);
+	}
+}
+#endif
+
+static int udp_open(const char *dest, int ttl)
+{
+	struct addrinfo hints, *ai;
+	char host[NI_MAXHOST];
+	const char *port;
+	int r, sndbuf = 4 * 1024 * 1024;
+#ifdef _WIN32
+	int ttl_v4 = ttl;
+#else
+	unsigned char ttl_v4 = (unsigned char)ttl;
+#endif
+
+	/* host:port, or [v6 address]:port */
+	port = strrchr(dest, ':');
+	if (!port || port == dest || (size_t)(port - dest) >= sizeof(host)) {
+		fprintf(stderr, "UDP destination must be host:port.\n");
+		return -1;
+	}
+	if (dest[0] == '[' && port[-1] == ']') {
+		memcpy(host, dest + 1, port - dest - 2);
+		host[port - dest - 2] = '\0';
+	} else {
+		memcpy(host, dest, port - dest);
+		host[port - dest] = '\0';
+	}
+	port++;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = PF_UNSPEC;
+	hints.ai_socktype = SOCK_DGRAM;
+	r = getaddrinfo(host, port, &hints, &ai);
+	if (r) {
+		fprintf(stderr, "UDP destination %s ERROR - %s.\n", dest, gai_strerror(r));
+		return -1;
+	}
+	memcpy(&udp.dest, ai->ai_addr, ai->ai_addrlen);
+	udp.dest_len = (socklen_t)ai->ai_addrlen;
+	udp.s = socket(ai->ai_family, SOCK_DGRAM, IPPROTO_UDP);
+	freeaddrinfo(ai);
+	if (udp.s == (SOCKET)SOCKET_ERROR) {
+		fprintf(stderr, "Failed to open the UDP socket.\n");
+		return -1;
+	}
+	setsockopt(udp.s, SOL_SOCKET, SO_SNDBUF, (char *)&sndbuf, sizeof(sndbuf));
+	if (udp.dest.ss_family == AF_INET &&
+	    IN_MULTICAST(ntohl(((struct sockaddr_in *)&udp.dest)->sin_addr.s_addr)))
+		setsockopt(udp.s, IPPROTO_IP, IP_MULTICAST_TTL, (char *)&ttl_v4, sizeof(ttl_v4));
+	if (udp.dest.ss_family == AF_INET6 &&
+	    IN6_IS_ADDR_MULTICAST(&((struct sockaddr_in6 *)&udp.dest)->sin6_addr))
+		setsockopt(udp.s, IPPROTO_IPV6, IPV6_MULTICAST_HOPS, (char *)&ttl, sizeof(ttl));
+	set_nonblocking(udp.s, 1);
+	return 0;
+}
+
+static int udp_send(io_buf (*bufs)[3], int *nbufs, int n)
+/* returns datagrams the socket took, 0 if it is full */
+{
+	int i;
+#if defined(__linux__)
+	struct mmsghdr msgs[UDP_BATCH];
+
+	memset(msgs, 0, n * sizeof(struct mmsghdr));
+	for (i = 0; i < n; i++) {
+		msgs[i].msg_hdr.msg_name = &udp.dest;
+		msgs[i].msg_hdr.msg_namelen = udp.dest_len;
+		msgs[i].msg_hdr.msg_iov = bufs[i];
+		msgs[i].msg_hdr.msg_iovlen = nbufs[i];
+	}
+	stats.send_calls++;
+	i = sendmmsg(udp.s, msgs, n, 0);
+	if (i >= 0)
+		return i;
+	if (SOCKET_WOULDBLOCK())
+		return 0;
+	/* unreachable and the like, the datagram is lost either way */
+	return 1;
+#else
+	for (i = 0; i < n; i++) {
+#ifdef _WIN32
+		DWORD sent;
+		stats.send_calls++;
+		if (WSASendTo(udp.s, bufs[i], nbufs[i], &sent, 0, (struct sockaddr *)&udp.dest,
+			      udp.dest_len, NULL, NULL) == SOCKET_ERROR && SOCKET_WOULDBLOCK())
+			return i;
+#else
+		struct msghdr msg;
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_name = &udp.dest;
+		msg.msg_namelen = udp.dest_len;
+		msg.msg_iov = bufs[i];
+		msg.msg_iovlen = nbufs[i];
+		stats.send_calls++;
+		if (sendmsg(udp.s, &msg, 0) < 0 && SOCKET_WOULDBLOCK())
+			return i;
+#endif
+	}
+	return n;
+#endif
+}
+
+static int udp_flush(void)
+/* sends every whole datagram queued, returns 1 when the socket is full */
+{
+	struct sample_ring *ring = &devices[0].ring;
+	io_buf bufs[UDP_BATCH][3];
+	int nbufs[UDP_BATCH];
+	unsigned char hdr[UDP_BATCH][UDP_HEADER_LEN];
+	uint64_t end_seq[UDP_BATCH];
+	uint32_t end_off[UDP_BATCH];
+	struct ring_slot *slot;
+	uint64_t seq, first, last, ts;
+	uint32_t off, need, take;
+	int n, k, r;
+
+	while (1) {
+		pthread_mutex_lock(&ll_mutex);
+		slot = &ring->slots[udp.cursor % ring->size];
+		if (udp.cursor < ring->wseq &&
+		    (ring->wseq - udp.cursor + LAG_MARGIN > ring->size || slot->seq != udp.cursor)) {
+			/* datagrams never wait, the sample index shows the gap */
+			udp.skipped += ring->wseq - 1 - udp.cursor;
+			udp.cursor = ring->wseq - 1;
+			udp.offset = 0;
+		}
+
+		/* carve whole datagrams out of the blocks that are there */
+		seq = first = udp.cursor;
+		off = udp.offset;
+		for (n = 0; n < UDP_BATCH && seq < ring->wseq; n++) {
+			slot = &ring->slots[seq % ring->size];
+			ts = slot->time_ns - (uint64_t)((slot->len - off) / 2 * 1e9 / devices[0].sample_rate);
+			memcpy(hdr[n], "RTLU", 4);
+			put_be(hdr[n] + 4, udp.seq + n, 4);
+			put_be(hdr[n] + 8, slot->sample + off / 2, 8);
+			put_be(hdr[n] + 16, ts, 8);
+			put_be(hdr[n] + 24, devices[0].sample_rate, 4);
+			put_be(hdr[n] + 28, IQ_FMT_CU8, 2);
+			put_be(hdr[n] + 30, udp.payload, 2);
+			IO_BUF_SET(&bufs[n][0], hdr[n], UDP_HEADER_LEN);
+			k = 1;
+			need = udp.payload;
+			while (need && seq < ring->wseq && k < 3) {
+				slot = &ring->slots[seq % ring->size];
+				take = slot->len - off < need ? slot->len - off : need;
+				IO_BUF_SET(&bufs[n][k], slot->data + off, take);
+				k++;
+				need -= take;
+				off += take;
+				if (off == slot->len) {
+					seq++;
+					off = 0;
+				}
+			}
+			if (need)
+				break;
+			nbufs[n] = k;
+			end_seq[n] = seq;
+			end_off[n] = off;
+		}
+		if (!n) {
+			pthread_mutex_unlock(&ll_mutex);
+			return 0;
+		}
+		last = end_off[n - 1] ? end_seq[n - 1] : end_seq[n - 1] - 1;
+		for (seq = first; seq <= last; seq++)
+			ring->slots[seq % ring->size].pins++;
+		pthread_mutex_unlock(&ll_mutex);
+
+		r = udp_send(bufs, nbufs, n);
+
+		pthread_mutex_lock(&ll_mutex);
+		ring_unpin(ring, first, last);
+		if (r > 0) {
+			udp.cursor = end_seq[r - 1];
+			udp.offset = end_off[r - 1];
+			udp.seq += r;
+			udp.datagrams += r;
+			stats.datagrams += r;
+		}
+		pthread_mutex_unlock(&ll_mutex);
+		if (r < n)
+			return 1;
+	}
+}
+
+static void udp_want_write(int on)
+{
+	if (udp.want_write == on)
+		return;
+	udp.want_write = on;
+	loop_mod(udp.s, &udp, 0, on);
+}
+
+static int set_gain_by_index(rtlsdr_dev_t *_dev, unsigned int index)
+{
+	int res = 0;
+	int* gains;
+	int count = rtlsdr_get_tuner_gains(_dev, NULL);
+
+	if (count > 0 && (unsigned int)count > index) {
+		gains = malloc(sizeof(int) * count);
+		count = rtlsdr_get_tuner_gains(_dev, gains);
+
+		res = rtlsdr_set_tuner_gain(_dev, gains[index]);
+
+		free(gains);
+	}
+
+	return res;
+}
+
+static int device_command(struct device *d, unsigned char cmd, uint32_t param, int replaced)
+/* runs on the control thread, returns what librtlsdr returned */
+{
+	char note[32] = "";
+
+	if (replaced)
+		snprintf(note, sizeof(note), " (%d older dropped)", replaced);
+	if (!d->dev) {
+		/* a source takes any setting, only the rate changes anything */
+		printf("source: command 0x%02x %u%s\n", cmd, param, note);
+		return cmd == 0x02 && !param ? -1 : 0;
+	}
+	switch(cmd) {
+	case 0x01:
+		printf("set freq %d%s\n", param, note);
+		return rtlsdr_set_center_freq(d->dev, param);
+	case 0x02:
+		printf("set sample rate %d%s\n", param, note);
+		return rtlsdr_set_sample_rate(d->dev, param);
+	case 0x03:
+		printf("set gain mode %d%s\n", param, note);
+		return rtlsdr_set_tuner_gain_mode(d->dev, param);
+	case 0x04:
+		printf("set gain %d%s\n", param, note);
+		return rtlsdr_set_tuner_gain(d->dev, param);
+	case 0x05:
+		printf("set freq correction %d%s\n", param, note);
+		return rtlsdr_set_freq_correction(d->dev, param);
+	case 0x06:
+		printf("set if stage %d gain %d%s\n", param >> 16, (short)(param & 0xffff), note);
+		return rtlsdr_set_tuner_if_gain(d->dev, param >> 16, (short)(param & 0xffff));
+	case 0x07:
+		printf("set test mode %d%s\n", param, note);
+		return rtlsdr_set_testmode(d->dev, param);
+	case 0x08:
+		printf("set agc mode %d%s\n", param, note);
+		return rtlsdr_set_agc_mode(d->dev, param);
+	case 0x09:
+		printf("set direct sampling %d%s\n", param, note);
+		return rtlsdr_set_direct_sampling(d->dev, param);
+	case 0x0a:
+		printf("set offset tuning %d%s\n", param, note);
+		return rtlsdr_set_offset_tuning(d->dev, param);
+	case 0x0b:
+		printf("set rtl xtal %d%s\n", param, note);
+		return rtlsdr_set_xtal_freq(d->dev, param, 0);
+	case 0x0c:
+		printf("set tuner xtal %d%s\n", param, note);
+		return rtlsdr_set_xtal_freq(d->dev, 0, param);
+	case 0x0d:
+		printf("set tuner gain by index %d%s\n", param, note);
+		return set_gain_by_index(d->dev, param);
+	case 0x0e:
+		printf("set bias tee %d%s\n", param, note);
+		return rtlsdr_set_bias_tee(d->dev, (int)param);
+	default:
+		return -1;
+	}
+}
+
+static void *ctrl_worker(void *arg)
+/*
+ * Tuning takes milliseconds, far longer than a client needs to send the
+ * next value while a knob is turned. Commands wait here instead, where a
+ * newer value of the same setting replaces the one not yet applied.
+ */
+{
+	struct device *d = arg;
+	struct ctrl_cmd batch[CTRL_PENDING];
+	int i, n;
+
+	pthread_mutex_lock(&d->ctrl_mutex);
+	while (!do_exit) {
+		if (!d->ctrl.npending) {
+			pthread_cond_wait(&d->ctrl_cond, &d->ctrl_mutex);
+			continue;
+		}
+		n = d->ctrl.npending;
+		memcpy(batch, d->ctrl.pending, n * sizeof(batch[0]));
+		d->ctrl.npending = 0;
+		pthread_mutex_unlock(&d->ctrl_mutex);
+
+		for (i = 0; i < n; i++) {
+			batch[i].result = device_command(d, batch[i].cmd, batch[i].param,
+							 batch[i].replaced);
+			if (batch[i].result < 0)
+				fprintf(stderr, "WARNING: command 0x%02x failed (%d)\n",
+					batch[i].cmd, batch[i].result);
+		}
+
+		pthread_mutex_lock(&d->ctrl_mutex);
+		/* every applied command gets its status frame, wait for the loop to make room */
+		while (!do_exit && d->ctrl.ndone + n > CTRL_DONE)
+			pthread_cond_wait(&d->ctrl_cond, &d->ctrl_mutex);
+		if (d->ctrl.ndone + n > CTRL_DONE)
 			break;
+		memcpy(d->ctrl.done + d->ctrl.ndone, batch, n * sizeof(batch[0]));
+		d->ctrl.ndone += n;
+		loop_wake();
+	}
+	pthread_mutex_unlock(&d->ctrl_mutex);
+	return NULL;
+}
+
+static int ctrl_same(const struct ctrl_cmd *a, unsigned char cmd, uint32_t param)
+/* whether param is a newer value for the setting in a */
+{
+	if (a->cmd != cmd)
+		return 0;
+	/* every IF stage has a gain of its own */
+	return cmd != 0x06 || a->param >> 16 == param >> 16;
+}
+
+static void ctrl_post(struct device *d, unsigned char cmd, uint32_t param)
+{
+	struct ctrl_cmd *q = d->ctrl.pending;
+	int i, replaced = 0;
+
+	pthread_mutex_lock(&d->ctrl_mutex);
+	stats.commands++;
+	/* the new value takes the place of the old one at the end */
+	for (i = 0; i < d->ctrl.npending; i++) {
+		if (!ctrl_same(&q[i], cmd, param))
+			continue;
+		replaced = q[i].replaced + 1;
+		stats.replaced++;
+		memmove(&q[i], &q[i + 1], (d->ctrl.npending - i - 1) * sizeof(q[0]));
+		d->ctrl.npending--;
+		break;
+	}
+	if (d->ctrl.npending == CTRL_PENDING) {
+		pthread_mutex_unlock(&d->ctrl_mutex);
+		printf("too many pending commands, dropping 0x%02x\n", cmd);
+		return;
+	}
+	q[d->ctrl.npending].cmd = cmd;
+	q[d->ctrl.npending].param = param;
+	q[d->ctrl.npending].replaced = replaced;
+	q[d->ctrl.npending].result = 0;
+	d->ctrl.npending++;
+	pthread_cond_signal(&d->ctrl_cond);
+	pthread_mutex_unlock(&d->ctrl_mutex);
+}
+
+static int client_has_control(struct client *c)
+{
+	struct client *owner;
+
+	if (ctrl_policy == CTRL_ALL)
+		return 1;
+	owner = clients;
+	if (ctrl_policy == CTRL_LAST)
+		while (owner && owner->next)
+			owner = owner->next;
+	return owner == c;
+}
+
+static int client_custom(struct client *c)
+{
+	return c->ddc_offset || c->ddc_rate || c->format != IQ_FMT_CU8 || c->compress ||
+	       c->spec_size;
+}
+
+static void command_apply(struct client *c, unsigned char cmd, uint32_t param)
+{
+	/*
+	 * 0x20 and up only shape what this client receives and leave the
+	 * device alone, so the control policy does not apply to them.
+	 */
+	switch(cmd) {
+	case 0x20:
+		printf("client %d: ddc offset %d Hz\n", c->id, (int32_t)param);
+		c->ddc_offset = (int32_t)param;
+		c->reconfigure = 1;
+		return;
+	case 0x21:
+		printf("client %d: ddc output rate %u Hz\n", c->id, param);
+		c->ddc_rate = param;
+		c->reconfigure = 1;
+		return;
+	case 0x22:
+		if (param >= IQ_FMT_COUNT) {
+			printf("client %d: unknown sample format %u\n", c->id, param);
+			return;
+		}
+		printf("client %d: sample format %s\n", c->id, iq_format_name[param]);
+		c->format = (enum iq_format)param;
+		c->reconfigure = 1;
+		return;
+	case 0x24:
+		/* control only, for clients taking the samples over UDP */
+		printf("client %d: tcp samples %s\n", c->id, param ? "off" : "on");
+		c->mute = param != 0;
+		c->reconfigure = 1;
+		return;
+	case 0x23:
+		/* 0 off, n > 0 sends codec blocks with n - 1 low bits dropped */
+		if (param > IQ_MAX_SHIFT + 1) {
+			printf("client %d: can drop at most %d bits\n", c->id, IQ_MAX_SHIFT);
+			return;
+		}
+		printf("client %d: compression %u\n", c->id, param);
+		c->compress = (int)param;
+		c->reconfigure = 1;
+		return;
+	case 0x25:
+		/* frames around samples, with status frames in between */
+		printf("client %d: framing %s\n", c->id, param ? "on" : "off");
+		c->frame = param != 0;
+		c->reconfigure = 1;
+		return;
+	case 0x26:
+		/* 0 back to samples, else bins per spectrum */
+		if (param && (param < SPEC_MIN_SIZE || param > SPEC_MAX_SIZE || (param & (param - 1)))) {
+			printf("client %d: spectrum size must be a power of two from %d to %d\n",
+			       c->id, SPEC_MIN_SIZE, SPEC_MAX_SIZE);
+			return;
 		}
+		printf("client %d: spectrum size %u\n", c->id, param);
+		c->spec_size = (int)param;
+		c->reconfigure = 1;
+		return;
+	case 0x27:
+		if (param < 1 || param > SPEC_MAX_RATE) {
+			printf("client %d: spectra per second must be 1 to %d\n", c->id, SPEC_MAX_RATE);
+			return;
+		}
+		printf("client %d: %u spectra per second\n", c->id, param);
+		c->spec_rate = (int)param;
+		c->reconfigure = 1;
+		return;
+	case 0x28:
+		/* dB of bin value 0 in the high half, hundredths of a dB per step in the low */
+		c->spec_floor = (int16_t)(param >> 16);
+		c->spec_step = (int)(param & 0xffff);
+		printf("client %d: spectrum from %d dB in %d/100 dB steps\n", c->id,
+		       c->spec_floor, c->spec_step);
+		c->reconfigure = 1;
+		return;
+	default:
+		break;
 	}
 
-	if (argc < optind)
-		usage();
+	if (!client_has_control(c)) {
+		if (!c->ignored++)
+			printf("client %d has no control, ignoring its commands\n", c->id);
+		return;
+	}
+	if (cmd < 0x01 || cmd > 0x0e)
+		return;
+	ctrl_post(c->d, cmd, param);
+}
 
-	if (!dev_given) {
-		dev_index = verbose_device_search("0");
+static void ctrl_results(struct device *d)
+/* runs on the loop once a control thread applied something */
+{
+	struct ctrl_cmd done[CTRL_DONE];
+	unsigned char st[FRAME_HEADER_LEN + STATUS_LEN];
+	struct client *c;
+	int i, n;
+
+	pthread_mutex_lock(&d->ctrl_mutex);
+	n = d->ctrl.ndone;
+	memcpy(done, d->ctrl.done, n * sizeof(done[0]));
+	d->ctrl.ndone = 0;
+	/* the control thread may be waiting for room */
+	pthread_cond_signal(&d->ctrl_cond);
+	pthread_mutex_unlock(&d->ctrl_mutex);
+
+	for (i = 0; i < n; i++) {
+		if (done[i].cmd == 0x02 && done[i].result >= 0) {
+			d->sample_rate = done[i].param;
+			/* decimation follows the new rate */
+			for (c = clients; c; c = c->next)
+				if (c->d == d && client_custom(c))
+					c->reconfigure = 1;
+		}
+		frame_header((char *)st, FRAME_STATUS, STATUS_LEN);
+		memset(st + FRAME_HEADER_LEN, 0, STATUS_LEN);
+		st[FRAME_HEADER_LEN] = done[i].cmd;
+		put_be(st + FRAME_HEADER_LEN + 4, done[i].param, 4);
+		put_be(st + FRAME_HEADER_LEN + 8, (uint32_t)done[i].result, 4);
+		put_be(st + FRAME_HEADER_LEN + 12, (uint32_t)done[i].replaced, 4);
+		for (c = clients; c; c = c->next) {
+			if (c->d != d || c->dead || !c->framed)
+				continue;
+			/* frames only ever get appended whole */
+			if (c->out_len + sizeof(st) > OUT_BUF_LENGTH) {
+				c->status_lost++;
+				continue;
+			}
+			memcpy(c->out + c->out_len, st, sizeof(st));
+			c->out_len += sizeof(st);
+		}
 	}
+}
 
-	if (dev_index < 0) {
-	    exit(1);
+static int client_read(struct client *c)
+/* reads 5 byte commands as they come, returns -1 once the client is gone */
+{
+	uint32_t param;
+	int r;
+
+	while (1) {
+		r = recv(c->s, (char *)c->cmd + c->cmd_len, sizeof(c->cmd) - c->cmd_len, 0);
+		stats.recv_calls++;
+		if (r == 0)
+			return -1;
+		if (r < 0)
+			return SOCKET_WOULDBLOCK() ? 0 : -1;
+		c->cmd_len += r;
+		if (c->cmd_len < (int)sizeof(c->cmd))
+			continue;
+		c->cmd_len = 0;
+		param = (uint32_t)c->cmd[1] << 24 | (uint32_t)c->cmd[2] << 16 |
+			(uint32_t)c->cmd[3] << 8 | c->cmd[4];
+		command_apply(c, c->cmd[0], param);
 	}
+}
 
-	rtlsdr_open(&dev, (uint32_t)dev_index);
-	if (NULL == dev) {
-	fprintf(stderr, "Failed to open rtlsdr device #%d.\n", dev_index);
-		exit(1);
+static void *async_worker(void *arg)
+{
+	struct device *d = arg;
+	int r;
+
+	RTLSDR_TRACE_THREAD("dongle");
+	r = rtlsdr_read_async(d->dev, rtlsdr_callback, d, buf_num, DEFAULT_BUF_LENGTH);
+	if (r < 0 && !do_exit)
+		fprintf(stderr, "WARNING: device %d async read failed (%d)\n", d->id, r);
+	return NULL;
+}
+
+static void source_fill(struct device *d, unsigned char *buf, uint32_t len)
+/* the file, looped, or a tone at an eighth of the rate over a little noise */
+{
+	static const int tone_i[8] = {60, 42, 0, -42, -60, -42, 0, 42};
+	uint32_t i, n;
+
+	if (d->file) {
+		for (i = 0; i < len; i += n) {
+			n = (uint32_t)fread(buf + i, 1, len - i, d->file);
+			if (n)
+				continue;
+			if (fseek(d->file, 0, SEEK_SET) < 0 || !i) {
+				/* empty or unseekable, carry on with silence */
+				memset(buf + i, 127, len - i);
+				break;
+			}
+		}
+		return;
 	}
+	for (i = 0; i + 1 < len; i += 2, d->source_pos++) {
+		d->source_seed = d->source_seed * 1103515245 + 12345;
+		buf[i] = (unsigned char)(128 + tone_i[d->source_pos & 7] + (int)(d->source_seed >> 29) - 4);
+		buf[i + 1] = (unsigned char)(128 + tone_i[(d->source_pos + 6) & 7] +
+					     (int)((d->source_seed >> 26) & 7) - 4);
+	}
+}
 
-#ifndef _WIN32
-	sigact.sa_handler = sighandler;
-	sigemptyset(&sigact.sa_mask);
-	sigact.sa_flags = 0;
-	sigign.sa_handler = SIG_IGN;
-	sigaction(SIGINT, &sigact, NULL);
-	sigaction(SIGTERM, &sigact, NULL);
-	sigaction(SIGQUIT, &sigact, NULL);
-	sigaction(SIGPIPE, &sigign, NULL);
+static void *source_worker(void *arg)
+/* stands in for rtlsdr_read_async(), one block per block time */
+{
+	struct device *d = arg;
+	unsigned char *buf = malloc(DEFAULT_BUF_LENGTH);
+	double due = now_sec(), t;
+
+	if (!buf)
+		return NULL;
+	while (!do_exit && !d->source_stop) {
+		source_fill(d, buf, DEFAULT_BUF_LENGTH);
+		due += DEFAULT_BUF_LENGTH / 2.0 / d->sample_rate;
+		t = now_sec();
+		if (due > t)
+			usleep((int)((due - t) * 1e6));
+		else if (t - due > 1.0)
+			due = t;	/* fell behind, no burst to catch up */
+		rtlsdr_callback(buf, DEFAULT_BUF_LENGTH, d);
+	}
+	free(buf);
+	return NULL;
+}
+
+static void streaming_start(struct device *d)
+{
+	if (d->streaming)
+		return;
+	if (!d->dev) {
+		d->source_stop = 0;
+		pthread_create(&d->async_thread, NULL, source_worker, d);
+		d->streaming = 1;
+		return;
+	}
+	/* Reset endpoint before we start reading from it (mandatory) */
+	if (rtlsdr_reset_buffer(d->dev) < 0)
+		fprintf(stderr, "WARNING: Failed to reset buffers.\n");
+	pthread_create(&d->async_thread, NULL, async_worker, d);
+	d->streaming = 1;
+}
+
+static void streaming_stop(struct device *d)
+{
+	if (!d->streaming)
+		return;
+	if (d->dev)
+		rtlsdr_cancel_async(d->dev);
+	else
+		d->source_stop = 1;
+	pthread_join(d->async_thread, NULL);
+	d->streaming = 0;
+	printf("device %d: %llu blocks received, %llu dropped while a client was sending\n",
+	       d->id, (unsigned long long)d->ring.blocks, (unsigned long long)d->ring.busy);
+}
+
+static uint64_t ring_replay_start(struct device *d)
+/* called with ll_mutex held, oldest block that arrived within replay_ms */
+{
+	struct sample_ring *ring = &d->ring;
+	uint64_t seq = ring->wseq, cutoff;
+	struct ring_slot *slot;
+
+	if (!replay_ms || !d->streaming)
+		return seq;
+	cutoff = now_ns() - (uint64_t)replay_ms * 1000000;
+	/* leave the client half the ring to catch up in */
+	while (seq > 0 && ring->wseq - seq < ring->size / 2) {
+		slot = &ring->slots[(seq - 1) % ring->size];
+		if (slot->seq != seq - 1 || slot->time_ns < cutoff)
+			break;
+		seq--;
+	}
+	return seq;
+}
+
+static int client_start(struct device *d, SOCKET sock, struct sockaddr_storage *remote, socklen_t rlen)
+{
+	static int next_id = 0;
+	struct linger ling = {1,0};
+	struct client *c, **pp;
+	dongle_info_t dongle_info;
+	uint64_t replay;
+	int r;
+
+	c = calloc(1, sizeof(struct client));
+	if (!c)
+		return -1;
+	c->id = next_id++;
+	c->d = d;
+	c->s = sock;
+	c->spec_rate = DEFAULT_SPEC_RATE;
+	c->spec_floor = DEFAULT_SPEC_FLOOR;
+	c->spec_step = DEFAULT_SPEC_STEP;
+	setsockopt(sock, SOL_SOCKET, SO_LINGER, (char *)&ling, sizeof(ling));
+
+	getnameinfo((struct sockaddr *)remote, rlen,
+		    c->host, NI_MAXHOST,
+		    c->port, NI_MAXSERV, NI_NUMERICSERV);
+	printf("client %d accepted on device %d! %s %s\n", c->id, d->id, c->host, c->port);
+
+	memset(&dongle_info, 0, sizeof(dongle_info));
+	memcpy(&dongle_info.magic, "RTL0", 4);
+
+	r = rtlsdr_get_tuner_type(d->dev);
+	if (r >= 0)
+		dongle_info.tuner_type = htonl(r);
+
+	r = rtlsdr_get_tuner_gains(d->dev, NULL);
+	if (r >= 0)
+		dongle_info.tuner_gain_count = htonl(r);
+
+	/* the greeting is sent blocking, everything after it from the loop */
+	set_nonblocking(sock, 0);
+	r = send(sock, (const char *)&dongle_info, sizeof(dongle_info), 0);
+	if (sizeof(dongle_info) != r)
+		printf("failed to send dongle information\n");
+	set_nonblocking(sock, 1);
+
+#ifdef __linux__
+	if (zerocopy) {
+		r = 1;
+		c->zerocopy = !setsockopt(sock, SOL_SOCKET, SO_ZEROCOPY, &r, sizeof(r));
+		if (!c->zerocopy)
+			printf("client %d: zero-copy unavailable, copying\n", c->id);
+	}
+#endif
+
+	/* new clients start with the next block, or as far back as asked */
+	pthread_mutex_lock(&ll_mutex);
+	c->cursor = ring_replay_start(d);
+	replay = d->ring.wseq - c->cursor;
+	pthread_mutex_unlock(&ll_mutex);
+	if (replay)
+		printf("client %d: replaying %llu blocks\n", c->id, (unsigned long long)replay);
+
+	for (pp = &clients; *pp; pp = &(*pp)->next);
+	*pp = c;
+	client_count++;
+	d->clients++;
+	loop_add(sock, c);
+	/* the replay goes out as soon as the socket takes it */
+	if (replay)
+		loop_want_write(c, 1);
+
+	streaming_start(d);
+	return 0;
+}
+
+static void clients_accept(struct device *d)
+{
+	struct sockaddr_storage remote;
+	socklen_t rlen;
+	SOCKET s;
+
+	while (1) {
+		rlen = sizeof(remote);
+		s = accept(d->listen, (struct sockaddr *)&remote, &rlen);
+		if (s == SOCKET_ERROR)
+			return;
+		if (d->clients >= max_clients) {
+			printf("client refused, device %d already serves %d\n", d->id, d->clients);
+			closesocket(s);
+		} else if (client_start(d, s, &remote, rlen) < 0)
+			closesocket(s);
+	}
+}
+
+static void clients_reap(int all)
+/* closes clients marked dead, every client if all is set */
+{
+	struct client *c, **pp;
+
+	pp = &clients;
+	while ((c = *pp)) {
+		if (!all && !c->dead) {
+			pp = &c->next;
+			continue;
+		}
+		*pp = c->next;
+		client_count--;
+		c->d->clients--;
+
+		loop_del(c->s);
+		closesocket(c->s);
+		/* whatever the kernel still sends from these goes nowhere now */
+		pthread_mutex_lock(&ll_mutex);
+		for (; c->zc_tail != c->zc_head; c->zc_tail++)
+			if (!c->zc[c->zc_tail % ZEROCOPY_PENDING].done)
+				ring_unpin(&c->d->ring, c->zc[c->zc_tail % ZEROCOPY_PENDING].first,
+					   c->zc[c->zc_tail % ZEROCOPY_PENDING].last);
+		pthread_mutex_unlock(&ll_mutex);
+		iq_ddc_free(c->ddc);
+		spectrum_free(c->spec);
+		free(c->out);
+		printf("client %d gone, %llu blocks sent, %llu skipped, %llu commands ignored, "
+		       "%.1f MB in %llu sends\n",
+		       c->id, (unsigned long long)c->sent, (unsigned long long)c->skipped,
+		       (unsigned long long)c->ignored, c->bytes / 1e6,
+		       (unsigned long long)c->send_calls);
+		if (c->status_lost)
+			printf("client %d: %llu status frames lost to a full buffer\n",
+			       c->id, (unsigned long long)c->status_lost);
+		free(c);
+	}
+}
+
+static void stats_print(double elapsed)
+{
+	static struct net_stats last;
+	static uint64_t last_bytes[MAX_DEVICES], last_blocks[MAX_DEVICES], last_busy[MAX_DEVICES];
+	uint64_t bytes = stats.bytes - last.bytes;
+	uint64_t sends = stats.send_calls - last.send_calls;
+	struct device *d;
+	int i;
+
+	printf("net: %.2f MB/s to %d clients, %llu sends (%.0f kB each), %llu recvs, "
+	       "%llu waits, %llu zero-copy (%llu copied), %llu datagrams, "
+	       "%llu commands (%llu replaced)\n",
+	       bytes / elapsed / 1e6, client_count, (unsigned long long)sends,
+	       sends ? bytes / 1e3 / sends : 0.0,
+	       (unsigned long long)(stats.recv_calls - last.recv_calls),
+	       (unsigned long long)(stats.waits - last.waits),
+	       (unsigned long long)(stats.zc_sends - last.zc_sends),
+	       (unsigned long long)(stats.zc_copied - last.zc_copied),
+	       (unsigned long long)(stats.datagrams - last.datagrams),
+	       (unsigned long long)(stats.commands - last.commands),
+	       (unsigned long long)(stats.replaced - last.replaced));
+	last = stats;
+	for (i = 0; i < device_count; i++) {
+		d = &devices[i];
+		printf("device %d: %.2f MB/s to %d clients, %llu blocks in, %llu lost to busy slots\n",
+		       d->id, (d->bytes - last_bytes[i]) / elapsed / 1e6, d->clients,
+		       (unsigned long long)(d->ring.blocks - last_blocks[i]),
+		       (unsigned long long)(d->ring.busy - last_busy[i]));
+		last_bytes[i] = d->bytes;
+		last_blocks[i] = d->ring.blocks;
+		last_busy[i] = d->ring.busy;
+	}
+}
+
+static struct device *listen_device(void *tag)
+{
+	int i;
+	for (i = 0; i < device_count; i++)
+		if (tag == &devices[i].listen)
+			return &devices[i];
+	return NULL;
+}
+
+static void loop_run(void)
+{
+	struct loop_event ev[LOOP_EVENTS];
+	struct client *c;
+	struct device *d;
+	double stats_last = now_sec(), t;
+	int i, k, n, r, fresh;
+
+	while (!do_exit) {
+		n = loop_wait(ev, LOOP_EVENTS, 1000);
+		fresh = 0;
+		for (i = 0; i < n; i++) {
+			if ((d = listen_device(ev[i].tag))) {
+				clients_accept(d);
+				continue;
+			}
+			if (ev[i].tag == &loop.wake_rx) {
+				/* new blocks, applied commands, or both */
+				loop_wake_drain();
+				for (k = 0; k < device_count; k++)
+					ctrl_results(&devices[k]);
+				fresh = 1;
+				continue;
+			}
+			if (ev[i].tag == &udp) {
+				if (ev[i].flags & EV_ERROR) {
+					/* clear a pending ICMP error */
+					socklen_t len = sizeof(r);
+					getsockopt(udp.s, SOL_SOCKET, SO_ERROR, (char *)&r, &len);
+				}
+				if (ev[i].flags & EV_WRITE)
+					udp_want_write(udp_flush());
+				continue;
+			}
+			c = ev[i].tag;
+			if (c->dead)
+				continue;
+			if (ev[i].flags & EV_ERROR) {
+#ifdef __linux__
+				/* zero-copy completions, or a real error when there are none */
+				if (!c->zerocopy || !client_errqueue(c))
+					ev[i].flags |= EV_READ;
 #else
-	SetConsoleCtrlHandler( (PHANDLER_ROUTINE) sighandler, TRUE );
+				ev[i].flags |= EV_READ;
 #endif
+			}
+			if ((ev[i].flags & EV_READ) && client_read(c) < 0) {
+				c->dead = 1;
+				continue;
+			}
+			if (ev[i].flags & EV_WRITE) {
+				r = client_flush(c);
+				if (r < 0)
+					c->dead = 1;
+				else
+					loop_want_write(c, r);
+			}
+		}
+		/* new blocks, clients waiting for room get them on EV_WRITE */
+		if (fresh && udp_enabled && !udp.want_write)
+			udp_want_write(udp_flush());
+		if (fresh) {
+			for (c = clients; c; c = c->next) {
+				if (c->dead)
+					continue;
+				if (c->want_write) {
+					/* but they must not hold the ring back meanwhile */
+					pthread_mutex_lock(&ll_mutex);
+					r = client_lagging(c);
+					pthread_mutex_unlock(&ll_mutex);
+					if (r) {
+						printf("client %d lagging, dropped\n", c->id);
+						c->dead = 1;
+					}
+					continue;
+				}
+				r = client_flush(c);
+				if (r < 0)
+					c->dead = 1;
+				else
+					loop_want_write(c, r);
+			}
+		}
+
+		clients_reap(0);
+		/* a dongle only streams while somebody listens, unless told otherwise */
+		for (k = 0; k < device_count; k++) {
+			d = &devices[k];
+			if (d->clients || !d->streaming || keep_streaming || (udp_enabled && !k))
+				continue;
+			streaming_stop(d);
+			printf("device %d listening on port %s...\n", d->id, d->port);
+		}
+
+		if (stats_interval) {
+			t = now_sec();
+			if (t - stats_last >= stats_interval) {
+				stats_print(t - stats_last);
+				stats_last = t;
+			}
+		}
+	}
+}
+
+static int device_open(struct device *d, char *query, uint32_t frequency,
+		       uint32_t samp_rate, int gain, int ppm_error, int direct_sampling)
+{
+	int index, r;
+
+	index = verbose_device_search(query);
+	if (index < 0)
+		return -1;
+	rtlsdr_open(&d->dev, (uint32_t)index);
+	if (NULL == d->dev) {
+		fprintf(stderr, "Failed to open rtlsdr device #%d.\n", index);
+		return -1;
+	}
+	rtlsdr_get_device_usb_strings(index, NULL, NULL, d->serial);
 
 	/* Set direct sampling */
-        if (direct_sampling)
-                verbose_direct_sampling(dev, 2);
+	if (direct_sampling)
+		verbose_direct_sampling(d->dev, 2);
 
 	/* Set the tuner error */
-	verbose_ppm_set(dev, ppm_error);
+	verbose_ppm_set(d->dev, ppm_error);
 
 	/* Set the sample rate */
-	r = rtlsdr_set_sample_rate(dev, samp_rate);
+	r = rtlsdr_set_sample_rate(d->dev, samp_rate);
 	if (r < 0)
 		fprintf(stderr, "WARNING: Failed to set sample rate.\n");
+	else
+		d->sample_rate = samp_rate;
 
 	/* Set the frequency */
-	r = rtlsdr_set_center_freq(dev, frequency);
+	r = rtlsdr_set_center_freq(d->dev, frequency);
 	if (r < 0)
 		fprintf(stderr, "WARNING: Failed to set center freq.\n");
 	else
@@ -508,37 +2350,38 @@ int main(int argc, char **argv)
 
 	if (0 == gain) {
 		 /* Enable automatic gain */
-		r = rtlsdr_set_tuner_gain_mode(dev, 0);
+		r = rtlsdr_set_tuner_gain_mode(d->dev, 0);
 		if (r < 0)
 			fprintf(stderr, "WARNING: Failed to enable automatic gain.\n");
 	} else {
 		/* Enable manual gain */
-		r = rtlsdr_set_tuner_gain_mode(dev, 1);
+		r = rtlsdr_set_tuner_gain_mode(d->dev, 1);
 		if (r < 0)
 			fprintf(stderr, "WARNING: Failed to enable manual gain.\n");
 
 		/* Set the tuner gain */
-		r = rtlsdr_set_tuner_gain(dev, gain);
+		r = rtlsdr_set_tuner_gain(d->dev, gain);
 		if (r < 0)
 			fprintf(stderr, "WARNING: Failed to set tuner gain.\n");
 		else
 			fprintf(stderr, "Tuner gain set to %f dB.\n", gain/10.0);
 	}
 
-	rtlsdr_set_bias_tee(dev, enable_biastee);
+	rtlsdr_set_bias_tee(d->dev, enable_biastee);
 	if (enable_biastee)
 		fprintf(stderr, "activated bias-T on GPIO PIN 0\n");
+	return 0;
+}
 
-	/* Reset endpoint before we start reading from it (mandatory) */
-	r = rtlsdr_reset_buffer(dev);
-	if (r < 0)
-		fprintf(stderr, "WARNING: Failed to reset buffers.\n");
-
-	pthread_mutex_init(&exit_cond_lock, NULL);
-	pthread_mutex_init(&ll_mutex, NULL);
-	pthread_mutex_init(&exit_cond_lock, NULL);
-	pthread_cond_init(&cond, NULL);
-	pthread_cond_init(&exit_cond, NULL);
+static SOCKET listen_open(const char *addr, const char *port, char *hostinfo, char *portinfo)
+{
+	struct sockaddr_storage local;
+	struct addrinfo *ai;
+	struct addrinfo *aiHead;
+	struct addrinfo  hints = { 0 };
+	struct linger ling = {1,0};
+	SOCKET listensocket = SOCKET_ERROR;
+	int aiErr, r;
 
 	hints.ai_flags  = AI_PASSIVE; /* Server mode. */
 	hints.ai_family = PF_UNSPEC;  /* IPv4 or IPv6. */
@@ -552,7 +2395,7 @@ int main(int argc, char **argv)
 	{
 		fprintf(stderr, "local address %s ERROR - %s.\n",
 		        addr, gai_strerror(aiErr));
-		return(-1);
+		return SOCKET_ERROR;
 	}
 	memcpy(&local, aiHead->ai_addr, aiHead->ai_addrlen);
 
@@ -576,95 +2419,281 @@ int main(int argc, char **argv)
 		else
 			break;
 	}
+	freeaddrinfo(aiHead);
+
+	set_nonblocking(listensocket, 1);
+	listen(listensocket, max_clients);
+	return listensocket;
+}
 
+int main(int argc, char **argv)
+{
+	int opt, i;
+	char *addr = "127.0.0.1";
+	const char *port = DEFAULT_PORT_STR;
+	uint32_t frequency = 100000000, samp_rate = DEFAULT_SAMPLE_RATE_HZ;
+	char hostinfo[NI_MAXHOST];
+	char portinfo[NI_MAXSERV];
+	char *dev_query[MAX_DEVICES];
+	int dev_given = 0;
+	struct device *d;
+	int gain = 0;
+	int ppm_error = 0;
+	int direct_sampling = 0;
+	char *udp_dest = NULL;
+	int udp_ttl = 1;
 #ifdef _WIN32
-	ioctlsocket(listensocket, FIONBIO, &blockmode);
+	WSADATA wsd;
+	i = WSAStartup(MAKEWORD(2,2), &wsd);
 #else
-	r = fcntl(listensocket, F_GETFL, 0);
-	r = fcntl(listensocket, F_SETFL, r | O_NONBLOCK);
-#endif
-
-	while(1) {
-		printf("listening...\n");
-		printf("Use the device argument 'rtl_tcp=%s:%s' in OsmoSDR "
-		       "(gr-osmosdr) source\n"
-		       "to receive samples in GRC and control "
-		       "rtl_tcp parameters (frequency, gain, ...).\n",
-		       hostinfo, portinfo);
-		listen(listensocket,1);
-
-		while(1) {
-			FD_ZERO(&readfds);
-			FD_SET(listensocket, &readfds);
-			tv.tv_sec = 1;
-			tv.tv_usec = 0;
-			r = select(listensocket+1, &readfds, NULL, NULL, &tv);
-			if(do_exit) {
-				goto out;
-			} else if(r) {
-				rlen = sizeof(remote);
-				s = accept(listensocket,(struct sockaddr *)&remote, &rlen);
-				break;
+	struct sigaction sigact, sigign;
+#endif
+
+	while ((opt = getopt(argc, argv, "a:p:f:g:s:b:n:m:l:c:d:P:S:u:U:t:kr:F:TDZ")) != -1) {
+		switch (opt) {
+		case 'd':
+			if (dev_given == MAX_DEVICES) {
+				fprintf(stderr, "Can serve at most %d devices.\n", MAX_DEVICES);
+				exit(1);
 			}
+			dev_query[dev_given++] = optarg;
+			break;
+		case 'f':
+			frequency = (uint32_t)atofs(optarg);
+			break;
+		case 'g':
+			gain = (int)(atof(optarg) * 10); /* tenths of a dB */
+			break;
+		case 's':
+			samp_rate = (uint32_t)atofs(optarg);
+			break;
+		case 'a':
+		        addr = strdup(optarg);
+			break;
+		case 'p':
+		        port = strdup(optarg);
+			break;
+		case 'b':
+			buf_num = atoi(optarg);
+			break;
+		case 'n':
+			llbuf_num = atoi(optarg);
+			break;
+		case 'm':
+			max_clients = atoi(optarg);
+			break;
+		case 'l':
+			if (strcmp(optarg, "drop") == 0)
+				lag_policy = LAG_DROP;
+			else if (strcmp(optarg, "skip") == 0)
+				lag_policy = LAG_SKIP;
+			else
+				usage();
+			break;
+		case 'c':
+			if (strcmp(optarg, "all") == 0)
+				ctrl_policy = CTRL_ALL;
+			else if (strcmp(optarg, "first") == 0)
+				ctrl_policy = CTRL_FIRST;
+			else if (strcmp(optarg, "last") == 0)
+				ctrl_policy = CTRL_LAST;
+			else
+				usage();
+			break;
+		case 'S':
+			stats_interval = atoi(optarg);
+			break;
+		case 'u':
+			udp_dest = optarg;
+			break;
+		case 'U':
+			udp.payload = atoi(optarg);
+			break;
+		case 't':
+			udp_ttl = atoi(optarg);
+			break;
+		case 'k':
+			keep_streaming = 1;
+			break;
+		case 'r':
+			replay_ms = atoi(optarg);
+			keep_streaming = 1;
+			break;
+		case 'F':
+			source = optarg;
+			break;
+		case 'Z':
+#ifdef __linux__
+			zerocopy = 1;
+#else
+			fprintf(stderr, "Zero-copy sends need Linux, ignoring -Z.\n");
+#endif
+			break;
+		case 'P':
+			ppm_error = atoi(optarg);
+			break;
+		case 'T':
+			enable_biastee = 1;
+			break;
+		case 'D':
+			direct_sampling = 1;
+			break;
+		default:
+			usage();
+			break;
 		}
+	}
 
-		setsockopt(s, SOL_SOCKET, SO_LINGER, (char *)&ling, sizeof(ling));
-
-		getnameinfo((struct sockaddr *)&remote, rlen,
-			    remhostinfo, NI_MAXHOST,
-			    remportinfo, NI_MAXSERV, NI_NUMERICSERV);
-		printf("client accepted! %s %s\n", remhostinfo, remportinfo);
-
-		memset(&dongle_info, 0, sizeof(dongle_info));
-		memcpy(&dongle_info.magic, "RTL0", 4);
-
-		r = rtlsdr_get_tuner_type(dev);
-		if (r >= 0)
-			dongle_info.tuner_type = htonl(r);
-
-		r = rtlsdr_get_tuner_gains(dev, NULL);
-		if (r >= 0)
-			dongle_info.tuner_gain_count = htonl(r);
-
-		r = send(s, (const char *)&dongle_info, sizeof(dongle_info), 0);
-		if (sizeof(dongle_info) != r)
-			printf("failed to send dongle information\n");
-
-		pthread_attr_init(&attr);
-		pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_JOINABLE);
-		r = pthread_create(&tcp_worker_thread, &attr, tcp_worker, NULL);
-		r = pthread_create(&command_thread, &attr, command_worker, NULL);
-		pthread_attr_destroy(&attr);
-
-		r = rtlsdr_read_async(dev, rtlsdr_callback, NULL, buf_num, 0);
-
-		pthread_join(tcp_worker_thread, &status);
-		pthread_join(command_thread, &status);
+	if (argc < optind)
+		usage();
 
-		closesocket(s);
+	if (llbuf_num < LAG_MARGIN + 2) {
+		fprintf(stderr, "Need at least %d buffers.\n", LAG_MARGIN + 2);
+		exit(1);
+	}
+	if (replay_ms < 0) {
+		fprintf(stderr, "Replay length must not be negative.\n");
+		exit(1);
+	}
+	if (max_clients < 1) {
+		fprintf(stderr, "Need to allow at least one client.\n");
+		exit(1);
+	}
+	if (!udp.payload)
+		udp.payload = DEFAULT_UDP_PAYLOAD;
+	if (udp.payload < 2 || udp.payload > 65000 || (udp.payload & 1)) {
+		fprintf(stderr, "UDP payload must be an even number of bytes up to 65000.\n");
+		exit(1);
+	}
+	if (source && dev_given) {
+		fprintf(stderr, "Either -F or -d, not both.\n");
+		exit(1);
+	}
+	if (!dev_given)
+		dev_query[dev_given++] = "0";
+	/* one allocation for every ring */
+	ring_arena = malloc((size_t)dev_given * llbuf_num * DEFAULT_BUF_LENGTH);
+	if (!ring_arena) {
+		fprintf(stderr, "Failed to allocate %d buffers.\n", dev_given * llbuf_num);
+		exit(1);
+	}
+	if (replay_ms && (double)replay_ms / 1000 * samp_rate * 2 / DEFAULT_BUF_LENGTH > llbuf_num / 2)
+		fprintf(stderr, "WARNING: %d buffers hold %.0f ms, replay is cut to that.\n",
+			llbuf_num, (double)llbuf_num / 2 * DEFAULT_BUF_LENGTH / 2 / samp_rate * 1000);
+
+	for (i = 0; i < dev_given; i++) {
+		d = &devices[i];
+		d->id = i;
+		if (ring_init(&d->ring, (unsigned int)llbuf_num,
+			      ring_arena + (size_t)i * llbuf_num * DEFAULT_BUF_LENGTH) < 0) {
+			fprintf(stderr, "Failed to allocate %d buffers.\n", llbuf_num);
+			exit(1);
+		}
+		if (source) {
+			d->sample_rate = samp_rate;
+			snprintf(d->serial, sizeof(d->serial), "%s", source);
+			if (strcmp(source, "tone") && !(d->file = fopen(source, "rb"))) {
+				fprintf(stderr, "Failed to open %s\n", source);
+				exit(1);
+			}
+		} else if (device_open(d, dev_query[i], frequency, samp_rate, gain,
+				       ppm_error, direct_sampling) < 0)
+			exit(1);
+		device_count++;
+	}
 
-		printf("all threads dead..\n");
-		curelem = ll_buffers;
-		ll_buffers = 0;
+#ifndef _WIN32
+	sigact.sa_handler = sighandler;
+	sigemptyset(&sigact.sa_mask);
+	sigact.sa_flags = 0;
+	sigign.sa_handler = SIG_IGN;
+	sigaction(SIGINT, &sigact, NULL);
+	sigaction(SIGTERM, &sigact, NULL);
+	sigaction(SIGQUIT, &sigact, NULL);
+	sigaction(SIGPIPE, &sigign, NULL);
+#else
+	SetConsoleCtrlHandler( (PHANDLER_ROUTINE) sighandler, TRUE );
+#endif
 
-		while(curelem != 0) {
-			prev = curelem;
-			curelem = curelem->next;
-			free(prev->data);
-			free(prev);
-		}
+	dsp_tables_init();
+	pthread_mutex_init(&ll_mutex, NULL);
+	if (loop_init() < 0) {
+		fprintf(stderr, "Failed to set up the event loop.\n");
+		exit(1);
+	}
+	loop_add(loop.wake_rx, &loop.wake_rx);
+
+	/* the first device takes the given port, the others the ones after it */
+	for (i = 0; i < device_count; i++) {
+		d = &devices[i];
+		pthread_mutex_init(&d->ctrl_mutex, NULL);
+		pthread_cond_init(&d->ctrl_cond, NULL);
+		pthread_create(&d->ctrl_thread, NULL, ctrl_worker, d);
+		snprintf(d->port, sizeof(d->port), "%d", atoi(port) + i);
+		d->listen = listen_open(addr, d->port, hostinfo, portinfo);
+		if (d->listen == SOCKET_ERROR)
+			exit(1);
+		loop_add(d->listen, &d->listen);
+		printf("device %d (serial %s) on port %s\n", d->id, d->serial, portinfo);
+	}
 
-		do_exit = 0;
-		global_numq = 0;
+	if (udp_dest) {
+		if (udp_open(udp_dest, udp_ttl) < 0)
+			exit(1);
+		udp_enabled = 1;
+		loop_add(udp.s, &udp);
+		loop_mod(udp.s, &udp, 0, 0);
+		printf("streaming %d byte datagrams of device 0 to %s\n", udp.payload, udp_dest);
+		/* datagrams go out whether or not anybody is connected */
+		streaming_start(&devices[0]);
+	}
+	if (keep_streaming) {
+		/* reconnecting clients find the dongle running and the ring full */
+		for (i = 0; i < device_count; i++)
+			streaming_start(&devices[i]);
+		printf("streaming while idle");
+		if (replay_ms)
+			printf(", new clients get the last %d ms first", replay_ms);
+		printf("\n");
 	}
 
-out:
-	rtlsdr_close(dev);
-	closesocket(listensocket);
-	closesocket(s);
+	printf("listening...\n");
+	printf("Use the device argument 'rtl_tcp=%s:%s' in OsmoSDR "
+	       "(gr-osmosdr) source\n"
+	       "to receive samples in GRC and control "
+	       "rtl_tcp parameters (frequency, gain, ...).\n",
+	       hostinfo, devices[0].port);
+
+	loop_run();
+
+	for (i = 0; i < device_count; i++) {
+		d = &devices[i];
+		pthread_mutex_lock(&d->ctrl_mutex);
+		pthread_cond_signal(&d->ctrl_cond);
+		pthread_mutex_unlock(&d->ctrl_mutex);
+		pthread_join(d->ctrl_thread, NULL);
+	}
+	clients_reap(1);
+	for (i = 0; i < device_count; i++)
+		streaming_stop(&devices[i]);
+	if (udp_enabled) {
+		printf("udp: %llu datagrams, %llu blocks skipped\n",
+		       (unsigned long long)udp.datagrams, (unsigned long long)udp.skipped);
+		closesocket(udp.s);
+	}
+	for (i = 0; i < device_count; i++) {
+		d = &devices[i];
+		if (d->file)
+			fclose(d->file);
+		else if (d->dev)
+			rtlsdr_close(d->dev);
+		ring_free(&d->ring);
+		closesocket(d->listen);
+	}
+	free(ring_arena);
 #ifdef _WIN32
 	WSACleanup();
 #endif
 	printf("bye!\n");
-	return r >= 0 ? r : -r;
+	return 0;
 }
@@ -0,0 +1,532 @@
+/*
+ * rtl-sdr, turns your Realtek RTL2832 based DVB dongle into a SDR receiver
+ * rtl_tcp_bench, load and latency tester for rtl_tcp
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Connects any number of clients to one rtl_tcp port and drains them as
+ * fast as it can. The first client may send a command pattern, with
+ * framing on, so every command can be timed until its status frame comes
+ * back. Run it against 'rtl_tcp -F tone' to test without a dongle.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#ifndef _WIN32
+#include <unistd.h>
+#include <netdb.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#else
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#include "getopt/getopt.h"
+#endif
+
+#ifdef _WIN32
+#pragma comment(lib, "ws2_32.lib")
+#define poll WSAPoll
+#define ioctl ioctlsocket
+typedef u_long avail_t;
+#else
+#define closesocket close
+#define SOCKET int
+#define INVALID_SOCKET -1
+typedef int avail_t;
+#endif
+
+#define DEFAULT_PORT_STR "1234"
+#define DEFAULT_SAMPLE_RATE_HZ 2048000
+#define DEFAULT_BUF_LENGTH (16 * 32 * 512)	/* rtl_tcp's block size */
+#define MAX_CLIENTS 256
+#define RECV_LENGTH (256 * 1024)
+#define INFLIGHT 4096		/* commands awaiting their status frame */
+#define GREETING_LEN 12
+#define FRAME_HEADER_LEN 8
+#define FRAME_SAMPLES 0
+#define FRAME_STATUS 1
+#define STATUS_LEN 16
+
+enum pattern {
+	PAT_NONE,
+	PAT_RETUNE,		/* 0x01, a new frequency every time */
+	PAT_GAIN		/* 0x0d through every gain index, or 0x04 */
+};
+
+struct bench_client {
+	SOCKET s;
+	int framed;
+	int closed;
+	unsigned char info[GREETING_LEN];	/* "RTL0", tuner type, gain count */
+	int info_len;
+	int gains;
+	unsigned char hdr[FRAME_HEADER_LEN];
+	int hdr_len;
+	uint32_t left;		/* payload bytes of the current frame */
+	unsigned char status[STATUS_LEN];
+	int status_len;
+	uint64_t bytes;		/* sample bytes */
+	double first;		/* time of the first and latest sample bytes */
+	double last;
+};
+
+struct sent_cmd {
+	unsigned char cmd;
+	uint32_t param;
+	double t;
+};
+
+struct queue_depth {		/* receive queues, sampled before each read */
+	uint64_t sum;
+	uint64_t n;
+	uint64_t max;
+};
+
+struct latency {
+	uint64_t sent;
+	uint64_t applied;
+	uint64_t coalesced;	/* replaced by a newer value before the device saw it */
+	double sum;
+	double max;
+};
+
+static struct bench_client clients[MAX_CLIENTS];
+static int client_count = 1;
+static struct sent_cmd inflight[INFLIGHT];
+static int inflight_head, inflight_len;
+static struct latency lat, lat_total;
+static struct queue_depth queued, queued_total;
+
+void usage(void)
+{
+	fprintf(stderr,
+		"rtl_tcp_bench, load and latency tester for rtl_tcp\n\n"
+		"Usage:\t[-a server address (default: 127.0.0.1)]\n"
+		"\t[-p server port (default: %s)]\n"
+		"\t[-c number of clients (default: 1, max: %d)]\n"
+		"\t[-t seconds to run (default: 10)]\n"
+		"\t[-i seconds between reports (default: 1)]\n"
+		"\t[-P command pattern: none, retune, gain (default: none)]\n"
+		"\t[-R commands per second (default: 100)]\n"
+		"\t[-s sample rate the server runs at, to count lost samples (default: %d)]\n",
+		DEFAULT_PORT_STR, MAX_CLIENTS, DEFAULT_SAMPLE_RATE_HZ);
+	exit(1);
+}
+
+static double now_sec(void)
+{
+	struct timeval tv;
+#ifdef _WIN32
+	FILETIME ft;
+	unsigned __int64 t = 0;
+	GetSystemTimeAsFileTime(&ft);
+	t = ((unsigned __int64)ft.dwHighDateTime << 32) | ft.dwLowDateTime;
+	tv.tv_sec = (long)(t / 10000000);
+	tv.tv_usec = (long)(t % 10000000 / 10);
+#else
+	gettimeofday(&tv, NULL);
+#endif
+	return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static uint32_t get_be32(const unsigned char *p)
+{
+	return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+static void set_nonblocking(SOCKET s)
+{
+#ifdef _WIN32
+	u_long on = 1;
+	ioctlsocket(s, FIONBIO, &on);
+#else
+	int on = 1;
+	ioctl(s, FIONBIO, &on);
+#endif
+}
+
+static SOCKET connect_to(const char *addr, const char *port)
+{
+	struct addrinfo hints, *res, *ai;
+	SOCKET s = INVALID_SOCKET;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	if (getaddrinfo(addr, port, &hints, &res)) {
+		fprintf(stderr, "Failed to resolve %s\n", addr);
+		return INVALID_SOCKET;
+	}
+	for (ai = res; ai; ai = ai->ai_next) {
+		s = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+		if (s == INVALID_SOCKET)
+			continue;
+		if (!connect(s, ai->ai_addr, (int)ai->ai_addrlen))
+			break;
+		closesocket(s);
+		s = INVALID_SOCKET;
+	}
+	freeaddrinfo(res);
+	return s;
+}
+
+static int send_cmd(struct bench_client *c, unsigned char cmd, uint32_t param)
+{
+	unsigned char b[5];
+	b[0] = cmd;
+	b[1] = param >> 24;
+	b[2] = param >> 16;
+	b[3] = param >> 8;
+	b[4] = param & 0xff;
+	/* commands are tiny, a full socket here means rtl_tcp stopped reading */
+	return send(c->s, (const char *)b, 5, 0) == 5 ? 0 : -1;
+}
+
+static void cmd_sent(unsigned char cmd, uint32_t param, double t)
+{
+	struct sent_cmd *e;
+
+	if (inflight_len == INFLIGHT) {
+		/* nothing came back for a long time, forget the oldest */
+		inflight_head = (inflight_head + 1) % INFLIGHT;
+		inflight_len--;
+	}
+	e = &inflight[(inflight_head + inflight_len) % INFLIGHT];
+	e->cmd = cmd;
+	e->param = param;
+	e->t = t;
+	inflight_len++;
+	lat.sent++;
+}
+
+static void cmd_applied(unsigned char cmd, uint32_t param, double t)
+/* older values of the same command went away without a status of their own */
+{
+	struct sent_cmd *e;
+	int i, j, n = 0;
+
+	for (i = 0; i < inflight_len; i++) {
+		e = &inflight[(inflight_head + i) % INFLIGHT];
+		if (e->cmd != cmd)
+			continue;
+		if (e->param != param) {
+			n++;
+			continue;
+		}
+		lat.applied++;
+		lat.coalesced += n;
+		lat.sum += t - e->t;
+		if (t - e->t > lat.max)
+			lat.max = t - e->t;
+		/* drop this one and the older ones it stood for */
+		for (j = i; j >= 0; j--) {
+			e = &inflight[(inflight_head + j) % INFLIGHT];
+			if (e->cmd == cmd)
+				e->cmd = 0;
+		}
+		break;
+	}
+	while (inflight_len && !inflight[inflight_head].cmd) {
+		inflight_head = (inflight_head + 1) % INFLIGHT;
+		inflight_len--;
+	}
+}
+
+static void client_data(struct bench_client *c, const unsigned char *p, size_t len, double t)
+{
+	size_t n;
+
+	if (c->info_len < GREETING_LEN) {
+		n = GREETING_LEN - c->info_len;
+		n = len < n ? len : n;
+		memcpy(c->info + c->info_len, p, n);
+		c->info_len += (int)n;
+		if (c->info_len == GREETING_LEN)
+			c->gains = (int)get_be32(c->info + 8);
+		p += n;
+		len -= n;
+	}
+	if (!len)
+		return;
+	if (!c->framed) {
+		if (!c->bytes)
+			c->first = t;
+		c->bytes += len;
+		c->last = t;
+		return;
+	}
+	while (len) {
+		if (c->hdr_len < FRAME_HEADER_LEN) {
+			c->hdr[c->hdr_len++] = *p++;
+			len--;
+			if (c->hdr_len == FRAME_HEADER_LEN) {
+				c->left = get_be32(c->hdr + 4);
+				c->status_len = 0;
+			}
+			continue;
+		}
+		n = len < c->left ? len : c->left;
+		if (c->hdr[2] == FRAME_SAMPLES) {
+			if (!c->bytes)
+				c->first = t;
+			c->bytes += n;
+			c->last = t;
+		} else if (c->hdr[2] == FRAME_STATUS && c->status_len + n <= STATUS_LEN) {
+			memcpy(c->status + c->status_len, p, n);
+			c->status_len += (int)n;
+			if (c->status_len == STATUS_LEN)
+				cmd_applied(c->status[0], get_be32(c->status + 4), t);
+		}
+		p += n;
+		len -= n;
+		c->left -= (uint32_t)n;
+		if (!c->left)
+			c->hdr_len = 0;
+	}
+}
+
+static void client_read(struct bench_client *c, unsigned char *buf)
+{
+	avail_t avail = 0;
+	int r;
+
+	if (!ioctl(c->s, FIONREAD, &avail)) {
+		queued.sum += avail;
+		queued.n++;
+		if ((uint64_t)avail > queued.max)
+			queued.max = avail;
+	}
+	r = recv(c->s, (char *)buf, RECV_LENGTH, 0);
+	if (r > 0) {
+		client_data(c, buf, r, now_sec());
+		return;
+	}
+	if (r == 0 || (r < 0 &&
+#ifdef _WIN32
+		       WSAGetLastError() != WSAEWOULDBLOCK
+#else
+		       errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR
+#endif
+		       )) {
+		c->closed = 1;
+		closesocket(c->s);
+	}
+}
+
+static void fold_interval(void)
+{
+	lat_total.sent += lat.sent;
+	lat_total.applied += lat.applied;
+	lat_total.coalesced += lat.coalesced;
+	lat_total.sum += lat.sum;
+	if (lat.max > lat_total.max)
+		lat_total.max = lat.max;
+	memset(&lat, 0, sizeof(lat));
+	queued_total.sum += queued.sum;
+	queued_total.n += queued.n;
+	if (queued.max > queued_total.max)
+		queued_total.max = queued.max;
+	memset(&queued, 0, sizeof(queued));
+}
+
+static void report(const char *label, double elapsed, uint64_t bytes,
+		   const struct latency *l, const struct queue_depth *q)
+{
+	int i, open = 0;
+
+	for (i = 0; i < client_count; i++)
+		open += !clients[i].closed;
+	printf("%s%.2f MB/s over %d clients, receive queue avg %.0f kB max %.0f kB",
+	       label, bytes / elapsed / 1e6, open,
+	       q->n ? q->sum / 1e3 / q->n : 0.0, q->max / 1e3);
+	if (l->sent)
+		printf(", %llu commands, %llu applied, %llu coalesced, latency avg %.1f ms max %.1f ms",
+		       (unsigned long long)l->sent, (unsigned long long)l->applied,
+		       (unsigned long long)l->coalesced,
+		       l->applied ? l->sum / l->applied * 1e3 : 0.0, l->max * 1e3);
+	printf("\n");
+}
+
+int main(int argc, char **argv)
+{
+	struct pollfd fds[MAX_CLIENTS];
+	struct bench_client *c;
+	unsigned char *buf;
+	char *addr = "127.0.0.1";
+	const char *port = DEFAULT_PORT_STR;
+	double duration = 10, interval = 1, cmd_rate = 100;
+	double start, t, next_cmd, next_report, span;
+	uint32_t sample_rate = DEFAULT_SAMPLE_RATE_HZ;
+	enum pattern pattern = PAT_NONE;
+	uint64_t bytes, last_bytes = 0, expected, got, lost = 0;
+	uint32_t k = 0, param;
+	unsigned char cmd;
+	int opt, i, n, left;
+#ifdef _WIN32
+	WSADATA wsd;
+	WSAStartup(MAKEWORD(2,2), &wsd);
+#endif
+
+	while ((opt = getopt(argc, argv, "a:p:c:t:i:P:R:s:")) != -1) {
+		switch (opt) {
+		case 'a':
+			addr = optarg;
+			break;
+		case 'p':
+			port = optarg;
+			break;
+		case 'c':
+			client_count = atoi(optarg);
+			break;
+		case 't':
+			duration = atof(optarg);
+			break;
+		case 'i':
+			interval = atof(optarg);
+			break;
+		case 'P':
+			if (strcmp(optarg, "none") == 0)
+				pattern = PAT_NONE;
+			else if (strcmp(optarg, "retune") == 0)
+				pattern = PAT_RETUNE;
+			else if (strcmp(optarg, "gain") == 0)
+				pattern = PAT_GAIN;
+			else
+				usage();
+			break;
+		case 'R':
+			cmd_rate = atof(optarg);
+			break;
+		case 's':
+			sample_rate = (uint32_t)atof(optarg);
+			break;
+		default:
+			usage();
+			break;
+		}
+	}
+	if (client_count < 1 || client_count > MAX_CLIENTS) {
+		fprintf(stderr, "Need 1 to %d clients.\n", MAX_CLIENTS);
+		exit(1);
+	}
+	if (duration <= 0 || interval <= 0 || cmd_rate <= 0) {
+		fprintf(stderr, "Durations and rates must be positive.\n");
+		exit(1);
+	}
+	buf = malloc(RECV_LENGTH);
+	if (!buf) {
+		fprintf(stderr, "Out of memory.\n");
+		exit(1);
+	}
+
+	for (i = 0; i < client_count; i++) {
+		c = &clients[i];
+		c->s = connect_to(addr, port);
+		if (c->s == INVALID_SOCKET) {
+			fprintf(stderr, "Failed to connect client %d to %s:%s\n", i, addr, port);
+			exit(1);
+		}
+		set_nonblocking(c->s);
+	}
+	/* the first client steers, everything else only drains */
+	if (pattern != PAT_NONE) {
+		clients[0].framed = 1;
+		if (send_cmd(&clients[0], 0x25, 1) < 0) {
+			fprintf(stderr, "Failed to send to the server.\n");
+			exit(1);
+		}
+	}
+	printf("%d clients on %s:%s for %.0f s\n", client_count, addr, port, duration);
+
+	start = now_sec();
+	next_cmd = start + 1.0 / cmd_rate;
+	next_report = start + interval;
+	while ((t = now_sec()) < start + duration) {
+		if (pattern != PAT_NONE && t >= next_cmd && !clients[0].closed &&
+		    clients[0].info_len == GREETING_LEN) {
+			if (pattern == PAT_RETUNE) {
+				cmd = 0x01;
+				param = 100000000 + (k % 100000) * 1000;
+			} else if (clients[0].gains > 0) {
+				cmd = 0x0d;
+				param = k % clients[0].gains;
+			} else {
+				cmd = 0x04;
+				param = (k % 50) * 10;
+			}
+			if (send_cmd(&clients[0], cmd, param) == 0)
+				cmd_sent(cmd, param, t);
+			k++;
+			next_cmd += 1.0 / cmd_rate;
+			if (next_cmd < t)
+				next_cmd = t;
+		}
+		for (i = n = 0; i < client_count; i++) {
+			fds[n].fd = clients[i].s;
+			fds[n].events = clients[i].closed ? 0 : POLLIN;
+			fds[n++].revents = 0;
+		}
+		left = (int)(((pattern != PAT_NONE ? next_cmd : next_report) - now_sec()) * 1000);
+		poll(fds, n, left < 0 ? 0 : left > 100 ? 100 : left);
+		for (i = 0; i < client_count; i++)
+			if (!clients[i].closed && fds[i].revents)
+				client_read(&clients[i], buf);
+
+		t = now_sec();
+		if (t >= next_report) {
+			for (i = 0, bytes = 0; i < client_count; i++)
+				bytes += clients[i].bytes;
+			report("", interval, bytes - last_bytes, &lat, &queued);
+			fold_interval();
+			last_bytes = bytes;
+			next_report += interval;
+		}
+	}
+	span = now_sec() - start;
+
+	/* every client should have seen the full rate since its first block */
+	for (i = 0, bytes = 0, n = 0; i < client_count; i++) {
+		c = &clients[i];
+		bytes += c->bytes;
+		n += c->closed;
+		if (!c->bytes || c->framed)
+			continue;
+		expected = (uint64_t)((c->last - c->first) * sample_rate) * 2;
+		got = c->bytes;
+		if (expected > got + DEFAULT_BUF_LENGTH)
+			lost += expected - got;
+	}
+	fold_interval();
+	report("total: ", span, bytes, &lat_total, &queued_total);
+	printf("%d clients disconnected by the server, about %.0f blocks lost\n",
+	       n, (double)lost / DEFAULT_BUF_LENGTH);
+
+	for (i = 0; i < client_count; i++)
+		if (!clients[i].closed)
+			closesocket(clients[i].s);
+	free(buf);
+#ifdef _WIN32
+	WSACleanup();
+#endif
+	return n ? 1 : 0;
+}
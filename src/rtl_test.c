@@ -26,6 +26,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <math.h>
+#include <stddef.h>
 
 #ifdef __APPLE__
 #include <sys/time.h>
@@ -35,6 +36,7 @@
 
 #ifndef _WIN32
 #include <unistd.h>
+#include <sys/resource.h>
 #else
 #include <windows.h>
 #include "getopt/getopt.h"
@@ -53,6 +55,19 @@
 #define PPM_DURATION			10
 #define PPM_DUMP_TIME			5
 
+#define BENCH_DURATION			5
+#define BENCH_MAX_LIST			16
+#define BENCH_BUF_NUMS			"4,8,15,32"
+#define BENCH_BUF_LENS			"16384,65536,262144"
+#define BENCH_RATES			"1024000,2048000,2400000,3200000"
+
+#define HOP_COUNT			100
+#define SETTLE_MS			100	/* captured after every hop */
+#define SETTLE_WINDOW			1024	/* samples per power estimate */
+#define SETTLE_MAX_WINDOWS		512
+#define SETTLE_DB			1.0
+#define MAX_SAMPLE_RATE			3200000
+
 struct time_generic
 /* holds all the platform specific values */
 {
@@ -71,7 +86,9 @@ struct time_generic
 static enum {
 	NO_BENCHMARK,
 	TUNER_BENCHMARK,
-	PPM_BENCHMARK
+	PPM_BENCHMARK,
+	STREAM_BENCHMARK,
+	RETUNE_BENCHMARK
 } test_mode = NO_BENCHMARK;
 
 static int do_exit = 0;
@@ -83,6 +100,61 @@ static uint32_t total_samples = 0;
 static uint32_t dropped_samples = 0;
 
 static unsigned int ppm_duration = PPM_DURATION;
+static double bench_duration = BENCH_DURATION;
+
+/* one combination of the streaming benchmark */
+struct bench_run {
+	uint32_t rate;
+	uint32_t buf_num;
+	uint32_t buf_len;
+	int zerocopy;		/* what the library ended up using */
+	double duration;
+	double start;		/* s, when the first block arrived */
+	double prev;
+	double last;
+	uint64_t bytes;
+	uint64_t lost;		/* bytes, from the counter pattern */
+	uint64_t gaps;		/* callback intervals seen */
+	double gap_sum;		/* s */
+	double gap_sq;
+	double gap_max;
+	double cpu;		/* s of process time while streaming */
+};
+
+enum hop_op {
+	HOP_FREQ,
+	HOP_GAIN,
+	HOP_RATE,
+	HOP_BW,
+	HOP_OPS
+};
+
+static const char *hop_op_name[HOP_OPS] = {
+	"center_freq", "tuner_gain", "sample_rate", "tuner_bandwidth"
+};
+
+static const uint32_t hop_rates[] = {
+	250000, 1024000, 1400000, 1800000, 1920000,
+	2048000, 2400000, 2560000, 2880000, 3200000
+};
+
+static const uint32_t hop_bws[] = {
+	300000, 600000, 1000000, 1500000, 2000000,
+	3000000, 5000000, 6000000, 7000000, 8000000
+};
+
+/* one operation under one hop pattern, a value per hop */
+struct hop_result {
+	double *call_us;
+	double *xfers;
+	double *i2c;
+	double *settle_us;
+	int n;
+	int errors;
+	int unsettled;		/* still moving at the end of the capture */
+};
+
+static uint32_t hop_seed;
 
 void usage(void)
 {
@@ -96,7 +168,15 @@ void usage(void)
 		"\t[-p[seconds] enable PPM error measurement (default: 10 seconds)]\n"
 #endif
 		"\t[-b output_block_size (default: 16 * 16384)]\n"
-		"\t[-S force sync output (default: async)]\n");
+		"\t[-S force sync output (default: async)]\n"
+		"\t[-B sweep async buffer settings and sample rates, JSON on stdout]\n"
+		"\t[-N buf_num list for -B (default: " BENCH_BUF_NUMS ")]\n"
+		"\t[-L buf_len list for -B, multiples of 512 (default: " BENCH_BUF_LENS ")]\n"
+		"\t[-R sample rate list for -B (default: " BENCH_RATES ")]\n"
+		"\t[-T seconds per combination for -B (default: %d)]\n"
+		"\t[-r time frequency, gain, rate and bandwidth changes, JSON on stdout]\n"
+		"\t[-n hops per pattern for -r (default: %d)]\n",
+		BENCH_DURATION, HOP_COUNT);
 	exit(1);
 }
 
@@ -122,10 +202,11 @@ static void sighandler(int signum)
 }
 #endif
 
-static void underrun_test(unsigned char *buf, uint32_t len, int mute)
+static uint8_t bcnt, uninit = 1;
+
+static uint32_t underrun_test(unsigned char *buf, uint32_t len, int mute)
 {
 	uint32_t i, lost = 0;
-	static uint8_t bcnt, uninit = 1;
 
 	if (uninit) {
 		bcnt = buf[0];
@@ -143,10 +224,11 @@ static void underrun_test(unsigned char *buf, uint32_t len, int mute)
 	total_samples += len;
 	dropped_samples += lost;
 	if (mute)
-		return;
+		return lost;
 	if (lost)
 		printf("lost at least %d bytes\n", lost);
 
+	return lost;
 }
 
 #ifndef _WIN32
@@ -187,6 +269,58 @@ static int ppm_gettime(struct time_generic *tg)
 }
 #endif
 
+static const char *tuner_name(enum rtlsdr_tuner type)
+{
+	switch (type) {
+	case RTLSDR_TUNER_E4000:
+		return "E4000";
+	case RTLSDR_TUNER_FC0012:
+		return "FC0012";
+	case RTLSDR_TUNER_FC0013:
+		return "FC0013";
+	case RTLSDR_TUNER_FC2580:
+		return "FC2580";
+	case RTLSDR_TUNER_R820T:
+		return "R820T";
+	case RTLSDR_TUNER_R828D:
+		return "R828D";
+	default:
+		return "unknown";
+	}
+}
+
+static double now_sec(void)
+{
+	static struct time_generic tg;
+
+	ppm_gettime(&tg);
+	return tg.tv_sec + tg.tv_nsec * 1e-9;
+}
+
+static double cpu_sec(void)
+/* user and system time of the whole process, libusb's work included */
+{
+#ifdef _WIN32
+	FILETIME created, exited, kernel, user;
+	ULARGE_INTEGER k, u;
+
+	if (!GetProcessTimes(GetCurrentProcess(), &created, &exited, &kernel, &user))
+		return 0;
+	k.LowPart = kernel.dwLowDateTime;
+	k.HighPart = kernel.dwHighDateTime;
+	u.LowPart = user.dwLowDateTime;
+	u.HighPart = user.dwHighDateTime;
+	return (k.QuadPart + u.QuadPart) * 1e-7;
+#else
+	struct rusage ru;
+
+	if (getrusage(RUSAGE_SELF, &ru) < 0)
+		return 0;
+	return ru.ru_utime.tv_sec + ru.ru_stime.tv_sec +
+	       (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) * 1e-6;
+#endif
+}
+
 static int ppm_report(uint64_t nsamples, uint64_t interval)
 {
 	double real_rate, ppm;
@@ -256,6 +390,405 @@ static void rtlsdr_callback(unsigned char *buf, uint32_t len, void *ctx)
 		ppm_test(len);
 }
 
+static void bench_callback(unsigned char *buf, uint32_t len, void *ctx)
+{
+	struct bench_run *b = ctx;
+	double t = now_sec(), gap;
+
+	if (do_exit)
+		return;
+	if (b->bytes) {
+		gap = t - b->prev;
+		b->gaps++;
+		b->gap_sum += gap;
+		b->gap_sq += gap * gap;
+		if (gap > b->gap_max)
+			b->gap_max = gap;
+	} else
+		b->start = t;
+	b->prev = t;
+	b->last = t;
+	b->bytes += len;
+	b->lost += underrun_test(buf, len, 1);
+	if (t - b->start >= b->duration)
+		rtlsdr_cancel_async(dev);
+}
+
+static int bench_list(const char *arg, uint32_t *out)
+/* comma separated, 2.4e6 style values allowed */
+{
+	char *end;
+	int n = 0;
+
+	while (*arg && n < BENCH_MAX_LIST) {
+		out[n] = (uint32_t)strtod(arg, &end);
+		if (end == arg || !out[n])
+			return -1;
+		n++;
+		arg = *end == ',' ? end + 1 : end;
+		if (*end && *end != ',')
+			return -1;
+	}
+	return *arg ? -1 : n;
+}
+
+static int bench_one(struct bench_run *b, int zerocopy)
+{
+	double cpu;
+	int r;
+
+	memset(&b->zerocopy, 0, sizeof(*b) - offsetof(struct bench_run, zerocopy));
+	b->duration = bench_duration;
+	uninit = 1;
+	rtlsdr_set_zerocopy(dev, zerocopy);
+	if (rtlsdr_set_sample_rate(dev, b->rate) < 0) {
+		fprintf(stderr, "Failed to set %u Hz.\n", b->rate);
+		return -1;
+	}
+	rtlsdr_reset_buffer(dev);
+	cpu = cpu_sec();
+	r = rtlsdr_read_async(dev, bench_callback, b, b->buf_num, b->buf_len);
+	b->cpu = cpu_sec() - cpu;
+	b->zerocopy = rtlsdr_get_zerocopy(dev) == 1;
+	return r;
+}
+
+static void bench_report(const struct bench_run *b, int first)
+{
+	double nominal = b->buf_len / 2.0 / b->rate;
+	double mean = b->gaps ? b->gap_sum / b->gaps : 0;
+	double var = b->gaps ? b->gap_sq / b->gaps - mean * mean : 0;
+	double secs = b->last - b->start;
+	double mb = b->bytes / 1e6;
+
+	fprintf(stderr, "%8u Hz %3u x %7u %-9s %6.3f Msps, lost %llu bytes, "
+		"jitter %.0f us, max gap %.1f ms, %.2f ms cpu/MB\n",
+		b->rate, b->buf_num, b->buf_len, b->zerocopy ? "zero-copy" : "userspace",
+		secs > 0 ? b->bytes / 2.0 / secs / 1e6 : 0, (unsigned long long)b->lost,
+		sqrt(var > 0 ? var : 0) * 1e6, b->gap_max * 1e3,
+		mb > 0 ? b->cpu * 1e3 / mb : 0);
+	printf("%s\n    {\"sample_rate\": %u, \"buf_num\": %u, \"buf_len\": %u, "
+	       "\"zerocopy\": %s,\n     \"seconds\": %.3f, \"bytes\": %llu, "
+	       "\"lost_bytes\": %llu, \"lost_ppm\": %.3f, \"rate_ratio\": %.6f,\n"
+	       "     \"interval_us\": {\"nominal\": %.1f, \"mean\": %.1f, "
+	       "\"stddev\": %.1f, \"max\": %.1f},\n"
+	       "     \"cpu_seconds\": %.4f, \"cpu_ms_per_mb\": %.4f}",
+	       first ? "" : ",", b->rate, b->buf_num, b->buf_len,
+	       b->zerocopy ? "true" : "false", secs, (unsigned long long)b->bytes,
+	       (unsigned long long)b->lost, b->bytes ? 1e6 * b->lost / b->bytes : 0,
+	       secs > 0 ? (b->bytes - b->buf_len) / 2.0 / secs / b->rate : 0,
+	       nominal * 1e6, mean * 1e6, sqrt(var > 0 ? var : 0) * 1e6, b->gap_max * 1e6,
+	       b->cpu, mb > 0 ? b->cpu * 1e3 / mb : 0);
+}
+
+static int stream_benchmark(const char *nums, const char *lens, const char *rates)
+/* every rate, buffer count and length, with and without zero-copy */
+{
+	uint32_t num[BENCH_MAX_LIST], len[BENCH_MAX_LIST], rate[BENCH_MAX_LIST];
+	int n_num, n_len, n_rate, i, j, k, zc, r = 0, first = 1;
+	struct bench_run b;
+
+	n_num = bench_list(nums, num);
+	n_len = bench_list(lens, len);
+	n_rate = bench_list(rates, rate);
+	if (n_num < 0 || n_len < 0 || n_rate < 0) {
+		fprintf(stderr, "Bad list, use values like 4,8,15 (at most %d).\n",
+			BENCH_MAX_LIST);
+		return -1;
+	}
+	for (j = 0; j < n_len; j++) {
+		if (len[j] % 512) {
+			fprintf(stderr, "Buffer length %u is not a multiple of 512.\n", len[j]);
+			return -1;
+		}
+	}
+	fprintf(stderr, "Streaming benchmark, %d combinations of %g s each...\n",
+		n_num * n_len * n_rate, bench_duration);
+	printf("{\n  \"tool\": \"rtl_test\",\n  \"tuner\": \"%s\",\n"
+	       "  \"seconds_per_run\": %.1f,\n  \"runs\": [",
+	       tuner_name(rtlsdr_get_tuner_type(dev)), bench_duration);
+	for (k = 0; k < n_rate && !do_exit; k++)
+	for (i = 0; i < n_num && !do_exit; i++)
+	for (j = 0; j < n_len && !do_exit; j++) {
+		b.rate = rate[k];
+		b.buf_num = num[i];
+		b.buf_len = len[j];
+		for (zc = 1; zc >= 0 && !do_exit; zc--) {
+			r = bench_one(&b, zc);
+			if (r < 0 || !b.bytes) {
+				fprintf(stderr, "No samples at %u Hz, %u x %u (%d).\n",
+					b.rate, b.buf_num, b.buf_len, r);
+				r = -1;
+				break;
+			}
+			bench_report(&b, first);
+			first = 0;
+			/* zero-copy fell back, the userspace run would be the same */
+			if (!b.zerocopy)
+				break;
+		}
+	}
+	printf("\n  ]\n}\n");
+	fflush(stdout);
+	rtlsdr_set_zerocopy(dev, 1);
+	return do_exit ? 0 : r;
+}
+
+static int tuner_range(uint32_t *lo, uint32_t *hi)
+/* returns 1 for an RTL-SDR Blog V4, which reaches HF through its upconverter */
+{
+	char manufact[256], product[256], serial[256];
+	int v4 = 0;
+
+	if (rtlsdr_get_usb_strings(dev, manufact, product, serial) == 0)
+		v4 = !strcmp(manufact, "RTLSDRBlog") && !strcmp(product, "Blog V4");
+
+	switch (rtlsdr_get_tuner_type(dev)) {
+	case RTLSDR_TUNER_E4000:
+		*lo = MHZ(52);
+		*hi = MHZ(2200UL);
+		break;
+	case RTLSDR_TUNER_FC0012:
+		*lo = MHZ(22);
+		*hi = MHZ(948);
+		break;
+	case RTLSDR_TUNER_FC0013:
+		*lo = MHZ(22);
+		*hi = MHZ(1100);
+		break;
+	case RTLSDR_TUNER_FC2580:
+		*lo = MHZ(146);
+		*hi = MHZ(924);
+		break;
+	default:
+		*lo = v4 ? MHZ(1) : MHZ(24);
+		*hi = MHZ(1766);
+		break;
+	}
+	return v4;
+}
+
+static uint32_t hop_rand(void)
+/* xorshift, so the random pattern is the same on every run */
+{
+	hop_seed ^= hop_seed << 13;
+	hop_seed ^= hop_seed >> 17;
+	hop_seed ^= hop_seed << 5;
+	return hop_seed;
+}
+
+static uint32_t hop_value(enum hop_op op, int random, int i, int n,
+			  uint32_t lo, uint32_t hi, const int *gains, int gain_count)
+{
+	uint32_t k = random ? hop_rand() : (uint32_t)i;
+
+	switch (op) {
+	case HOP_FREQ:
+		if (random)
+			return lo + k % (hi - lo);
+		return lo + (uint32_t)((uint64_t)(hi - lo) * i / (n > 1 ? n - 1 : 1));
+	case HOP_GAIN:
+		return (uint32_t)gains[k % gain_count];
+	case HOP_RATE:
+		return hop_rates[k % (sizeof(hop_rates) / sizeof(hop_rates[0]))];
+	default:
+		return hop_bws[k % (sizeof(hop_bws) / sizeof(hop_bws[0]))];
+	}
+}
+
+static int hop_apply(enum hop_op op, uint32_t value)
+{
+	switch (op) {
+	case HOP_FREQ:
+		return rtlsdr_set_center_freq(dev, value);
+	case HOP_GAIN:
+		return rtlsdr_set_tuner_gain(dev, (int)value);
+	case HOP_RATE:
+		return rtlsdr_set_sample_rate(dev, value);
+	default:
+		return rtlsdr_set_tuner_bandwidth(dev, value);
+	}
+}
+
+static double settle_time(const uint8_t *buf, int len, uint32_t rate, int *unsettled)
+/* us of samples before the power stays within SETTLE_DB of where it ends up */
+{
+	double p[SETTLE_MAX_WINDOWS], ref = 0, tol = pow(10, SETTLE_DB / 10);
+	double si, sq, si2, sq2, v;
+	int windows = len / 2 / SETTLE_WINDOW, i, j;
+
+	if (windows > SETTLE_MAX_WINDOWS)
+		windows = SETTLE_MAX_WINDOWS;
+	if (windows < 4) {
+		*unsettled = 1;
+		return 0;
+	}
+	for (i = 0; i < windows; i++) {
+		si = sq = si2 = sq2 = 0;
+		for (j = 0; j < SETTLE_WINDOW; j++) {
+			v = buf[2 * (i * SETTLE_WINDOW + j)];
+			si += v;
+			si2 += v * v;
+			v = buf[2 * (i * SETTLE_WINDOW + j) + 1];
+			sq += v;
+			sq2 += v * v;
+		}
+		/* DC moves with the tuner too, but only the noise tells lock */
+		si /= SETTLE_WINDOW;
+		sq /= SETTLE_WINDOW;
+		p[i] = si2 / SETTLE_WINDOW - si * si + sq2 / SETTLE_WINDOW - sq * sq + 1e-9;
+	}
+	for (i = windows * 3 / 4; i < windows; i++)
+		ref += p[i];
+	ref /= windows - windows * 3 / 4;
+	for (i = windows - 1; i >= 0; i--)
+		if (p[i] > ref * tol || p[i] < ref / tol)
+			break;
+	*unsettled = i + 1 >= windows * 3 / 4;
+	return (i + 1) * (double)SETTLE_WINDOW * 1e6 / rate;
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return (x > y) - (x < y);
+}
+
+static void print_dist(const char *name, double *v, int n, int last)
+/* sorts v */
+{
+	double sum = 0;
+	int i;
+
+	if (!n) {
+		printf("      \"%s\": null%s\n", name, last ? "" : ",");
+		return;
+	}
+	qsort(v, n, sizeof(double), cmp_double);
+	for (i = 0; i < n; i++)
+		sum += v[i];
+	printf("      \"%s\": {\"min\": %.1f, \"mean\": %.1f, \"p50\": %.1f, "
+	       "\"p90\": %.1f, \"p99\": %.1f, \"max\": %.1f}%s\n", name, v[0], sum / n,
+	       v[(int)((n - 1) * 0.5 + 0.5)], v[(int)((n - 1) * 0.9 + 0.5)],
+	       v[(int)((n - 1) * 0.99 + 0.5)], v[n - 1], last ? "" : ",");
+}
+
+static void hop_report(struct hop_result *h, enum hop_op op, int random, int first)
+{
+	double mean_x = 0, mean_i = 0;
+	int i;
+
+	for (i = 0; i < h->n; i++) {
+		mean_x += h->xfers[i] / h->n;
+		mean_i += h->i2c[i] / h->n;
+	}
+	printf("%s\n    {\"op\": \"%s\", \"pattern\": \"%s\", \"hops\": %d, "
+	       "\"errors\": %d, \"unsettled\": %d,\n",
+	       first ? "" : ",", hop_op_name[op], random ? "random" : "sequential",
+	       h->n + h->errors, h->errors, h->unsettled);
+	print_dist("call_us", h->call_us, h->n, 0);
+	print_dist("ctrl_transfers", h->xfers, h->n, 0);
+	print_dist("i2c_transactions", h->i2c, h->n, 0);
+	print_dist("settle_us", h->settle_us, h->n, 1);
+	printf("    }");
+	if (!h->n) {
+		fprintf(stderr, "%-16s %-10s all %d failed\n", hop_op_name[op],
+			random ? "random" : "sequential", h->errors);
+		return;
+	}
+	/* sorted by print_dist */
+	fprintf(stderr, "%-16s %-10s call p50 %7.2f ms max %7.2f ms, %5.1f transfers "
+		"(%5.1f I2C), settle p50 %6.2f ms p99 %6.2f ms, %d errors, %d unsettled\n",
+		hop_op_name[op], random ? "random" : "sequential",
+		h->call_us[(h->n - 1) / 2] / 1e3, h->call_us[h->n - 1] / 1e3, mean_x, mean_i,
+		h->settle_us[(h->n - 1) / 2] / 1e3,
+		h->settle_us[(int)((h->n - 1) * 0.99 + 0.5)] / 1e3, h->errors, h->unsettled);
+}
+
+static int retune_benchmark(const int *gains, int gain_count, int hops)
+/*
+ * Times every call, counts the control transfers and I2C transactions it
+ * made, then captures SETTLE_MS of samples to see how many of them are
+ * still unusable. The other settings stay put in the middle of their range.
+ */
+{
+	uint32_t lo, hi, x0, x1, i0, i1, value, rate;
+	int v4, op, random, i, n_read, len, r = 0, first = 1, unsettled;
+	struct hop_result h;
+	uint8_t *capture;
+	double t0;
+
+	if (gain_count <= 0 || hops <= 0) {
+		fprintf(stderr, "Need a tuner with gains and a positive hop count.\n");
+		return -1;
+	}
+	v4 = tuner_range(&lo, &hi);
+	len = (SETTLE_MS * (MAX_SAMPLE_RATE / 1000) * 2 + 511) / 512 * 512;
+	capture = malloc(len);
+	h.call_us = malloc(4 * hops * sizeof(double));
+	if (!capture || !h.call_us) {
+		free(capture);
+		free(h.call_us);
+		return -1;
+	}
+	h.xfers = h.call_us + hops;
+	h.i2c = h.xfers + hops;
+	h.settle_us = h.i2c + hops;
+
+	fprintf(stderr, "Retune benchmark on %s%s, %u to %u MHz, %d hops per pattern...\n",
+		tuner_name(rtlsdr_get_tuner_type(dev)), v4 ? " (Blog V4)" : "",
+		lo / MHZ(1), hi / MHZ(1), hops);
+	printf("{\n  \"tool\": \"rtl_test\",\n  \"tuner\": \"%s\",\n  \"blog_v4\": %s,\n"
+	       "  \"range_hz\": [%u, %u],\n  \"sample_rate\": %u,\n"
+	       "  \"settle_capture_ms\": %d,\n  \"settle_db\": %.1f,\n  \"results\": [",
+	       tuner_name(rtlsdr_get_tuner_type(dev)), v4 ? "true" : "false",
+	       lo, hi, samp_rate, SETTLE_MS, SETTLE_DB);
+
+	rtlsdr_set_tuner_gain_mode(dev, 1);
+	for (op = 0; op < HOP_OPS && !do_exit; op++)
+	for (random = 0; random < 2 && !do_exit; random++) {
+		rtlsdr_set_center_freq(dev, lo + (hi - lo) / 2);
+		rtlsdr_set_tuner_gain(dev, gains[gain_count / 2]);
+		rtlsdr_set_sample_rate(dev, samp_rate);
+		rtlsdr_set_tuner_bandwidth(dev, 0);
+		hop_seed = 0x2545f491;
+		h.n = h.errors = h.unsettled = 0;
+		for (i = 0; i < hops && !do_exit; i++) {
+			value = hop_value(op, random, i, hops, lo, hi, gains, gain_count);
+			rtlsdr_get_ctrl_stats(dev, &x0, &i0);
+			t0 = now_sec();
+			r = hop_apply(op, value);
+			h.call_us[h.n] = (now_sec() - t0) * 1e6;
+			rtlsdr_get_ctrl_stats(dev, &x1, &i1);
+			if (r < 0) {
+				h.errors++;
+				continue;
+			}
+			h.xfers[h.n] = x1 - x0;
+			h.i2c[h.n] = i1 - i0;
+			rate = rtlsdr_get_sample_rate(dev);
+			n_read = (int)((SETTLE_MS * (uint64_t)rate / 1000 * 2 + 511) / 512 * 512);
+			rtlsdr_reset_buffer(dev);
+			if (rtlsdr_read_sync(dev, capture, n_read, &n_read) < 0) {
+				h.errors++;
+				continue;
+			}
+			h.settle_us[h.n] = settle_time(capture, n_read, rate, &unsettled);
+			h.unsettled += unsettled;
+			h.n++;
+		}
+		hop_report(&h, op, random, first);
+		first = 0;
+	}
+	printf("\n  ]\n}\n");
+	fflush(stdout);
+	rtlsdr_set_sample_rate(dev, samp_rate);
+	free(capture);
+	free(h.call_us);
+	return 0;
+}
+
 void e4k_benchmark(void)
 {
 	uint32_t freq, gap_start = 0, gap_end = 0;
@@ -315,8 +848,12 @@ int main(int argc, char **argv)
 	uint32_t out_block_size = DEFAULT_BUF_LENGTH;
 	int count;
 	int gains[100];
+	const char *bench_nums = BENCH_BUF_NUMS;
+	const char *bench_lens = BENCH_BUF_LENS;
+	const char *bench_rates = BENCH_RATES;
+	int hops = HOP_COUNT;
 
-	while ((opt = getopt(argc, argv, "d:s:b:tp::Sh")) != -1) {
+	while ((opt = getopt(argc, argv, "d:s:b:tp::ShBN:L:R:T:rn:")) != -1) {
 		switch (opt) {
 		case 'd':
 			dev_index = verbose_device_search(optarg);
@@ -339,6 +876,27 @@ int main(int argc, char **argv)
 		case 'S':
 			sync_mode = 1;
 			break;
+		case 'B':
+			test_mode = STREAM_BENCHMARK;
+			break;
+		case 'N':
+			bench_nums = optarg;
+			break;
+		case 'L':
+			bench_lens = optarg;
+			break;
+		case 'R':
+			bench_rates = optarg;
+			break;
+		case 'T':
+			bench_duration = atof(optarg);
+			break;
+		case 'r':
+			test_mode = RETUNE_BENCHMARK;
+			break;
+		case 'n':
+			hops = atoi(optarg);
+			break;
 		case 'h':
 		default:
 			usage();
@@ -357,6 +915,11 @@ int main(int argc, char **argv)
 		out_block_size = DEFAULT_BUF_LENGTH;
 	}
 
+	if (test_mode == STREAM_BENCHMARK && (sync_mode || bench_duration <= 0)) {
+		fprintf(stderr, "The streaming benchmark needs async mode and a positive -T.\n");
+		exit(1);
+	}
+
 	buffer = malloc(out_block_size * sizeof(uint8_t));
 
 	if (!dev_given) {
@@ -403,9 +966,19 @@ int main(int argc, char **argv)
 		goto exit;
 	}
 
+	if (test_mode == RETUNE_BENCHMARK) {
+		r = retune_benchmark(gains, count, hops);
+		goto exit;
+	}
+
 	/* Enable test mode */
 	r = rtlsdr_set_testmode(dev, 1);
 
+	if (test_mode == STREAM_BENCHMARK) {
+		r = stream_benchmark(bench_nums, bench_lens, bench_rates);
+		goto exit;
+	}
+
 	/* Reset endpoint before we start reading from it (mandatory) */
 	verbose_reset_buffer(dev);
 